@@ -3,8 +3,18 @@
 
 #include <string>
 #include <memory>
+#include <cstddef>
+#include <cstdint>
 #include <map>
+#include <vector>
 #include <stdexcept>
+#include <functional>
+#include <utility>
+#include <chrono>
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+# include <string_view>
+# define HJSON_HAS_STRING_VIEW 1
+#endif
 
 #define HJSON_OP_DECL_VAL(_T, _O) \
 friend Value operator _O(_T, const Value&); \
@@ -77,6 +87,75 @@ enum class Type {
 };
 
 
+class Arena;
+
+
+// DecoderStats receives counters and wall times from the unmarshal functions,
+// see DecoderOptions::stats. The values are added to the members instead of
+// replacing them, so that one DecoderStats can collect the totals of many
+// calls (but not of calls running at the same time). If the library was built
+// with the Cmake option HJSON_ENABLE_STATS turned off, all members stay zero.
+struct DecoderStats {
+  // Size of the input text.
+  std::uint64_t bytes = 0;
+  // Number of Values in the returned trees, indexed by Type, e.g.
+  // `nodes[static_cast<int>(Hjson::Type::Map)]`.
+  std::uint64_t nodes[8] = {};
+  // Deepest nesting of vectors and maps in any returned tree. A root scalar is
+  // at depth 0, the elements of a root vector or map at depth 1.
+  int maxDepth = 0;
+  // Bytes of the comments (and whitespace, see
+  // DecoderOptions::whitespaceAsComments) kept in the returned trees.
+  std::uint64_t commentBytes = 0;
+  // Bytes of string values that were copied unchanged from the input, that
+  // refer to the input (see DecoderOptions::stringViews), and that were
+  // decoded from escape sequences or a multiline string.
+  std::uint64_t stringBytesCopied = 0;
+  std::uint64_t stringBytesReferenced = 0;
+  std::uint64_t stringBytesUnescaped = 0;
+  // Number of numbers parsed, and the time it took.
+  std::uint64_t numbers = 0;
+  double numberSeconds = 0;
+  // Number of objects allocated (from the heap, or from DecoderOptions::arena)
+  // for the Value trees, not counting the growth of vectors and maps.
+  std::uint64_t allocations = 0;
+  // Time spent reading the input in UnmarshalFromFile() and StreamDecoder (a
+  // memory mapped file is instead read while it is parsed), and parsing it.
+  double readSeconds = 0;
+  double parseSeconds = 0;
+};
+// The string, number and allocation counters of DecoderStats describe the work
+// done, so the parts of the input that are parsed more than once (which can
+// happen when DecoderOptions::threads is greater than 1) are counted more than
+// once.
+
+
+// EncoderStats receives counters and wall times from the marshal functions,
+// see EncoderOptions::stats. Like DecoderStats, the values are added to the
+// members.
+struct EncoderStats {
+  // Size of the output text.
+  std::uint64_t bytes = 0;
+  // Number of Values written, indexed by Type.
+  std::uint64_t nodes[8] = {};
+  // Deepest nesting of vectors and maps written.
+  int maxDepth = 0;
+  // Bytes of comments written.
+  std::uint64_t commentBytes = 0;
+  // Bytes of string values written unchanged (quoteless, within quotes or as
+  // multiline strings), and written with escape sequences.
+  std::uint64_t stringBytesCopied = 0;
+  std::uint64_t stringBytesEscaped = 0;
+  // Number of numbers formatted, and the time it took.
+  std::uint64_t numbers = 0;
+  double numberSeconds = 0;
+  // Time spent in the marshal function, and the part of it spent passing the
+  // output to the stream, file or callback function.
+  double encodeSeconds = 0;
+  double writeSeconds = 0;
+};
+
+
 // DecoderOptions defines options for decoding from Hjson.
 struct DecoderOptions {
   // Keep all comments from the Hjson input, store them in
@@ -89,6 +168,38 @@ struct DecoderOptions {
   // If true, an Hjson::syntax_error exception is thrown from the unmarshal
   // functions if a map contains duplicate keys.
   bool duplicateKeyException = false;
+  // If not null, the Value tree created by the unmarshal functions is
+  // allocated from this Arena instead of from the heap. See Hjson::Arena.
+  Arena *arena = nullptr;
+  // If true, string values that do not contain any escape sequences refer to
+  // the input data instead of holding a copy of it (see
+  // Value::as_string_view()). The caller must then keep the input data alive
+  // and unchanged for as long as any Value from the returned tree exists,
+  // unless the input was moved into `Unmarshal(std::string&&)`, in which case
+  // the Value tree keeps it alive.
+  bool stringViews = false;
+  // If greater than 1, Unmarshal splits the elements of a big root array or
+  // root map into up to this many segments that are parsed at the same time,
+  // each by its own thread. The result is exactly the same as when parsing on
+  // a single thread. Ignored if arena is set.
+  int threads = 1;
+  // If set, used instead of std::thread for the segments when threads > 1.
+  // Must call task(i) once for each i in [0, count), for example in an
+  // existing thread pool, and return when all of those calls have returned.
+  std::function<void(size_t count, const std::function<void(size_t)>& task)> executor;
+  // The unmarshal functions and Hjson::Parse() throw Hjson::syntax_error if
+  // arrays and maps are nested deeper than this, for example "[[1]]" has a
+  // depth of 2 (and a root map without braces counts as one level). The
+  // unmarshal and marshal functions, Value::clone(), Value::deep_equal(),
+  // Value::hash(), Value::freeze() and the destruction of a tree do not use
+  // the call stack for nesting, but Parse(), Merge() and Diff() do, so deeply
+  // nested input could otherwise make them overflow the stack. Set to 0 for no
+  // limit.
+  int maxDepth = 1000;
+  // If not null, the unmarshal functions add counters and wall times to it.
+  // Measuring the time of each number makes parsing a bit slower, otherwise
+  // the cost is small.
+  DecoderStats *stats = nullptr;
 };
 
 
@@ -120,23 +231,203 @@ struct EncoderOptions {
   bool omitRootBraces = false;
   // Write comments, if any are found in the Hjson::Value objects.
   bool comments = true;
+  // If greater than 1, the marshal functions split the elements of each big
+  // vector or map into up to this many segments that are written at the same
+  // time, each by its own thread, and then join the segments in order. The
+  // output is exactly the same as when writing on a single thread, but each
+  // segment is kept in memory until it is joined.
+  int threads = 1;
+  // If set, used instead of std::thread for the segments when threads > 1,
+  // like DecoderOptions::executor.
+  std::function<void(size_t count, const std::function<void(size_t)>& task)> executor;
+  // If not null, the marshal functions add counters and wall times to it.
+  EncoderStats *stats = nullptr;
+};
+
+
+// An Arena is a memory pool that the unmarshal functions can use (see
+// DecoderOptions::arena) for allocating the Value tree they create. Each
+// allocation from an Arena is just a pointer increment, and all memory is
+// released at once when the Arena is destroyed. Programs that parse many
+// short-lived documents, especially from several threads at the same time,
+// can use one Arena per document to avoid most of the calls to the heap.
+//
+// A Value tree created in an Arena can be used and modified like any other
+// Value tree, but no Value referencing it may be used or destroyed after the
+// Arena has been destroyed. Use Value::clone() to get a copy of the tree that
+// is allocated on the heap. An Arena is not thread safe, only one thread at a
+// time may unmarshal into it.
+class Arena {
+public:
+  // Memory is reserved from the heap in blocks of blockSize bytes.
+  explicit Arena(size_t blockSize = 64 * 1024);
+  ~Arena();
+
+  Arena(const Arena&) = delete;
+  Arena& operator =(const Arena&) = delete;
+
+  // Returns a pointer to at least `size` bytes of memory, aligned to
+  // `alignment` (which must be a power of two). The memory is released when
+  // the Arena is destroyed.
+  void *allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+  // Returns the total number of bytes that this Arena has reserved from the
+  // heap.
+  size_t capacity() const;
+
+private:
+  class Block;
+
+  Block *head;
+  char *pos, *end;
+  size_t blockSize, cap;
+};
+
+
+// A StringView refers to a sequence of chars owned by someone else, without
+// any guarantee of null termination. Converts to std::string_view when
+// compiled as C++17 or later.
+class StringView {
+public:
+  StringView();
+  StringView(const char *data, size_t size);
+  StringView(const char *str);
+  StringView(const std::string& str);
+
+  const char *data() const;
+  size_t size() const;
+  bool empty() const;
+  const char *begin() const;
+  const char *end() const;
+  char operator[](size_t) const;
+
+  // Returns a negative value, zero or a positive value like
+  // std::string::compare().
+  int compare(const StringView&) const;
+
+  explicit operator std::string() const;
+#if HJSON_HAS_STRING_VIEW
+  operator std::string_view() const {
+    return std::string_view(pCh, len);
+  }
+#endif
+
+private:
+  const char *pCh;
+  size_t len;
+};
+
+
+bool operator ==(const StringView&, const StringView&);
+bool operator !=(const StringView&, const StringView&);
+bool operator <(const StringView&, const StringView&);
+
+
+// A sequence of map keys and vector indexes that leads from a Value to one of
+// its descendants. The path is parsed once, after that it can be looked up in
+// any number of Values without any allocation (see Value::at(const Path&) and
+// Value::find(const Path&)).
+class Path {
+public:
+  // An empty path, that leads to the Value itself.
+  Path();
+  // Parses a JSON Pointer (RFC 6901) if `path` is empty or starts with '/',
+  // like "/service/pools/3/timeout", where "~1" means '/' and "~0" means '~'.
+  // Otherwise the elements are separated by dots, like
+  // "service.pools.3.timeout". An element is always used as a key in a Map.
+  // In a Vector, an element that is a non-negative integer without leading
+  // zeros is used as an index, and the element "-" means the end of the
+  // Vector (only useful to Value::insert_or_assign(const Path&, Value)).
+  // Throws Hjson::syntax_error if a JSON Pointer contains a '~' that is not
+  // followed by '0' or '1'.
+  explicit Path(const std::string& path);
+  explicit Path(const char *path);
+
+  // Adds an element to the end of the path, without any parsing. Needed for
+  // keys that contain the separator. Throws Hjson::index_out_of_bounds for a
+  // negative index.
+  Path& push_back(const std::string& key);
+  Path& push_back(int index);
+  // Returns the number of elements in the path.
+  size_t size() const;
+  bool empty() const;
+
+private:
+  friend class Value;
+
+  struct Step {
+    std::string key;
+    // The index in a Vector, or -1 if the key is not an index, or -2 for "-".
+    int index;
+  };
+
+  std::vector<Step> steps;
 };
 
 
 class MapProxy;
+class ValueAccess;
 
 
 class Value {
   friend class MapProxy;
+  friend class ConstValue;
+  // Used by the decoder and the encoder.
+  friend class ValueAccess;
 
 private:
   class ValueImpl;
   class Comments;
 
-  std::shared_ptr<ValueImpl> prv;
+  // Points to the ValueImpl of a Value. Null, Bool, Double and Int64 values
+  // are stored in the ImplRef itself, so that creating or copying them does
+  // not allocate any memory or change any reference count. All other types
+  // are stored in a ValueImpl that copies of the Value share.
+  class ImplRef {
+    friend class ValueImpl;
+
+  public:
+    ImplRef();
+    ImplRef(std::shared_ptr<ValueImpl>);
+    ImplRef(const ImplRef&);
+    ImplRef(ImplRef&&);
+    ~ImplRef();
+
+    ImplRef& operator =(const ImplRef&);
+    ImplRef& operator =(ImplRef&&);
+    // True if both refer to the same ValueImpl, or hold equal local values.
+    bool operator ==(const ImplRef&) const;
+
+    ValueImpl *operator->() const {
+      return p;
+    }
+
+    ValueImpl& operator*() const {
+      return *p;
+    }
+
+  private:
+    // Points either to local or to the object owned by sp.
+    ValueImpl *p;
+    union {
+      std::shared_ptr<ValueImpl> sp;
+      // Big enough for a ValueImpl (checked in hjson_value.cpp).
+      alignas(8) unsigned char local[24];
+    };
+
+    bool _isLocal() const {
+      return p == reinterpret_cast<const ValueImpl*>(local);
+    }
+    // Take over the contents of the argument. Must only be called when this
+    // object holds nothing, i.e. after _release() or from a constructor.
+    void _copyFrom(const ImplRef&);
+    void _moveFrom(ImplRef&);
+    void _release();
+  };
+
+  ImplRef prv;
   std::shared_ptr<Comments> cm;
 
-  Value(std::shared_ptr<ValueImpl>, std::shared_ptr<Comments>);
+  Value(const ImplRef&, std::shared_ptr<Comments>);
 
 public:
   Value();
@@ -222,6 +513,11 @@ public:
   operator unsigned long long() const;
   operator const char*() const;
   operator std::string() const;
+  // Returns a view of the string without copying it. The view is valid for
+  // as long as this Value (or any other Value referring to the same string)
+  // exists and is not changed. Throws type_mismatch if this Value is not of
+  // type String.
+  StringView as_string_view() const;
 
   // Like `Marshal(Value)` but outputs the result to the stream.
   friend std::ostream& operator <<(std::ostream&, const Value&);
@@ -243,10 +539,39 @@ public:
   bool is_numeric() const;
   // Returns true if the entire tree for which this Value is the root is equal
   // to the entire tree for which the Value parameter is root. Comments are
-  // ignored in the comparison.
+  // ignored in the comparison. Returns false right away if both trees are
+  // frozen and their hashes differ (see hash()).
   bool deep_equal(const Value&) const;
-  // Returns a full clone of the tree for which this Value is the root.
+  // Returns a hash of the entire tree for which this Value is the root, which
+  // is the same for all trees that are deep_equal(). Comments are ignored.
+  // The hash of each part of a frozen tree is computed by freeze() and stored,
+  // so it is returned without walking the tree. For a tree that is not frozen
+  // the hash is computed on each call, but frozen parts of the tree still use
+  // their stored hashes.
+  std::size_t hash() const;
+  // Returns a full clone of the tree for which this Value is the root. A
+  // frozen tree is shared instead of copied, since it cannot be changed
+  // anyway (see freeze()).
   Value clone() const;
+  // Makes the tree for which this Value is the root immutable, so that it can
+  // be read from several threads at the same time without any locking. The
+  // tree is not copied. Afterwards a change made through this Value or any
+  // other Value that refers to a part of the tree (e.g. a copy of this Value)
+  // first replaces the changed Vector, Map or scalar, and each container on
+  // the path to it, with a copy that is not frozen. All other parts of the
+  // tree are shared with the frozen version. Calling freeze() again on the
+  // changed tree only needs to visit the copied parts. References to elements
+  // (`Value&`) that were obtained before freeze() was called must not be used
+  // to change the tree. Reading an element with a non-const function that
+  // returns a reference or pointer to it (like the non-const find(), at(),
+  // begin() or `operator[](int)`) also copies the frozen containers on the
+  // path, since the element could be changed through the reference. Lookups
+  // that fail, and reads through `operator[](std::string)`, leave the tree
+  // unchanged. Threads that share a frozen tree should read it through const
+  // Values or ConstValue.
+  void freeze();
+  // Returns true if this Value is a part of a frozen tree.
+  bool is_frozen() const;
 
   // -- Vector and Map specific functions
   // Removes all child elements from this Value if it is of type Vector or Map.
@@ -271,12 +596,27 @@ public:
   // Returns the number of child elements contained in this Value if this Value
   // is of type Vector or Map. Returns 0 if this Value is of any other type.
   size_t size() const;
+  // Makes room for `count` child elements if this Value is of type Vector or
+  // Map, so that adding that many elements does not need to grow the storage
+  // more than once. Does nothing if this Value is of any other type.
+  void reserve(size_t count);
 
   // -- Vector specific function
   // Increases the size of this Vector by adding a Value at the end. Throws
   // Hjson::type_mismatch if this Value is of any other type than Vector or
   // Undefined.
   void push_back(const Value&);
+  // Like push_back(const Value&), but moves the Value into the Vector instead
+  // of copying it, so that no reference count or comment is touched.
+  void push_back(Value&&);
+  // Constructs a Value from `args` at the end of this Vector and returns a
+  // reference to it. Throws Hjson::type_mismatch if this Value is of any other
+  // type than Vector or Undefined.
+  template<typename... Args>
+  Value& emplace_back(Args&&... args) {
+    push_back(Value(std::forward<Args>(args)...));
+    return (*this)[static_cast<int>(size() - 1)];
+  }
 
   // -- Map specific functions
   // Get key by its zero-based insertion index. Throws
@@ -292,12 +632,44 @@ public:
   Value& at(const std::string& key);
   const Value& at(const char *key) const;
   Value& at(const char *key);
+  // Returns a reference to the Value that the path leads to. Throws
+  // Hjson::index_out_of_bounds if there is no such Value, or if the path
+  // passes through a Value that is not a Vector or a Map.
+  const Value& at(const Path& path) const;
+  Value& at(const Path& path);
+  // Returns a pointer to the Value that the path leads to, or null if there is
+  // no such Value. Never throws. If the Value is found, the non-const version
+  // thaws the frozen Values along the path (see freeze()). A failed lookup
+  // does not change anything.
+  const Value *find(const Path& path) const;
+  Value *find(const Path& path);
+  // Looks up all the paths in a single walk through this Value: a path that
+  // begins with the same elements as the path before it in the list only
+  // looks up the rest of its elements. Returns a pointer (or null) for each
+  // path, like find(const Path&).
+  std::vector<const Value*> find(const std::vector<Path>& paths) const;
   // Iterations are always done in alphabetical key order. Returns a default
   // constructed iterator if this Value is of any other type than Map.
   std::map<std::string, Value>::iterator begin();
   std::map<std::string, Value>::iterator end();
   std::map<std::string, Value>::const_iterator begin() const;
   std::map<std::string, Value>::const_iterator end() const;
+  // Sets the child element specified by `key` to `value`, moving both into
+  // the Map and looking up the key only once. The element gets the comments
+  // of `value`, like in assign_with_comments(). A new key is added last in the
+  // insertion order. Returns true if the key was added, false if an existing
+  // element was replaced. Throws Hjson::type_mismatch if this Value is of any
+  // other type than Map or Undefined.
+  bool insert_or_assign(std::string key, Value value);
+  // Like insert_or_assign(std::string, Value), but for the Value that the
+  // path leads to. Missing elements along the path are created as Maps, an
+  // element can also be added at the end of a Vector (as index size() or
+  // "-"). Returns true if an element was added. Throws Hjson::type_mismatch
+  // if the path passes through a Value that is not a Vector, a Map or
+  // Undefined, or through a Vector with an element that is not an index.
+  // Throws Hjson::index_out_of_bounds for an index beyond the end of a
+  // Vector. Elements that were created before such an error are kept.
+  bool insert_or_assign(const Path& path, Value value);
   // Removes the child element specified by the input key if this Value is of
   // type Map. Returns the number of erased elements (0 or 1). Throws
   // Hjson::type_mismatch if this Value is of any other type than Map or
@@ -350,14 +722,16 @@ class MapProxy : public Value {
   friend class Value;
 
 private:
-  std::shared_ptr<ValueImpl> parentPrv;
+  ImplRef parentPrv;
+  // The Value that parentPrv belongs to, so that a frozen parent can be
+  // replaced by a copy if this element is changed.
+  Value *parent;
   std::string key;
   Value *pTarget;
   // True if an explicit assignment has been made to this MapProxy.
   bool wasAssigned;
 
-  MapProxy(std::shared_ptr<ValueImpl> parent, const std::string& key,
-    Value *pTarget);
+  MapProxy(Value *parent, const std::string& key, Value *pTarget);
 
   // Make the copy constructor private in order to avoid accidental creation of
   // MapProxy variables like this:
@@ -376,6 +750,50 @@ public:
 };
 
 
+// A read-only reference to a Value that does not change any reference count,
+// neither when it is created nor when it is used to look up elements (unlike
+// copying a Value, which is what `const Value::operator[](std::string)`
+// returns). Reading a frozen tree (see Value::freeze()) through ConstValues
+// from many threads at the same time therefore does not make the threads
+// compete for the same memory. A ConstValue is only valid for as long as the
+// Value that it refers to exists and is not changed. The functions behave like
+// the const functions of Value with the same names.
+class ConstValue {
+public:
+  // Creates an Undefined ConstValue.
+  ConstValue();
+  ConstValue(const Value&);
+
+  Type type() const;
+  bool defined() const;
+  bool empty() const;
+  bool is_container() const;
+  bool is_numeric() const;
+  bool is_frozen() const;
+  size_t size() const;
+
+  ConstValue operator[](const std::string&) const;
+  ConstValue operator[](const char*) const;
+  ConstValue operator[](int) const;
+  ConstValue at(const std::string& key) const;
+  ConstValue at(const char *key) const;
+  ConstValue at(const Path& path) const;
+  // Returns a reference to the key instead of a copy.
+  const std::string& key(int) const;
+
+  double to_double() const;
+  std::int64_t to_int64() const;
+  std::string to_string() const;
+  StringView as_string_view() const;
+
+  // Returns the Value that this ConstValue refers to.
+  const Value& value() const;
+
+private:
+  const Value *pv;
+};
+
+
 class StreamEncoder {
 public:
   const Value& v;
@@ -402,6 +820,356 @@ public:
 };
 
 
+// An IncrementalDecoder unmarshals documents that arrive in chunks, for
+// example from a socket or a pipe. The caller feeds each chunk as it arrives.
+// A document is known to be complete as soon as the closing brace (or
+// bracket) of its root has been fed. To find out, each chunk that contains a
+// '}' or ']' makes feed() check the syntax of the buffered document from its
+// start, like Hjson::Parse() does (so DecoderOptions::maxDepth applies), but
+// without creating any Values. A document without root braces is only
+// complete when finish() is called. If the buffered input is not valid Hjson,
+// take() throws Hjson::syntax_error and discards all of it.
+//
+// Anything fed after the end of a complete document is kept as the start of
+// the next document, so several documents can be decoded from one stream.
+// Comments after the closing brace of a document therefore become
+// comment_before of the next document, and are discarded if no document
+// follows.
+//
+// Example:
+//
+//   Hjson::IncrementalDecoder decoder;
+//   while (size_t n = readSocket(buf, sizeof(buf))) {
+//     decoder.feed(buf, n);
+//     while (decoder.ready()) {
+//       handleRequest(decoder.take());
+//     }
+//   }
+//   if (decoder.finish()) {
+//     handleRequest(decoder.take());
+//   }
+//
+class IncrementalDecoder {
+public:
+  explicit IncrementalDecoder(const DecoderOptions& options = DecoderOptions());
+  ~IncrementalDecoder();
+
+  IncrementalDecoder(const IncrementalDecoder&) = delete;
+  IncrementalDecoder& operator =(const IncrementalDecoder&) = delete;
+
+  // Appends a chunk of input. Returns true if a complete document is
+  // available from take().
+  bool feed(const char *data, size_t size);
+  bool feed(const std::string& data);
+  // Signals the end of the input, making any remaining input a complete
+  // document. Returns true if a document is available from take(), i.e.
+  // unless the remaining input only consists of whitespace and comments.
+  bool finish();
+  // Returns true if a complete document is available from take().
+  bool ready() const;
+  // Unmarshals and returns the next complete document, and removes it from
+  // the input buffer. Returns an Undefined Value if no document is complete.
+  // Throws Hjson::syntax_error if the document is not valid Hjson.
+  Value take();
+  // Returns the number of bytes of input that are buffered.
+  size_t buffered() const;
+
+private:
+  class State;
+
+  std::unique_ptr<State> state;
+};
+
+
+// A Decoder unmarshals many documents with the same options. Unlike separate
+// calls to Unmarshal() it keeps its buffers from one document to the next, so
+// that small documents can be decoded at a high rate without any setup cost.
+//
+// decode() works like Unmarshal(). next() instead reads consecutive documents
+// from one buffer or stream, for example JSON lines or a log of Hjson
+// records. A document that starts with '{' or '[' ends at the matching
+// closing brace or bracket, any other document (such as a root map without
+// braces, or a single number or string) ends at the end of its line. Comments
+// on the lines before a document become its comment_before, comments on the
+// same line after it become its comment_after. When reading from a stream,
+// the input is read in chunks and only the part that has not been decoded
+// yet is buffered. The option stringViews is only used for input that the
+// caller keeps alive, see reset().
+//
+// If a document is not valid Hjson, next() throws Hjson::syntax_error after
+// skipping it, so next() can be called again to continue with the following
+// document. A document that starts with '{' or '[' is skipped up to its
+// matching closing brace or bracket (braces and brackets in quoted strings
+// and comments are not counted), any other document up to the end of the
+// line that it started on.
+//
+// Example:
+//
+//   Hjson::Decoder decoder;
+//   decoder.reset(std::cin);
+//   for (const Hjson::Value& record : decoder) {
+//     handleRecord(record);
+//   }
+//
+class Decoder {
+public:
+  class iterator {
+  public:
+    iterator()
+      : decoder(nullptr),
+      doc(Type::Null)
+    {
+    }
+
+    const Value& operator *() const { return doc; }
+    const Value *operator ->() const { return &doc; }
+    // Reads the next document, or becomes equal to end() at the end of the
+    // input.
+    iterator& operator ++() {
+      if (!decoder->next(doc)) {
+        decoder = nullptr;
+      }
+      return *this;
+    }
+    bool operator ==(const iterator& other) const { return decoder == other.decoder; }
+    bool operator !=(const iterator& other) const { return decoder != other.decoder; }
+
+  private:
+    friend class Decoder;
+
+    explicit iterator(Decoder *d)
+      : decoder(d),
+      doc(Type::Null)
+    {
+      ++*this;
+    }
+
+    Decoder *decoder;
+    Value doc;
+  };
+
+  explicit Decoder(const DecoderOptions& options = DecoderOptions());
+  ~Decoder();
+
+  Decoder(const Decoder&) = delete;
+  Decoder& operator =(const Decoder&) = delete;
+
+  // Like `Unmarshal(const char*, size_t, DecoderOptions)`, using the options
+  // of this Decoder. Does not change the input of next().
+  Value decode(const char *data, size_t dataSize);
+  // Like `Unmarshal(const std::string&, DecoderOptions)`.
+  Value decode(const std::string& data);
+
+  // Sets the input of next() to a buffer that the caller must keep alive (and
+  // unchanged) until next() has returned false or reset() is called again.
+  void reset(const char *data, size_t dataSize);
+  void reset(const std::string& data);
+  // Like `reset(const std::string&)`, but the Decoder keeps the data.
+  void reset(std::string&& data);
+  // Sets the input of next() to a stream, which is read as needed.
+  void reset(std::istream& in);
+  // Decodes the next document into v (including its comments). Returns false,
+  // without changing v, if there is only whitespace and comments left.
+  bool next(Value& v);
+
+  // Iterates over the documents that next() returns.
+  iterator begin();
+  iterator end();
+
+private:
+  class State;
+
+  std::unique_ptr<State> state;
+};
+
+
+// A FileCache keeps the Value trees of the files it has parsed, so that the
+// parts of a program that read the same file can share one tree, and so that
+// a file is only parsed again when it has changed. A file is considered
+// changed when its size or modification time is not the same as when it was
+// parsed. If compareContent is true, the contents of such a file are also
+// compared (by hash) with the contents that were parsed, so that a file that
+// was only touched is not parsed again.
+//
+// The trees are frozen (see Value::freeze()), so they can be read from any
+// number of threads, and a change made through a returned Value does not
+// affect the cache or any other user of the tree. A Value that was returned
+// before a file changed keeps referring to the old tree. All functions can be
+// called from several threads at the same time (see watch() for what onChange
+// can call).
+//
+// Example:
+//
+//   Hjson::FileCache cache;
+//   cache.watch(std::chrono::seconds(1));
+//   ...
+//   Hjson::Value config = cache.get(szPath);
+//
+class FileCache {
+public:
+  explicit FileCache(const DecoderOptions& options = DecoderOptions(),
+    bool compareContent = false);
+  // Stops the thread started by watch(), if any.
+  ~FileCache();
+
+  FileCache(const FileCache&) = delete;
+  FileCache& operator =(const FileCache&) = delete;
+
+  // Returns the tree of the file at path. The file is parsed (with
+  // UnmarshalFromFile() and the options of this FileCache) if it is not in
+  // the cache or has changed. Throws Hjson::file_error or Hjson::syntax_error
+  // like UnmarshalFromFile(), and then keeps the previous tree of the file in
+  // the cache, if any. If several threads ask for the same file at the same
+  // time, it is only parsed once.
+  Value get(const std::string& path);
+  // Returns the tree of the file at path from the cache without checking the
+  // file, or an Undefined Value if the file has not been parsed.
+  Value cached(const std::string& path) const;
+  // Checks all files in the cache, and parses those that have changed.
+  // Returns the number of files that got a new tree. A file that cannot be
+  // read or parsed keeps its previous tree.
+  size_t refresh();
+  // Starts a thread that calls refresh() every interval, until stop() is
+  // called or the FileCache is destroyed. If onChange is set, the thread
+  // calls it with the path and the new tree of each file whose tree in the
+  // cache has been replaced since the previous check, either by the thread
+  // itself or by get(). It is not called for the first tree of a file.
+  // onChange can call any function of the FileCache except watch() (which
+  // then throws std::logic_error), and must not destroy the FileCache.
+  void watch(std::chrono::milliseconds interval,
+    const std::function<void(const std::string& path, const Value& root)>& onChange = nullptr);
+  // Stops the thread started by watch(), waiting for it to finish. If called
+  // from onChange, it returns at once and the thread stops when onChange
+  // returns.
+  void stop();
+  // Removes the file at path from the cache.
+  void erase(const std::string& path);
+  // Removes all files from the cache.
+  void clear();
+
+private:
+  class Entry;
+  class State;
+
+  std::unique_ptr<State> state;
+};
+
+
+// An EventHandler receives the contents of an Hjson document from
+// Hjson::Parse(), one event at a time, without any Value tree being created.
+// Override the functions for the events of interest, the default
+// implementations do nothing. Throw an exception from any of the functions to
+// stop parsing, it is passed on to the caller of Parse().
+//
+// Key names and strings are views into the input data, or into a temporary
+// buffer if they contain escape sequences. A view is only valid until the
+// function that received it returns.
+class EventHandler {
+public:
+  virtual ~EventHandler();
+
+  // Called for each map. Each element is reported as key() followed by the
+  // events for its value, then end_object() is called.
+  virtual void start_object();
+  virtual void end_object();
+  // Called for each vector. The events for each element follow, then
+  // end_array() is called.
+  virtual void start_array();
+  virtual void end_array();
+  virtual void key(const StringView& name);
+  // Called for each string, quoted or quoteless.
+  virtual void string(const StringView& str);
+  // Called for each null, boolean and number.
+  virtual void scalar(const Value& val);
+  // Called for each run of comments (including the whitespace between them),
+  // unless DecoderOptions::comments is false. If
+  // DecoderOptions::whitespaceAsComments is true, it is also called for runs of
+  // only whitespace.
+  virtual void comment(const StringView& text);
+};
+
+
+class LazyValue;
+
+
+// A read-only view of an Hjson document for when only a few values are needed
+// from a big document. The constructor makes a single pass over the input to
+// check the syntax (like Hjson::Parse() does) and to build an index of where
+// each value starts and ends, without creating any Values. Keys, strings and
+// numbers are only decoded when they are accessed through a LazyValue.
+// Throws Hjson::syntax_error if the input is not valid Hjson, or nested deeper
+// than the default DecoderOptions::maxDepth. Comments are ignored.
+class LazyDocument {
+public:
+  // The caller must keep "data" alive and unchanged for as long as the
+  // LazyDocument or any LazyValue from it exists.
+  LazyDocument(const char *data, size_t dataSize);
+  explicit LazyDocument(const std::string& data);
+  // Takes ownership of "data", it does not need to be kept alive.
+  explicit LazyDocument(std::string&& data);
+
+  LazyValue root() const;
+
+private:
+  class Index;
+
+  std::shared_ptr<const Index> idx;
+
+  friend class LazyValue;
+};
+
+
+// Refers to a value in a LazyDocument, and keeps the document alive. Has the
+// same read-only accessors as Hjson::Value, with the same exceptions. Looking
+// up a key or an index is linear in the number of elements that precede it.
+// If a map contains duplicate keys, key lookups find the last value (like in
+// the Value tree from Unmarshal), but size(), key(int) and operator[](int)
+// see every occurrence.
+class LazyValue {
+public:
+  // Creates an Undefined LazyValue.
+  LazyValue();
+
+  Type type() const;
+  bool defined() const;
+  bool empty() const;
+  bool is_container() const;
+  bool is_numeric() const;
+  size_t size() const;
+
+  // Returns an Undefined LazyValue if this is Undefined or if the key is not
+  // found.
+  LazyValue operator[](const std::string& key) const;
+  LazyValue operator[](const char *key) const;
+  LazyValue operator[](int index) const;
+  // Like operator[], but throws Hjson::index_out_of_bounds if the key is not
+  // found.
+  LazyValue at(const std::string& key) const;
+  LazyValue at(const char *key) const;
+  std::string key(int index) const;
+
+  // Decodes this value, including all of its elements, into a Value tree.
+  // Returns an Undefined Value if this LazyValue is Undefined.
+  Value to_value() const;
+  // Like the Value functions of the same names, but only this one value is
+  // decoded.
+  double to_double() const;
+  std::int64_t to_int64() const;
+  std::string to_string() const;
+
+private:
+  std::shared_ptr<const LazyDocument::Index> idx;
+  // Index of the entry in idx, or -1 if Undefined.
+  int node;
+
+  LazyValue(const std::shared_ptr<const LazyDocument::Index>&, int node);
+  int _find(const char *key, size_t keySize) const;
+  int _element(int index) const;
+
+  friend class LazyDocument;
+};
+
+
 // Returns a properly indented text representation of the input value tree.
 // Extra options can be specified in the input parameter "options".
 std::string Marshal(const Value& v, const EncoderOptions& options = EncoderOptions());
@@ -413,10 +1181,37 @@ std::string Marshal(const Value& v, const EncoderOptions& options = EncoderOptio
 void MarshalToFile(const Value& v, const std::string& path,
   const EncoderOptions& options = EncoderOptions());
 
+// Like Marshal, but instead of returning the text it passes it to the
+// function "write", one chunk of at most 64 KiB at a time (except when a
+// single string is bigger than that). The whole text is never kept in memory
+// at once, which is useful when writing a big document to a socket or to a
+// file descriptor.
+void MarshalToCallback(const Value& v, const std::function<void(const char *data,
+  size_t size)>& write, const EncoderOptions& options = EncoderOptions());
+
 // Returns a properly indented JSON text representation of the input value
 // tree.
 std::string MarshalJson(const Value&);
 
+// Returns a JSON text representation of the input value tree without any
+// whitespace, for sending to other programs rather than to people.
+std::string MarshalJsonCompact(const Value&);
+
+// Returns a compact binary representation of the input value tree, for
+// caching a parsed document so that it can be loaded again faster than by
+// parsing the text (see UnmarshalBinary). The format is not human readable and
+// may change between versions of this library, so it should not be used for
+// long-term storage. Of the options only "comments" and "stats" are used.
+// Vectors, maps and the order of map elements are kept exactly, including
+// Undefined elements.
+std::string MarshalBinary(const Value& v, const EncoderOptions& options = EncoderOptions());
+
+// Writes the output of MarshalBinary to the file specified by the input
+// parameter "path". Throws Hjson::file_error if the file cannot be opened for
+// writing.
+void MarshalBinaryToFile(const Value& v, const std::string& path,
+  const EncoderOptions& options = EncoderOptions());
+
 // Creates a Value tree from input text.
 Value Unmarshal(const char *data, size_t dataSize,
   const DecoderOptions& options = DecoderOptions());
@@ -429,11 +1224,61 @@ Value Unmarshal(const char *data, const DecoderOptions& options = DecoderOptions
 Value Unmarshal(const std::string& data,
   const DecoderOptions& options = DecoderOptions());
 
+// Creates a Value tree from input text. The Value tree takes ownership of
+// "data" so that comments (and strings, if DecoderOptions::stringViews is
+// true) can refer to it instead of being copied.
+Value Unmarshal(std::string&& data,
+  const DecoderOptions& options = DecoderOptions());
+
 // Reads the entire file (in binary mode) and unmarshals it. Throws
-// Hjson::file_error if the file cannot be opened for reading.
+// Hjson::file_error if the file cannot be opened for reading. The file is
+// parsed from a memory mapping if possible. If DecoderOptions::stringViews is
+// true the Value tree keeps the mapping, and then the file must not be
+// changed for as long as any Value from the tree exists.
 Value UnmarshalFromFile(const std::string& path,
   const DecoderOptions& options = DecoderOptions());
 
+// Creates a Value tree from data written by MarshalBinary. Throws
+// Hjson::syntax_error if the data is not valid or was written by another
+// version of the format. The options comments, duplicateKeyException, arena,
+// stringViews, maxDepth and stats are used like in Unmarshal(). Since strings
+// are stored without escape sequences, all strings are views of the data if
+// stringViews is true.
+Value UnmarshalBinary(const char *data, size_t dataSize,
+  const DecoderOptions& options = DecoderOptions());
+
+// Like `UnmarshalBinary(const char*, size_t, const DecoderOptions&)`.
+Value UnmarshalBinary(const std::string& data,
+  const DecoderOptions& options = DecoderOptions());
+
+// Like `UnmarshalBinary(const char*, size_t, const DecoderOptions&)`, but the
+// Value tree takes ownership of "data" so that comments and string views can
+// refer to it instead of being copied.
+Value UnmarshalBinary(std::string&& data,
+  const DecoderOptions& options = DecoderOptions());
+
+// Reads the entire file written by MarshalBinaryToFile and unmarshals it, from
+// a memory mapping if possible. Like with UnmarshalFromFile, if
+// DecoderOptions::stringViews is true the Value tree keeps the mapping and the
+// file must not be changed for as long as any Value from the tree exists. Then
+// no string or comment is copied.
+Value UnmarshalBinaryFromFile(const std::string& path,
+  const DecoderOptions& options = DecoderOptions());
+
+// Parses input text and reports its contents to "handler" instead of creating
+// a Value tree, see Hjson::EventHandler. Throws Hjson::syntax_error if the
+// input is not valid Hjson, possibly after some events have already been
+// reported. A root map without braces is reported like any other map. It is
+// recognized by the first key name followed by ':', so some invalid input that
+// Unmarshal() decodes as a single quoteless string is rejected. The options
+// duplicateKeyException, arena, stringViews and stats are ignored.
+void Parse(const char *data, size_t dataSize, EventHandler& handler,
+  const DecoderOptions& options = DecoderOptions());
+
+// Like `Parse(const char*, size_t, EventHandler&, const DecoderOptions&)`.
+void Parse(const std::string& data, EventHandler& handler,
+  const DecoderOptions& options = DecoderOptions());
+
 // Returns a Value tree that is a combination of the input parameters "base"
 // and "ext".
 //
@@ -447,12 +1292,73 @@ Value UnmarshalFromFile(const std::string& path,
 // and "ext" trees, the one from "ext" will be used in the returned tree.
 //
 // Maps and vectors are cloned, not copied. Therefore changes in the returned
-// tree will not affect the input variables "base" and "ext.
+// tree will not affect the input variables "base" and "ext. Frozen subtrees
+// are shared instead of cloned (see Value::freeze()), so if "base" and "ext"
+// are frozen only the maps that exist in both of them are created.
 //
 // If "ext" is of type Undefined, a clone of "base" is returned.
 //
 Value Merge(const Value& base, const Value& ext);
 
+// Returns the same tree as merging each layer into the result of merging the
+// layers before it, e.g. `Merge(Merge(layers[0], layers[1]), layers[2])`, but
+// in one pass and without creating the intermediate trees. Returns an
+// Undefined Value if "layers" is empty.
+Value Merge(const std::vector<Value>& layers);
+
+// Returns a patch that turns "from" into "to" when given to ApplyPatch(). The
+// patch is a Vector of Maps with the same layout as a JSON Patch (RFC 6902),
+// using only the operations "add", "remove" and "replace":
+//
+//   [{op: "replace", path: "/server/port", value: 8081}]
+//
+// Equality is decided like in Value::deep_equal(), so comments are ignored,
+// but the values in the patch are clones that keep their comments. Subtrees
+// that are shared by "from" and "to" (like the unchanged parts of a frozen
+// tree after a change, see Value::freeze()) are skipped without being walked.
+Value Diff(const Value& from, const Value& to);
+
+// Applies a patch created by Diff() (or any JSON Patch that only uses "add",
+// "remove" and "replace") to "target". A frozen target is only copied along
+// the changed paths. Throws Hjson::index_out_of_bounds if a path does not
+// exist, Hjson::syntax_error if a path is not a valid JSON Pointer, and
+// Hjson::type_mismatch if the patch is malformed. The operations before the
+// failing one remain applied.
+void ApplyPatch(Value& target, const Value& patch);
+
+
+// Writes Hjson text from events like the ones that Hjson::Parse() reports,
+// without any Value tree. The text is formatted like Marshal() formats a tree
+// without comments; comment() events are ignored. The events must describe
+// exactly one value, and inside a map each value must follow a key() event.
+// EncoderOptions::stats is not used.
+class EventEncoder : public EventHandler {
+public:
+  explicit EventEncoder(const EncoderOptions& options = EncoderOptions());
+  ~EventEncoder();
+
+  EventEncoder(const EventEncoder&) = delete;
+  EventEncoder& operator =(const EventEncoder&) = delete;
+
+  void start_object() override;
+  void end_object() override;
+  void start_array() override;
+  void end_array() override;
+  void key(const StringView& name) override;
+  void string(const StringView& str) override;
+  void scalar(const Value& val) override;
+  // Writes a whole Value tree, without its comments. Undefined elements are
+  // skipped, like Marshal() does.
+  void value(const Value& val);
+
+  // Returns the text written so far, and leaves this EventEncoder empty.
+  std::string take();
+
+private:
+  struct Impl;
+
+  std::unique_ptr<Impl> impl;
+};
 
 }
 
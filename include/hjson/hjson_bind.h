@@ -0,0 +1,509 @@
+#ifndef HJSON_BIND_ZPQMWOEIRUTYALSK
+#define HJSON_BIND_ZPQMWOEIRUTYALSK
+
+#include "hjson.h"
+#include <limits>
+#include <type_traits>
+
+
+namespace Hjson {
+
+
+// Hjson::Bind<T> lists the fields of a struct T, so that
+// `Hjson::Unmarshal<T>(text)` can decode Hjson text straight into a T and
+// `Hjson::Marshal(obj)` can encode a T, without a Value tree being created in
+// between. The list is given with the HJSON_BIND macro, at global scope:
+//
+//   struct Pool {
+//     std::string host;
+//     int port = 80;
+//     std::vector<int> weights;
+//   };
+//   HJSON_BIND(Pool,
+//     HJSON_FIELD(host)
+//     HJSON_FIELD(port)
+//     HJSON_FIELD_NAMED(weights, "weight-list"))
+//
+// The fields can be of these types: bool, the integer and floating point
+// types, std::string, Hjson::Value (which takes any value, without
+// comments), std::vector<U> (except std::vector<bool>) and
+// std::map<std::string, U> of those types, and other bound structs.
+template<typename T>
+struct Bind {
+  static const bool bound = false;
+};
+
+
+#define HJSON_BIND(T, ...) \
+  namespace Hjson { \
+  template<> \
+  struct Bind<T> { \
+    typedef T BoundType; \
+    static const bool bound = true; \
+    template<typename F> \
+    static void fields(F& f) { \
+      __VA_ARGS__ \
+    } \
+  }; \
+  }
+#define HJSON_FIELD(member) f(#member, &BoundType::member);
+#define HJSON_FIELD_NAMED(member, name) f(name, &BoundType::member);
+
+
+struct BindOps;
+
+
+// The object that the next value is decoded into, and how. An object with
+// null ops ignores the value (e.g. for an unknown key).
+struct BindSlot {
+  void *obj;
+  const BindOps *ops;
+};
+
+
+// What a type does with each event from the parser. Each function that
+// returns bool returns false if the value cannot be decoded into the type.
+struct BindOps {
+  bool (*startObject)(void *obj);
+  bool (*startArray)(void *obj);
+  // Returns the slot for the element with the key. Only called after
+  // startObject().
+  BindSlot (*key)(void *obj, const StringView& key);
+  // Returns the slot for the next element. Only called after startArray().
+  BindSlot (*element)(void *obj);
+  bool (*string)(void *obj, const StringView& str);
+  bool (*scalar)(void *obj, const Value& val);
+  // A description of the type for error messages.
+  const char *name;
+
+  template<typename B>
+  static const BindOps *of() {
+    static const BindOps ops = {&B::startObject, &B::startArray, &B::key,
+      &B::element, &B::string, &B::scalar, B::name()};
+    return &ops;
+  }
+};
+
+
+// The functions of a type that accepts nothing but null, which leaves the
+// object unchanged.
+struct BindDefaults {
+  static bool startObject(void*) {
+    return false;
+  }
+  static bool startArray(void*) {
+    return false;
+  }
+  static BindSlot key(void*, const StringView&) {
+    return BindSlot();
+  }
+  static BindSlot element(void*) {
+    return BindSlot();
+  }
+  static bool string(void*, const StringView&) {
+    return false;
+  }
+  static bool scalar(void*, const Value& val) {
+    return val.type() == Type::Null;
+  }
+  // Returns true if the object should be left out by Marshal().
+  template<typename T>
+  static bool skip(const T&) {
+    return false;
+  }
+};
+
+
+// Decodes into and encodes from a bound struct. Specialized below for the
+// other supported types.
+template<typename T, typename Enable = void>
+struct Binder : BindDefaults {
+  static_assert(Bind<T>::bound, "The type must be listed with HJSON_BIND, "
+    "or be one of the other types supported by Hjson::Unmarshal<T>().");
+
+  static const char *name() {
+    return "a struct";
+  }
+
+  static bool startObject(void*) {
+    return true;
+  }
+
+  struct KeyFinder {
+    T *obj;
+    const StringView& key;
+    BindSlot slot;
+
+    template<typename U>
+    void operator()(const char *fieldName, U T::*member) {
+      if (!slot.ops && key == StringView(fieldName)) {
+        slot.obj = &(obj->*member);
+        slot.ops = BindOps::of<Binder<U>>();
+      }
+    }
+  };
+
+  static BindSlot key(void *obj, const StringView& key) {
+    KeyFinder finder = {static_cast<T*>(obj), key, BindSlot()};
+    Bind<T>::fields(finder);
+    return finder.slot;
+  }
+
+  struct FieldWriter {
+    EventEncoder& enc;
+    const T& obj;
+
+    template<typename U>
+    void operator()(const char *fieldName, U T::*member) {
+      if (!Binder<U>::skip(obj.*member)) {
+        enc.key(fieldName);
+        Binder<U>::write(enc, obj.*member);
+      }
+    }
+  };
+
+  static void write(EventEncoder& enc, const T& obj) {
+    FieldWriter writer = {enc, obj};
+    enc.start_object();
+    Bind<T>::fields(writer);
+    enc.end_object();
+  }
+};
+
+
+template<>
+struct Binder<bool> : BindDefaults {
+  static const char *name() {
+    return "a bool";
+  }
+
+  static bool scalar(void *obj, const Value& val) {
+    if (val.type() == Type::Bool) {
+      *static_cast<bool*>(obj) = val.to_int64() != 0;
+    }
+    return val.type() == Type::Bool || val.type() == Type::Null;
+  }
+
+  static void write(EventEncoder& enc, bool obj) {
+    enc.scalar(Value(obj));
+  }
+};
+
+
+template<typename T>
+struct Binder<T, typename std::enable_if<std::is_arithmetic<T>::value &&
+  !std::is_same<T, bool>::value>::type> : BindDefaults
+{
+  static const char *name() {
+    return (std::is_floating_point<T>::value ? "a floating point number" :
+      std::is_signed<T>::value ? "an integer of this size" :
+      "an unsigned integer of this size");
+  }
+
+  // A number that is out of range for T, or that has a fraction when T is an
+  // integer type, cannot be decoded into T. Integers that do not fit in an
+  // int64 are parsed as doubles, and so are rounded like any other double.
+  static bool scalar(void *obj, const Value& val) {
+    if (!val.is_numeric()) {
+      return val.type() == Type::Null;
+    }
+    return _assign(static_cast<T*>(obj), val,
+      std::integral_constant<int, std::is_floating_point<T>::value ? 0 :
+      std::is_signed<T>::value ? 1 : 2>());
+  }
+
+  static void write(EventEncoder& enc, T obj) {
+    enc.scalar(_toValue(obj, std::is_unsigned<T>()));
+  }
+
+private:
+  static bool _assign(T *pObj, const Value& val, std::integral_constant<int, 0>) {
+    double d = val.to_double();
+    if (d < -static_cast<double>(std::numeric_limits<T>::max()) ||
+      d > static_cast<double>(std::numeric_limits<T>::max()))
+    {
+      return false;
+    }
+    *pObj = static_cast<T>(d);
+    return true;
+  }
+
+  static bool _assign(T *pObj, const Value& val, std::integral_constant<int, 1>) {
+    std::int64_t i;
+    if (val.type() == Type::Int64) {
+      i = val.to_int64();
+    } else {
+      // The min of a signed type is minus a power of 2, so it is exact as a
+      // double, and so is -min (one more than max).
+      double d = val.to_double();
+      if (!(d >= static_cast<double>(std::numeric_limits<T>::min()) &&
+        d < -static_cast<double>(std::numeric_limits<T>::min())) ||
+        static_cast<double>(static_cast<std::int64_t>(d)) != d)
+      {
+        return false;
+      }
+      i = static_cast<std::int64_t>(d);
+    }
+    if (i < static_cast<std::int64_t>(std::numeric_limits<T>::min()) ||
+      i > static_cast<std::int64_t>(std::numeric_limits<T>::max()))
+    {
+      return false;
+    }
+    *pObj = static_cast<T>(i);
+    return true;
+  }
+
+  static bool _assign(T *pObj, const Value& val, std::integral_constant<int, 2>) {
+    std::uint64_t u;
+    if (val.type() == Type::Int64) {
+      if (val.to_int64() < 0) {
+        return false;
+      }
+      u = static_cast<std::uint64_t>(val.to_int64());
+    } else {
+      // max + 1 is a power of 2, and so exact as a double.
+      double d = val.to_double();
+      if (!(d >= 0 && d < static_cast<double>(std::numeric_limits<T>::max() / 2 + 1) * 2) ||
+        static_cast<double>(static_cast<std::uint64_t>(d)) != d)
+      {
+        return false;
+      }
+      u = static_cast<std::uint64_t>(d);
+    }
+    if (u > static_cast<std::uint64_t>(std::numeric_limits<T>::max())) {
+      return false;
+    }
+    *pObj = static_cast<T>(u);
+    return true;
+  }
+
+  static Value _toValue(T obj, std::false_type) {
+    return Value(obj);
+  }
+
+  // Above the range of int64 the value is written as a double, like such
+  // values are decoded.
+  static Value _toValue(T obj, std::true_type) {
+    if (static_cast<std::uint64_t>(obj) >
+      static_cast<std::uint64_t>(std::numeric_limits<std::int64_t>::max()))
+    {
+      return Value(static_cast<double>(obj));
+    }
+    return Value(static_cast<std::int64_t>(obj));
+  }
+};
+
+
+template<>
+struct Binder<std::string> : BindDefaults {
+  static const char *name() {
+    return "a string";
+  }
+
+  static bool string(void *obj, const StringView& str) {
+    static_cast<std::string*>(obj)->assign(str.data(), str.size());
+    return true;
+  }
+
+  // Numbers and booleans are converted with Value::to_string(), so the text
+  // is not always the same as in the input (e.g. 1.50 becomes "1.5").
+  static bool scalar(void *obj, const Value& val) {
+    if (val.type() != Type::Null) {
+      *static_cast<std::string*>(obj) = val.to_string();
+    }
+    return true;
+  }
+
+  static void write(EventEncoder& enc, const std::string& obj) {
+    enc.string(obj);
+  }
+};
+
+
+template<>
+struct Binder<Value> : BindDefaults {
+  static const char *name() {
+    return "a Value";
+  }
+
+  static bool startObject(void *obj) {
+    static_cast<Value*>(obj)->assign_with_comments(Value(Type::Map));
+    return true;
+  }
+
+  static bool startArray(void *obj) {
+    static_cast<Value*>(obj)->assign_with_comments(Value(Type::Vector));
+    return true;
+  }
+
+  static BindSlot key(void *obj, const StringView& key) {
+    Value *pv = static_cast<Value*>(obj);
+    std::string name(key);
+    pv->insert_or_assign(name, Value(Type::Null));
+    BindSlot slot = {&pv->at(name), BindOps::of<Binder<Value>>()};
+    return slot;
+  }
+
+  static BindSlot element(void *obj) {
+    BindSlot slot = {&static_cast<Value*>(obj)->emplace_back(Type::Null),
+      BindOps::of<Binder<Value>>()};
+    return slot;
+  }
+
+  static bool string(void *obj, const StringView& str) {
+    static_cast<Value*>(obj)->assign_with_comments(Value(std::string(str)));
+    return true;
+  }
+
+  static bool scalar(void *obj, const Value& val) {
+    static_cast<Value*>(obj)->assign_with_comments(val);
+    return true;
+  }
+
+  static bool skip(const Value& obj) {
+    return !obj.defined();
+  }
+
+  static void write(EventEncoder& enc, const Value& obj) {
+    enc.value(obj);
+  }
+};
+
+
+template<typename U>
+struct Binder<std::vector<U>> : BindDefaults {
+  static const char *name() {
+    return "a vector";
+  }
+
+  static bool startArray(void *obj) {
+    static_cast<std::vector<U>*>(obj)->clear();
+    return true;
+  }
+
+  static BindSlot element(void *obj) {
+    auto pVec = static_cast<std::vector<U>*>(obj);
+    pVec->emplace_back();
+    BindSlot slot = {&pVec->back(), BindOps::of<Binder<U>>()};
+    return slot;
+  }
+
+  static void write(EventEncoder& enc, const std::vector<U>& obj) {
+    enc.start_array();
+    for (const auto& elem : obj) {
+      Binder<U>::write(enc, elem);
+    }
+    enc.end_array();
+  }
+};
+
+
+template<typename U>
+struct Binder<std::map<std::string, U>> : BindDefaults {
+  static const char *name() {
+    return "a map";
+  }
+
+  static bool startObject(void *obj) {
+    static_cast<std::map<std::string, U>*>(obj)->clear();
+    return true;
+  }
+
+  static BindSlot key(void *obj, const StringView& key) {
+    BindSlot slot = {&(*static_cast<std::map<std::string, U>*>(obj))[std::string(key)],
+      BindOps::of<Binder<U>>()};
+    return slot;
+  }
+
+  static void write(EventEncoder& enc, const std::map<std::string, U>& obj) {
+    enc.start_object();
+    for (const auto& elem : obj) {
+      if (!Binder<U>::skip(elem.second)) {
+        enc.key(elem.first);
+        Binder<U>::write(enc, elem.second);
+      }
+    }
+    enc.end_object();
+  }
+};
+
+
+// Receives the events from Hjson::Parse() for `Unmarshal<T>()`, and decodes
+// them into the root slot.
+class BindHandler : public EventHandler {
+public:
+  explicit BindHandler(const BindSlot& root);
+
+  void start_object() override;
+  void end_object() override;
+  void start_array() override;
+  void end_array() override;
+  void key(const StringView& name) override;
+  void string(const StringView& str) override;
+  void scalar(const Value& val) override;
+
+private:
+  struct Frame {
+    BindSlot slot;
+    bool isArray;
+  };
+
+  std::vector<Frame> stack;
+  // The slot for the next value of a map (or for the root value).
+  BindSlot next;
+  // The number of nested vectors and maps inside an ignored value.
+  int skipDepth;
+  // For error messages.
+  std::string lastKey;
+
+  BindSlot _target();
+  void _fail(const char *what, const BindSlot& slot);
+};
+
+
+// Decodes Hjson text straight into a T, without creating a Value tree. T can
+// be a struct listed with HJSON_BIND, or any other type that can be a field of
+// such a struct. Keys that are not fields of the struct are ignored, and
+// fields that are not in the text keep their default values. Throws
+// Hjson::syntax_error for invalid Hjson, and Hjson::type_mismatch if a value
+// cannot be decoded into the field type (e.g. a map into an int). Comments are
+// ignored.
+template<typename T>
+T Unmarshal(const char *data, size_t dataSize,
+  const DecoderOptions& options = DecoderOptions())
+{
+  T ret = T();
+  BindSlot root = {&ret, BindOps::of<Binder<T>>()};
+  BindHandler handler(root);
+  DecoderOptions opt = options;
+  opt.comments = false;
+  opt.whitespaceAsComments = false;
+  Parse(data, dataSize, handler, opt);
+  return ret;
+}
+
+
+template<typename T>
+T Unmarshal(const std::string& data, const DecoderOptions& options = DecoderOptions()) {
+  return Unmarshal<T>(data.data(), data.size(), options);
+}
+
+
+// Encodes a struct listed with HJSON_BIND (or a vector or map of such
+// structs), without creating a Value tree. The text is formatted like
+// `Marshal(const Value&, const EncoderOptions&)` formats a map of the same
+// fields, in the order they are listed in. Only used for types that cannot be
+// converted to a Value.
+template<typename T>
+typename std::enable_if<!std::is_convertible<const T&, Value>::value, std::string>::type
+Marshal(const T& obj, const EncoderOptions& options = EncoderOptions()) {
+  EventEncoder enc(options);
+  Binder<T>::write(enc, obj);
+  return enc.take();
+}
+
+
+}
+
+
+#endif
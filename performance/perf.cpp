@@ -1,8 +1,39 @@
+#include <cstring>
+#include <iostream>
+
+
+void perf_benchmark();
 void perf_multithread();
 
 
-int main() {
-  perf_multithread();
+int main(int argc, char **argv) {
+  bool runAll = (argc < 2);
+
+  for (int a = 1; a < argc; ++a) {
+    if (std::strcmp(argv[a], "benchmark") && std::strcmp(argv[a], "multithread")) {
+      std::cerr << "Usage: " << argv[0] << " [benchmark] [multithread]" << std::endl;
+      return 1;
+    }
+  }
+
+  auto selected = [&](const char *name) {
+    if (runAll) {
+      return true;
+    }
+    for (int a = 1; a < argc; ++a) {
+      if (!std::strcmp(argv[a], name)) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  if (selected("benchmark")) {
+    perf_benchmark();
+  }
+  if (selected("multithread")) {
+    perf_multithread();
+  }
 
   return 0;
 }
@@ -0,0 +1,485 @@
+#include <hjson.h>
+#include <hjson_bind.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+#ifndef HJSON_PERF_NUMBER_PARSER
+# define HJSON_PERF_NUMBER_PARSER "unknown"
+#endif
+
+
+// Count every heap allocation made by the process, so that the benchmark can
+// report allocations per document. Relaxed atomics are enough since we only
+// read the counter between runs.
+static std::atomic<unsigned long long> _allocCount(0);
+
+
+void *operator new(std::size_t size) {
+  _allocCount.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+
+void *operator new[](std::size_t size) {
+  return operator new(size);
+}
+
+
+void operator delete(void *p) noexcept {
+  std::free(p);
+}
+
+
+void operator delete[](void *p) noexcept {
+  std::free(p);
+}
+
+
+void operator delete(void *p, std::size_t) noexcept {
+  std::free(p);
+}
+
+
+void operator delete[](void *p, std::size_t) noexcept {
+  std::free(p);
+}
+
+
+// The elements of the records corpus, for Unmarshal<T>().
+struct PerfRecord {
+  std::int64_t id = 0;
+  std::string name, host;
+  int port = 0;
+};
+HJSON_BIND(PerfRecord,
+  HJSON_FIELD(id)
+  HJSON_FIELD(name)
+  HJSON_FIELD(host)
+  HJSON_FIELD(port))
+
+
+struct Corpus {
+  std::string name;
+  std::string text;
+  Hjson::Value root;
+};
+
+
+struct Result {
+  double seconds;
+  unsigned long long iterations;
+  unsigned long long allocs;
+};
+
+
+// Runs fn repeatedly for at least minSeconds (and at least once).
+static Result _measure(const std::function<void()>& fn, double minSeconds) {
+  Result res = {0.0, 0, 0};
+  auto allocStart = _allocCount.load(std::memory_order_relaxed);
+  auto start = std::chrono::steady_clock::now();
+
+  do {
+    fn();
+    ++res.iterations;
+    res.seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  } while (res.seconds < minSeconds);
+
+  res.allocs = _allocCount.load(std::memory_order_relaxed) - allocStart;
+
+  return res;
+}
+
+
+static void _report(const std::string& corpus, const std::string& op,
+  size_t bytes, const Result& res)
+{
+  double mbps = (static_cast<double>(bytes) * res.iterations) /
+    (res.seconds * 1024.0 * 1024.0);
+
+  std::cout << std::left << std::setw(20) << corpus << std::setw(14) << op <<
+    std::right << std::fixed << std::setprecision(2) << std::setw(10) << mbps <<
+    " MB/s" << std::setw(14) << std::setprecision(1) <<
+    static_cast<double>(res.allocs) / res.iterations << " allocs/doc" <<
+    std::setw(12) << std::setprecision(3) <<
+    res.seconds * 1000.0 / res.iterations << " ms/doc" << std::endl;
+}
+
+
+static std::string _deepNesting(int depth) {
+  std::string ret;
+
+  for (int a = 0; a < depth; ++a) {
+    ret += (a % 2 ? "[\n" : "{\n  key" + std::to_string(a) + ": ");
+  }
+  ret += "leaf";
+  for (int a = depth - 1; a >= 0; --a) {
+    ret += (a % 2 ? "\n]" : "\n}");
+  }
+
+  return ret;
+}
+
+
+static std::string _wideMap(int width) {
+  std::string ret = "{\n";
+
+  for (int a = 0; a < width; ++a) {
+    ret += "  feature_flag_" + std::to_string(a * 7919 % width) + ": " +
+      (a % 3 ? "true" : "quoteless value " + std::to_string(a)) + "\n";
+  }
+
+  return ret + "}";
+}
+
+
+static std::string _longStrings(int count, int length) {
+  std::string ret = "[\n";
+  std::string plain(length, 'x');
+  std::string escaped;
+
+  for (int a = 0; a < length / 8; ++a) {
+    escaped += "ab\\\"cd\\n";
+  }
+
+  for (int a = 0; a < count; ++a) {
+    switch (a % 3) {
+    case 0:
+      ret += "  \"" + plain + "\"\n";
+      break;
+    case 1:
+      ret += "  \"" + escaped + "\"\n";
+      break;
+    default:
+      ret += "  '''\n  " + plain + "\n  " + plain + "\n  '''\n";
+      break;
+    }
+  }
+
+  return ret + "]";
+}
+
+
+static std::string _numbers(int count) {
+  std::ostringstream oss;
+
+  oss.imbue(std::locale::classic());
+  oss.precision(17);
+  oss << "[\n";
+  for (int a = 0; a < count; ++a) {
+    switch (a % 4) {
+    case 0:
+      oss << "  " << a * 31337 << ",\n";
+      break;
+    case 1:
+      oss << "  " << -a << ",\n";
+      break;
+    case 2:
+      oss << "  " << a / 7.0 << ",\n";
+      break;
+    default:
+      oss << "  " << a * 1.5e-3 << "e12,\n";
+      break;
+    }
+  }
+  oss << "]";
+
+  return oss.str();
+}
+
+
+static std::string _records(int count) {
+  std::string ret = "[\n";
+
+  for (int a = 0; a < count; ++a) {
+    ret += "  {\n    # record " + std::to_string(a) + "\n    id: " +
+      std::to_string(a) + "\n    name: host-" + std::to_string(a) +
+      "\n    host: \"10.0." + std::to_string(a / 256 % 256) + "." +
+      std::to_string(a % 256) + "\"\n    port: " + std::to_string(8000 + a % 100) +
+      "\n  }\n";
+  }
+
+  return ret + "]";
+}
+
+
+// Concatenates all valid test documents into one root map, so that the
+// benchmark also covers the mix of syntax found in real files.
+static std::string _realCorpus(const std::string& assetDir) {
+  std::ifstream list(assetDir + "/testlist.txt");
+  std::string line;
+  Hjson::Value root(Hjson::Type::Map);
+
+  while (std::getline(list, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (!line.compare(0, 4, "fail") || line.find("_test.") == std::string::npos) {
+      continue;
+    }
+    try {
+      root[line] = Hjson::UnmarshalFromFile(assetDir + "/" + line);
+    } catch (const std::exception&) {
+    }
+  }
+
+  if (root.empty()) {
+    return "";
+  }
+
+  return Hjson::Marshal(root);
+}
+
+
+static void _access(const Hjson::Value& v, size_t *pCount) {
+  switch (v.type()) {
+  case Hjson::Type::Vector:
+    for (int a = 0; a < int(v.size()); ++a) {
+      _access(v[a], pCount);
+    }
+    break;
+  case Hjson::Type::Map:
+    for (int a = 0; a < int(v.size()); ++a) {
+      // Both index access and key lookup.
+      _access(v[v.key(a)], pCount);
+    }
+    break;
+  default:
+    ++*pCount;
+    break;
+  }
+}
+
+
+// Like _access, but through ConstValues.
+static void _constAccess(Hjson::ConstValue v, size_t *pCount) {
+  switch (v.type()) {
+  case Hjson::Type::Vector:
+    for (int a = 0; a < int(v.size()); ++a) {
+      _constAccess(v[a], pCount);
+    }
+    break;
+  case Hjson::Type::Map:
+    for (int a = 0; a < int(v.size()); ++a) {
+      _constAccess(v[v.key(a)], pCount);
+    }
+    break;
+  default:
+    ++*pCount;
+    break;
+  }
+}
+
+
+// Counts the values reported by Hjson::Parse().
+class CountingHandler : public Hjson::EventHandler {
+public:
+  size_t count = 0;
+
+  void key(const Hjson::StringView&) override {
+    ++count;
+  }
+
+  void string(const Hjson::StringView&) override {
+    ++count;
+  }
+
+  void scalar(const Hjson::Value&) override {
+    ++count;
+  }
+};
+
+
+static void _runCorpus(const Corpus& c, double minSeconds) {
+  size_t bytes = c.text.size();
+  Hjson::DecoderOptions decNoComments;
+  decNoComments.comments = false;
+  Hjson::Value ext = Hjson::Unmarshal(c.text, decNoComments);
+  volatile size_t sink = 0;
+
+  _report(c.name, "Unmarshal", bytes, _measure([&]() {
+    sink += Hjson::Unmarshal(c.text).size();
+  }, minSeconds));
+
+  _report(c.name, "Unmarshal/nc", bytes, _measure([&]() {
+    sink += Hjson::Unmarshal(c.text, decNoComments).size();
+  }, minSeconds));
+
+  _report(c.name, "Unmarshal/a", bytes, _measure([&]() {
+    Hjson::Arena arena;
+    Hjson::DecoderOptions decArena;
+    decArena.arena = &arena;
+    sink += Hjson::Unmarshal(c.text, decArena).size();
+  }, minSeconds));
+
+  _report(c.name, "Unmarshal/v", bytes, _measure([&]() {
+    Hjson::DecoderOptions decViews;
+    decViews.stringViews = true;
+    sink += Hjson::Unmarshal(c.text, decViews).size();
+  }, minSeconds));
+
+  _report(c.name, "Unmarshal/s", bytes, _measure([&]() {
+    Hjson::DecoderStats stats;
+    Hjson::DecoderOptions decStats;
+    decStats.stats = &stats;
+    sink += Hjson::Unmarshal(c.text, decStats).size();
+  }, minSeconds));
+
+  // Loading the document from the binary cache format instead of the text.
+  std::string binary = Hjson::MarshalBinary(c.root);
+  _report(c.name, "Unmarshal/b", bytes, _measure([&]() {
+    sink += Hjson::UnmarshalBinary(binary).size();
+  }, minSeconds));
+
+  if (c.name == "records") {
+    _report(c.name, "Unmarshal<T>", bytes, _measure([&]() {
+      sink += Hjson::Unmarshal<std::vector<PerfRecord>>(c.text).size();
+    }, minSeconds));
+  }
+
+  if (c.name == "records") {
+    // The same records as JSON lines, one document per line.
+    std::string lines;
+    for (int i = 0; i < int(c.root.size()); ++i) {
+      lines += Hjson::MarshalJsonCompact(c.root[i]) + "\n";
+    }
+    _report(c.name, "Unmarshal/lines", lines.size(), _measure([&]() {
+      for (size_t pos = 0, end; pos < lines.size(); pos = end + 1) {
+        end = lines.find('\n', pos);
+        sink += Hjson::Unmarshal(lines.data() + pos, end - pos).size();
+      }
+    }, minSeconds));
+    _report(c.name, "Decoder/lines", lines.size(), _measure([&]() {
+      Hjson::Decoder decoder;
+      decoder.reset(lines);
+      Hjson::Value doc;
+      while (decoder.next(doc)) {
+        sink += doc.size();
+      }
+    }, minSeconds));
+  }
+
+  _report(c.name, "Unmarshal/t", bytes, _measure([&]() {
+    Hjson::DecoderOptions decThreads;
+    decThreads.threads = 4;
+    sink += Hjson::Unmarshal(c.text, decThreads).size();
+  }, minSeconds));
+
+  // Index the document, then decode a single value from it.
+  _report(c.name, "LazyDocument", bytes, _measure([&]() {
+    Hjson::LazyDocument doc(c.text);
+    Hjson::LazyValue root = doc.root();
+    sink += (root.is_container() && root.size() ? root[int(root.size() / 2)].to_value().size() : 0);
+  }, minSeconds));
+
+  _report(c.name, "Parse", bytes, _measure([&]() {
+    CountingHandler handler;
+    Hjson::Parse(c.text, handler);
+    sink += handler.count;
+  }, minSeconds));
+
+  _report(c.name, "Marshal", bytes, _measure([&]() {
+    sink += Hjson::Marshal(c.root).size();
+  }, minSeconds));
+
+  _report(c.name, "Marshal/t", bytes, _measure([&]() {
+    Hjson::EncoderOptions encThreads;
+    encThreads.threads = 4;
+    sink += Hjson::Marshal(c.root, encThreads).size();
+  }, minSeconds));
+
+  _report(c.name, "MarshalJson", bytes, _measure([&]() {
+    sink += Hjson::MarshalJson(c.root).size();
+  }, minSeconds));
+
+  _report(c.name, "MarshalJson/c", bytes, _measure([&]() {
+    sink += Hjson::MarshalJsonCompact(c.root).size();
+  }, minSeconds));
+
+  if (c.name == "records") {
+    auto records = Hjson::Unmarshal<std::vector<PerfRecord>>(c.text);
+    Hjson::EncoderOptions encNoComments;
+    encNoComments.comments = false;
+    _report(c.name, "Marshal/nc", bytes, _measure([&]() {
+      sink += Hjson::Marshal(c.root, encNoComments).size();
+    }, minSeconds));
+    _report(c.name, "Marshal<T>", bytes, _measure([&]() {
+      sink += Hjson::Marshal(records, encNoComments).size();
+    }, minSeconds));
+  }
+
+  _report(c.name, "Marshal/b", bytes, _measure([&]() {
+    sink += Hjson::MarshalBinary(c.root).size();
+  }, minSeconds));
+
+  _report(c.name, "clone", bytes, _measure([&]() {
+    sink += c.root.clone().size();
+  }, minSeconds));
+
+  _report(c.name, "Merge", bytes, _measure([&]() {
+    sink += Hjson::Merge(c.root, ext).size();
+  }, minSeconds));
+
+  Hjson::Value frozen = c.root.clone(), frozenExt = ext.clone();
+  frozen.freeze();
+  frozenExt.freeze();
+  _report(c.name, "Merge/f", bytes, _measure([&]() {
+    sink += Hjson::Merge(frozen, frozenExt).size();
+  }, minSeconds));
+
+  _report(c.name, "access", bytes, _measure([&]() {
+    size_t count = 0;
+    _access(c.root, &count);
+    sink += count;
+  }, minSeconds));
+
+  _report(c.name, "access/cv", bytes, _measure([&]() {
+    size_t count = 0;
+    _constAccess(frozen, &count);
+    sink += count;
+  }, minSeconds));
+}
+
+
+void perf_benchmark() {
+  double minSeconds = 0.3;
+  if (const char *szMin = std::getenv("HJSON_PERF_MIN_SECONDS")) {
+    minSeconds = std::atof(szMin);
+  }
+
+  std::vector<Corpus> corpora = {
+    {"deep_nesting", _deepNesting(500), Hjson::Value()},
+    {"wide_map", _wideMap(20000), Hjson::Value()},
+    {"long_strings", _longStrings(300, 4096), Hjson::Value()},
+    {"numbers", _numbers(100000), Hjson::Value()},
+    {"records", _records(20000), Hjson::Value()},
+    {"real", _realCorpus("../test/assets"), Hjson::Value()},
+  };
+
+  std::cout << "Number parser: " << HJSON_PERF_NUMBER_PARSER << std::endl;
+
+  for (auto& c : corpora) {
+    if (c.text.empty()) {
+      std::cout << "Skipping corpus " << c.name << " (no input found)" << std::endl;
+      continue;
+    }
+    c.root = Hjson::Unmarshal(c.text);
+    std::cout << "\n" << c.name << ": " << c.text.size() << " bytes" << std::endl;
+    _runCorpus(c, minSeconds);
+  }
+}
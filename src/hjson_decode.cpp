@@ -1,9 +1,54 @@
-#include "hjson.h"
+#include "hjson_internal.h"
+#include "hjson_bind.h"
 #include <vector>
+#include <deque>
 #include <algorithm>
 #include <cctype>
 #include <cstring>
+#include <cstdint>
 #include <fstream>
+#include <thread>
+#include <exception>
+#include <climits>
+#include <iterator>
+#include <mutex>
+#include <condition_variable>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if !HJSON_NO_SIMD
+# if defined(__AVX2__)
+#  include <immintrin.h>
+#  define HJSON_SCAN_AVX2 1
+#  define HJSON_SCAN_SSE2 1
+# elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define HJSON_SCAN_SSE2 1
+# elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#  include <arm_neon.h>
+#  define HJSON_SCAN_NEON 1
+# endif
+#endif
+#if defined(_MSC_VER) && (HJSON_SCAN_SSE2 || HJSON_SCAN_NEON)
+# include <intrin.h>
+#endif
+#if !HJSON_NO_MMAP
+# if defined(_WIN32)
+#  ifndef WIN32_LEAN_AND_MEAN
+#   define WIN32_LEAN_AND_MEAN
+#  endif
+#  ifndef NOMINMAX
+#   define NOMINMAX
+#  endif
+#  include <windows.h>
+#  define HJSON_MMAP_WIN32 1
+# elif defined(__unix__) || defined(__APPLE__)
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#  define HJSON_MMAP_POSIX 1
+# endif
+#endif
 
 
 namespace Hjson {
@@ -17,6 +62,48 @@ public:
 };
 
 
+// A vector or map that _readNested() is reading.
+struct ReadFrame {
+  explicit ReadFrame(Type type)
+    : container(type),
+    ciValue(),
+    ciBefore(),
+    ciExtra(),
+    ciKey(),
+    childType(Type::Undefined),
+    childSize(0)
+  {
+  }
+
+  Value container;
+  bool isMap;
+  // True for a root map without braces.
+  bool withoutBraces;
+  // False for the container that _readNested() was asked to read, which does
+  // not get the comments before and after it (see _readArray()).
+  bool isValue;
+  // The comment before the container, if isValue.
+  CommentInfo ciValue;
+  // The comments that are given to the next element.
+  CommentInfo ciBefore, ciExtra;
+  // For a map: the key of the element being read, and the comment between
+  // the key and the ':'.
+  std::string key;
+  CommentInfo ciKey;
+  // The type and size of the last element that was a vector or a map. Used
+  // to reserve room in the next such element, since the elements of a
+  // container tend to have the same shape (e.g. an array of records).
+  Type childType;
+  size_t childSize;
+};
+
+
+// The most elements that are reserved from ReadFrame::childSize. Records are
+// smaller than this, and a big sibling must not leave unused room in every
+// small container that follows it.
+static const size_t _maxSiblingReserve = 64;
+
+
 class Parser {
 public:
   const unsigned char *data;
@@ -24,31 +111,125 @@ public:
   int indexNext;
   unsigned char ch;
   DecoderOptions opt;
+  // Keeps data alive, if not null.
+  std::shared_ptr<const void> owner;
+  // Comments and string views are spans of refData. It is data itself if
+  // data is kept alive by owner or by the caller, otherwise a copy of data
+  // (then held by owner) that is created when the first comment is found.
+  const char *refData;
+  // If true, each comment is copied on its own instead of referring to
+  // refData (used when data is a file mapping that is released after
+  // parsing).
+  bool copyComments;
+  // Number of arrays and maps that contain the current position, see
+  // DecoderOptions::maxDepth.
+  size_t depth;
+  // The decoded chars of the current escaped string, and the stack of
+  // _readNested(). Kept here so that a Decoder can reuse their memory for the
+  // next document.
+  std::vector<char> scratch;
+  std::vector<ReadFrame> frames;
+};
+
+
+// A read-only memory mapping of an entire file.
+class MappedFile {
+public:
+  const char *data;
+  size_t size;
+#if HJSON_MMAP_WIN32
+  HANDLE hMapping;
+#endif
+
+  MappedFile();
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator =(const MappedFile&) = delete;
+
+  // Returns false if the file could not be opened. Sets data to null if the
+  // file was opened but could not be mapped (e.g. because it is empty, or not
+  // a regular file).
+  bool map(const std::string& path);
+};
+
+
+// Makes all Values created on this thread during the lifetime of this object
+// be allocated from the Arena (if not null).
+class ArenaScope {
+public:
+  Arena *prev;
+
+  explicit ArenaScope(Arena *arena);
+  ~ArenaScope();
 };
 
 
 bool tryParseNumber(Value *pNumber, const char *text, size_t textSize, bool stopAtNext);
+Type numberType(const char *text, size_t textSize);
+Arena *swapCurrentArena(Arena *arena);
 static Value _readValue(Parser *p);
 
 
-static inline void _setComment(Value& val, void (Value::*fp)(const std::string&),
+ArenaScope::ArenaScope(Arena *arena)
+  : prev(swapCurrentArena(arena))
+{
+}
+
+
+ArenaScope::~ArenaScope() {
+  swapCurrentArena(prev);
+}
+
+
+static const std::shared_ptr<const void>& _commentOwner(Parser *p) {
+  if (!p->refData) {
+    auto text = std::make_shared<std::string>((const char*) p->data, p->dataSize);
+    p->refData = text->data();
+    p->owner = text;
+  }
+
+  return p->owner;
+}
+
+
+static inline void _appendComment(Value& val, ValueAccess::CommentKind kind,
+  Parser *p, const CommentInfo& ci)
+{
+  if (ci.hasComment && p->copyComments) {
+    ValueAccess::copyComment(val, kind, reinterpret_cast<const char*>(p->data) +
+      ci.cmStart, ci.cmEnd - ci.cmStart, true);
+  } else if (ci.hasComment) {
+    auto& owner = _commentOwner(p);
+    ValueAccess::appendComment(val, kind, owner, p->refData + ci.cmStart,
+      ci.cmEnd - ci.cmStart);
+  }
+}
+
+
+static inline void _setComment(Value& val, ValueAccess::CommentKind kind,
   Parser *p, const CommentInfo& ci)
 {
-  if (ci.hasComment) {
-    (val.*fp)(std::string(p->data + ci.cmStart, p->data + ci.cmEnd));
+  if (ci.hasComment && p->copyComments) {
+    ValueAccess::copyComment(val, kind, reinterpret_cast<const char*>(p->data) +
+      ci.cmStart, ci.cmEnd - ci.cmStart, false);
+  } else if (ci.hasComment) {
+    auto& owner = _commentOwner(p);
+    ValueAccess::setComment(val, kind, owner, p->refData + ci.cmStart,
+      ci.cmEnd - ci.cmStart);
   }
 }
 
 
-static inline void _setComment(Value& val, void (Value::*fp)(const std::string&),
+static inline void _setComment(Value& val, ValueAccess::CommentKind kind,
   Parser *p, const CommentInfo& ciA, const CommentInfo& ciB)
 {
   if (ciA.hasComment && ciB.hasComment) {
-    (val.*fp)(std::string(p->data + ciA.cmStart, p->data + ciA.cmEnd) +
-      std::string(p->data + ciB.cmStart, p->data + ciB.cmEnd));
+    _setComment(val, kind, p, ciA);
+    _appendComment(val, kind, p, ciB);
   } else {
-    _setComment(val, fp, p, ciA);
-    _setComment(val, fp, p, ciB);
+    _setComment(val, kind, p, ciA);
+    _setComment(val, kind, p, ciB);
   }
 }
 
@@ -67,6 +248,134 @@ static bool _next(Parser *p) {
 }
 
 
+#if HJSON_SCAN_SSE2 || HJSON_SCAN_NEON
+static inline int _firstBit(std::uint64_t mask) {
+#if defined(_MSC_VER)
+  unsigned long index;
+# if defined(_M_X64) || defined(_M_ARM64)
+  _BitScanForward64(&index, mask);
+# else
+  if (!_BitScanForward(&index, static_cast<unsigned long>(mask))) {
+    _BitScanForward(&index, static_cast<unsigned long>(mask >> 32));
+    index += 32;
+  }
+# endif
+  return static_cast<int>(index);
+#else
+  return __builtin_ctzll(mask);
+#endif
+}
+#endif
+
+
+// Returns a pointer to the first byte in [pCh, pEnd) that is less than or
+// equal to maxCtrl or equal to one of n1 - n5, or pEnd if there is no such
+// byte. The callers use this to skip runs of bytes that need no special
+// handling, so stopping too early is harmless but stopping too late is not.
+static inline const unsigned char *_scan(const unsigned char *pCh,
+  const unsigned char *pEnd, unsigned char maxCtrl, unsigned char n1,
+  unsigned char n2, unsigned char n3, unsigned char n4, unsigned char n5)
+{
+#if HJSON_SCAN_AVX2
+  {
+    const __m256i vCtrl = _mm256_set1_epi8(static_cast<char>(maxCtrl));
+    const __m256i v1 = _mm256_set1_epi8(static_cast<char>(n1));
+    const __m256i v2 = _mm256_set1_epi8(static_cast<char>(n2));
+    const __m256i v3 = _mm256_set1_epi8(static_cast<char>(n3));
+    const __m256i v4 = _mm256_set1_epi8(static_cast<char>(n4));
+    const __m256i v5 = _mm256_set1_epi8(static_cast<char>(n5));
+
+    for (; pEnd - pCh >= 32; pCh += 32) {
+      __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pCh));
+      __m256i m = _mm256_cmpeq_epi8(_mm256_min_epu8(x, vCtrl), x);
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, v1));
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, v2));
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, v3));
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, v4));
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, v5));
+      std::uint32_t mask = static_cast<std::uint32_t>(_mm256_movemask_epi8(m));
+      if (mask) {
+        return pCh + _firstBit(mask);
+      }
+    }
+  }
+#endif
+#if HJSON_SCAN_SSE2
+  {
+    const __m128i vCtrl = _mm_set1_epi8(static_cast<char>(maxCtrl));
+    const __m128i v1 = _mm_set1_epi8(static_cast<char>(n1));
+    const __m128i v2 = _mm_set1_epi8(static_cast<char>(n2));
+    const __m128i v3 = _mm_set1_epi8(static_cast<char>(n3));
+    const __m128i v4 = _mm_set1_epi8(static_cast<char>(n4));
+    const __m128i v5 = _mm_set1_epi8(static_cast<char>(n5));
+
+    for (; pEnd - pCh >= 16; pCh += 16) {
+      __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pCh));
+      __m128i m = _mm_cmpeq_epi8(_mm_min_epu8(x, vCtrl), x);
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(x, v1));
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(x, v2));
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(x, v3));
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(x, v4));
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(x, v5));
+      int mask = _mm_movemask_epi8(m);
+      if (mask) {
+        return pCh + _firstBit(static_cast<std::uint32_t>(mask));
+      }
+    }
+  }
+#elif HJSON_SCAN_NEON
+  {
+    const uint8x16_t vCtrl = vdupq_n_u8(maxCtrl);
+    const uint8x16_t v1 = vdupq_n_u8(n1);
+    const uint8x16_t v2 = vdupq_n_u8(n2);
+    const uint8x16_t v3 = vdupq_n_u8(n3);
+    const uint8x16_t v4 = vdupq_n_u8(n4);
+    const uint8x16_t v5 = vdupq_n_u8(n5);
+
+    for (; pEnd - pCh >= 16; pCh += 16) {
+      uint8x16_t x = vld1q_u8(pCh);
+      uint8x16_t m = vcleq_u8(x, vCtrl);
+      m = vorrq_u8(m, vceqq_u8(x, v1));
+      m = vorrq_u8(m, vceqq_u8(x, v2));
+      m = vorrq_u8(m, vceqq_u8(x, v3));
+      m = vorrq_u8(m, vceqq_u8(x, v4));
+      m = vorrq_u8(m, vceqq_u8(x, v5));
+      // Narrow to four bits per byte so that the mask fits in 64 bits.
+      std::uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+        vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+      if (mask) {
+        return pCh + (_firstBit(mask) >> 2);
+      }
+    }
+  }
+#endif
+
+  for (; pCh < pEnd; ++pCh) {
+    unsigned char c = *pCh;
+    if (c <= maxCtrl || c == n1 || c == n2 || c == n3 || c == n4 || c == n5) {
+      break;
+    }
+  }
+
+  return pCh;
+}
+
+
+// Moves to the next occurrence of c, or to the first null character or the end
+// of the input, whichever comes first.
+static void _skipUntil(Parser *p, unsigned char c) {
+  if (p->ch == 0 || p->ch == c) {
+    return;
+  }
+
+  const unsigned char *pEnd = _scan(p->data + p->indexNext, p->data + p->dataSize,
+    0, c, c, c, c, c);
+
+  p->indexNext = static_cast<int>(pEnd - p->data);
+  _next(p);
+}
+
+
 static bool _prev(Parser *p) {
   // get the previous character.
   if (p->indexNext > 1) {
@@ -152,9 +461,10 @@ static unsigned char _escapee(unsigned char c) {
 
 // Parse a multiline string value.
 static std::string _readMLString(Parser *p) {
-  // Store the string in a new vector, because the length of it might be
+  // Store the string in a separate vector, because the length of it might be
   // different than the length in the input data.
-  std::vector<char> res;
+  std::vector<char>& res = p->scratch;
+  res.clear();
   int triple = 0;
 
   // we are at ''' +1 - get indent
@@ -213,11 +523,16 @@ static std::string _readMLString(Parser *p) {
       lastLf = true;
       _next(p);
       skipIndent();
+    } else if (p->ch == '\r') {
+      _next(p);
     } else {
-      if (p->ch != '\r') {
-        res.push_back(p->ch);
-        lastLf = false;
-      }
+      // Copy the whole run of plain characters in one go.
+      const unsigned char *pStart = p->data + p->indexNext - 1;
+      const unsigned char *pEnd = _scan(pStart + 1, p->data + p->dataSize, 0,
+        '\'', '\n', '\r', '\r', '\r');
+      res.insert(res.end(), pStart, pEnd);
+      lastLf = false;
+      p->indexNext = static_cast<int>(pEnd - p->data);
       _next(p);
     }
   }
@@ -249,9 +564,10 @@ static void _toUtf8(std::vector<char> &res, uint32_t uIn) {
 // callers make sure that (ch === '"' || ch === "'")
 // When parsing for string values, we must look for " and \ characters.
 static std::string _readString(Parser *p, bool allowML) {
-  // Store the string in a new vector, because the length of it might be
+  // Store the string in a separate vector, because the length of it might be
   // different than the length in the input data.
-  std::vector<char> res;
+  std::vector<char>& res = p->scratch;
+  res.clear();
 
   char exitCh = p->ch;
   while (_next(p)) {
@@ -298,7 +614,13 @@ static std::string _readString(Parser *p, bool allowML) {
     } else if (p->ch == '\n' || p->ch == '\r') {
       throw syntax_error(_errAt(p, "Bad string containing newline"));
     } else {
-      res.push_back(p->ch);
+      // Copy the whole run of plain characters in one go.
+      const unsigned char *pStart = p->data + p->indexNext - 1;
+      const unsigned char *pEnd = _scan(pStart + 1, p->data + p->dataSize, 0,
+        exitCh, '\\', '\n', '\r', '\r');
+      res.insert(res.end(), pStart, pEnd);
+      // Stop at the last plain character, the loop will move past it.
+      p->indexNext = static_cast<int>(pEnd - p->data);
     }
   }
 
@@ -306,13 +628,63 @@ static std::string _readString(Parser *p, bool allowML) {
 }
 
 
-// quotes for keys are optional in Hjson
-// unless they include {}[],: or whitespace.
-static std::string _readKeyname(Parser *p) {
-  if (p->ch == '"' || p->ch == '\'') {
-    return _readString(p, false);
+// Returns a String Value for the part of the input data starting at pCh.
+static Value _stringValue(Parser *p, const unsigned char *pCh, size_t size) {
+  if (p->opt.stringViews) {
+    HJSON_STATS(p->opt.stats, p->opt.stats->stringBytesReferenced += size);
+    // p->refData == p->data
+    return ValueAccess::stringView(p->owner, reinterpret_cast<const char*>(pCh), size);
+  }
+
+  HJSON_STATS(p->opt.stats, p->opt.stats->stringBytesCopied += size);
+
+  return std::string(reinterpret_cast<const char*>(pCh), size);
+}
+
+
+// Like _readString(p, allowML), but strings without escape sequences are
+// returned as a view into the input data. Other strings are decoded into
+// *pBuf, and the returned view refers to *pBuf.
+static StringView _readStringView(Parser *p, bool allowML, std::string *pBuf) {
+  const unsigned char *pStart = p->data + p->indexNext;
+  const unsigned char *pEnd = _scan(pStart, p->data + p->dataSize, 0,
+    p->ch, '\\', '\n', '\r', '\r');
+
+  // An empty string within single quotes could be the start of a multiline
+  // string.
+  if (pEnd < p->data + p->dataSize && *pEnd == p->ch &&
+    (p->ch == '"' || pEnd > pStart))
+  {
+    p->indexNext = static_cast<int>(pEnd + 1 - p->data);
+    _next(p);
+    return StringView(reinterpret_cast<const char*>(pStart), pEnd - pStart);
+  }
+
+  *pBuf = _readString(p, allowML);
+
+  return StringView(*pBuf);
+}
+
+
+// Like _readString(p, true), but strings without escape sequences are taken
+// directly from the input data.
+static Value _readStringValue(Parser *p) {
+  std::string buf;
+  StringView str = _readStringView(p, true, &buf);
+
+  if (str.data() != buf.data()) {
+    return _stringValue(p, reinterpret_cast<const unsigned char*>(str.data()),
+      str.size());
   }
 
+  HJSON_STATS(p->opt.stats, p->opt.stats->stringBytesUnescaped += buf.size());
+
+  return buf;
+}
+
+
+// Reads a key name without quotes, returns a view into the input data.
+static StringView _readQuotelessKey(Parser *p) {
   // keyStart is the index for the first char of the key.
   size_t keyStart = p->indexNext - 1;
   // keyEnd is the index for the first char after the key (i.e. not included in the key).
@@ -326,7 +698,8 @@ static std::string _readKeyname(Parser *p) {
         p->indexNext = firstSpace + 1;
         throw syntax_error(_errAt(p, "Found whitespace in your key name (use quotes to include)"));
       }
-      return std::string(reinterpret_cast<const char*>(p->data) + keyStart, keyEnd - keyStart);
+      return StringView(reinterpret_cast<const char*>(p->data) + keyStart,
+        keyEnd - keyStart);
     } else if (p->ch <= ' ') {
       if (p->ch == 0) {
         throw syntax_error(_errAt(p, "Found EOF while looking for a key name (check your syntax)"));
@@ -346,6 +719,17 @@ static std::string _readKeyname(Parser *p) {
 }
 
 
+// quotes for keys are optional in Hjson
+// unless they include {}[],: or whitespace.
+static std::string _readKeyname(Parser *p) {
+  if (p->ch == '"' || p->ch == '\'') {
+    return _readString(p, false);
+  }
+
+  return static_cast<std::string>(_readQuotelessKey(p));
+}
+
+
 static CommentInfo _white(Parser *p) {
   CommentInfo ci = {
     p->opt.whitespaceAsComments,
@@ -363,16 +747,18 @@ static CommentInfo _white(Parser *p) {
       if (p->opt.comments) {
         ci.hasComment = true;
       }
-      while (p->ch > 0 && p->ch != '\n') {
-        _next(p);
-      }
+      _skipUntil(p, '\n');
     } else if (p->ch == '/' && _peek(p, 0) == '*') {
       if (p->opt.comments) {
         ci.hasComment = true;
       }
       _next(p);
       _next(p);
-      while (p->ch > 0 && !(p->ch == '*' && _peek(p, 0) == '/')) {
+      for (;;) {
+        _skipUntil(p, '*');
+        if (p->ch == 0 || _peek(p, 0) == '/') {
+          break;
+        }
         _next(p);
       }
       if (p->ch > 0) {
@@ -408,9 +794,7 @@ static CommentInfo _getCommentAfter(Parser *p) {
       if (p->opt.comments) {
         ci.hasComment = true;
       }
-      while (p->ch > 0 && p->ch != '\n') {
-        _next(p);
-      }
+      _skipUntil(p, '\n');
 	  
       // MUST include '\n' charactor in 'after' comment,
 	  // otherwise ']' or '}' will be eaten if no seperator ',' before these comments
@@ -422,7 +806,11 @@ static CommentInfo _getCommentAfter(Parser *p) {
       }
       _next(p);
       _next(p);
-      while (p->ch > 0 && !(p->ch == '*' && _peek(p, 0) == '/')) {
+      for (;;) {
+        _skipUntil(p, '*');
+        if (p->ch == 0 || _peek(p, 0) == '/') {
+          break;
+        }
         _next(p);
       }
       if (p->ch > 0) {
@@ -442,8 +830,11 @@ static CommentInfo _getCommentAfter(Parser *p) {
 
 
 // Hjson strings can be quoteless
-// returns string, true, false, or null.
-static Value _readTfnns(Parser *p) {
+// Returns true and stores true, false, null or a number in *pScalar, or returns
+// false and stores a view of the quoteless string in *pStr. In both cases the
+// text of the value is stored in *pStr. pScalar may be null, to only find out
+// where the value ends.
+static bool _readTfnns(Parser *p, Value *pScalar, StringView *pStr) {
   if (_isPunctuatorChar(p->ch)) {
     throw syntax_error(_errAt(p, std::string("Found a punctuator character '") +
       (char)p->ch + std::string("' when expecting a quoteless string (check your syntax)")));
@@ -458,6 +849,17 @@ static Value _readTfnns(Parser *p) {
   }
 
   for (;;) {
+    // Skip the whole run of characters that can neither end the value nor be
+    // whitespace.
+    if (p->indexNext < p->dataSize) {
+      const unsigned char *pRun = p->data + p->indexNext;
+      const unsigned char *pEnd = _scan(pRun, p->data + p->dataSize, ' ', ',',
+        '}', ']', '#', '/');
+      if (pEnd != pRun) {
+        p->indexNext = static_cast<int>(pEnd - p->data);
+        valEnd = p->indexNext;
+      }
+    }
     _next(p);
     bool isEol = (p->ch == '\r' || p->ch == '\n' || p->ch == 0);
     if (isEol ||
@@ -468,33 +870,49 @@ static Value _readTfnns(Parser *p) {
       const char *pVal = reinterpret_cast<const char*>(p->data) + valStart;
       size_t valLen = valEnd - valStart;
 
+      bool isScalar = false;
+
       switch (*pVal)
       {
       case 'f':
         if (valLen == 5 && !std::strncmp(pVal, "false", 5)) {
-          return false;
+          isScalar = true;
+          if (pScalar) {
+            *pScalar = false;
+          }
         }
         break;
       case 'n':
         if (valLen == 4 && !std::strncmp(pVal, "null", 4)) {
-          return Value(Type::Null);
+          isScalar = true;
+          if (pScalar) {
+            *pScalar = Value(Type::Null);
+          }
         }
         break;
       case 't':
         if (valLen == 4 && !std::strncmp(pVal, "true", 4)) {
-          return true;
+          isScalar = true;
+          if (pScalar) {
+            *pScalar = true;
+          }
         }
         break;
       default:
         if (*pVal == '-' || (*pVal >= '0' && *pVal <= '9')) {
-          Value number;
-          if (tryParseNumber(&number, pVal, valLen, false)) {
-            return number;
+          if (!pScalar) {
+            isScalar = (numberType(pVal, valLen) != Type::Undefined);
+            break;
           }
+          DecoderStats *stats = p->opt.stats;
+          StatsTimer timer(stats ? &stats->numberSeconds : nullptr);
+          isScalar = tryParseNumber(pScalar, pVal, valLen, false);
+          HJSON_STATS(stats, stats->numbers += isScalar);
         }
       }
-      if (isEol) {
-        return std::string(pVal, valLen);
+      if (isScalar || isEol) {
+        *pStr = StringView(pVal, valLen);
+        return isScalar;
       }
     }
     if (std::isspace(p->ch)) {
@@ -509,172 +927,281 @@ static Value _readTfnns(Parser *p) {
 }
 
 
-// Parse an array value.
-// assuming ch == '['
-static Value _readArray(Parser *p) {
-  Value array(Hjson::Type::Vector);
+// Thrown when the input is nested deeper than DecoderOptions::maxDepth. Never
+// caught by the decoder, unlike other syntax errors which can make it try to
+// read the input in another way.
+class depth_error : public syntax_error {
+public:
+  explicit depth_error(const std::string& what_arg) : syntax_error(what_arg) {}
+};
 
-  // Skip '['.
-  _next(p);
-  auto ciBefore = _white(p);
 
-  if (p->ch == ']') {
-    _setComment(array, &Value::set_comment_inside, p, ciBefore);
-    _next(p);
-    return array; // empty array
+// Must be called before reading the elements of a vector or a map at the
+// nesting depth `depth` (1 for the elements of the root).
+static void _checkDepth(Parser *p, size_t depth) {
+  if (p->opt.maxDepth > 0 && depth > static_cast<size_t>(p->opt.maxDepth)) {
+    throw depth_error(_errAt(p, "Found more than " + std::to_string(p->opt.maxDepth) +
+      " levels of nested arrays and objects (see DecoderOptions::maxDepth)"));
   }
+}
 
-  CommentInfo ciExtra = {};
-
-  while (p->ch > 0) {
-    auto elem = _readValue(p);
-    _setComment(elem, &Value::set_comment_before, p, ciBefore, ciExtra);
-    auto ciAfter = _white(p);
-    // in Hjson the comma is optional and trailing commas are allowed
-    if (p->ch == ',') {
-      _next(p);
-      // It is unlikely that someone writes a comment after the value but
-      // before the comma, so we include any such comment in "comment_after".
-      ciExtra = _white(p);
-    } else {
-      ciExtra = {};
-    }
-    if (p->ch == ']') {
-      // _setComment will not clear elem's 'after' comments
-	  // if ciAfter & ciExtra are empty, double elem's 'after' comments will appear
-      if (ciAfter.hasComment || ciExtra.hasComment) {
-        auto existingAfter = elem.get_comment_after();
-        _setComment(elem, &Value::set_comment_after, p, ciAfter, ciExtra);
-        if (!existingAfter.empty()) {
-          elem.set_comment_after(existingAfter + elem.get_comment_after());
-        }
-      }
-      array.push_back(elem);
-      _next(p);
-      return array;
-    }
-    array.push_back(elem);
-    ciBefore = ciAfter;
-  }
 
-  throw syntax_error(_errAt(p, "End of input while parsing an array (did you forget a closing ']'?)"));
-}
+// What _readNested() reads.
+enum ReadStart {
+  _startValue,
+  _startArray,
+  _startObject,
+  _startRootObject
+};
 
 
-// Parse an object value.
-static Value _readObject(Parser *p, bool withoutBraces) {
-  Value object(Hjson::Type::Map);
+// Lends the memory of p->frames to one call of _readNested().
+class FrameStack {
+public:
+  explicit FrameStack(Parser *p)
+    : parser(p)
+  {
+    frames.swap(parser->frames);
+  }
 
-  if (!withoutBraces) {
-    // assuming ch == '{'
-    _next(p);
+  ~FrameStack() {
+    frames.clear();
+    frames.swap(parser->frames);
   }
 
-  auto ciBefore = _white(p);
+  std::vector<ReadFrame> frames;
 
-  if (p->ch == '}' && !withoutBraces) {
-    _setComment(object, &Value::set_comment_inside, p, ciBefore);
-    _next(p);
-    return object; // empty object
-  }
+private:
+  Parser *parser;
+};
 
-  CommentInfo ciExtra = {};
 
-  while (p->ch > 0) {
-    auto key = _readKeyname(p);
-    if (p->opt.duplicateKeyException && object[key].defined()) {
-      throw syntax_error(_errAt(p, "Found duplicate of key '" + key + "'"));
-    }
-    auto ciKey = _white(p);
-    if (p->ch != ':') {
-      throw syntax_error(_errAt(p, std::string(
-        "Expected ':' instead of '") + (char)(p->ch) + "'"));
+// Reads a value with its comments (or only the contents of an array or a
+// map), including all of its elements. Nested arrays and maps are kept in an
+// explicit stack instead of being read by recursive calls, so that deeply
+// nested input cannot overflow the call stack.
+static Value _readNested(Parser *p, ReadStart start) {
+  enum {
+    // Read the value at the current position.
+    BeginValue,
+    // Read the next element of the container on top of the stack, or its end.
+    NextElement,
+    // A value has been read into val, give it to the container on top of the
+    // stack.
+    EndValue
+  } state = BeginValue;
+
+  FrameStack frameStack(p);
+  std::vector<ReadFrame>& stack = frameStack.frames;
+  // Always replaced with assign_with_comments(), since the comments of the
+  // previous value must not be kept. Null until then, since an Undefined
+  // Value would be allocated.
+  Value val(Type::Null);
+  // The comment before val.
+  CommentInfo ciVal = {};
+
+  // Pushes a frame for the array or map at the current position, reads up to
+  // the first element. Returns false if the container is empty, then it is
+  // already popped into val.
+  auto open = [&](bool isMap, bool withoutBraces, bool isValue) -> bool {
+    _checkDepth(p, p->depth + stack.size() + 1);
+    stack.emplace_back(isMap ? Type::Map : Type::Vector);
+    ReadFrame& f = stack.back();
+    if (stack.size() > 1) {
+      const ReadFrame& parent = stack[stack.size() - 2];
+      if (parent.childType == f.container.type()) {
+        f.container.reserve(std::min(parent.childSize, _maxSiblingReserve));
+      }
     }
-    _next(p);
-    // duplicate keys overwrite the previous value
-    auto elem = _readValue(p);
-    _setComment(elem, &Value::set_comment_key, p, ciKey);
-    if (!elem.get_comment_before().empty()) {
-      elem.set_comment_key(elem.get_comment_key() +
-        elem.get_comment_before());
-      elem.set_comment_before("");
-    }
-    _setComment(elem, &Value::set_comment_before, p, ciBefore, ciExtra);
-    auto ciAfter = _white(p);
-    // in Hjson the comma is optional and trailing commas are allowed
-    if (p->ch == ',') {
+    f.isMap = isMap;
+    f.withoutBraces = withoutBraces;
+    f.isValue = isValue;
+    f.ciValue = ciVal;
+
+    if (!withoutBraces) {
+      // Skip '[' or '{'.
       _next(p);
-      // It is unlikely that someone writes a comment after the value but
-      // before the comma, so we include any such comment in "comment_after".
-      ciExtra = _white(p);
-    } else {
-      ciExtra = {};
     }
-    if (p->ch == '}' && !withoutBraces) {
-      // _setComment will not clear elem's 'after' comments
-	  // if ciAfter & ciExtra are empty, double elem's 'after' comments will appear
-      if (ciAfter.hasComment || ciExtra.hasComment) {
-        auto existingAfter = elem.get_comment_after();      
-        _setComment(elem, &Value::set_comment_after, p, ciAfter, ciExtra);
-        if (!existingAfter.empty()) {
-          elem.set_comment_after(existingAfter + elem.get_comment_after());
-        }
-      }
-      object[key].assign_with_comments(std::move(elem));
+    f.ciBefore = _white(p);
+    f.ciExtra = {};
+
+    if (p->ch == (isMap ? '}' : ']') && !withoutBraces) {
+      _setComment(f.container, ValueAccess::CommentInside, p, f.ciBefore);
       _next(p);
-      return object;
+      val.assign_with_comments(std::move(f.container));
+      stack.pop_back();
+      return false;
     }
-    object[key].assign_with_comments(std::move(elem));
-    ciBefore = ciAfter;
-  }
 
-  if (withoutBraces) {
-    if (object.empty()) {
-      _setComment(object, &Value::set_comment_inside, p, ciBefore);
-    } else {
-      _setComment(object[static_cast<int>(object.size() - 1)],
-        &Value::set_comment_after, p, ciBefore, ciExtra);
-    }
+    return true;
+  };
 
-    return object;
+  if (start != _startValue) {
+    if (!open(start != _startArray, start == _startRootObject, false)) {
+      return val; // empty array or object
+    }
+    state = NextElement;
   }
-  throw syntax_error(_errAt(p, "End of input while parsing an object (did you forget a closing '}'?)"));
-}
 
+  for (;;) {
+    switch (state) {
+    case BeginValue:
+      ciVal = _white(p);
+
+      switch (p->ch) {
+      case '{':
+      case '[':
+        state = (open(p->ch == '{', false, true) ? NextElement : EndValue);
+        continue;
+      case '"':
+      case '\'':
+        val.assign_with_comments(_readStringValue(p));
+        break;
+      default:
+        {
+          // Not Undefined, which would be allocated (see Value::Value()).
+          Value scalar(Type::Null);
+          StringView str;
+          if (!_readTfnns(p, &scalar, &str)) {
+            scalar = _stringValue(p, reinterpret_cast<const unsigned char*>(str.data()),
+              str.size());
+          }
+          val.assign_with_comments(std::move(scalar));
+        }
+        // Make sure that any comment will include preceding whitespace.
+        if (p->ch == '#' || p->ch == '/') {
+          while (_prev(p) && std::isspace(p->ch)) {}
+          _next(p);
+        }
+        break;
+      }
+      state = EndValue;
+      break;
 
-// Parse a Hjson value. It could be an object, an array, a string, a number or a word.
-static Value _readValue(Parser *p) {
-  Hjson::Value ret;
+    case NextElement:
+      {
+        ReadFrame& f = stack.back();
 
-  auto ciBefore = _white(p);
+        if (p->ch <= 0) {
+          if (!f.withoutBraces) {
+            throw syntax_error(_errAt(p, f.isMap ?
+              "End of input while parsing an object (did you forget a closing '}'?)" :
+              "End of input while parsing an array (did you forget a closing ']'?)"));
+          }
+          // Only the root map can be without braces, so the stack holds
+          // nothing else.
+          if (f.container.empty()) {
+            _setComment(f.container, ValueAccess::CommentInside, p, f.ciBefore);
+          } else {
+            _setComment(f.container[static_cast<int>(f.container.size() - 1)],
+              ValueAccess::CommentAfter, p, f.ciBefore, f.ciExtra);
+          }
+          return std::move(f.container);
+        }
 
-  switch (p->ch) {
-  case '{':
-    ret = _readObject(p, false);
-    break;
-  case '[':
-    ret = _readArray(p);
-    break;
-  case '"':
-  case '\'':
-    ret = _readString(p, true);
-    break;
-  default:
-    ret = _readTfnns(p);
-    // Make sure that any comment will include preceding whitespace.
-    if (p->ch == '#' || p->ch == '/') {
-      while (_prev(p) && std::isspace(p->ch)) {}
-      _next(p);
+        if (f.isMap) {
+          f.key = _readKeyname(p);
+          const Value *pPrev;
+          if (p->opt.duplicateKeyException &&
+            (pPrev = ValueAccess::find(f.container, f.key)) && pPrev->defined())
+          {
+            throw syntax_error(_errAt(p, "Found duplicate of key '" + f.key + "'"));
+          }
+          f.ciKey = _white(p);
+          if (p->ch != ':') {
+            throw syntax_error(_errAt(p, std::string(
+              "Expected ':' instead of '") + (char)(p->ch) + "'"));
+          }
+          _next(p);
+        }
+      }
+      state = BeginValue;
+      break;
+
+    case EndValue:
+      {
+        auto ciAfter = _getCommentAfter(p);
+
+        _setComment(val, ValueAccess::CommentBefore, p, ciVal);
+        _setComment(val, ValueAccess::CommentAfter, p, ciAfter);
+
+        if (stack.empty()) {
+          return val;
+        }
+
+        ReadFrame& f = stack.back();
+
+        if (f.isMap) {
+          _setComment(val, ValueAccess::CommentKey, p, f.ciKey);
+          ValueAccess::moveComment(val, ValueAccess::CommentBefore, ValueAccess::CommentKey);
+        }
+        _setComment(val, ValueAccess::CommentBefore, p, f.ciBefore, f.ciExtra);
+        ciAfter = _white(p);
+        // in Hjson the comma is optional and trailing commas are allowed
+        if (p->ch == ',') {
+          _next(p);
+          // It is unlikely that someone writes a comment after the value but
+          // before the comma, so we include any such comment in "comment_after".
+          f.ciExtra = _white(p);
+        } else {
+          f.ciExtra = {};
+        }
+
+        bool closed = (p->ch == (f.isMap ? '}' : ']') && !f.withoutBraces);
+        if (closed) {
+          // Keep the 'after' comment that was found above.
+          _appendComment(val, ValueAccess::CommentAfter, p, ciAfter);
+          _appendComment(val, ValueAccess::CommentAfter, p, f.ciExtra);
+        }
+        if (val.is_container()) {
+          f.childType = val.type();
+          f.childSize = val.size();
+        }
+        if (f.isMap) {
+          // duplicate keys overwrite the previous value
+          f.container.insert_or_assign(std::move(f.key), std::move(val));
+        } else {
+          f.container.push_back(std::move(val));
+        }
+        f.ciBefore = ciAfter;
+
+        if (!closed) {
+          state = NextElement;
+          break;
+        }
+
+        _next(p);
+        val.assign_with_comments(std::move(f.container));
+        ciVal = f.ciValue;
+        bool isValue = f.isValue;
+        stack.pop_back();
+        if (!isValue) {
+          return val;
+        }
+        // state is still EndValue, for the container that was just closed.
+      }
+      break;
     }
-    break;
   }
+}
 
-  auto ciAfter = _getCommentAfter(p);
 
-  _setComment(ret, &Value::set_comment_before, p, ciBefore);
-  _setComment(ret, &Value::set_comment_after, p, ciAfter);
+// Parse an array value.
+// assuming ch == '['
+static Value _readArray(Parser *p) {
+  return _readNested(p, _startArray);
+}
 
-  return ret;
+
+// Parse an object value.
+static Value _readObject(Parser *p, bool withoutBraces) {
+  return _readNested(p, withoutBraces ? _startRootObject : _startObject);
+}
+
+
+// Parse a Hjson value. It could be an object, an array, a string, a number or a word.
+static Value _readValue(Parser *p) {
+  return _readNested(p, _startValue);
 }
 
 
@@ -688,7 +1215,7 @@ static Value _hasTrailing(Parser *p, CommentInfo *ci) {
 static Value _rootValue(Parser *p) {
   Value ret;
   std::string errMsg;
-  CommentInfo ciExtra;
+  CommentInfo ciExtra = {};
 
   auto ciBefore = _white(p);
 
@@ -708,6 +1235,9 @@ static Value _rootValue(Parser *p) {
   }
 
   if (!ret.defined()) {
+    // Forget the work done for a root that turns out not to be a map.
+    DecoderStats statsBefore;
+    HJSON_STATS(p->opt.stats, statsBefore = *p->opt.stats);
     // assume we have a root object without braces
     try {
       ret = _readObject(p, true);
@@ -717,12 +1247,17 @@ static Value _rootValue(Parser *p) {
       } else if (ret.size() > 0) {
         // if there were no braces, the first comment belongs to the first child
         // of the root object, not to the root object itself.
-        _setComment(ret[0], &Value::set_comment_before, p, ciBefore);
+        _setComment(ret[0], ValueAccess::CommentBefore, p, ciBefore);
         ciBefore = CommentInfo();
       }
+    } catch(const depth_error&) {
+      throw;
     } catch(const syntax_error& e) {
       errMsg = std::string(e.what());
     }
+    if (!ret.defined()) {
+      HJSON_STATS(p->opt.stats, *p->opt.stats = statsBefore);
+    }
   }
 
   if (!ret.defined()) {
@@ -736,12 +1271,8 @@ static Value _rootValue(Parser *p) {
   }
 
   if (ret.defined()) {
-    _setComment(ret, &Value::set_comment_before, p, ciBefore);
-    auto existingAfter = ret.get_comment_after();
-    _setComment(ret, &Value::set_comment_after, p, ciExtra);
-    if (!existingAfter.empty()) {
-      ret.set_comment_after(existingAfter + ret.get_comment_after());
-    }
+    _setComment(ret, ValueAccess::CommentBefore, p, ciBefore);
+    _appendComment(ret, ValueAccess::CommentAfter, p, ciExtra);
     return ret;
   }
 
@@ -753,25 +1284,460 @@ static Value _rootValue(Parser *p) {
 }
 
 
-// Unmarshal parses the Hjson-encoded data and returns a tree of Values.
-//
-// Unmarshal uses the inverse of the encodings that Marshal uses.
-//
-Value Unmarshal(const char *data, size_t dataSize, const DecoderOptions& options) {
+// An element of the root array or root map, read by _readSegment().
+struct SegmentElem {
+  // Position of the first char of the element (or of its key).
+  int start;
+  // The comments that were given to _setComment() as CommentBefore.
+  CommentInfo ciBefore, ciExtra;
+  std::string key;
+  Value value;
+};
+
+
+// The elements of the root array or root map that _readSegment() read from
+// one part of the input.
+struct Segment {
+  std::deque<SegmentElem> elems;
+  // Position of the next element, where reading stopped (or the position
+  // after the closing bracket if closed is true), and the comments that will
+  // be given to the next element.
+  int end;
+  CommentInfo ciBefore, ciExtra;
+  // True if the end of the root array or root map was found.
+  bool closed;
+  // True if a syntax error was found at end.
+  bool failed;
+  // Work counters, if DecoderOptions::stats is set.
+  DecoderStats stats;
+};
+
+
+// Reads a key, the ':' and the value of an element of a map, like
+// _readObject().
+static Value _readMember(Parser *p, std::string *pKey) {
+  *pKey = _readKeyname(p);
+  auto ciKey = _white(p);
+  if (p->ch != ':') {
+    throw syntax_error(_errAt(p, std::string(
+      "Expected ':' instead of '") + (char)(p->ch) + "'"));
+  }
+  _next(p);
+  auto elem = _readValue(p);
+  _setComment(elem, ValueAccess::CommentKey, p, ciKey);
+  ValueAccess::moveComment(elem, ValueAccess::CommentBefore, ValueAccess::CommentKey);
+
+  return elem;
+}
+
+
+// Reads elements of the root array or root map from the current position
+// (which must be the first char of an element) until the position of the next
+// element is at or after limit, or until the end of the root array or root
+// map. The loop is the same as in _readArray() and _readObject().
+static void _readSegment(Parser *p, bool isMap, bool withoutBraces, int limit,
+  Segment *seg)
+{
+  CommentInfo ciBefore = seg->ciBefore, ciExtra = seg->ciExtra;
+
+  seg->closed = false;
+  seg->failed = false;
+
+  try {
+    while (p->ch > 0) {
+      seg->end = p->indexNext - 1;
+      seg->ciBefore = ciBefore;
+      seg->ciExtra = ciExtra;
+      if (seg->end >= limit) {
+        return;
+      }
+
+      std::string key;
+      Value elem = (isMap ? _readMember(p, &key) : _readValue(p));
+      _setComment(elem, ValueAccess::CommentBefore, p, ciBefore, ciExtra);
+      seg->elems.push_back({seg->end, ciBefore, ciExtra, std::move(key), std::move(elem)});
+      auto& se = seg->elems.back();
+      auto ciAfter = _white(p);
+      if (p->ch == ',') {
+        _next(p);
+        ciExtra = _white(p);
+      } else {
+        ciExtra = {};
+      }
+      if (p->ch == (isMap ? '}' : ']') && !withoutBraces) {
+        _appendComment(se.value, ValueAccess::CommentAfter, p, ciAfter);
+        _appendComment(se.value, ValueAccess::CommentAfter, p, ciExtra);
+        _next(p);
+        seg->end = p->indexNext - 1;
+        seg->closed = true;
+        return;
+      }
+      ciBefore = ciAfter;
+    }
+
+    seg->end = p->indexNext - 1;
+    seg->ciBefore = ciBefore;
+    seg->ciExtra = ciExtra;
+    // Only a root object without braces may end at the end of the input.
+    seg->closed = withoutBraces;
+    seg->failed = !withoutBraces;
+  } catch (const syntax_error&) {
+    seg->failed = true;
+  }
+}
+
+
+static void _positionAt(Parser *p, int pos) {
+  p->indexNext = pos;
+  _next(p);
+}
+
+
+static bool _sameComment(const CommentInfo& a, const CommentInfo& b) {
+  return a.hasComment == b.hasComment && (!a.hasComment ||
+    (a.cmStart == b.cmStart && a.cmEnd == b.cmEnd));
+}
+
+
+// Returns a position at or after pos that probably is the first char of an
+// element of the root array or root map: the first char on a line that has
+// the same indentation as the first element. Returns -1 if there is no such
+// line within a reasonable distance. Any position is safe to return, since
+// _rootValueParallel() discards the elements read from a wrong position.
+static int _findSplit(const Parser *p, size_t pos, size_t indent, bool isMap) {
+  const unsigned char *pCh = p->data + pos;
+  const unsigned char *pEnd = p->data + std::min(p->dataSize, pos + (1 << 16));
+
+  while ((pCh = static_cast<const unsigned char*>(std::memchr(pCh, '\n', pEnd - pCh)))) {
+    const unsigned char *pLine = ++pCh;
+    while (pCh < pEnd && (*pCh == ' ' || *pCh == '\t')) {
+      ++pCh;
+    }
+    if (pCh == pEnd) {
+      break;
+    }
+    if (static_cast<size_t>(pCh - pLine) != indent) {
+      continue;
+    }
+    switch (*pCh) {
+    case '\r':
+    case '\n':
+    case ',':
+    case ':':
+    case ']':
+    case '}':
+    case '#':
+    case '/':
+      continue;
+    case '[':
+    case '{':
+      if (isMap) {
+        continue;
+      }
+      break;
+    default:
+      break;
+    }
+    return static_cast<int>(pCh - p->data);
+  }
+
+  return -1;
+}
+
+
+// Each thread parses at least this many bytes.
+static const size_t _minSegmentSize = 1 << 18;
+
+
+#if !HJSON_NO_STATS
+// Adds the work counters (see DecoderStats) of from to *pTo.
+static void _addWork(DecoderStats *pTo, const DecoderStats& from) {
+  pTo->stringBytesCopied += from.stringBytesCopied;
+  pTo->stringBytesReferenced += from.stringBytesReferenced;
+  pTo->stringBytesUnescaped += from.stringBytesUnescaped;
+  pTo->numbers += from.numbers;
+  pTo->numberSeconds += from.numberSeconds;
+  pTo->allocations += from.allocations;
+}
+#endif
+
+
+// Like _rootValue(), but if the root is an array or a map, its elements are
+// read in segments by several threads at the same time and then joined.
+// Returns an undefined Value if the input must be parsed by _rootValue()
+// instead (because it is too small, or contains a syntax error, or the
+// root is not an array or a map). The result is always exactly the same as
+// from _rootValue().
+static Value _rootValueParallel(Parser *p) {
+  auto ciBefore = _white(p);
+  bool isMap = (p->ch != '['), withoutBraces = (isMap && p->ch != '{');
+
+  if (!withoutBraces) {
+    _next(p);
+  }
+
+  Segment first = {};
+  first.ciBefore = _white(p);
+  if (p->ch == 0 || (!withoutBraces && p->ch == (isMap ? '}' : ']'))) {
+    return Value();
+  }
+
+  // Split the input into segments of about the same size.
+  int start = p->indexNext - 1;
+  size_t nSegments = std::min(static_cast<size_t>(p->opt.threads),
+    (p->dataSize - start) / _minSegmentSize);
+  if (nSegments < 2) {
+    return Value();
+  }
+
+  int indent = 0;
+  while (indent < start && p->data[start - indent - 1] != '\n') {
+    ++indent;
+  }
+
+  // limits[i] is the start of segment i + 1.
+  std::vector<int> limits;
+  for (size_t i = 1; i < nSegments; ++i) {
+    int split = _findSplit(p, start + (p->dataSize - start) * i / nSegments, indent, isMap);
+    if (split > (limits.empty() ? start : limits.back())) {
+      limits.push_back(split);
+    }
+  }
+  limits.push_back(INT_MAX);
+
+  // Make sure that all threads refer to the same copy of the input.
+  if (p->opt.comments && !p->copyComments) {
+    _commentOwner(p);
+  }
+
+  std::vector<Segment> segments(limits.size());
+  std::vector<std::exception_ptr> errors(limits.size());
+  segments[0] = std::move(first);
+
+  auto task = [&](size_t i) {
+    try {
+      Parser sp = *p;
+      if (sp.opt.stats) {
+        sp.opt.stats = &segments[i].stats;
+      }
+      AllocationCounter counter(sp.opt.stats ? &sp.opt.stats->allocations : nullptr);
+      // The elements are inside the root array or root map.
+      sp.depth = 1;
+      if (i > 0) {
+        _positionAt(&sp, limits[i - 1]);
+        segments[i].ciBefore = {};
+        segments[i].ciExtra = {};
+      }
+      _readSegment(&sp, isMap, withoutBraces, limits[i], &segments[i]);
+    } catch (...) {
+      errors[i] = std::current_exception();
+    }
+  };
+
+  if (p->opt.executor) {
+    p->opt.executor(segments.size(), task);
+  } else {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < segments.size(); ++i) {
+      threads.emplace_back(task, i);
+    }
+    task(0);
+    for (auto& t : threads) {
+      t.join();
+    }
+  }
+
+  for (auto& err : errors) {
+    if (err) {
+      std::rethrow_exception(err);
+    }
+  }
+
+  HJSON_STATS(p->opt.stats, for (const auto& seg : segments) {
+    _addWork(p->opt.stats, seg.stats);
+  });
+
+  // Join the segments. The elements of a segment are only used from the
+  // position where the previous segment ended, and only if the segment had
+  // arrived at that position in the same state. Otherwise that part of the
+  // input is read again on this thread.
+  Value ret(isMap ? Type::Map : Type::Vector);
+  Segment cur = {};
+  cur.end = start;
+
+  size_t elemCount = 0;
+  for (const auto& seg : segments) {
+    elemCount += seg.elems.size();
+  }
+  ret.reserve(elemCount);
+
+  for (size_t i = 0; i < segments.size() && !cur.closed; ++i) {
+    auto& seg = segments[i];
+    auto it = std::lower_bound(seg.elems.begin(), seg.elems.end(), cur.end,
+      [](const SegmentElem& se, int pos) { return se.start < pos; });
+
+    if (i == 0 || (it != seg.elems.end() && it->start == cur.end && (it == seg.elems.begin() ||
+      (_sameComment(it->ciBefore, cur.ciBefore) && _sameComment(it->ciExtra, cur.ciExtra)))))
+    {
+      if (it != seg.elems.end() && i > 0) {
+        _setComment(it->value, ValueAccess::CommentBefore, p, cur.ciBefore, cur.ciExtra);
+      }
+    } else {
+      // Read this part again, from where the previous segment ended.
+      seg.elems.clear();
+      seg.ciBefore = cur.ciBefore;
+      seg.ciExtra = cur.ciExtra;
+      _positionAt(p, cur.end);
+      p->depth = 1;
+      _readSegment(p, isMap, withoutBraces, limits[i], &seg);
+      p->depth = 0;
+      it = seg.elems.begin();
+    }
+
+    if (seg.failed) {
+      return Value();
+    }
+
+    for (; it != seg.elems.end(); ++it) {
+      if (isMap) {
+        const Value *pPrev;
+        if (p->opt.duplicateKeyException &&
+          (pPrev = ValueAccess::find(ret, it->key)) && pPrev->defined())
+        {
+          return Value();
+        }
+        ret.insert_or_assign(std::move(it->key), std::move(it->value));
+      } else {
+        ret.push_back(std::move(it->value));
+      }
+    }
+
+    cur.end = seg.end;
+    cur.ciBefore = seg.ciBefore;
+    cur.ciExtra = seg.ciExtra;
+    cur.closed = seg.closed;
+  }
+
+  if (!cur.closed) {
+    return Value();
+  }
+
+  CommentInfo ciExtra;
+  _positionAt(p, cur.end);
+  if (_hasTrailing(p, &ciExtra)) {
+    return Value();
+  }
+
+  if (withoutBraces) {
+    _setComment(ret[static_cast<int>(ret.size() - 1)], ValueAccess::CommentAfter, p,
+      cur.ciBefore, cur.ciExtra);
+    _setComment(ret[0], ValueAccess::CommentBefore, p, ciBefore);
+    ciBefore = CommentInfo();
+  }
+
+  _setComment(ret, ValueAccess::CommentBefore, p, ciBefore);
+  _appendComment(ret, ValueAccess::CommentAfter, p, ciExtra);
+
+  return ret;
+}
+
+
+// Adds the counts of the Values and comments in the tree of v to *stats.
+static void _treeStats(const Value& v, int depth, DecoderStats *stats) {
+  static const ValueAccess::CommentKind kinds[] = {ValueAccess::CommentBefore,
+    ValueAccess::CommentKey, ValueAccess::CommentInside, ValueAccess::CommentAfter};
+
+  ++stats->nodes[static_cast<int>(v.type())];
+  for (auto kind : kinds) {
+    size_t size;
+    ValueAccess::getComment(v, kind, &size);
+    stats->commentBytes += size;
+  }
+
+  if (v.type() == Type::Vector || v.type() == Type::Map) {
+    stats->maxDepth = std::max(stats->maxDepth, depth + 1);
+    for (size_t a = 0; a < v.size(); ++a) {
+      _treeStats((v.type() == Type::Map ? ValueAccess::element(v, a) :
+        v[static_cast<int>(a)]), depth + 1, stats);
+    }
+  }
+}
+
+
+// Makes p ready to read data from the start, keeping its options and buffers.
+static void _resetParser(Parser *p, const char *data, size_t dataSize,
+  const std::shared_ptr<const void>& owner, bool copyComments)
+{
+  p->data = (const unsigned char*) data;
+  p->dataSize = dataSize;
+  p->indexNext = 0;
+  p->ch = ' ';
+  p->owner = owner;
+  p->refData = (owner || p->opt.stringViews ? data : nullptr);
+  p->copyComments = copyComments;
+  p->depth = 0;
+}
+
+
+// Decodes all of p->data as one document.
+static Value _decodeDocument(Parser *p) {
+  DecoderStats *stats = p->opt.stats;
+  Value ret;
+
+  {
+    ArenaScope arenaScope(p->opt.arena);
+    StatsTimer timer(stats ? &stats->parseSeconds : nullptr);
+    AllocationCounter counter(stats ? &stats->allocations : nullptr);
+
+    _resetAt(p);
+    if (p->opt.threads > 1 && !p->opt.arena) {
+      ret = _rootValueParallel(p);
+      if (!ret.defined()) {
+        _resetAt(p);
+      }
+    }
+    if (!ret.defined()) {
+      ret = _rootValue(p);
+    }
+  }
+
+  HJSON_STATS(stats, stats->bytes += p->dataSize; _treeStats(ret, 0, stats));
+
+  return ret;
+}
+
+
+static Value _unmarshal(const char *data, size_t dataSize, const DecoderOptions& options,
+  const std::shared_ptr<const void>& owner, bool copyComments = false)
+{
   Parser parser = {
     (const unsigned char*) data,
     dataSize,
     0,
     ' ',
-    options
+    options,
+    owner,
+    (owner || options.stringViews ? data : nullptr),
+    copyComments,
+    0,
+    {},
+    {}
   };
 
   if (parser.opt.whitespaceAsComments) {
     parser.opt.comments = true;
   }
 
-  _resetAt(&parser);
-  return _rootValue(&parser);
+  return _decodeDocument(&parser);
+}
+
+
+// Unmarshal parses the Hjson-encoded data and returns a tree of Values.
+//
+// Unmarshal uses the inverse of the encodings that Marshal uses.
+//
+Value Unmarshal(const char *data, size_t dataSize, const DecoderOptions& options) {
+  return _unmarshal(data, dataSize, options, nullptr);
 }
 
 
@@ -789,55 +1755,2177 @@ Value Unmarshal(const std::string &data, const DecoderOptions& options) {
 }
 
 
-Value UnmarshalFromFile(const std::string &path, const DecoderOptions& options) {
-  std::ifstream infile(path, std::ifstream::ate | std::ifstream::binary);
-  if (!infile.is_open()) {
-    throw file_error("Could not open file '" + path + "' for reading");
-  }
-  std::string inStr;
-  size_t len = infile.tellg();
-  inStr.resize(len);
-  infile.seekg(0, std::ios::beg);
-  infile.read(&inStr[0], inStr.size());
-  infile.close();
+Value Unmarshal(std::string &&data, const DecoderOptions& options) {
+  auto owner = std::make_shared<std::string>(std::move(data));
 
-  while (len > 0 && inStr.at(len - 1) == '\0') {
-    --len;
-  }
+  return _unmarshal(owner->data(), owner->size(), options, owner);
+}
 
-  if (len > 0 && inStr.at(len - 1) == '\n') {
-    --len;
-  }
-  if (len > 0 && inStr.at(len - 1) == '\r') {
-    --len;
-  }
 
-  return Unmarshal(inStr.c_str(), len, options);
+EventHandler::~EventHandler() {
 }
 
 
-StreamDecoder::StreamDecoder(Value& _v, const DecoderOptions& _o)
-  : v(_v), o(_o)
-{
+void EventHandler::start_object() {
 }
 
 
-std::istream &operator >>(std::istream& in, StreamDecoder& sd) {
-  std::string inStr{ std::istreambuf_iterator<char>(in),
-    std::istreambuf_iterator<char>() };
-  sd.v.assign_with_comments(Unmarshal(inStr, sd.o));
+void EventHandler::end_object() {
+}
 
-  return in;
+
+void EventHandler::start_array() {
 }
 
 
-std::istream &operator >>(std::istream& in, StreamDecoder&& sd) {
-  return operator >>(in, sd);
+void EventHandler::end_array() {
 }
 
 
-std::istream &operator >>(std::istream& in, Value& v) {
-  return in >> StreamDecoder(v, DecoderOptions());
+void EventHandler::key(const StringView&) {
+}
+
+
+void EventHandler::string(const StringView&) {
+}
+
+
+void EventHandler::scalar(const Value&) {
+}
+
+
+void EventHandler::comment(const StringView&) {
+}
+
+
+static void _parseValue(Parser *p, EventHandler& h);
+
+
+static void _parseComment(Parser *p, EventHandler& h) {
+  auto ci = _white(p);
+
+  if (ci.hasComment && ci.cmEnd > ci.cmStart) {
+    h.comment(StringView(reinterpret_cast<const char*>(p->data) + ci.cmStart,
+      ci.cmEnd - ci.cmStart));
+  }
+}
+
+
+static StringView _readKeyView(Parser *p, std::string *pBuf) {
+  if (p->ch == '"' || p->ch == '\'') {
+    return _readStringView(p, false, pBuf);
+  }
+
+  return _readQuotelessKey(p);
+}
+
+
+// Like _readArray, but for Parse().
+static void _parseArray(Parser *p, EventHandler& h) {
+  h.start_array();
+
+  // Skip '['.
+  _next(p);
+  _parseComment(p, h);
+
+  while (p->ch > 0) {
+    if (p->ch == ']') {
+      _next(p);
+      h.end_array();
+      return;
+    }
+    _parseValue(p, h);
+    _parseComment(p, h);
+    // in Hjson the comma is optional and trailing commas are allowed
+    if (p->ch == ',') {
+      _next(p);
+      _parseComment(p, h);
+    }
+  }
+
+  throw syntax_error(_errAt(p, "End of input while parsing an array (did you forget a closing ']'?)"));
+}
+
+
+// Like _readObject, but for Parse().
+static void _parseObject(Parser *p, EventHandler& h, bool withoutBraces) {
+  std::string buf;
+
+  h.start_object();
+
+  if (!withoutBraces) {
+    // assuming ch == '{'
+    _next(p);
+  }
+
+  _parseComment(p, h);
+
+  while (p->ch > 0) {
+    if (p->ch == '}' && !withoutBraces) {
+      _next(p);
+      h.end_object();
+      return;
+    }
+    h.key(_readKeyView(p, &buf));
+    _parseComment(p, h);
+    if (p->ch != ':') {
+      throw syntax_error(_errAt(p, std::string(
+        "Expected ':' instead of '") + (char)(p->ch) + "'"));
+    }
+    _next(p);
+    _parseValue(p, h);
+    _parseComment(p, h);
+    // in Hjson the comma is optional and trailing commas are allowed
+    if (p->ch == ',') {
+      _next(p);
+      _parseComment(p, h);
+    }
+  }
+
+  if (withoutBraces) {
+    h.end_object();
+    return;
+  }
+  throw syntax_error(_errAt(p, "End of input while parsing an object (did you forget a closing '}'?)"));
+}
+
+
+// Like _readValue, but for Parse().
+static void _parseValue(Parser *p, EventHandler& h) {
+  _parseComment(p, h);
+
+  switch (p->ch) {
+  case '{':
+    _checkDepth(p, ++p->depth);
+    _parseObject(p, h, false);
+    --p->depth;
+    break;
+  case '[':
+    _checkDepth(p, ++p->depth);
+    _parseArray(p, h);
+    --p->depth;
+    break;
+  case '"':
+  case '\'':
+    {
+      std::string buf;
+      h.string(_readStringView(p, true, &buf));
+    }
+    break;
+  default:
+    {
+      Value scalar(Type::Null);
+      StringView str;
+      if (_readTfnns(p, &scalar, &str)) {
+        h.scalar(scalar);
+      } else {
+        h.string(str);
+      }
+    }
+    break;
+  }
+}
+
+
+// Returns true if the input (starting at the current char) is a key name
+// followed by ':', i.e. the start of a root object without braces. The
+// position in the input is not changed.
+static bool _isRootObject(Parser *p) {
+  if (p->ch == 0) {
+    // Empty input (or only comments) is an empty root object.
+    return true;
+  }
+
+  int indexNext = p->indexNext;
+  unsigned char ch = p->ch;
+  bool ret = false;
+
+  try {
+    std::string buf;
+    _readKeyView(p, &buf);
+    _white(p);
+    ret = (p->ch == ':');
+  } catch(const syntax_error&) {
+  }
+
+  p->indexNext = indexNext;
+  p->ch = ch;
+
+  return ret;
+}
+
+
+void Parse(const char *data, size_t dataSize, EventHandler& handler,
+  const DecoderOptions& options)
+{
+  Parser parser = {
+    (const unsigned char*) data,
+    dataSize,
+    0,
+    ' ',
+    options,
+    nullptr,
+    data,
+    false,
+    0,
+    {},
+    {}
+  };
+
+  if (parser.opt.whitespaceAsComments) {
+    parser.opt.comments = true;
+  }
+
+  _resetAt(&parser);
+  _parseComment(&parser, handler);
+
+  if (parser.ch == '{' || parser.ch == '[' || !_isRootObject(&parser)) {
+    _parseValue(&parser, handler);
+  } else {
+    _parseObject(&parser, handler, true);
+  }
+
+  _parseComment(&parser, handler);
+  if (parser.ch > 0) {
+    throw syntax_error(_errAt(&parser, "Syntax error, found trailing characters"));
+  }
+}
+
+
+void Parse(const std::string& data, EventHandler& handler,
+  const DecoderOptions& options)
+{
+  Parse(data.data(), data.size(), handler, options);
+}
+
+
+BindHandler::BindHandler(const BindSlot& root)
+  : next(root),
+  skipDepth(0)
+{
+}
+
+
+// Returns the slot for the value that has just started, and (unless it is an
+// element of a vector) clears next.
+BindSlot BindHandler::_target() {
+  if (!stack.empty() && stack.back().isArray) {
+    const BindSlot& parent = stack.back().slot;
+    return parent.ops->element(parent.obj);
+  }
+
+  BindSlot ret = next;
+  next = BindSlot();
+
+  return ret;
+}
+
+
+void BindHandler::_fail(const char *what, const BindSlot& slot) {
+  throw type_mismatch(std::string("Cannot decode ") + what + " into " +
+    slot.ops->name + (lastKey.empty() ? "" : " (key '" + lastKey + "')") + ".");
+}
+
+
+void BindHandler::start_object() {
+  if (skipDepth) {
+    ++skipDepth;
+    return;
+  }
+
+  BindSlot slot = _target();
+  if (!slot.ops) {
+    skipDepth = 1;
+    return;
+  }
+  if (!slot.ops->startObject(slot.obj)) {
+    _fail("a map", slot);
+  }
+
+  Frame f = {slot, false};
+  stack.push_back(f);
+}
+
+
+void BindHandler::end_object() {
+  if (skipDepth) {
+    --skipDepth;
+  } else {
+    stack.pop_back();
+  }
+}
+
+
+void BindHandler::start_array() {
+  if (skipDepth) {
+    ++skipDepth;
+    return;
+  }
+
+  BindSlot slot = _target();
+  if (!slot.ops) {
+    skipDepth = 1;
+    return;
+  }
+  if (!slot.ops->startArray(slot.obj)) {
+    _fail("a vector", slot);
+  }
+
+  Frame f = {slot, true};
+  stack.push_back(f);
+}
+
+
+void BindHandler::end_array() {
+  end_object();
+}
+
+
+void BindHandler::key(const StringView& name) {
+  if (skipDepth) {
+    return;
+  }
+
+  lastKey.assign(name.data(), name.size());
+  const BindSlot& parent = stack.back().slot;
+  next = parent.ops->key(parent.obj, name);
+}
+
+
+void BindHandler::string(const StringView& str) {
+  if (skipDepth) {
+    return;
+  }
+
+  BindSlot slot = _target();
+  if (slot.ops && !slot.ops->string(slot.obj, str)) {
+    _fail("a string", slot);
+  }
+}
+
+
+void BindHandler::scalar(const Value& val) {
+  if (skipDepth) {
+    return;
+  }
+
+  BindSlot slot = _target();
+  if (slot.ops && !slot.ops->scalar(slot.obj, val)) {
+    _fail(val.type() == Type::Bool ? "a bool" : val.is_numeric() ?
+      ("the number " + val.to_string()).c_str() : "null", slot);
+  }
+}
+
+
+// An entry of the index that LazyDocument builds over its input. The entries
+// are in document order, so the entries for the elements of a container
+// directly follow the entry for the container.
+struct LazyNode {
+  // Index in the input of the first char of the value (for a root map without
+  // braces: of the first char after any leading whitespace and comments).
+  int start;
+  // The number of elements of a container, or the size of the text of a
+  // quoteless value.
+  int size;
+  // Index of the first entry after the entries for the elements.
+  int next;
+  // The key, if this is an element of a map. A span of the input, or of
+  // LazyTape::keys if keyDecoded is true.
+  int keyStart;
+  int keySize;
+  bool keyDecoded;
+  // Type::Undefined for true, false, null and numbers, their exact type is
+  // only found out when needed.
+  Type type;
+};
+
+
+struct LazyTape {
+  std::vector<LazyNode> nodes;
+  // The keys that contain escape sequences, decoded.
+  std::string keys;
+  // True if the root is a map without braces.
+  bool rootWithoutBraces;
+};
+
+
+class LazyDocument::Index {
+public:
+  // Holds the input, if it was moved into the LazyDocument.
+  std::string text;
+  const char *data;
+  size_t dataSize;
+  LazyTape tape;
+};
+
+
+static void _indexValue(Parser *p, LazyTape *pTape);
+
+
+// Like _parseArray, but adds the elements to the index.
+static void _indexArray(Parser *p, LazyTape *pTape, int node) {
+  int size = 0;
+
+  // Skip '['.
+  _next(p);
+  _white(p);
+
+  while (p->ch > 0) {
+    if (p->ch == ']') {
+      _next(p);
+      pTape->nodes[node].type = Type::Vector;
+      pTape->nodes[node].size = size;
+      return;
+    }
+    _indexValue(p, pTape);
+    ++size;
+    _white(p);
+    // in Hjson the comma is optional and trailing commas are allowed
+    if (p->ch == ',') {
+      _next(p);
+      _white(p);
+    }
+  }
+
+  throw syntax_error(_errAt(p, "End of input while parsing an array (did you forget a closing ']'?)"));
+}
+
+
+// Like _parseObject, but adds the elements to the index.
+static void _indexObject(Parser *p, LazyTape *pTape, int node, bool withoutBraces) {
+  std::string buf;
+  int size = 0;
+
+  pTape->nodes[node].type = Type::Map;
+
+  if (!withoutBraces) {
+    // assuming ch == '{'
+    _next(p);
+  }
+
+  _white(p);
+
+  while (p->ch > 0) {
+    if (p->ch == '}' && !withoutBraces) {
+      _next(p);
+      pTape->nodes[node].size = size;
+      return;
+    }
+    StringView key = _readKeyView(p, &buf);
+    _white(p);
+    if (p->ch != ':') {
+      throw syntax_error(_errAt(p, std::string(
+        "Expected ':' instead of '") + (char)(p->ch) + "'"));
+    }
+    _next(p);
+    int elem = static_cast<int>(pTape->nodes.size());
+    _indexValue(p, pTape);
+    LazyNode& n = pTape->nodes[elem];
+    n.keySize = static_cast<int>(key.size());
+    n.keyDecoded = (key.data() == buf.data());
+    if (n.keyDecoded) {
+      n.keyStart = static_cast<int>(pTape->keys.size());
+      pTape->keys.append(key.data(), key.size());
+    } else {
+      n.keyStart = static_cast<int>(key.data() -
+        reinterpret_cast<const char*>(p->data));
+    }
+    ++size;
+    _white(p);
+    // in Hjson the comma is optional and trailing commas are allowed
+    if (p->ch == ',') {
+      _next(p);
+      _white(p);
+    }
+  }
+
+  if (withoutBraces) {
+    pTape->nodes[node].size = size;
+    return;
+  }
+  throw syntax_error(_errAt(p, "End of input while parsing an object (did you forget a closing '}'?)"));
+}
+
+
+// Like _parseValue, but adds an entry for the value (and for each of its
+// elements) to the index instead of decoding it.
+static void _indexValue(Parser *p, LazyTape *pTape) {
+  _white(p);
+
+  int node = static_cast<int>(pTape->nodes.size());
+  pTape->nodes.push_back({p->indexNext - 1, 0, 0, 0, 0, false, Type::String});
+
+  switch (p->ch) {
+  case '{':
+    _checkDepth(p, ++p->depth);
+    _indexObject(p, pTape, node, false);
+    --p->depth;
+    break;
+  case '[':
+    _checkDepth(p, ++p->depth);
+    _indexArray(p, pTape, node);
+    --p->depth;
+    break;
+  case '"':
+  case '\'':
+    {
+      std::string buf;
+      _readStringView(p, true, &buf);
+    }
+    break;
+  default:
+    {
+      StringView str;
+      if (_readTfnns(p, nullptr, &str)) {
+        pTape->nodes[node].type = Type::Undefined;
+      }
+      pTape->nodes[node].start = static_cast<int>(str.data() -
+        reinterpret_cast<const char*>(p->data));
+      pTape->nodes[node].size = static_cast<int>(str.size());
+    }
+    break;
+  }
+
+  pTape->nodes[node].next = static_cast<int>(pTape->nodes.size());
+}
+
+
+// Builds the index for the whole input, in the same way as Parse() reads it.
+static void _indexRoot(const char *data, size_t dataSize, LazyTape *pTape) {
+  DecoderOptions opt;
+  opt.comments = false;
+
+  Parser parser = {
+    (const unsigned char*) data,
+    dataSize,
+    0,
+    ' ',
+    opt,
+    nullptr,
+    data,
+    false,
+    0,
+    {},
+    {}
+  };
+  Parser *p = &parser;
+
+  _resetAt(p);
+  _white(p);
+
+  pTape->rootWithoutBraces = !(p->ch == '{' || p->ch == '[' || !_isRootObject(p));
+  if (pTape->rootWithoutBraces) {
+    pTape->nodes.push_back({p->indexNext - 1, 0, 0, 0, 0, false, Type::Map});
+    _indexObject(p, pTape, 0, true);
+    pTape->nodes[0].next = static_cast<int>(pTape->nodes.size());
+  } else {
+    _indexValue(p, pTape);
+  }
+
+  _white(p);
+  if (p->ch > 0) {
+    throw syntax_error(_errAt(p, "Syntax error, found trailing characters"));
+  }
+}
+
+
+LazyDocument::LazyDocument(const char *data, size_t dataSize) {
+  auto index = std::make_shared<Index>();
+  index->data = data;
+  index->dataSize = dataSize;
+  _indexRoot(index->data, index->dataSize, &index->tape);
+  idx = index;
+}
+
+
+LazyDocument::LazyDocument(const std::string& data)
+  : LazyDocument(data.data(), data.size())
+{
+}
+
+
+LazyDocument::LazyDocument(std::string&& data) {
+  auto index = std::make_shared<Index>();
+  index->text = std::move(data);
+  index->data = index->text.data();
+  index->dataSize = index->text.size();
+  _indexRoot(index->data, index->dataSize, &index->tape);
+  idx = index;
+}
+
+
+LazyValue LazyDocument::root() const {
+  return LazyValue(idx, 0);
+}
+
+
+LazyValue::LazyValue()
+  : node(-1)
+{
+}
+
+
+LazyValue::LazyValue(const std::shared_ptr<const LazyDocument::Index>& _idx, int _node)
+  : idx(_idx),
+  node(_node)
+{
+}
+
+
+Type LazyValue::type() const {
+  if (node < 0) {
+    return Type::Undefined;
+  }
+
+  const LazyNode& n = idx->tape.nodes[node];
+  if (n.type != Type::Undefined) {
+    return n.type;
+  }
+
+  switch (idx->data[n.start]) {
+  case 't':
+  case 'f':
+    return Type::Bool;
+  case 'n':
+    return Type::Null;
+  default:
+    return numberType(idx->data + n.start, n.size);
+  }
+}
+
+
+bool LazyValue::defined() const {
+  return node >= 0;
+}
+
+
+bool LazyValue::empty() const {
+  switch (type()) {
+  case Type::Undefined:
+  case Type::Null:
+    return true;
+  case Type::String:
+    return to_string().empty();
+  case Type::Vector:
+  case Type::Map:
+    return size() == 0;
+  default:
+    return false;
+  }
+}
+
+
+bool LazyValue::is_container() const {
+  Type t = type();
+  return t == Type::Vector || t == Type::Map;
+}
+
+
+bool LazyValue::is_numeric() const {
+  Type t = type();
+  return t == Type::Double || t == Type::Int64;
+}
+
+
+size_t LazyValue::size() const {
+  if (node < 0) {
+    return 0;
+  }
+
+  const LazyNode& n = idx->tape.nodes[node];
+  if (n.type == Type::Vector || n.type == Type::Map) {
+    return n.size;
+  }
+
+  return 0;
+}
+
+
+// Returns the entry for the last element with the key, or -1.
+int LazyValue::_find(const char *key, size_t keySize) const {
+  const LazyNode& n = idx->tape.nodes[node];
+  int ret = -1;
+
+  for (int a = 0, elem = node + 1; a < n.size; ++a) {
+    const LazyNode& e = idx->tape.nodes[elem];
+    if (static_cast<size_t>(e.keySize) == keySize) {
+      const char *pKey = (e.keyDecoded ? idx->tape.keys.data() : idx->data) +
+        e.keyStart;
+      if (!std::memcmp(pKey, key, keySize)) {
+        ret = elem;
+      }
+    }
+    elem = e.next;
+  }
+
+  return ret;
+}
+
+
+// Returns the entry for the element at index, which must be in bounds.
+int LazyValue::_element(int index) const {
+  int elem = node + 1;
+
+  for (int a = 0; a < index; ++a) {
+    elem = idx->tape.nodes[elem].next;
+  }
+
+  return elem;
+}
+
+
+LazyValue LazyValue::operator[](const std::string& key) const {
+  switch (type()) {
+  case Type::Undefined:
+    return LazyValue();
+  case Type::Map:
+    {
+      int elem = _find(key.data(), key.size());
+      if (elem < 0) {
+        return LazyValue();
+      }
+      return LazyValue(idx, elem);
+    }
+  default:
+    throw type_mismatch("Must be of type Undefined or Map for that operation.");
+  }
+}
+
+
+LazyValue LazyValue::operator[](const char *key) const {
+  return operator[](std::string(key));
+}
+
+
+LazyValue LazyValue::operator[](int index) const {
+  switch (type()) {
+  case Type::Undefined:
+    throw index_out_of_bounds("Index out of bounds.");
+  case Type::Vector:
+  case Type::Map:
+    if (index < 0 || index >= size()) {
+      throw index_out_of_bounds("Index out of bounds.");
+    }
+    return LazyValue(idx, _element(index));
+  default:
+    throw type_mismatch("Must be of type Undefined, Vector or Map for that operation.");
+  }
+}
+
+
+LazyValue LazyValue::at(const std::string& key) const {
+  switch (type()) {
+  case Type::Undefined:
+    throw index_out_of_bounds("Key not found.");
+  case Type::Map:
+    {
+      int elem = _find(key.data(), key.size());
+      if (elem < 0) {
+        throw index_out_of_bounds("Key not found.");
+      }
+      return LazyValue(idx, elem);
+    }
+  default:
+    throw type_mismatch("Must be of type Map for that operation.");
+  }
+}
+
+
+LazyValue LazyValue::at(const char *key) const {
+  return at(std::string(key));
+}
+
+
+std::string LazyValue::key(int index) const {
+  switch (type()) {
+  case Type::Undefined:
+  case Type::Map:
+    if (index < 0 || index >= size()) {
+      throw index_out_of_bounds("Index out of bounds.");
+    }
+    {
+      const LazyNode& e = idx->tape.nodes[_element(index)];
+      return std::string((e.keyDecoded ? idx->tape.keys.data() : idx->data) +
+        e.keyStart, e.keySize);
+    }
+  default:
+    throw type_mismatch("Must be of type Map for that operation.");
+  }
+}
+
+
+Value LazyValue::to_value() const {
+  if (node < 0) {
+    return Value();
+  }
+
+  DecoderOptions opt;
+  opt.comments = false;
+
+  Parser parser = {
+    (const unsigned char*) idx->data,
+    idx->dataSize,
+    0,
+    ' ',
+    opt,
+    nullptr,
+    idx->data,
+    false,
+    0,
+    {},
+    {}
+  };
+
+  _positionAt(&parser, idx->tape.nodes[node].start);
+  if (node == 0 && idx->tape.rootWithoutBraces) {
+    return _readObject(&parser, true);
+  }
+
+  return _readValue(&parser);
+}
+
+
+double LazyValue::to_double() const {
+  return to_value().to_double();
+}
+
+
+std::int64_t LazyValue::to_int64() const {
+  return to_value().to_int64();
+}
+
+
+std::string LazyValue::to_string() const {
+  return to_value().to_string();
+}
+
+
+MappedFile::MappedFile()
+  : data(nullptr),
+  size(0)
+#if HJSON_MMAP_WIN32
+  , hMapping(NULL)
+#endif
+{
+}
+
+
+MappedFile::~MappedFile() {
+#if HJSON_MMAP_WIN32
+  if (data) {
+    UnmapViewOfFile(data);
+  }
+  if (hMapping) {
+    CloseHandle(hMapping);
+  }
+#elif HJSON_MMAP_POSIX
+  if (data) {
+    munmap(const_cast<char*>(data), size);
+  }
+#endif
+}
+
+
+bool MappedFile::map(const std::string& path) {
+#if HJSON_MMAP_WIN32
+  HANDLE hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+    OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (hFile == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  LARGE_INTEGER fileSize;
+  if (GetFileSizeEx(hFile, &fileSize) && fileSize.QuadPart > 0 &&
+    static_cast<unsigned long long>(fileSize.QuadPart) <= SIZE_MAX)
+  {
+    hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (hMapping) {
+      data = static_cast<const char*>(MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0));
+      size = static_cast<size_t>(fileSize.QuadPart);
+    }
+  }
+
+  CloseHandle(hFile);
+
+  return true;
+#elif HJSON_MMAP_POSIX
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0 &&
+    static_cast<unsigned long long>(st.st_size) <= SIZE_MAX)
+  {
+    void *p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      data = static_cast<const char*>(p);
+      size = static_cast<size_t>(st.st_size);
+# ifdef MADV_SEQUENTIAL
+      madvise(p, size, MADV_SEQUENTIAL);
+# endif
+    }
+  }
+
+  close(fd);
+
+  return true;
+#else
+  return true;
+#endif
+}
+
+
+// Returns the length of the data without trailing null chars and without
+// one trailing line feed.
+static size_t _trimmedLength(const char *data, size_t len) {
+  while (len > 0 && data[len - 1] == '\0') {
+    --len;
+  }
+
+  if (len > 0 && data[len - 1] == '\n') {
+    --len;
+  }
+  if (len > 0 && data[len - 1] == '\r') {
+    --len;
+  }
+
+  return len;
+}
+
+
+// The file is parsed directly from a memory mapping when possible. The
+// mapping is kept alive by the Value tree only if string views are
+// requested, otherwise comments are copied so that the mapping (which on some
+// platforms locks the file) can be released before returning.
+Value UnmarshalFromFile(const std::string &path, const DecoderOptions& options) {
+  auto mapping = std::make_shared<MappedFile>();
+  if (!mapping->map(path)) {
+    throw file_error("Could not open file '" + path + "' for reading");
+  }
+
+  if (mapping->data) {
+    size_t len = _trimmedLength(mapping->data, mapping->size);
+
+    if (options.stringViews) {
+      return _unmarshal(mapping->data, len, options, mapping);
+    }
+
+    return _unmarshal(mapping->data, len, options, nullptr, true);
+  }
+
+  // Not mappable, read it instead.
+  std::ifstream infile(path, std::ifstream::ate | std::ifstream::binary);
+  if (!infile.is_open()) {
+    throw file_error("Could not open file '" + path + "' for reading");
+  }
+  std::string inStr;
+  size_t len = infile.tellg();
+  {
+    StatsTimer timer(options.stats ? &options.stats->readSeconds : nullptr);
+    inStr.resize(len);
+    infile.seekg(0, std::ios::beg);
+    infile.read(&inStr[0], inStr.size());
+    infile.close();
+  }
+
+  // Let the Value tree keep the file contents instead of a copy of them.
+  inStr.resize(_trimmedLength(inStr.data(), len));
+
+  return Unmarshal(std::move(inStr), options);
+}
+
+
+// Reads the data written by MarshalBinary().
+struct BinaryReader {
+  const unsigned char *data;
+  const unsigned char *pCh;
+  const unsigned char *pEnd;
+  const DecoderOptions& opt;
+  // Keeps data alive, if not null.
+  std::shared_ptr<const void> owner;
+  // If true, comments refer to data instead of being copied.
+  bool refComments;
+};
+
+
+// The most elements that _readBinary() reserves room for in a vector or map
+// before it has read them.
+static const std::uint64_t _binaryMaxReserve = 4096;
+
+
+// A vector or map that _readBinary() is reading.
+struct BinaryFrame {
+  Value container;
+  // Number of elements left to read.
+  std::uint64_t remaining;
+  // The key of the element being read, if container is a map.
+  std::string key;
+};
+
+
+static void _binaryError(BinaryReader *r, const std::string& message) {
+  throw syntax_error("Invalid binary Hjson data at offset " +
+    std::to_string(r->pCh - r->data) + ": " + message);
+}
+
+
+static std::uint64_t _readBinaryVarint(BinaryReader *r) {
+  std::uint64_t ret = 0;
+
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (r->pCh == r->pEnd) {
+      _binaryError(r, "Unexpected end of data");
+    }
+    unsigned char c = *r->pCh++;
+    // The last byte only has room for the top bit, and a last byte of zero
+    // would be a longer encoding than MarshalBinary() writes.
+    if ((shift == 63 && (c & 0x7e)) || (shift && !c)) {
+      --r->pCh;
+      _binaryError(r, "Invalid varint");
+    }
+    ret |= static_cast<std::uint64_t>(c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      return ret;
+    }
+  }
+
+  _binaryError(r, "Invalid varint");
+  return 0;
+}
+
+
+// Returns a pointer to the next `size` bytes, and moves past them.
+static const char *_readBinaryBytes(BinaryReader *r, std::uint64_t size) {
+  if (size > static_cast<std::uint64_t>(r->pEnd - r->pCh)) {
+    _binaryError(r, "Unexpected end of data");
+  }
+  auto ret = reinterpret_cast<const char*>(r->pCh);
+  r->pCh += size;
+
+  return ret;
+}
+
+
+// Reads one value. A vector or map is returned without its elements, and
+// *pCount is set to the number of elements that follow.
+static Value _readBinaryValue(BinaryReader *r, std::uint64_t *pCount) {
+  unsigned char tag = *_readBinaryBytes(r, 1);
+  unsigned type = (tag & binaryTypeMask);
+  DecoderStats *stats = r->opt.stats;
+  // Not Undefined, which would be allocated (see Value::Value()).
+  Value ret(Type::Null);
+
+  if ((tag & ~(binaryTypeMask | binaryHasComments | binaryTrue)) ||
+    ((tag & binaryTrue) && type != static_cast<unsigned>(Type::Bool)))
+  {
+    --r->pCh;
+    _binaryError(r, "Invalid tag");
+  }
+
+  // The comments are set after the value has been created.
+  const char *commentList[4] = {};
+  size_t commentSizes[4] = {};
+  if (tag & binaryHasComments) {
+    unsigned char mask = *_readBinaryBytes(r, 1);
+    if (mask & ~0x0f) {
+      --r->pCh;
+      _binaryError(r, "Invalid comment mask");
+    }
+    for (int k = ValueAccess::CommentBefore; k <= ValueAccess::CommentAfter; ++k) {
+      if (mask & (1 << k)) {
+        commentSizes[k] = _readBinaryVarint(r);
+        commentList[k] = _readBinaryBytes(r, commentSizes[k]);
+      }
+    }
+  }
+
+  *pCount = 0;
+
+  switch (static_cast<Type>(type)) {
+  case Type::Undefined:
+    ret = Value();
+    break;
+
+  case Type::Null:
+    break;
+
+  case Type::Bool:
+    ret = Value(!!(tag & binaryTrue));
+    break;
+
+  case Type::Double:
+    {
+      auto pBytes = reinterpret_cast<const unsigned char*>(_readBinaryBytes(r, 8));
+      std::uint64_t bits = 0;
+      for (int a = 0; a < 8; ++a) {
+        bits |= static_cast<std::uint64_t>(pBytes[a]) << (8 * a);
+      }
+      double d;
+      std::memcpy(&d, &bits, sizeof(d));
+      ret = Value(d);
+      HJSON_STATS(stats, ++stats->numbers);
+    }
+    break;
+
+  case Type::Int64:
+    {
+      std::uint64_t n = _readBinaryVarint(r);
+      ret = Value(static_cast<long long>((n >> 1) ^ (0 - (n & 1))));
+      HJSON_STATS(stats, ++stats->numbers);
+    }
+    break;
+
+  case Type::String:
+    {
+      std::uint64_t size = _readBinaryVarint(r);
+      const char *pStr = _readBinaryBytes(r, size);
+      if (r->opt.stringViews) {
+        ret = ValueAccess::stringView(r->owner, pStr, size);
+        HJSON_STATS(stats, stats->stringBytesReferenced += size);
+      } else {
+        ret = Value(std::string(pStr, size));
+        HJSON_STATS(stats, stats->stringBytesCopied += size);
+      }
+    }
+    break;
+
+  case Type::Vector:
+  case Type::Map:
+    *pCount = _readBinaryVarint(r);
+    // Each element takes at least one byte (two in a map), so a bigger count
+    // is malformed and must not make us loop for a long time.
+    if (*pCount > static_cast<std::uint64_t>(r->pEnd - r->pCh) /
+      (type == static_cast<unsigned>(Type::Map) ? 2 : 1))
+    {
+      _binaryError(r, "Invalid element count");
+    }
+    ret = Value(static_cast<Type>(type));
+    break;
+  }
+
+  for (int k = ValueAccess::CommentBefore; k <= ValueAccess::CommentAfter; ++k) {
+    if (!commentList[k] || !r->opt.comments) {
+      continue;
+    }
+    auto kind = static_cast<ValueAccess::CommentKind>(k);
+    if (r->refComments) {
+      ValueAccess::setComment(ret, kind, r->owner, commentList[k], commentSizes[k]);
+    } else {
+      ValueAccess::copyComment(ret, kind, commentList[k], commentSizes[k], false);
+    }
+  }
+
+  return ret;
+}
+
+
+// Reads the root value and all its elements. Like _readNested(), nested
+// vectors and maps are kept in an explicit stack.
+static Value _readBinary(BinaryReader *r) {
+  std::vector<BinaryFrame> stack;
+  std::uint64_t count;
+  Value val = _readBinaryValue(r, &count);
+
+  for (;;) {
+    if (val.is_container() && r->opt.maxDepth > 0 &&
+      stack.size() >= static_cast<size_t>(r->opt.maxDepth))
+    {
+      _binaryError(r, "Found more than " + std::to_string(r->opt.maxDepth) +
+        " levels of nested arrays and objects (see DecoderOptions::maxDepth)");
+    }
+    if (val.is_container() && count) {
+      BinaryFrame f = {std::move(val), count, std::string()};
+      // The element count is known up front, but each nested container can
+      // claim about as many elements as there are bytes left, so only a
+      // bounded part of it is reserved.
+      f.container.reserve(static_cast<size_t>(std::min<std::uint64_t>(count,
+        _binaryMaxReserve)));
+      stack.push_back(std::move(f));
+    } else {
+      // val is complete, add it to its container.
+      while (!stack.empty()) {
+        BinaryFrame& f = stack.back();
+        if (f.container.type() == Type::Vector) {
+          f.container.push_back(std::move(val));
+        } else if (r->opt.duplicateKeyException &&
+          ValueAccess::find(f.container, f.key))
+        {
+          _binaryError(r, "Found duplicate of key '" + f.key + "'");
+        } else {
+          f.container.insert_or_assign(std::move(f.key), std::move(val));
+        }
+        if (--f.remaining) {
+          break;
+        }
+        val.assign_with_comments(std::move(f.container));
+        stack.pop_back();
+      }
+      if (stack.empty()) {
+        return val;
+      }
+    }
+
+    BinaryFrame& f = stack.back();
+    if (f.container.type() == Type::Map) {
+      std::uint64_t size = _readBinaryVarint(r);
+      f.key.assign(_readBinaryBytes(r, size), size);
+    }
+    val.assign_with_comments(_readBinaryValue(r, &count));
+  }
+}
+
+
+static Value _unmarshalBinary(const char *data, size_t dataSize,
+  const DecoderOptions& options, const std::shared_ptr<const void>& owner)
+{
+  BinaryReader reader = {
+    reinterpret_cast<const unsigned char*>(data),
+    reinterpret_cast<const unsigned char*>(data),
+    reinterpret_cast<const unsigned char*>(data) + dataSize,
+    options,
+    owner,
+    (owner || options.stringViews)
+  };
+
+  DecoderStats *stats = options.stats;
+  Value ret;
+
+  {
+    ArenaScope arenaScope(options.arena);
+    StatsTimer timer(stats ? &stats->parseSeconds : nullptr);
+    AllocationCounter counter(stats ? &stats->allocations : nullptr);
+
+    if (dataSize < 4 || std::memcmp(data, "HJB", 3)) {
+      _binaryError(&reader, "Not binary Hjson data");
+    }
+    if (static_cast<unsigned char>(data[3]) != binaryVersion) {
+      reader.pCh += 3;
+      _binaryError(&reader, "Unsupported version " +
+        std::to_string(static_cast<unsigned char>(data[3])));
+    }
+    reader.pCh += 4;
+
+    ret = _readBinary(&reader);
+    if (reader.pCh != reader.pEnd) {
+      _binaryError(&reader, "Unexpected data after the root value");
+    }
+  }
+
+  HJSON_STATS(stats, stats->bytes += dataSize; _treeStats(ret, 0, stats));
+
+  return ret;
+}
+
+
+// UnmarshalBinary decodes the data written by MarshalBinary. There is no
+// text to parse, and all sizes are known in advance.
+//
+Value UnmarshalBinary(const char *data, size_t dataSize, const DecoderOptions& options) {
+  return _unmarshalBinary(data, dataSize, options, nullptr);
+}
+
+
+Value UnmarshalBinary(const std::string& data, const DecoderOptions& options) {
+  return UnmarshalBinary(data.data(), data.size(), options);
+}
+
+
+Value UnmarshalBinary(std::string&& data, const DecoderOptions& options) {
+  auto owner = std::make_shared<std::string>(std::move(data));
+
+  return _unmarshalBinary(owner->data(), owner->size(), options, owner);
+}
+
+
+Value UnmarshalBinaryFromFile(const std::string& path, const DecoderOptions& options) {
+  auto mapping = std::make_shared<MappedFile>();
+  if (!mapping->map(path)) {
+    throw file_error("Could not open file '" + path + "' for reading");
+  }
+
+  if (mapping->data) {
+    if (options.stringViews) {
+      return _unmarshalBinary(mapping->data, mapping->size, options, mapping);
+    }
+
+    return _unmarshalBinary(mapping->data, mapping->size, options, nullptr);
+  }
+
+  // Not mappable, read it instead.
+  std::ifstream infile(path, std::ifstream::ate | std::ifstream::binary);
+  if (!infile.is_open()) {
+    throw file_error("Could not open file '" + path + "' for reading");
+  }
+  std::string inStr;
+  {
+    StatsTimer timer(options.stats ? &options.stats->readSeconds : nullptr);
+    inStr.resize(static_cast<size_t>(infile.tellg()));
+    infile.seekg(0, std::ios::beg);
+    infile.read(&inStr[0], inStr.size());
+    infile.close();
+  }
+
+  return UnmarshalBinary(std::move(inStr), options);
+}
+
+
+StreamDecoder::StreamDecoder(Value& _v, const DecoderOptions& _o)
+  : v(_v), o(_o)
+{
+}
+
+
+std::istream &operator >>(std::istream& in, StreamDecoder& sd) {
+  // Hjson allows a root without braces and comments after the root, so the
+  // end of the document is not known before the end of the stream. See
+  // IncrementalDecoder for input that arrives in parts.
+  std::string inStr;
+  {
+    StatsTimer timer(sd.o.stats ? &sd.o.stats->readSeconds : nullptr);
+    char chunk[4096];
+    std::streamsize n;
+    while ((n = in.rdbuf()->sgetn(chunk, sizeof(chunk))) > 0) {
+      inStr.append(chunk, static_cast<size_t>(n));
+    }
+  }
+  sd.v.assign_with_comments(Unmarshal(std::move(inStr), sd.o));
+
+  return in;
+}
+
+
+std::istream &operator >>(std::istream& in, StreamDecoder&& sd) {
+  return operator >>(in, sd);
+}
+
+
+std::istream &operator >>(std::istream& in, Value& v) {
+  return in >> StreamDecoder(v, DecoderOptions());
+}
+
+
+class IncrementalDecoder::State {
+public:
+  DecoderOptions opt;
+  // Only used to find out if a document is complete, like Parse() does.
+  Parser parser;
+  EventHandler ignore;
+  std::string buf;
+  // The size of the complete document at the start of buf, or 0.
+  size_t docEnd;
+  // The part of buf that has already been searched for '}' and ']'.
+  size_t searched;
+  bool finished;
+
+  explicit State(const DecoderOptions&);
+
+  void reset();
+  // Sets docEnd if the document at the start of buf is complete.
+  void scan();
+};
+
+
+IncrementalDecoder::State::State(const DecoderOptions& options)
+  : opt(options),
+  parser{nullptr, 0, 0, ' ', options, nullptr, nullptr, false, 0, {}, {}},
+  finished(false)
+{
+  // Nothing but the position where the root ends is needed.
+  parser.opt.comments = false;
+  parser.opt.whitespaceAsComments = false;
+  parser.opt.stringViews = true;
+  parser.opt.stats = nullptr;
+  reset();
+}
+
+
+void IncrementalDecoder::State::reset() {
+  docEnd = 0;
+  searched = 0;
+}
+
+
+void IncrementalDecoder::State::scan() {
+  if (docEnd) {
+    return;
+  }
+
+  Parser *p = &parser;
+  _resetParser(p, buf.data(), buf.size(), nullptr, false);
+  _resetAt(p);
+  _white(p);
+
+  if (p->indexNext > p->dataSize) {
+    // Only whitespace and comments so far.
+    if (finished) {
+      buf.clear();
+      reset();
+    }
+    return;
+  }
+
+  if (p->ch != '{' && p->ch != '[') {
+    // A root without braces ends with the input.
+    if (finished) {
+      docEnd = buf.size();
+    }
+    return;
+  }
+
+  // The root can only have been closed by a '}' or ']' fed since the last
+  // time the document was parsed. Then the whole document is parsed again,
+  // since the parser cannot continue from where the input ended.
+  if (!finished && buf.find_first_of("}]", searched) == std::string::npos) {
+    searched = buf.size();
+    return;
+  }
+  searched = buf.size();
+
+  try {
+    _parseValue(p, ignore);
+    docEnd = std::min(static_cast<size_t>(p->indexNext - 1), buf.size());
+  } catch (const syntax_error&) {
+    if (!finished && p->indexNext >= p->dataSize) {
+      // The document might continue in the next chunk.
+      return;
+    }
+    // take() reports the error, for all of the input buffered so far.
+    docEnd = buf.size();
+  }
+}
+
+
+IncrementalDecoder::IncrementalDecoder(const DecoderOptions& options)
+  : state(new State(options))
+{
+}
+
+
+IncrementalDecoder::~IncrementalDecoder() {
+}
+
+
+bool IncrementalDecoder::feed(const char *data, size_t size) {
+  state->buf.append(data, size);
+  state->scan();
+
+  return ready();
+}
+
+
+bool IncrementalDecoder::feed(const std::string& data) {
+  return feed(data.data(), data.size());
+}
+
+
+bool IncrementalDecoder::finish() {
+  state->finished = true;
+  state->scan();
+
+  return ready();
+}
+
+
+bool IncrementalDecoder::ready() const {
+  return state->docEnd != 0;
+}
+
+
+Value IncrementalDecoder::take() {
+  if (!ready()) {
+    return Value();
+  }
+
+  std::string doc = state->buf.substr(0, state->docEnd);
+  state->buf.erase(0, state->docEnd);
+  state->reset();
+  // The rest of the buffer might already contain the next document.
+  state->scan();
+
+  return Unmarshal(std::move(doc), state->opt);
+}
+
+
+size_t IncrementalDecoder::buffered() const {
+  return state->buf.size();
+}
+
+
+class Decoder::State {
+public:
+  explicit State(const DecoderOptions&);
+
+  // Replaces the decoded part of buf with more input from the stream.
+  // Returns false at the end of the stream, or if the input is not a stream.
+  bool fill();
+  // Moves pos to the start of the line after the one that contains from.
+  void skipLine(size_t from);
+  // Moves pos past the document that starts with '{' or '[' at from, i.e. to
+  // the char after the matching '}' or ']' (or to the end of the input).
+  void skipDocument(size_t from);
+  // Returns true if there are at least n chars at pos, reading more input if
+  // needed.
+  bool available(size_t n);
+
+  Parser parser;
+  bool stringViews;
+  // True if data is buf, then the Values cannot refer to it.
+  bool ownsData;
+  // The input of next(), either the buffer given to reset() or buf.
+  const char *data;
+  size_t size;
+  // The first char in data that has not been decoded.
+  size_t pos;
+  // Null unless reading from a stream that has not ended.
+  std::istream *in;
+  std::string buf;
+};
+
+
+Decoder::State::State(const DecoderOptions& options)
+  : parser{nullptr, 0, 0, ' ', options, nullptr, nullptr, false, 0, {}, {}},
+  stringViews(options.stringViews),
+  ownsData(false),
+  data(nullptr),
+  size(0),
+  pos(0),
+  in(nullptr)
+{
+  if (parser.opt.whitespaceAsComments) {
+    parser.opt.comments = true;
+  }
+}
+
+
+bool Decoder::State::fill() {
+  if (!in) {
+    return false;
+  }
+
+  DecoderStats *stats = parser.opt.stats;
+  StatsTimer timer(stats ? &stats->readSeconds : nullptr);
+
+  buf.erase(0, pos);
+  pos = 0;
+
+  // Doubling the size that is read keeps the cost of decoding a document
+  // again, after it turned out to be incomplete, proportional to its size.
+  size_t prevSize = buf.size();
+  size_t chunkSize = std::max(prevSize, static_cast<size_t>(65536));
+  buf.resize(prevSize + chunkSize);
+  std::streamsize n = in->rdbuf()->sgetn(&buf[prevSize],
+    static_cast<std::streamsize>(chunkSize));
+  buf.resize(prevSize + (n > 0 ? static_cast<size_t>(n) : 0));
+
+  data = buf.data();
+  size = buf.size();
+
+  if (n <= 0) {
+    in = nullptr;
+    return false;
+  }
+
+  return true;
+}
+
+
+void Decoder::State::skipLine(size_t from) {
+  pos = from;
+
+  for (;;) {
+    auto pNewline = static_cast<const char*>(std::memchr(data + pos, '\n', size - pos));
+    if (pNewline) {
+      pos = pNewline - data + 1;
+      return;
+    }
+    pos = size;
+    if (!fill()) {
+      return;
+    }
+  }
+}
+
+
+bool Decoder::State::available(size_t n) {
+  while (size - pos < n) {
+    if (!fill()) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+void Decoder::State::skipDocument(size_t from) {
+  pos = from;
+  int depth = 0;
+  // True if the previous char is whitespace or punctuation, so that a quote or
+  // a comment can start here (inside a quoteless string they cannot).
+  bool tokenStart = true;
+
+  while (available(1)) {
+    char c = data[pos];
+    char c2 = (available(2) ? data[pos + 1] : 0);
+
+    if (tokenStart && (c == '#' || (c == '/' && c2 == '/'))) {
+      while (available(1) && data[pos] != '\n') {
+        ++pos;
+      }
+    } else if (tokenStart && c == '/' && c2 == '*') {
+      pos += 2;
+      while (available(2) && !(data[pos] == '*' && data[pos + 1] == '/')) {
+        ++pos;
+      }
+      pos = std::min(pos + 2, size);
+    } else if (tokenStart && c == '\'' && c2 == '\'' && available(3) &&
+      data[pos + 2] == '\'')
+    {
+      pos += 3;
+      while (available(3) && std::memcmp(data + pos, "'''", 3)) {
+        ++pos;
+      }
+      pos = std::min(pos + 3, size);
+      tokenStart = false;
+    } else if (tokenStart && (c == '"' || c == '\'')) {
+      // A quoted string ends at its closing quote, or (if that is missing) at
+      // the end of the line, like _readString() fails there.
+      ++pos;
+      while (available(1) && data[pos] != c && data[pos] != '\n') {
+        pos += (data[pos] == '\\' && available(2) ? 2 : 1);
+      }
+      if (available(1) && data[pos] == c) {
+        ++pos;
+      }
+      tokenStart = false;
+    } else {
+      ++pos;
+      if (c == '{' || c == '[') {
+        ++depth;
+      } else if ((c == '}' || c == ']') && --depth == 0) {
+        return;
+      }
+      tokenStart = (std::isspace(static_cast<unsigned char>(c)) || c == '{' ||
+        c == '[' || c == '}' || c == ']' || c == ',' || c == ':');
+    }
+  }
+
+  pos = size;
+}
+
+
+Decoder::Decoder(const DecoderOptions& options)
+  : state(new State(options))
+{
+}
+
+
+Decoder::~Decoder() {
+}
+
+
+Value Decoder::decode(const char *data, size_t dataSize) {
+  Parser *p = &state->parser;
+
+  p->opt.stringViews = state->stringViews;
+  _resetParser(p, data, dataSize, nullptr, false);
+
+  return _decodeDocument(p);
+}
+
+
+Value Decoder::decode(const std::string& data) {
+  return decode(data.data(), data.size());
+}
+
+
+void Decoder::reset(const char *data, size_t dataSize) {
+  state->in = nullptr;
+  state->ownsData = false;
+  state->buf.clear();
+  state->data = data;
+  state->size = dataSize;
+  state->pos = 0;
+}
+
+
+void Decoder::reset(const std::string& data) {
+  reset(data.data(), data.size());
+}
+
+
+void Decoder::reset(std::string&& data) {
+  reset(nullptr, 0);
+  state->buf = std::move(data);
+  state->ownsData = true;
+  state->data = state->buf.data();
+  state->size = state->buf.size();
+}
+
+
+void Decoder::reset(std::istream& in) {
+  reset(nullptr, 0);
+  state->ownsData = true;
+  state->in = &in;
+}
+
+
+bool Decoder::next(Value& v) {
+  State& s = *state;
+  Parser *p = &s.parser;
+  DecoderStats *stats = p->opt.stats;
+
+  // The buffer can be replaced by State::fill() or reset(), so string values
+  // and comments must be copied unless the caller keeps the data alive.
+  p->opt.stringViews = (s.stringViews && !s.ownsData);
+
+  for (;;) {
+    _resetParser(p, s.data, s.size, nullptr, false);
+    p->copyComments = !p->refData;
+    p->indexNext = static_cast<int>(s.pos);
+    _next(p);
+
+    auto ciBefore = _white(p);
+    if (p->indexNext > p->dataSize) {
+      // Only whitespace and comments, or a comment that is not complete yet.
+      if (s.fill()) {
+        continue;
+      }
+      s.pos = s.size;
+      return false;
+    }
+
+    size_t start = p->indexNext - 1;
+    bool hasBraces = (p->ch == '{' || p->ch == '[');
+    const char *pLineEnd = nullptr;
+    if (!hasBraces) {
+      pLineEnd = static_cast<const char*>(std::memchr(s.data + start, '\n',
+        s.size - start));
+      if (!pLineEnd && s.fill()) {
+        continue;
+      }
+    }
+
+    Value ret;
+    size_t end;
+
+    try {
+      ArenaScope arenaScope(p->opt.arena);
+      StatsTimer timer(stats ? &stats->parseSeconds : nullptr);
+      AllocationCounter counter(stats ? &stats->allocations : nullptr);
+
+      if (hasBraces) {
+        ret = (p->ch == '{' ? _readObject(p, false) : _readArray(p));
+        auto ciAfter = _getCommentAfter(p);
+        if (p->indexNext > p->dataSize && s.fill()) {
+          // A comment after the document might continue in the next chunk.
+          continue;
+        }
+        _setComment(ret, ValueAccess::CommentAfter, p, ciAfter);
+        end = std::min(static_cast<size_t>(p->indexNext - 1), s.size);
+      } else {
+        // Decode the line as a complete document of its own.
+        end = (pLineEnd ? pLineEnd - s.data : s.size);
+        _resetParser(p, s.data + start, end - start, nullptr, !p->refData);
+        _resetAt(p);
+        ret = _rootValue(p);
+        _resetParser(p, s.data, s.size, nullptr, false);
+        p->copyComments = !p->refData;
+      }
+    } catch (const syntax_error&) {
+      if (hasBraces && p->indexNext >= p->dataSize && s.fill()) {
+        // The document might continue in the next chunk.
+        continue;
+      }
+      if (hasBraces) {
+        s.skipDocument(start);
+      } else {
+        s.skipLine(start);
+      }
+      throw;
+    }
+
+    _setComment(ret, ValueAccess::CommentBefore, p, ciBefore);
+
+    HJSON_STATS(stats, stats->bytes += end - s.pos; _treeStats(ret, 0, stats));
+
+    s.pos = end;
+    v.assign_with_comments(std::move(ret));
+
+    return true;
+  }
+}
+
+
+Decoder::iterator Decoder::begin() {
+  return iterator(this);
+}
+
+
+Decoder::iterator Decoder::end() {
+  return iterator();
+}
+
+
+// What FileCache compares to find out if a file has changed.
+struct FileStamp {
+  std::uint64_t size;
+  std::int64_t seconds, nanoseconds;
+  // The inode on POSIX, so that a file replaced by another one with the same
+  // size and time is noticed.
+  std::uint64_t id;
+
+  bool operator ==(const FileStamp& other) const {
+    return size == other.size && seconds == other.seconds &&
+      nanoseconds == other.nanoseconds && id == other.id;
+  }
+};
+
+
+// Returns false if the file does not exist.
+static bool _fileStamp(const std::string& path, FileStamp *pStamp) {
+#if defined(_WIN32)
+  struct __stat64 st;
+  if (_stat64(path.c_str(), &st)) {
+    return false;
+  }
+  *pStamp = {static_cast<std::uint64_t>(st.st_size), static_cast<std::int64_t>(st.st_mtime),
+    0, 0};
+#else
+  struct stat st;
+  if (stat(path.c_str(), &st)) {
+    return false;
+  }
+  *pStamp = {static_cast<std::uint64_t>(st.st_size), static_cast<std::int64_t>(st.st_mtime),
+# if defined(__APPLE__)
+    static_cast<std::int64_t>(st.st_mtimespec.tv_nsec),
+# else
+    static_cast<std::int64_t>(st.st_mtim.tv_nsec),
+# endif
+    static_cast<std::uint64_t>(st.st_ino)};
+#endif
+
+  return true;
+}
+
+
+class FileCache::Entry {
+public:
+  Entry()
+    : parsed(false),
+    contentHash(0),
+    generation(0),
+    root(Type::Null)
+  {
+  }
+
+  // Held while the file is checked and parsed.
+  std::mutex mutex;
+  bool parsed;
+  // The file that root was parsed from.
+  FileStamp stamp;
+  std::uint64_t contentHash;
+  // Incremented each time root is replaced.
+  std::uint64_t generation;
+  Value root;
+};
+
+
+class FileCache::State {
+public:
+  typedef std::function<void(const std::string&, const Value&)> ChangeFunction;
+
+  State(const DecoderOptions&, bool compareContent);
+
+  // Parses the file again if it has changed. Returns true if e.root was
+  // replaced. The caller must hold e.mutex.
+  bool update(const std::string& path, Entry& e);
+  // Like FileCache::refresh(). If pReported is not null, also calls onChange
+  // for each file whose generation is not the one in *pReported (i.e. that
+  // got a new tree since the previous call, here or in get()), and updates
+  // *pReported.
+  size_t refresh(std::map<std::string, std::uint64_t> *pReported,
+    const ChangeFunction& onChange);
+  // Returns true if called from the thread started by watch() (i.e. from
+  // onChange).
+  bool onWatcher();
+  // Stops the thread started by watch(), if any, and waits for it to finish.
+  // The caller must hold controlMutex, and must not be that thread.
+  void stopWatcher();
+
+  DecoderOptions opt;
+  bool compareContent;
+  // Held while entries is used.
+  mutable std::mutex mutex;
+  std::map<std::string, std::shared_ptr<Entry>> entries;
+  // Held by watch() and stop() while they start or stop the thread, and so
+  // while watcher is used.
+  std::mutex controlMutex;
+  std::thread watcher;
+  // Held while stopping and watcherId are used.
+  std::mutex watchMutex;
+  std::condition_variable wake;
+  bool stopping;
+  // The id of watcher, until it has been joined.
+  std::thread::id watcherId;
+};
+
+
+FileCache::State::State(const DecoderOptions& options, bool _compareContent)
+  : opt(options),
+  compareContent(_compareContent),
+  stopping(false)
+{
+}
+
+
+bool FileCache::State::update(const std::string& path, Entry& e) {
+  FileStamp stamp;
+  if (!_fileStamp(path, &stamp)) {
+    throw file_error("Could not open file '" + path + "' for reading");
+  }
+
+  if (e.parsed && stamp == e.stamp) {
+    return false;
+  }
+
+  Value root(Type::Null);
+  std::uint64_t contentHash = 0;
+
+  if (compareContent) {
+    std::string inStr;
+    {
+      StatsTimer timer(opt.stats ? &opt.stats->readSeconds : nullptr);
+      std::ifstream infile(path, std::ifstream::binary);
+      if (!infile.is_open()) {
+        throw file_error("Could not open file '" + path + "' for reading");
+      }
+      inStr.assign(std::istreambuf_iterator<char>(infile), std::istreambuf_iterator<char>());
+    }
+
+    contentHash = hashBytes(inStr.data(), inStr.size());
+    if (e.parsed && contentHash == e.contentHash) {
+      // Only touched.
+      e.stamp = stamp;
+      return false;
+    }
+
+    // Like UnmarshalFromFile().
+    inStr.resize(_trimmedLength(inStr.data(), inStr.size()));
+    root.assign_with_comments(Unmarshal(std::move(inStr), opt));
+  } else {
+    root.assign_with_comments(UnmarshalFromFile(path, opt));
+  }
+
+  root.freeze();
+  e.root.assign_with_comments(std::move(root));
+  e.stamp = stamp;
+  e.contentHash = contentHash;
+  e.parsed = true;
+  ++e.generation;
+
+  return true;
+}
+
+
+size_t FileCache::State::refresh(std::map<std::string, std::uint64_t> *pReported,
+  const ChangeFunction& onChange)
+{
+  std::vector<std::pair<std::string, std::shared_ptr<Entry>>> files;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    files.assign(entries.begin(), entries.end());
+  }
+
+  size_t changed = 0;
+
+  for (const auto& file : files) {
+    Entry& e = *file.second;
+    Value root(Type::Null);
+    bool report = false;
+    {
+      std::lock_guard<std::mutex> lock(e.mutex);
+      try {
+        if (update(file.first, e)) {
+          ++changed;
+        }
+      } catch (const std::exception&) {
+        // Keep the previous tree, the file is checked again next time.
+      }
+      if (pReported && e.parsed) {
+        auto it = pReported->find(file.first);
+        if (it == pReported->end()) {
+          // Parsed for the first time.
+          (*pReported)[file.first] = e.generation;
+        } else if (it->second != e.generation) {
+          it->second = e.generation;
+          root.assign_with_comments(e.root);
+          report = true;
+        }
+      }
+    }
+    if (report && onChange) {
+      onChange(file.first, root);
+    }
+  }
+
+  return changed;
+}
+
+
+bool FileCache::State::onWatcher() {
+  std::lock_guard<std::mutex> lock(watchMutex);
+  return watcherId == std::this_thread::get_id();
+}
+
+
+void FileCache::State::stopWatcher() {
+  if (!watcher.joinable()) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(watchMutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  watcher.join();
+
+  std::lock_guard<std::mutex> lock(watchMutex);
+  stopping = false;
+  watcherId = std::thread::id();
+}
+
+
+FileCache::FileCache(const DecoderOptions& options, bool compareContent)
+  : state(new State(options, compareContent))
+{
+}
+
+
+FileCache::~FileCache() {
+  stop();
+}
+
+
+Value FileCache::get(const std::string& path) {
+  std::shared_ptr<Entry> e;
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    auto& found = state->entries[path];
+    if (!found) {
+      found = std::make_shared<Entry>();
+    }
+    e = found;
+  }
+
+  std::lock_guard<std::mutex> lock(e->mutex);
+  try {
+    state->update(path, *e);
+  } catch (...) {
+    if (!e->parsed) {
+      // Do not let refresh() check a file that was never parsed.
+      std::lock_guard<std::mutex> lock(state->mutex);
+      auto it = state->entries.find(path);
+      if (it != state->entries.end() && it->second == e) {
+        state->entries.erase(it);
+      }
+    }
+    throw;
+  }
+
+  return e->root;
+}
+
+
+Value FileCache::cached(const std::string& path) const {
+  std::shared_ptr<Entry> e;
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    auto it = state->entries.find(path);
+    if (it == state->entries.end()) {
+      return Value();
+    }
+    e = it->second;
+  }
+
+  std::lock_guard<std::mutex> lock(e->mutex);
+
+  return (e->parsed ? e->root : Value());
+}
+
+
+size_t FileCache::refresh() {
+  return state->refresh(nullptr, nullptr);
+}
+
+
+void FileCache::watch(std::chrono::milliseconds interval,
+  const std::function<void(const std::string& path, const Value& root)>& onChange)
+{
+  if (state->onWatcher()) {
+    throw std::logic_error("FileCache::watch() cannot be called from onChange");
+  }
+  std::lock_guard<std::mutex> control(state->controlMutex);
+  state->stopWatcher();
+
+  // The files that are already parsed are only reported when they change.
+  std::map<std::string, std::shared_ptr<Entry>> entries;
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    entries = state->entries;
+  }
+  std::map<std::string, std::uint64_t> reported;
+  for (const auto& entry : entries) {
+    std::lock_guard<std::mutex> lock(entry.second->mutex);
+    if (entry.second->parsed) {
+      reported[entry.first] = entry.second->generation;
+    }
+  }
+
+  State *s = state.get();
+  // The thread waits for watchMutex until watcherId is set.
+  std::lock_guard<std::mutex> lock(state->watchMutex);
+  state->watcher = std::thread([s, interval, onChange, reported]() mutable {
+    std::unique_lock<std::mutex> lock(s->watchMutex);
+    while (!s->wake.wait_for(lock, interval, [s]() { return s->stopping; })) {
+      lock.unlock();
+      s->refresh(&reported, onChange);
+      lock.lock();
+    }
+  });
+  state->watcherId = state->watcher.get_id();
+}
+
+
+void FileCache::stop() {
+  {
+    std::lock_guard<std::mutex> lock(state->watchMutex);
+    if (state->watcherId == std::this_thread::get_id()) {
+      // Called from onChange, the thread cannot wait for itself. It ends
+      // when onChange returns, and is joined by the next watch() or stop()
+      // from another thread (or by the destructor).
+      state->stopping = true;
+      return;
+    }
+  }
+
+  std::lock_guard<std::mutex> control(state->controlMutex);
+  state->stopWatcher();
+}
+
+
+void FileCache::erase(const std::string& path) {
+  std::lock_guard<std::mutex> lock(state->mutex);
+  state->entries.erase(path);
+}
+
+
+void FileCache::clear() {
+  std::lock_guard<std::mutex> lock(state->mutex);
+  state->entries.clear();
 }
 
 
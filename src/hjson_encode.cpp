@@ -1,11 +1,14 @@
-#include "hjson.h"
-#include <sstream>
-#include <regex>
-#include <iomanip>
+#include "hjson_internal.h"
 #include <iostream>
 #include <fstream>
 #include <cmath>
 #include <cctype>
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+#include <thread>
+#include <exception>
 
 
 namespace Hjson {
@@ -13,17 +16,105 @@ namespace Hjson {
 
 struct Encoder {
   EncoderOptions opt;
-  std::ostream *os;
-  std::locale loc;
+  OutputSink *out;
   int indent;
-  std::regex needsEscape, needsQuotes, needsEscapeML, startsWithKeyword,
-    needsEscapeName, lineBreak;
+  // Number of vectors and maps that contain the Value being written.
+  int depth;
+  // opt.eol followed by opt.indentBy repeated for the deepest indent written
+  // so far.
+  std::string indentText;
+};
+
+
+// A comment of a Value, written without being copied.
+struct CommentRef {
+  const char *pCh;
+  size_t size;
+
+  bool empty() const {
+    return !size;
+  }
+};
+
+
+// Character classes used when deciding how a string must be written.
+enum {
+  // The char must be escaped inside double quotes: \\, \" or [\x00-\x1f].
+  _cEscape = 0x01,
+  // [\x00-\x1f]
+  _cControl = 0x02,
+  // A control char that is not allowed in a multiline string, i.e.
+  // [\x00-\x08\x0b\x0c\x0e-\x1f].
+  _cControlML = 0x04,
+  // \s
+  _cSpace = 0x08,
+  // The char cannot be part of a key name without quotes: [,{[}\]\s:#"'].
+  _cName = 0x10,
+  // The char can be the first byte of a sequence in _commonRangeLength().
+  _cLead = 0x20,
+
+  _kC = _cEscape | _cControl | _cControlML,
+  _kW = _cEscape | _cControl | _cSpace | _cName,
+  _kV = _cEscape | _cControl | _cControlML | _cSpace | _cName,
+  _kS = _cSpace | _cName,
+  _kQ = _cEscape | _cName,
+  _kB = _cEscape,
+  _kN = _cName,
+  _kL = _cLead
+};
+
+
+static const unsigned char _charClass[256] = {
+  _kC, _kC, _kC, _kC, _kC, _kC, _kC, _kC, _kC, _kW, _kW, _kV, _kV, _kW, _kC, _kC,  // 00
+  _kC, _kC, _kC, _kC, _kC, _kC, _kC, _kC, _kC, _kC, _kC, _kC, _kC, _kC, _kC, _kC,  // 10
+  _kS,   0, _kQ, _kN,   0,   0,   0, _kN,   0,   0,   0,   0, _kN,   0,   0,   0,  // 20
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0, _kN,   0,   0,   0,   0,   0,  // 30
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  // 40
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0, _kN, _kB, _kN,   0,   0,  // 50
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  // 60
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0, _kN,   0, _kN,   0,   0,  // 70
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  // 80
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  // 90
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  // A0
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  // B0
+    0,   0, _kL,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  // C0
+    0,   0,   0,   0,   0,   0,   0,   0, _kL,   0,   0,   0, _kL,   0,   0,   0,  // D0
+    0, _kL, _kL,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0, _kL,  // E0
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  // F0
+};
+
+
+// Result flags from _scanString().
+enum {
+  // The string cannot be written inside double quotes without escapes.
+  _sNeedsEscape = 0x01,
+  // The string cannot be written as a quoteless string (includes the control
+  // chars and _commonRangeLength() sequences from _sNeedsEscape, but not a
+  // backslash or a double quote).
+  _sNeedsQuotes = 0x02,
+  // The string cannot be written as a multiline string.
+  _sNeedsEscapeML = 0x04,
+  // The string cannot be written as a key name without quotes.
+  _sNeedsEscapeName = 0x08
 };
 
 
 bool startsWithNumber(const char *text, size_t textSize);
 static void _objElem(Encoder *e, const std::string& key, const Value& value, bool *pIsFirst,
-  bool isRootObject, const std::string& commentAfterPrevObj);
+  bool isRootObject, const CommentRef& commentAfterPrevObj);
+
+
+static inline CommentRef _comment(const Value& value, ValueAccess::CommentKind kind) {
+  CommentRef ret;
+  ret.pCh = ValueAccess::getComment(value, kind, &ret.size);
+  return ret;
+}
+
+
+static inline void _writeComment(Encoder *e, const CommentRef& comment) {
+  HJSON_STATS(e->opt.stats, e->opt.stats->commentBytes += comment.size);
+  e->out->write(comment.pCh, comment.size);
+}
 
 
 // table of character substitutions
@@ -51,11 +142,213 @@ static const char *_meta(char c) {
 
 
 static void _writeIndent(Encoder *e, int indent) {
-  *e->os << e->opt.eol;
+  size_t size = e->opt.eol.size() + indent * e->opt.indentBy.size();
+
+  while (e->indentText.size() < size) {
+    e->indentText += e->opt.indentBy;
+  }
+
+  e->out->write(e->indentText.data(), size);
+}
+
+
+// Returns the length of the UTF8 sequence starting at pC if it is one of the
+// code points that must always be escaped (invisible or line separating
+// chars), otherwise returns 0.
+static size_t _commonRangeLength(const unsigned char *pC, const unsigned char *pEnd) {
+  size_t nLeft = pEnd - pC;
+
+  if (nLeft < 2) {
+    return 0;
+  }
+
+  switch (pC[0])
+  {
+  case 0xc2:
+    return (pC[1] == 0xad ? 2 : 0);
+  case 0xd8:
+    return (pC[1] >= 0x80 && pC[1] <= 0x84 ? 2 : 0);
+  case 0xdc:
+    return (pC[1] == 0x8f ? 2 : 0);
+  default:
+    break;
+  }
+
+  if (nLeft < 3) {
+    return 0;
+  }
+
+  switch (pC[0])
+  {
+  case 0xe1:
+    return (pC[1] == 0x9e && (pC[2] == 0xb4 || pC[2] == 0xb5) ? 3 : 0);
+  case 0xe2:
+    if (pC[1] == 0x80) {
+      return (pC[2] == 0x8c || pC[2] == 0x8f ||
+        (pC[2] >= 0xa8 && pC[2] <= 0xaf) ? 3 : 0);
+    }
+    return (pC[1] == 0x81 && pC[2] >= 0xa0 && pC[2] <= 0xaf ? 3 : 0);
+  case 0xef:
+    if (pC[1] == 0xbb) {
+      return (pC[2] == 0xbf ? 3 : 0);
+    }
+    return (pC[1] == 0xbf && pC[2] >= 0xb0 && pC[2] <= 0xbf ? 3 : 0);
+  default:
+    break;
+  }
+
+  return 0;
+}
+
+
+// Returns the length of the sequence that must be escaped at pC, or 0 if the
+// char at pC can be written as it is inside double quotes.
+static inline size_t _escapeLength(const unsigned char *pC, const unsigned char *pEnd) {
+  unsigned char cc = _charClass[*pC];
+
+  if (cc & _cEscape) {
+    return 1;
+  } else if (cc & _cLead) {
+    return _commonRangeLength(pC, pEnd);
+  }
+
+  return 0;
+}
+
+
+// Classifies the string in a single pass, returning a combination of the
+// _sNeedsX flags.
+static unsigned _scanString(const StringView& str) {
+  const unsigned char *pC = reinterpret_cast<const unsigned char*>(str.data());
+  const unsigned char *pEnd = pC + str.size();
+  unsigned char cc = 0, ccAll = _cSpace;
+  bool hasCommonRange = false, hasTripleQuote = false, hasCommentStart = false;
+  int nQuotes = 0;
+  unsigned ret = 0;
+
+  if (pC == pEnd) {
+    return 0;
+  }
+
+  switch (*pC)
+  {
+  case '"':
+  case '\'':
+  case '#':
+  case '{':
+  case '}':
+  case '[':
+  case ']':
+  case ':':
+  case ',':
+    ret |= _sNeedsQuotes;
+    break;
+  default:
+    break;
+  }
+
+  for (; pC < pEnd; ++pC) {
+    unsigned char c = _charClass[*pC];
+    cc |= c;
+    ccAll &= c;
+
+    if ((c & _cLead) && !hasCommonRange && _commonRangeLength(pC, pEnd)) {
+      hasCommonRange = true;
+    }
+
+    if (*pC == '\'') {
+      if (++nQuotes == 3) {
+        hasTripleQuote = true;
+      }
+    } else {
+      nQuotes = 0;
+      if (*pC == '/' && pC + 1 < pEnd && (pC[1] == '/' || pC[1] == '*')) {
+        hasCommentStart = true;
+      }
+    }
+  }
+
+  const unsigned char *pFirst = reinterpret_cast<const unsigned char*>(str.data());
+  if ((_charClass[*pFirst] & _cSpace) || (_charClass[pEnd[-1]] & _cSpace) ||
+    (pFirst[0] == '/' && str.size() > 1 && (pFirst[1] == '*' || pFirst[1] == '/')))
+  {
+    ret |= _sNeedsQuotes;
+  }
+
+  if (hasCommonRange) {
+    ret |= _sNeedsEscape | _sNeedsQuotes | _sNeedsEscapeML;
+  }
+  if (cc & _cEscape) {
+    ret |= _sNeedsEscape;
+  }
+  if (cc & _cControl) {
+    ret |= _sNeedsQuotes;
+  }
+  if ((cc & _cControlML) || hasTripleQuote || (ccAll & _cSpace)) {
+    ret |= _sNeedsEscapeML;
+  }
+  if ((cc & _cName) || hasCommentStart) {
+    ret |= _sNeedsEscapeName;
+  }
+
+  return ret;
+}
+
+
+// Returns the index of the first \r or \n at or after pos, or
+// std::string::npos.
+static size_t _findLineBreak(const StringView& str, size_t pos) {
+  for (; pos < str.size(); ++pos) {
+    if (str[pos] == '\r' || str[pos] == '\n') {
+      return pos;
+    }
+  }
+
+  return std::string::npos;
+}
+
+
+// Returns true if the string starts with true, false or null, optionally
+// followed by whitespace and then possibly a comment or one of the chars ,]}
+// followed by anything except line breaks.
+static bool _startsWithKeyword(const StringView& str) {
+  size_t pos;
+
+  if (str.size() >= 4 && (!std::memcmp(str.data(), "true", 4) ||
+    !std::memcmp(str.data(), "null", 4)))
+  {
+    pos = 4;
+  } else if (str.size() >= 5 && !std::memcmp(str.data(), "false", 5)) {
+    pos = 5;
+  } else {
+    return false;
+  }
+
+  while (pos < str.size() && (_charClass[static_cast<unsigned char>(str[pos])] & _cSpace)) {
+    ++pos;
+  }
+
+  if (pos == str.size()) {
+    return true;
+  }
 
-  for (int i = 0; i < indent; i++) {
-    *e->os << e->opt.indentBy;
+  switch (str[pos])
+  {
+  case ',':
+  case ']':
+  case '}':
+  case '#':
+    break;
+  case '/':
+    if (pos + 1 < str.size() && (str[pos + 1] == '/' || str[pos + 1] == '*')) {
+      break;
+    }
+    return false;
+  default:
+    return false;
   }
+
+  return _findLineBreak(str, pos) == std::string::npos;
 }
 
 
@@ -103,82 +396,124 @@ static int _fromUtf8(const unsigned char **ppC, size_t *pnS) {
 }
 
 
-static void _quoteReplace(Encoder *e, const std::string& text) {
-  size_t uIndexStart = 0;
+static void _writeHex4(Encoder *e, int nCode) {
+  static const char *szDigits = "0123456789abcdef";
+  char buf[8];
+  int nChars = 0;
 
-  for (std::sregex_iterator it = std::sregex_iterator(text.begin(), text.end(),
-    e->needsEscape); it != std::sregex_iterator(); ++it)
-  {
-    std::smatch match = *it;
-    const char *szReplacement = _meta(match.str()[0]);
+  for (int a = (nCode > 0xffff ? (nCode > 0xfffff ? 20 : 16) : 12); a >= 0; a -= 4) {
+    buf[nChars++] = szDigits[(nCode >> a) & 0xf];
+  }
+
+  *e->out << "\\u";
+  e->out->write(buf, nChars);
+}
+
+
+// Returns false if none of the 8 chars in w can start a sequence that must be
+// escaped, i.e. none is a control char, \", \\ or a byte >= 0x80. Might return
+// true also for some chars that are fine, see _escapeLength().
+static inline bool _mayNeedEscape(std::uint64_t w) {
+  const std::uint64_t ones = 0x0101010101010101ULL;
+
+  // A subtraction sets the high bit of a byte that was smaller than the
+  // subtrahend (or equal to it, for the xor'ed bytes), except for borrows
+  // from bytes that already have been caught.
+  return ((w - ones * 0x20) | ((w ^ (ones * '"')) - ones) | ((w ^ (ones * '\\')) - ones) |
+    w) & (ones * 0x80);
+}
+
+
+static void _quoteReplace(Encoder *e, const StringView& text) {
+  const unsigned char *pStart = reinterpret_cast<const unsigned char*>(text.data());
+  const unsigned char *pEnd = pStart + text.size();
+  const unsigned char *pC = pStart, *pDone = pStart;
+
+  while (pC < pEnd) {
+    if (pEnd - pC >= 8) {
+      std::uint64_t w;
+      std::memcpy(&w, pC, 8);
+      if (!_mayNeedEscape(w)) {
+        pC += 8;
+        continue;
+      }
+    }
+
+    size_t nMatch = _escapeLength(pC, pEnd);
+    if (!nMatch) {
+      ++pC;
+      continue;
+    }
 
-    if (size_t(match.position()) > uIndexStart) {
+    if (pC > pDone) {
       // Append non-matching text.
-      *e->os << text.substr(uIndexStart, match.position() - uIndexStart);
+      e->out->write(reinterpret_cast<const char*>(pDone), pC - pDone);
     }
 
+    const char *szReplacement = _meta(*pC);
+
     if (szReplacement) {
-      *e->os << szReplacement;
+      *e->out << szReplacement;
     } else {
-      const char *pC = text.data() + match.position();
-      size_t nS = match.length();
+      const unsigned char *pM = pC;
+      size_t nS = nMatch;
 
-      *e->os << std::hex << std::setfill('0');
       while (nS) {
-        int nRet = _fromUtf8((const unsigned char**) &pC, &nS);
+        int nRet = _fromUtf8(&pM, &nS);
         if (nRet < 0) {
           // Not UTF8. Just dump it.
-          *e->os << std::string(pC, nS);
+          e->out->write(reinterpret_cast<const char*>(pM), nS);
           break;
         }
-        *e->os << "\\u" << std::setw(4) << nRet;
+        _writeHex4(e, nRet);
       }
     }
 
-    uIndexStart = match.position() + match.length();
+    pC += nMatch;
+    pDone = pC;
   }
 
-  if (uIndexStart < text.length()) {
+  if (pDone < pEnd) {
     // Append remaining text.
-    *e->os << text.substr(uIndexStart, text.length() - uIndexStart);
+    e->out->write(reinterpret_cast<const char*>(pDone), pEnd - pDone);
   }
 }
 
 
 // wrap the string into the ''' (multiline) format
-static void _mlString(Encoder *e, const std::string& value, const char *separator) {
+static void _mlString(Encoder *e, const StringView& value, const char *separator) {
   size_t uIndexStart = 0;
-  std::sregex_iterator it = std::sregex_iterator(value.begin(), value.end(),
-    e->lineBreak);
+  size_t uBreak = _findLineBreak(value, 0);
 
-  if (it == std::sregex_iterator()) {
+  if (uBreak == std::string::npos) {
     // The string contains only a single line. We still use the multiline
     // format as it avoids escaping the \ character (e.g. when used in a
     // regex).
-    *e->os << separator << "'''";
-    *e->os << value;
+    *e->out << separator << "'''";
+    e->out->write(value.data(), value.size());
   } else {
     _writeIndent(e, e->indent + 1);
-    *e->os << "'''";
+    *e->out << "'''";
 
+    // Each \r and each \n counts as one line break, so \r\n gives an empty
+    // line in between.
     do {
-      std::smatch match = *it;
       auto indent = e->indent + 1;
-      if (match.position() == uIndexStart) {
+      if (uBreak == uIndexStart) {
         indent = 0;
       }
       _writeIndent(e, indent);
-      if (size_t(match.position()) > uIndexStart) {
-        *e->os << value.substr(uIndexStart, match.position() - uIndexStart);
+      if (uBreak > uIndexStart) {
+        e->out->write(value.data() + uIndexStart, uBreak - uIndexStart);
       }
-      uIndexStart = match.position() + match.length();
-      ++it;
-    } while (it != std::sregex_iterator());
+      uIndexStart = uBreak + 1;
+      uBreak = _findLineBreak(value, uIndexStart);
+    } while (uBreak != std::string::npos);
 
-    if (uIndexStart < value.length()) {
+    if (uIndexStart < value.size()) {
       // Append remaining text.
       _writeIndent(e, e->indent + 1);
-      *e->os << value.substr(uIndexStart, value.length() - uIndexStart);
+      e->out->write(value.data() + uIndexStart, value.size() - uIndexStart);
     } else {
       // Trailing line feed.
       _writeIndent(e, 0);
@@ -187,21 +522,26 @@ static void _mlString(Encoder *e, const std::string& value, const char *separato
     _writeIndent(e, e->indent + 1);
   }
 
-  *e->os << "'''";
+  *e->out << "'''";
 }
 
 
 // Check if we can insert this string without quotes
 // see hjson syntax (must not parse as true, false, null or number)
-static void _quote(Encoder *e, const std::string& value, const char *separator,
+static void _quote(Encoder *e, const StringView& value, const char *separator,
   bool isRootObject, bool hasCommentAfter)
 {
   if (value.size() == 0) {
-    *e->os << separator << "\"\"";
-  } else if (e->opt.quoteAlways ||
-    std::regex_search(value, e->needsQuotes) ||
-    startsWithNumber(value.c_str(), value.size()) ||
-    std::regex_search(value, e->startsWithKeyword) ||
+    *e->out << separator << "\"\"";
+    return;
+  }
+
+  unsigned flags = _scanString(value);
+
+  if (e->opt.quoteAlways ||
+    (flags & _sNeedsQuotes) ||
+    startsWithNumber(value.data(), value.size()) ||
+    _startsWithKeyword(value) ||
     hasCommentAfter)
   {
 
@@ -211,39 +551,49 @@ static void _quote(Encoder *e, const std::string& value, const char *separator,
     // format or we must replace the offending characters with safe escape
     // sequences.
 
-    if (!std::regex_search(value, e->needsEscape)) {
-      *e->os << separator << '"' << value << '"';
-    } else if (!e->opt.quoteAlways && !std::regex_search(value,
-      e->needsEscapeML) && !isRootObject)
-    {
+    if (!(flags & _sNeedsEscape)) {
+      HJSON_STATS(e->opt.stats, e->opt.stats->stringBytesCopied += value.size());
+      *e->out << separator << '"';
+      e->out->write(value.data(), value.size());
+      *e->out << '"';
+    } else if (!e->opt.quoteAlways && !(flags & _sNeedsEscapeML) && !isRootObject) {
+      HJSON_STATS(e->opt.stats, e->opt.stats->stringBytesCopied += value.size());
       _mlString(e, value, separator);
     } else {
-      *e->os << separator << '"';
+      HJSON_STATS(e->opt.stats, e->opt.stats->stringBytesEscaped += value.size());
+      *e->out << separator << '"';
       _quoteReplace(e, value);
-      *e->os << '"';
+      *e->out << '"';
     }
   } else {
+    HJSON_STATS(e->opt.stats, e->opt.stats->stringBytesCopied += value.size());
     // return without quotes
-    *e->os << separator << value;
+    *e->out << separator;
+    e->out->write(value.data(), value.size());
   }
 }
 
 
-static void _quoteName(Encoder *e, const std::string& name) {
+static void _quoteName(Encoder *e, const StringView& name) {
   if (name.empty()) {
-    *e->os << "\"\"";
-  } else if (e->opt.quoteKeys || std::regex_search(name, e->needsEscapeName)) {
-    *e->os << '"';
-    if (std::regex_search(name, e->needsEscape)) {
+    *e->out << "\"\"";
+    return;
+  }
+
+  unsigned flags = _scanString(name);
+
+  if (e->opt.quoteKeys || (flags & _sNeedsEscapeName)) {
+    *e->out << '"';
+    if (flags & _sNeedsEscape) {
       _quoteReplace(e, name);
     } else {
-      *e->os << name;
+      e->out->write(name.data(), name.size());
     }
 
-    *e->os << '"';
+    *e->out << '"';
   } else {
     // without quotes
-    *e->os << name;
+    e->out->write(name.data(), name.size());
   }
 }
 
@@ -256,28 +606,28 @@ static void _bracesIndent(Encoder *e, bool isObjElement, const Value& value, con
       !value.empty()
       || (
         e->opt.comments
-        && !value.get_comment_inside().empty()
+        && !_comment(value, ValueAccess::CommentInside).empty()
       )
     )
     && (
       !e->opt.comments
-      || value.get_comment_key().empty()
+      || _comment(value, ValueAccess::CommentKey).empty()
     )
   ) {
     _writeIndent(e, e->indent);
   } else {
-    *e->os << separator;
+    *e->out << separator;
   }
 }
 
 
-static bool _quoteForComment(Encoder *e, const std::string& comment) {
+static bool _quoteForComment(Encoder *e, const CommentRef& comment) {
   if (!e->opt.comments) {
     return false;
   }
 
-  for (char ch : comment) {
-    switch (ch)
+  for (size_t a = 0; a < comment.size; ++a) {
+    switch (comment.pCh[a])
     {
     case '\r':
     case '\n':
@@ -294,172 +644,461 @@ static bool _quoteForComment(Encoder *e, const std::string& comment) {
 }
 
 
-// Produce a string from value.
-static void _str(Encoder *e, const Value& value, bool isRootObject, bool isObjElement) {
+#if !HJSON_NO_STATS
+// Adds value (but not its elements) to the counters in *stats.
+static void _countValue(Encoder *e, const Value& value, EncoderStats *stats) {
+  ++stats->nodes[static_cast<int>(value.type())];
+  if (value.is_container()) {
+    stats->maxDepth = std::max(stats->maxDepth, e->depth + 1);
+  }
+}
+#endif
+
+
+// A vector or map that _str() is writing.
+struct WriteFrame {
+  const Value *value;
+  bool isRootObject;
+  // The next element to write, by index (for a vector, or for a map in
+  // insertion order) or by iterator (for a map in key order), and the end of
+  // the elements to write.
+  size_t index, end;
+  std::map<std::string, Value>::const_iterator it, itEnd;
+  bool isFirst;
+  // The comment after the previous element (or the inner comment of the
+  // container, before the first element).
+  CommentRef commentAfter;
+};
+
+
+// Writes value, or if value is a vector or a map only the part up to its
+// first element. Returns true in that case, and then _nextElem() and
+// _endContainer() must be called to write the rest.
+static bool _beginValue(Encoder *e, const Value& value, bool isRootObject, bool isObjElement) {
   const char *separator = ((isObjElement && (!e->opt.comments ||
-    value.get_comment_key().empty())) ? " " : "");
+    _comment(value, ValueAccess::CommentKey).empty())) ? " " : "");
+
+  HJSON_STATS(e->opt.stats, _countValue(e, value, e->opt.stats));
 
   if (e->opt.comments) {
     if (isRootObject) {
-      *e->os << value.get_comment_before();
+      _writeComment(e, _comment(value, ValueAccess::CommentBefore));
     }
-    *e->os << value.get_comment_key();
+    _writeComment(e, _comment(value, ValueAccess::CommentKey));
   }
 
   switch (value.type()) {
   case Type::Double:
-    *e->os << separator;
+    *e->out << separator;
 
     if (std::isnan(static_cast<double>(value)) || std::isinf(static_cast<double>(value))) {
-      *e->os << Value(Type::Null).to_string();
+      *e->out << Value(Type::Null).to_string();
     } else if (!e->opt.allowMinusZero && value == 0 && std::signbit(static_cast<double>(value))) {
-      *e->os << Value(0).to_string();
+      *e->out << "0";
     } else {
-      *e->os << value.to_string();
+      char buf[32];
+      size_t size;
+      {
+        EncoderStats *stats = e->opt.stats;
+        StatsTimer timer(stats ? &stats->numberSeconds : nullptr);
+        size = formatDouble(static_cast<double>(value), buf);
+        HJSON_STATS(stats, ++stats->numbers);
+      }
+      e->out->write(buf, size);
+    }
+    break;
+
+  case Type::Int64:
+    {
+      char buf[32];
+      size_t size;
+      *e->out << separator;
+      {
+        EncoderStats *stats = e->opt.stats;
+        StatsTimer timer(stats ? &stats->numberSeconds : nullptr);
+        size = formatInt64(value.to_int64(), buf);
+        HJSON_STATS(stats, ++stats->numbers);
+      }
+      e->out->write(buf, size);
     }
     break;
 
   case Type::String:
-    _quote(e, value, separator, isRootObject, _quoteForComment(e, value.get_comment_after()));
+    _quote(e, value.as_string_view(), separator, isRootObject, _quoteForComment(e,
+      _comment(value, ValueAccess::CommentAfter)));
     break;
 
   case Type::Vector:
-    {
+    _bracesIndent(e, isObjElement, value, separator);
+    *e->out << "[";
+
+    e->indent++;
+    e->depth++;
+    return true;
+
+  case Type::Map:
+    e->depth++;
+    if (!e->opt.omitRootBraces || !isRootObject || value.empty()) {
       _bracesIndent(e, isObjElement, value, separator);
-      *e->os << "[";
+      *e->out << "{";
 
       e->indent++;
+    }
+    return true;
 
-      // Join all of the element texts together, separated with newlines
-      bool isFirst = true;
-      std::string commentAfter = value.get_comment_inside();
-      for (int i = 0; size_t(i) < value.size(); ++i) {
-        if (value[i].defined()) {
-          bool shouldIndent = (!e->opt.comments || value[i].get_comment_key().empty());
-
-          if (isFirst) {
-            isFirst = false;
-
-            if (e->opt.comments && !commentAfter.empty()) {
-              *e->os << commentAfter;
-              // This is the first element, so commentAfterPrevObj is the inner comment
-              // of the parent vector. The inner comment probably expects "]" to come
-              // after it and therefore needs one more level of indentation.
-              *e->os << e->opt.indentBy;
-              shouldIndent = false;
-            }
-          } else {
-            if (e->opt.separator) {
-              *e->os << ",";
-            }
+  default:
+    *e->out << separator << value.to_string();
+  }
 
-            if (e->opt.comments) {
-              *e->os << commentAfter;
-            }
-          }
+  if (e->opt.comments && isRootObject) {
+    _writeComment(e, _comment(value, ValueAccess::CommentAfter));
+  }
 
-          if (e->opt.comments && !value[i].get_comment_before().empty()) {
-            *e->os << value[i].get_comment_before();
-          } else if (shouldIndent) {
-            _writeIndent(e, e->indent);
-          }
+  return false;
+}
+
+
+// Writes what comes before the next element of the vector or map in *f (the
+// comments and the indentation, and for a map also the key), then returns the
+// element. Returns null if there are no more elements.
+static const Value *_nextElem(Encoder *e, WriteFrame *f, bool *pIsObjElement) {
+  const Value& value = *f->value;
+
+  if (value.type() == Type::Vector) {
+    *pIsObjElement = false;
+
+    // Join all of the element texts together, separated with newlines
+    while (f->index < f->end) {
+      const Value& elem = value[static_cast<int>(f->index++)];
+      if (!elem.defined()) {
+        continue;
+      }
+
+      bool shouldIndent = (!e->opt.comments ||
+        _comment(elem, ValueAccess::CommentKey).empty());
 
-          _str(e, value[i], false, false);
+      if (f->isFirst) {
+        f->isFirst = false;
+
+        if (e->opt.comments && !f->commentAfter.empty()) {
+          _writeComment(e, f->commentAfter);
+          // This is the first element, so commentAfterPrevObj is the inner comment
+          // of the parent vector. The inner comment probably expects "]" to come
+          // after it and therefore needs one more level of indentation.
+          *e->out << e->opt.indentBy;
+          shouldIndent = false;
+        }
+      } else {
+        if (e->opt.separator) {
+          *e->out << ",";
+        }
 
-          commentAfter = value[i].get_comment_after();
+        if (e->opt.comments) {
+          _writeComment(e, f->commentAfter);
         }
       }
 
-      if (e->opt.comments && !commentAfter.empty()) {
-        *e->os << commentAfter;
-      } else if (!value.empty()) {
-        _writeIndent(e, e->indent - 1);
+      auto commentBefore = _comment(elem, ValueAccess::CommentBefore);
+      if (e->opt.comments && !commentBefore.empty()) {
+        _writeComment(e, commentBefore);
+      } else if (shouldIndent) {
+        _writeIndent(e, e->indent);
       }
 
-      *e->os << "]";
+      f->commentAfter = _comment(elem, ValueAccess::CommentAfter);
+      return &elem;
+    }
+
+    return nullptr;
+  }
+
+  *pIsObjElement = true;
+
+  // Join all of the member texts together, separated with newlines
+  for (;;) {
+    const std::string *pKey;
+    const Value *pElem;
+    if (e->opt.preserveInsertionOrder) {
+      if (f->index >= f->end) {
+        return nullptr;
+      }
+      pKey = &ValueAccess::key(value, f->index);
+      pElem = &ValueAccess::element(value, f->index);
+      ++f->index;
+    } else {
+      if (f->it == f->itEnd) {
+        return nullptr;
+      }
+      pKey = &f->it->first;
+      pElem = &f->it->second;
+      ++f->it;
+    }
+
+    if (pElem->defined()) {
+      _objElem(e, *pKey, *pElem, &f->isFirst, f->isRootObject, f->commentAfter);
+      f->commentAfter = _comment(*pElem, ValueAccess::CommentAfter);
+      return pElem;
+    }
+  }
+}
+
+
+// Writes the end of the vector or map in f, after its last element.
+static void _endContainer(Encoder *e, const WriteFrame& f) {
+  const Value& value = *f.value;
+
+  if (value.type() == Type::Vector) {
+    if (e->opt.comments && !f.commentAfter.empty()) {
+      _writeComment(e, f.commentAfter);
+    } else if (!value.empty()) {
+      _writeIndent(e, e->indent - 1);
+    }
+
+    *e->out << "]";
+    e->indent--;
+  } else {
+    if (e->opt.comments && !f.commentAfter.empty()) {
+      _writeComment(e, f.commentAfter);
+    } else if (!value.empty() && (!e->opt.omitRootBraces || !f.isRootObject)) {
+      _writeIndent(e, e->indent - 1);
+    }
+
+    if (!e->opt.omitRootBraces || !f.isRootObject || value.empty()) {
       e->indent--;
+      *e->out << "}";
     }
-    break;
+  }
+  e->depth--;
 
-  case Type::Map:
-    {
-      if (!e->opt.omitRootBraces || !isRootObject || value.empty()) {
-        _bracesIndent(e, isObjElement, value, separator);
-        *e->os << "{";
-
-        e->indent++;
-      }
-
-      // Join all of the member texts together, separated with newlines
-      bool isFirst = true;
-      std::string commentAfter = value.get_comment_inside();
-      if (e->opt.preserveInsertionOrder) {
-        size_t limit = value.size();
-        for (int index = 0; index < limit; index++) {
-          if (value[index].defined()) {
-            _objElem(e, value.key(index), value[index], &isFirst, isRootObject, commentAfter);
-            commentAfter = value[index].get_comment_after();
-          }
-        }
-      } else {
-        for (auto it : value) {
-          if (it.second.defined()) {
-            _objElem(e, it.first, it.second, &isFirst, isRootObject, commentAfter);
-            commentAfter = it.second.get_comment_after();
-          }
-        }
+  if (e->opt.comments && f.isRootObject) {
+    _writeComment(e, _comment(value, ValueAccess::CommentAfter));
+  }
+}
+
+
+// Returns a frame for writing all of the elements of value.
+static WriteFrame _frame(Encoder *e, const Value& value, bool isRootObject) {
+  WriteFrame f;
+  f.value = &value;
+  f.isRootObject = isRootObject;
+  f.index = 0;
+  f.end = value.size();
+  if (value.type() == Type::Map && !e->opt.preserveInsertionOrder) {
+    f.it = value.begin();
+    f.itEnd = value.end();
+  }
+  f.isFirst = true;
+  f.commentAfter = _comment(value, ValueAccess::CommentInside);
+
+  return f;
+}
+
+
+// The smallest number of elements in each segment of a vector or map that
+// _strParallel() writes.
+static const size_t _minSegmentElements = 1024;
+
+
+// Returns the number of segments that the elements of the container in f
+// should be split into, or 0 if they should be written on this thread.
+static size_t _segmentCount(Encoder *e, const WriteFrame& f) {
+  size_t nSegments = std::min(static_cast<size_t>(std::max(e->opt.threads, 1)),
+    f.value->size() / _minSegmentElements);
+
+  return (nSegments < 2 ? 0 : nSegments);
+}
+
+
+#if !HJSON_NO_STATS
+// Adds the work counters (see EncoderStats) of from to *pTo.
+static void _addWork(EncoderStats *pTo, const EncoderStats& from) {
+  for (size_t a = 0; a < sizeof(pTo->nodes) / sizeof(pTo->nodes[0]); ++a) {
+    pTo->nodes[a] += from.nodes[a];
+  }
+  pTo->maxDepth = std::max(pTo->maxDepth, from.maxDepth);
+  pTo->commentBytes += from.commentBytes;
+  pTo->stringBytesCopied += from.stringBytesCopied;
+  pTo->stringBytesEscaped += from.stringBytesEscaped;
+  pTo->numbers += from.numbers;
+  pTo->numberSeconds += from.numberSeconds;
+}
+#endif
+
+
+static void _strParallel(Encoder *e, WriteFrame *pTop, size_t nSegments);
+
+
+// Writes the elements of the container in *pTop, including everything
+// nested in them, but not the end of the container. Nested
+// vectors and maps are kept in an explicit stack instead of being written by
+// recursive calls.
+static void _strElements(Encoder *e, WriteFrame *pTop) {
+  std::vector<WriteFrame> stack;
+  WriteFrame *f = pTop;
+
+  // Big containers are written by _strParallel(), which leaves the frame
+  // after the last element.
+  auto split = [e](WriteFrame *pFrame) {
+    if (size_t nSegments = _segmentCount(e, *pFrame)) {
+      _strParallel(e, pFrame, nSegments);
+    }
+  };
+
+  split(f);
+
+  for (;;) {
+    bool isObjElement;
+    const Value *pElem = _nextElem(e, f, &isObjElement);
+
+    if (!pElem) {
+      if (stack.empty()) {
+        return;
       }
+      _endContainer(e, *f);
+      stack.pop_back();
+      f = (stack.empty() ? pTop : &stack.back());
+    } else if (_beginValue(e, *pElem, false, isObjElement)) {
+      stack.push_back(_frame(e, *pElem, false));
+      f = &stack.back();
+      split(f);
+    }
+  }
+}
+
 
-      if (e->opt.comments && !commentAfter.empty()) {
-        *e->os << commentAfter;
-      } else if (!value.empty() && (!e->opt.omitRootBraces || !isRootObject)) {
-        _writeIndent(e, e->indent - 1);
+// A part of the elements of a vector or map that _strParallel() writes.
+struct WriteSegment {
+  WriteFrame frame;
+  OutputSink out;
+  EncoderStats stats;
+};
+
+
+// Writes the elements of the container in *pTop in nSegments segments, one
+// thread each, then writes the segments to e->out in order. Each segment
+// starts in the state that _nextElem() would have had when writing all of the
+// elements on one thread, so the output is exactly the same.
+static void _strParallel(Encoder *e, WriteFrame *pTop, size_t nSegments) {
+  const Value& value = *pTop->value;
+  bool byIterator = (value.type() == Type::Map && !e->opt.preserveInsertionOrder);
+  std::vector<WriteSegment> segments(nSegments);
+
+  auto it = pTop->it;
+  for (size_t i = 0; i < nSegments; ++i) {
+    WriteFrame& f = segments[i].frame;
+    f = *pTop;
+    f.index = pTop->index + (pTop->end - pTop->index) * i / nSegments;
+    f.end = pTop->index + (pTop->end - pTop->index) * (i + 1) / nSegments;
+    if (byIterator) {
+      f.it = it;
+      std::advance(it, f.end - f.index);
+      f.itEnd = it;
+    }
+    if (i > 0) {
+      // The state after the last element that the previous segment writes,
+      // or the state that the previous segment starts in if it has none.
+      const WriteFrame& prev = segments[i - 1].frame;
+      f.isFirst = prev.isFirst;
+      f.commentAfter = prev.commentAfter;
+      auto itPrev = f.it;
+      for (size_t index = f.index; index-- > prev.index;) {
+        const Value& elem = (byIterator ? (--itPrev)->second : value.type() == Type::Map ?
+          ValueAccess::element(value, index) : value[static_cast<int>(index)]);
+        if (elem.defined()) {
+          f.isFirst = false;
+          f.commentAfter = _comment(elem, ValueAccess::CommentAfter);
+          break;
+        }
       }
+    }
+  }
 
-      if (!e->opt.omitRootBraces || !isRootObject || value.empty()) {
-        e->indent--;
-        *e->os << "}";
+  std::vector<std::exception_ptr> errors(nSegments);
+
+  auto task = [&](size_t i) {
+    try {
+      Encoder se = *e;
+      se.out = &segments[i].out;
+      // Nested containers are written on this thread.
+      se.opt.threads = 1;
+      if (se.opt.stats) {
+        se.opt.stats = &segments[i].stats;
       }
+      _strElements(&se, &segments[i].frame);
+    } catch (...) {
+      errors[i] = std::current_exception();
     }
-    break;
+  };
 
-  default:
-    *e->os << separator << value.to_string();
+  if (e->opt.executor) {
+    e->opt.executor(segments.size(), task);
+  } else {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < segments.size(); ++i) {
+      threads.emplace_back(task, i);
+    }
+    task(0);
+    for (auto& t : threads) {
+      t.join();
+    }
   }
 
-  if (e->opt.comments && isRootObject) {
-    *e->os << value.get_comment_after();
+  for (auto& err : errors) {
+    if (err) {
+      std::rethrow_exception(err);
+    }
+  }
+
+  for (auto& seg : segments) {
+    std::string text = seg.out.take();
+    e->out->write(text.data(), text.size());
+    HJSON_STATS(e->opt.stats, _addWork(e->opt.stats, seg.stats));
+  }
+
+  *pTop = segments.back().frame;
+}
+
+
+// Produce a string from value.
+static void _str(Encoder *e, const Value& root) {
+  if (_beginValue(e, root, true, false)) {
+    WriteFrame f = _frame(e, root, true);
+    _strElements(e, &f);
+    _endContainer(e, f);
   }
 }
 
 
+// Writes what comes before the value of an element of a map: the comments,
+// the indentation and the key.
 static void _objElem(Encoder *e, const std::string& key, const Value& value, bool *pIsFirst,
-  bool isRootObject, const std::string& commentAfterPrevObj)
+  bool isRootObject, const CommentRef& commentAfterPrevObj)
 {
-  bool hasCommentBefore = (e->opt.comments && !value.get_comment_before().empty());
+  auto commentBefore = _comment(value, ValueAccess::CommentBefore);
+  bool hasCommentBefore = (e->opt.comments && !commentBefore.empty());
 
   if (*pIsFirst) {
     *pIsFirst = false;
     bool shouldIndent = ((!e->opt.omitRootBraces || !isRootObject) && !hasCommentBefore);
 
     if (e->opt.comments && !commentAfterPrevObj.empty()) {
-      *e->os << commentAfterPrevObj;
+      _writeComment(e, commentAfterPrevObj);
       // This is the first element, so commentAfterPrevObj is the inner comment
       // of the parent map. The inner comment probably expects "}" to come
       // after it and therefore needs one more level of indentation, unless
       // this is the root object without braces.
       if (shouldIndent) {
-        *e->os << e->opt.indentBy;
+        *e->out << e->opt.indentBy;
       }
     } else if (shouldIndent) {
       _writeIndent(e, e->indent);
     }
   } else {
     if (e->opt.separator) {
-      *e->os << ",";
+      *e->out << ",";
     }
     if (e->opt.comments) {
-      *e->os << commentAfterPrevObj;
+      _writeComment(e, commentAfterPrevObj);
     }
     if (!hasCommentBefore) {
       _writeIndent(e, e->indent);
@@ -467,53 +1106,214 @@ static void _objElem(Encoder *e, const std::string& key, const Value& value, boo
   }
 
   if (hasCommentBefore) {
-    *e->os << value.get_comment_before();
+    _writeComment(e, commentBefore);
   }
 
   _quoteName(e, key);
-  *e->os << ":";
-  _str(
-    e,
-    value,
-    false,
-    true
-  );
+  *e->out << ":";
 }
 
 
-static void _marshalStream(const Value& v, const EncoderOptions& options,
-  std::ostream *pStream)
+// Writes value as JSON, skipping all of the choices that _str() makes for
+// Hjson (quoteless and multiline strings, comments, brace placement). If
+// pretty is false, no whitespace at all is written. Like _str(), nested
+// vectors and maps are kept in an explicit stack.
+static void _json(Encoder *e, const Value& root, bool pretty) {
+  std::vector<WriteFrame> stack;
+  // The value to write next, if any.
+  const Value *pValue = &root;
+
+  for (;;) {
+    if (pValue) {
+      const Value& value = *pValue;
+
+      switch (value.type()) {
+      case Type::Double:
+        {
+          double d = static_cast<double>(value);
+          if (std::isnan(d) || std::isinf(d)) {
+            *e->out << "null";
+          } else if (!e->opt.allowMinusZero && d == 0 && std::signbit(d)) {
+            *e->out << '0';
+          } else {
+            char buf[32];
+            e->out->write(buf, formatDouble(d, buf));
+          }
+        }
+        break;
+
+      case Type::Int64:
+        {
+          char buf[32];
+          e->out->write(buf, formatInt64(value.to_int64(), buf));
+        }
+        break;
+
+      case Type::String:
+        *e->out << '"';
+        _quoteReplace(e, value.as_string_view());
+        *e->out << '"';
+        break;
+
+      case Type::Vector:
+      case Type::Map:
+        {
+          *e->out << (value.type() == Type::Vector ? '[' : '{');
+          e->indent++;
+
+          WriteFrame f;
+          f.value = &value;
+          f.isRootObject = false;
+          f.index = 0;
+          f.isFirst = true;
+          stack.push_back(f);
+        }
+        break;
+
+      default:
+        *e->out << value.to_string();
+      }
+    }
+
+    if (stack.empty()) {
+      return;
+    }
+
+    // Find the next element of the innermost vector or map.
+    WriteFrame& f = stack.back();
+    const Value& container = *f.value;
+    bool isMap = (container.type() == Type::Map);
+
+    pValue = nullptr;
+    while (!pValue && f.index < container.size()) {
+      size_t index = f.index++;
+      const Value& elem = (isMap ? ValueAccess::element(container, index) :
+        container[static_cast<int>(index)]);
+      if (!elem.defined()) {
+        continue;
+      }
+      if (!f.isFirst) {
+        *e->out << ',';
+      }
+      f.isFirst = false;
+      if (pretty) {
+        _writeIndent(e, e->indent);
+      }
+      if (isMap) {
+        *e->out << '"';
+        _quoteReplace(e, ValueAccess::key(container, index));
+        if (pretty) {
+          e->out->write("\": ", 3);
+        } else {
+          e->out->write("\":", 2);
+        }
+      }
+      pValue = &elem;
+    }
+
+    if (!pValue) {
+      e->indent--;
+      if (pretty && !container.empty()) {
+        _writeIndent(e, e->indent);
+      }
+      *e->out << (isMap ? '}' : ']');
+      stack.pop_back();
+    }
+  }
+}
+
+
+// Size of the chunks written to a stream, a file or a callback function.
+static const size_t _flushSize = 1 << 16;
+
+
+OutputSink::OutputSink()
+  : pos(0)
+{
+}
+
+
+OutputSink::OutputSink(const FlushFunction& f, size_t bufferSize)
+  : buf(bufferSize, '\0'), pos(0), flushFunction(f)
 {
+}
+
+
+void OutputSink::flush() {
+  if (pos) {
+    flushFunction(buf.data(), pos);
+    pos = 0;
+  }
+}
+
+
+std::string OutputSink::take() {
+  buf.resize(pos);
+  pos = 0;
+  return std::move(buf);
+}
+
+
+void OutputSink::_makeRoom(size_t size) {
+  if (flushFunction) {
+    flush();
+  } else {
+    buf.resize(std::max(buf.size() * 2, std::max(pos + size, static_cast<size_t>(256))));
+  }
+}
+
+
+static void _marshalSink(const Value& v, const EncoderOptions& options, OutputSink *pSink) {
   Encoder e;
-  e.os = pStream;
+  e.out = pSink;
   e.opt = options;
   e.indent = 0;
+  e.depth = 0;
+  e.indentText = options.eol;
 
   if (e.opt.separator) {
     e.opt.quoteAlways = true;
   }
 
-  // Regex should not be UTF8 aware, just treat the chars as values.
-  e.loc = std::locale::classic();
+  _str(&e, v);
+}
+
+
+// Like _marshalSink(), but passes the output to the function write instead of
+// collecting it.
+static void _marshalCallback(const Value& v, const OutputSink::FlushFunction& write,
+  const EncoderOptions& options)
+{
+  EncoderStats *stats = options.stats;
+  StatsTimer timer(stats ? &stats->encodeSeconds : nullptr);
+
+#if !HJSON_NO_STATS
+  if (stats) {
+    OutputSink sink([&write, stats](const char *pCh, size_t size) {
+      StatsTimer writeTimer(&stats->writeSeconds);
+      stats->bytes += size;
+      write(pCh, size);
+    }, _flushSize);
+
+    _marshalSink(v, options, &sink);
+    sink.flush();
+    return;
+  }
+#endif
+
+  OutputSink sink(write, _flushSize);
+
+  _marshalSink(v, options, &sink);
+  sink.flush();
+}
 
-  std::string commonRange = R"(]|\xc2\xad|\xd8[\x80-\x84]|\xdc\x8f|\xe1\x9e[\xb4\xb5]|\xe2\x80[\x8c\x8f]|\xe2\x80[\xa8-\xaf]|\xe2\x81[\xa0-\xaf]|\xef\xbb\xbf|\xef\xbf[\xb0-\xbf])";
-  // needsEscape tests if the string can be written without escapes
-  e.needsEscape.imbue(e.loc);
-  e.needsEscape.assign(R"([\\\"\x00-\x1f)" + commonRange);
-  // needsQuotes tests if the string can be written as a quoteless string (includes needsEscape but without \\ and \")
-  e.needsQuotes.imbue(e.loc);
-  e.needsQuotes.assign(R"(^\s|^"|^'|^#|^/\*|^//|^\{|^\}|^\[|^\]|^:|^,|\s$|[\x00-\x1f)" + commonRange);
-  // needsEscapeML tests if the string can be written as a multiline string (like needsEscape but without \n, \r, \\, \", \t)
-  e.needsEscapeML.imbue(e.loc);
-  e.needsEscapeML.assign(R"('''|^[\s]+$|[\x00-\x08\x0b\x0c\x0e-\x1f)" + commonRange);
-  // starts with a keyword and optionally is followed by a comment
-  e.startsWithKeyword.imbue(e.loc);
-  e.startsWithKeyword.assign(R"(^(true|false|null)\s*((,|\]|\}|#|//|/\*).*)?$)");
-  e.needsEscapeName.imbue(e.loc);
-  e.needsEscapeName.assign(R"([,\{\[\}\]\s:#"']|//|/\*)");
-  e.lineBreak.assign(R"(\r|\n|\r\n)");
 
-  _str(&e, v, true, false);
+static void _marshalStream(const Value& v, const EncoderOptions& options,
+  std::ostream *pStream)
+{
+  _marshalCallback(v, [pStream](const char *pCh, size_t size) {
+    pStream->write(pCh, size);
+  }, options);
 }
 
 
@@ -538,11 +1338,15 @@ static void _marshalStream(const Value& v, const EncoderOptions& options,
 // an infinite recursion.
 //
 std::string Marshal(const Value& v, const EncoderOptions& options) {
-  std::ostringstream oss;
+  EncoderStats *stats = options.stats;
+  StatsTimer timer(stats ? &stats->encodeSeconds : nullptr);
+  OutputSink sink;
 
-  _marshalStream(v, options, &oss);
+  _marshalSink(v, options, &sink);
+  std::string ret = sink.take();
+  HJSON_STATS(stats, stats->bytes += ret.size());
 
-  return oss.str();
+  return ret;
 }
 
 
@@ -553,26 +1357,450 @@ void MarshalToFile(const Value& v, const std::string &path, const EncoderOptions
   }
   _marshalStream(v, options, &outputFile);
   outputFile << options.eol;
+  HJSON_STATS(options.stats, options.stats->bytes += options.eol.size());
   outputFile.close();
 }
 
 
-// MarshalJson returns the Json encoding of v using
-// default options + "bracesSameLine", "quoteAlways", "quoteKeys" and
-// "separator".
+void MarshalToCallback(const Value& v, const std::function<void(const char*, size_t)>& write,
+  const EncoderOptions& options)
+{
+  _marshalCallback(v, write, options);
+}
+
+
+// MarshalJson returns the Json encoding of v, the same text that Marshal
+// gives with default options + "bracesSameLine", "quoteAlways", "quoteKeys"
+// and "separator", and without comments. The Hjson specific parts of the
+// encoder are skipped.
 //
 // See Marshal.
 //
 std::string MarshalJson(const Value& v) {
-  EncoderOptions opt;
+  OutputSink sink;
+  Encoder e;
+  e.out = &sink;
+  e.indent = 0;
+  e.indentText = e.opt.eol;
+
+  _json(&e, v, true);
+
+  return sink.take();
+}
+
+
+// MarshalJsonCompact returns the Json encoding of v without any whitespace.
+//
+// See MarshalJson.
+//
+std::string MarshalJsonCompact(const Value& v) {
+  OutputSink sink;
+  Encoder e;
+  e.out = &sink;
+  e.indent = 0;
+
+  _json(&e, v, false);
+
+  return sink.take();
+}
+
+
+// A vector or map that EventEncoder is writing. Nothing is written for the
+// container until its first element arrives, since an empty container is
+// written differently.
+struct EventFrame {
+  bool isMap;
+  bool isRootObject;
+  bool isObjElement;
+  bool opened;
+  bool isFirst;
+};
+
+
+struct EventEncoder::Impl {
+  Encoder e;
+  OutputSink sink;
+  std::vector<EventFrame> stack;
+
+  // Writes the opening brace of the container in f, if not already done.
+  void open(EventFrame *f) {
+    if (f->opened) {
+      return;
+    }
+    f->opened = true;
+
+    if (!f->isMap || !e.opt.omitRootBraces || !f->isRootObject) {
+      if (f->isObjElement && !e.opt.bracesSameLine) {
+        _writeIndent(&e, e.indent);
+      } else if (f->isObjElement) {
+        *e.out << " ";
+      }
+      *e.out << (f->isMap ? "{" : "[");
+      e.indent++;
+    }
+  }
+
+  // Writes what comes before a value, returns the frame of the container that
+  // it is an element of (or null for the root value).
+  EventFrame *beginValue() {
+    if (stack.empty()) {
+      return nullptr;
+    }
+
+    EventFrame *f = &stack.back();
+    if (!f->isMap) {
+      open(f);
+      if (!f->isFirst && e.opt.separator) {
+        *e.out << ",";
+      }
+      f->isFirst = false;
+      _writeIndent(&e, e.indent);
+    }
+
+    return f;
+  }
+
+  void startContainer(bool isMap) {
+    EventFrame *parent = beginValue();
+    EventFrame f = {isMap, !parent, parent && parent->isMap, false, true};
+    e.depth++;
+    stack.push_back(f);
+  }
+
+  void endContainer() {
+    const EventFrame& f = stack.back();
+
+    if (!f.opened) {
+      *e.out << (f.isObjElement ? " " : "") << (f.isMap ? "{}" : "[]");
+    } else if (!f.isMap || !e.opt.omitRootBraces || !f.isRootObject) {
+      _writeIndent(&e, e.indent - 1);
+      e.indent--;
+      *e.out << (f.isMap ? "}" : "]");
+    }
+
+    e.depth--;
+    stack.pop_back();
+  }
+};
+
+
+EventEncoder::EventEncoder(const EncoderOptions& options)
+  : impl(new Impl)
+{
+  Encoder& e = impl->e;
+  e.out = &impl->sink;
+  e.opt = options;
+  e.opt.comments = false;
+  e.opt.stats = nullptr;
+  e.indent = 0;
+  e.depth = 0;
+  e.indentText = options.eol;
+
+  if (e.opt.separator) {
+    e.opt.quoteAlways = true;
+  }
+}
+
+
+EventEncoder::~EventEncoder() {
+}
 
-  opt.bracesSameLine = true;
-  opt.quoteAlways = true;
-  opt.quoteKeys = true;
-  opt.separator = true;
-  opt.comments = false;
 
-  return Marshal(v, opt);
+void EventEncoder::start_object() {
+  impl->startContainer(true);
+}
+
+
+void EventEncoder::end_object() {
+  impl->endContainer();
+}
+
+
+void EventEncoder::start_array() {
+  impl->startContainer(false);
+}
+
+
+void EventEncoder::end_array() {
+  impl->endContainer();
+}
+
+
+void EventEncoder::key(const StringView& name) {
+  Encoder *e = &impl->e;
+  EventFrame *f = &impl->stack.back();
+
+  impl->open(f);
+  if (!f->isFirst) {
+    if (e->opt.separator) {
+      *e->out << ",";
+    }
+    _writeIndent(e, e->indent);
+  } else if (!e->opt.omitRootBraces || !f->isRootObject) {
+    _writeIndent(e, e->indent);
+  }
+  f->isFirst = false;
+
+  _quoteName(e, name);
+  *e->out << ":";
+}
+
+
+void EventEncoder::string(const StringView& str) {
+  EventFrame *parent = impl->beginValue();
+  _quote(&impl->e, str, (parent && parent->isMap ? " " : ""), !parent, false);
+}
+
+
+void EventEncoder::scalar(const Value& val) {
+  EventFrame *parent = impl->beginValue();
+  _beginValue(&impl->e, val, !parent, parent && parent->isMap);
+}
+
+
+// A vector or map that EventEncoder::value() is writing.
+struct ValueFrame {
+  const Value *value;
+  // The next element, by index (for a vector, or for a map in insertion
+  // order) or by iterator (for a map in key order).
+  size_t index;
+  std::map<std::string, Value>::const_iterator it;
+};
+
+
+void EventEncoder::value(const Value& val) {
+  std::vector<ValueFrame> stack;
+  bool inOrder = impl->e.opt.preserveInsertionOrder;
+  const Value *pNext = &val;
+
+  for (;;) {
+    if (pNext) {
+      switch (pNext->type()) {
+      case Type::Vector:
+      case Type::Map:
+        {
+          ValueFrame f = {pNext, 0, pNext->begin()};
+          stack.push_back(f);
+        }
+        if (pNext->type() == Type::Vector) {
+          start_array();
+        } else {
+          start_object();
+        }
+        break;
+      case Type::String:
+        string(pNext->as_string_view());
+        break;
+      default:
+        scalar(*pNext);
+        break;
+      }
+    }
+
+    if (stack.empty()) {
+      return;
+    }
+
+    ValueFrame& f = stack.back();
+    const Value& container = *f.value;
+    pNext = nullptr;
+
+    if (container.type() == Type::Vector) {
+      while (!pNext && f.index < container.size()) {
+        const Value& elem = container[static_cast<int>(f.index++)];
+        if (elem.defined()) {
+          pNext = &elem;
+        }
+      }
+    } else {
+      while (!pNext && (inOrder ? f.index < container.size() : f.it != container.end())) {
+        const std::string *pKey;
+        const Value *pElem;
+        if (inOrder) {
+          pKey = &ValueAccess::key(container, f.index);
+          pElem = &ValueAccess::element(container, f.index);
+          ++f.index;
+        } else {
+          pKey = &f.it->first;
+          pElem = &f.it->second;
+          ++f.it;
+        }
+        if (pElem->defined()) {
+          key(*pKey);
+          pNext = pElem;
+        }
+      }
+    }
+
+    if (!pNext) {
+      if (container.type() == Type::Vector) {
+        end_array();
+      } else {
+        end_object();
+      }
+      stack.pop_back();
+    }
+  }
+}
+
+
+std::string EventEncoder::take() {
+  return impl->sink.take();
+}
+
+
+static void _binaryVarint(std::string *pOut, std::uint64_t n) {
+  while (n >= 0x80) {
+    pOut->push_back(static_cast<char>((n & 0x7f) | 0x80));
+    n >>= 7;
+  }
+  pOut->push_back(static_cast<char>(n));
+}
+
+
+static void _binaryString(std::string *pOut, const char *pCh, size_t size) {
+  _binaryVarint(pOut, size);
+  pOut->append(pCh, size);
+}
+
+
+// Writes the tag, the comments and the payload of value, but not the
+// elements of a vector or map.
+static void _binaryValue(std::string *pOut, const Value& value, bool comments,
+  EncoderStats *stats)
+{
+  Type type = value.type();
+  unsigned char tag = static_cast<unsigned char>(type);
+  CommentRef commentList[4];
+  unsigned char mask = 0;
+
+  if (comments) {
+    for (int k = ValueAccess::CommentBefore; k <= ValueAccess::CommentAfter; ++k) {
+      commentList[k] = _comment(value, static_cast<ValueAccess::CommentKind>(k));
+      if (!commentList[k].empty()) {
+        mask |= (1 << k);
+      }
+    }
+    if (mask) {
+      tag |= binaryHasComments;
+    }
+  }
+  if (type == Type::Bool && static_cast<bool>(value)) {
+    tag |= binaryTrue;
+  }
+
+  pOut->push_back(static_cast<char>(tag));
+
+  if (mask) {
+    pOut->push_back(static_cast<char>(mask));
+    for (int k = ValueAccess::CommentBefore; k <= ValueAccess::CommentAfter; ++k) {
+      if (mask & (1 << k)) {
+        HJSON_STATS(stats, stats->commentBytes += commentList[k].size);
+        _binaryString(pOut, commentList[k].pCh, commentList[k].size);
+      }
+    }
+  }
+
+  switch (type) {
+  case Type::Double:
+    {
+      double d = static_cast<double>(value);
+      std::uint64_t bits;
+      std::memcpy(&bits, &d, sizeof(bits));
+      for (int a = 0; a < 8; ++a) {
+        pOut->push_back(static_cast<char>(bits >> (8 * a)));
+      }
+    }
+    break;
+
+  case Type::Int64:
+    {
+      std::uint64_t n = static_cast<std::uint64_t>(value.to_int64());
+      // Zigzag encoding, so that small negative numbers are short too.
+      _binaryVarint(pOut, (n << 1) ^ (0 - (n >> 63)));
+    }
+    break;
+
+  case Type::String:
+    {
+      StringView str = value.as_string_view();
+      HJSON_STATS(stats, stats->stringBytesCopied += str.size());
+      _binaryString(pOut, str.data(), str.size());
+    }
+    break;
+
+  case Type::Vector:
+  case Type::Map:
+    _binaryVarint(pOut, value.size());
+    break;
+
+  default:
+    break;
+  }
+}
+
+
+// MarshalBinary returns the binary encoding of v, see UnmarshalBinary. Of the
+// options only "comments" and "stats" are used. Like _str(), nested vectors
+// and maps are kept in an explicit stack.
+//
+std::string MarshalBinary(const Value& v, const EncoderOptions& options) {
+  EncoderStats *stats = options.stats;
+  StatsTimer timer(stats ? &stats->encodeSeconds : nullptr);
+  // The containers being written, and the index of their next element.
+  std::vector<std::pair<const Value*, size_t>> stack;
+  const Value *pValue = &v;
+  std::string ret("HJB");
+
+  ret.push_back(static_cast<char>(binaryVersion));
+
+  for (;;) {
+    if (pValue) {
+      HJSON_STATS(stats, ++stats->nodes[static_cast<int>(pValue->type())]);
+      _binaryValue(&ret, *pValue, options.comments, stats);
+      if (pValue->is_container()) {
+        HJSON_STATS(stats, stats->maxDepth = std::max(stats->maxDepth,
+          static_cast<int>(stack.size()) + 1));
+        stack.push_back(std::make_pair(pValue, size_t(0)));
+      }
+    }
+
+    // Go up until a container with elements left is found.
+    while (!stack.empty() && stack.back().second == stack.back().first->size()) {
+      stack.pop_back();
+    }
+    if (stack.empty()) {
+      break;
+    }
+
+    const Value& container = *stack.back().first;
+    size_t index = stack.back().second++;
+    if (container.type() == Type::Map) {
+      const std::string& key = ValueAccess::key(container, index);
+      _binaryString(&ret, key.data(), key.size());
+      pValue = &ValueAccess::element(container, index);
+    } else {
+      pValue = &container[static_cast<int>(index)];
+    }
+  }
+
+  HJSON_STATS(stats, stats->bytes += ret.size());
+
+  return ret;
+}
+
+
+void MarshalBinaryToFile(const Value& v, const std::string& path,
+  const EncoderOptions& options)
+{
+  std::ofstream outputFile(path, std::ofstream::binary);
+  if (!outputFile.is_open()) {
+    throw file_error("Could not open file '" + path + "' for writing");
+  }
+  std::string data = MarshalBinary(v, options);
+  StatsTimer writeTimer(options.stats ? &options.stats->writeSeconds : nullptr);
+  outputFile.write(data.data(), data.size());
+  outputFile.close();
 }
 
 
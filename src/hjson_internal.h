@@ -0,0 +1,242 @@
+#ifndef HJSON_INTERNAL_QMZBXNCVALSKDJFH
+#define HJSON_INTERNAL_QMZBXNCVALSKDJFH
+
+#include "hjson.h"
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#if !HJSON_NO_STATS
+# include <chrono>
+#endif
+#if defined(_MSC_VER) && defined(_M_X64)
+# include <intrin.h>
+#endif
+
+
+// Interface between the source files of the Hjson library. Not part of the
+// public API.
+namespace Hjson {
+
+
+// FNV-1a hash of [pCh, pCh + size).
+inline std::uint64_t hashBytes(const char *pCh, size_t size) {
+  std::uint64_t h = 0xcbf29ce484222325ULL;
+
+  for (size_t a = 0; a < size; ++a) {
+    h = (h ^ static_cast<unsigned char>(pCh[a])) * 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+
+// Gives the decoder and the encoder access to the internals of Value.
+class ValueAccess {
+public:
+  enum CommentKind {
+    CommentBefore,
+    CommentKey,
+    CommentInside,
+    CommentAfter
+  };
+
+  // Sets the comment to the span [pCh, pCh + size), a part of the memory kept
+  // alive by owner. The text is not copied until the comment is changed.
+  static void setComment(Value&, CommentKind, const std::shared_ptr<const void>& owner,
+    const char *pCh, size_t size);
+  // Like setComment, but appends the span to the existing comment.
+  static void appendComment(Value&, CommentKind, const std::shared_ptr<const void>& owner,
+    const char *pCh, size_t size);
+  // Like setComment (or appendComment if `append` is true), but copies the
+  // text.
+  static void copyComment(Value&, CommentKind, const char *pCh, size_t size, bool append);
+  // Appends the comment `from` to the comment `to`, then clears `from`.
+  static void moveComment(Value&, CommentKind from, CommentKind to);
+  // Returns a pointer to the comment text (not null-terminated) and stores its
+  // size in *pSize. The pointer is valid until the comment or the Value is
+  // changed.
+  static const char *getComment(const Value&, CommentKind, size_t *pSize);
+  // Returns a String Value that refers to [pCh, pCh + size) instead of
+  // holding a copy, see DecoderOptions::stringViews. Owner may be null if the
+  // caller keeps the memory alive.
+  static Value stringView(const std::shared_ptr<const void>& owner, const char *pCh,
+    size_t size);
+  // Return the key and the Value at index in insertion order, without the
+  // bounds and type checks of Value::key(int) and Value::operator[](int). The
+  // key is not copied.
+  static const std::string& key(const Value& map, size_t index);
+  static const Value& element(const Value& map, size_t index);
+  // Returns the element with the key, or null if the map has no such key.
+  static const Value *find(const Value& map, const std::string& key);
+  // Adds an element to the end of the map. The key must not already be in the
+  // map.
+  static void append(Value& map, const std::string& key, Value&& val);
+};
+
+
+// Collects the output of the encoder in a contiguous buffer. If a flush
+// function is given, the buffer is passed to it and then emptied each time
+// it is full, and when flush() is called. Otherwise the buffer grows until
+// the text is taken out with take().
+class OutputSink {
+public:
+  typedef std::function<void(const char*, size_t)> FlushFunction;
+
+  OutputSink();
+  OutputSink(const FlushFunction&, size_t bufferSize);
+
+  void write(const char *pCh, size_t size) {
+    if (size > buf.size() - pos) {
+      _makeRoom(size);
+      if (size > buf.size() - pos) {
+        // Bigger than the whole buffer, pass it on directly.
+        flushFunction(pCh, size);
+        return;
+      }
+    }
+    std::memcpy(&buf[pos], pCh, size);
+    pos += size;
+  }
+
+  OutputSink& operator <<(char c) {
+    if (pos == buf.size()) {
+      _makeRoom(1);
+    }
+    buf[pos++] = c;
+    return *this;
+  }
+
+  OutputSink& operator <<(const char *sz) {
+    write(sz, std::strlen(sz));
+    return *this;
+  }
+
+  OutputSink& operator <<(const std::string& str) {
+    write(str.data(), str.size());
+    return *this;
+  }
+
+  // Passes the buffered text to the flush function.
+  void flush();
+  // Returns the collected text and leaves the sink empty. Only for a sink
+  // without flush function.
+  std::string take();
+
+private:
+  std::string buf;
+  size_t pos;
+  FlushFunction flushFunction;
+
+  void _makeRoom(size_t size);
+};
+
+
+// Constants of the binary format written by MarshalBinary() and read by
+// UnmarshalBinary(). The data starts with the bytes 'H', 'J', 'B' and
+// binaryVersion, followed by the root value. A value starts with a tag byte
+// that holds its Type in the bits of binaryTypeMask, and the flags below. If
+// binaryHasComments is set, the tag is followed by a byte with bit k set for
+// each ValueAccess::CommentKind k that the value has, and then by those
+// comments as strings. Then follows nothing (for Undefined, Null and Bool), 8
+// bytes (for Double, little-endian IEEE 754), a varint (for Int64, zigzag
+// encoded), a string (for String), or a varint count followed by the elements
+// (for Vector, and for Map where each element is a key string followed by the
+// value). A varint is an unsigned LEB128 number, a string is a varint length
+// followed by the bytes.
+enum {
+  binaryVersion = 1,
+  binaryTypeMask = 0x07,
+  binaryHasComments = 0x08,
+  // For a Bool, the value is true.
+  binaryTrue = 0x10
+};
+
+
+// HJSON_STATS(stats, stmt) runs the statement stmt if stats (a DecoderStats or
+// EncoderStats pointer) is not null. Only stats is compiled if the library is
+// built without stats, so that variables that only hold it count as used.
+#if HJSON_NO_STATS
+# define HJSON_STATS(stats, stmt) do { (void) (stats); } while (0)
+#else
+# define HJSON_STATS(stats, stmt) do { if (stats) { stmt; } } while (0)
+#endif
+
+
+// Adds the time from construction to destruction to *pSeconds, unless
+// pSeconds is null.
+class StatsTimer {
+public:
+#if HJSON_NO_STATS
+  explicit StatsTimer(double*) {}
+#else
+  explicit StatsTimer(double *_pSeconds)
+    : pSeconds(_pSeconds)
+  {
+    if (pSeconds) {
+      start = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~StatsTimer() {
+    if (pSeconds) {
+      *pSeconds += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    }
+  }
+
+private:
+  double *pSeconds;
+  std::chrono::steady_clock::time_point start;
+#endif
+
+  StatsTimer(const StatsTimer&) = delete;
+  StatsTimer& operator =(const StatsTimer&) = delete;
+};
+
+
+// Makes all Values created on this thread during the lifetime of this object
+// count their allocations in *pCount (if not null).
+class AllocationCounter {
+public:
+  std::uint64_t *prev;
+
+  explicit AllocationCounter(std::uint64_t *pCount);
+  ~AllocationCounter();
+};
+
+
+// Writes the shortest text that is decoded to exactly d (which must be
+// finite) to buf, returns the number of chars written. Not null-terminated.
+// The text always contains a decimal point or an exponent, so that it is
+// decoded as a Double. buf must have room for at least 32 chars.
+size_t formatDouble(double d, char *buf);
+// Like formatDouble, for an Int64.
+size_t formatInt64(std::int64_t i, char *buf);
+
+
+// Stores the 128-bit product of a and b in *pHigh and *pLow.
+inline void multiply128(std::uint64_t a, std::uint64_t b, std::uint64_t *pHigh,
+  std::uint64_t *pLow)
+{
+#if defined(__SIZEOF_INT128__)
+  __extension__ typedef unsigned __int128 uint128;
+  uint128 res = static_cast<uint128>(a) * b;
+  *pHigh = static_cast<std::uint64_t>(res >> 64);
+  *pLow = static_cast<std::uint64_t>(res);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  *pLow = _umul128(a, b, pHigh);
+#else
+  std::uint64_t aLow = a & 0xffffffff, aHigh = a >> 32;
+  std::uint64_t bLow = b & 0xffffffff, bHigh = b >> 32;
+  std::uint64_t ll = aLow * bLow, lh = aLow * bHigh, hl = aHigh * bLow;
+  std::uint64_t mid = (ll >> 32) + (lh & 0xffffffff) + (hl & 0xffffffff);
+  *pHigh = aHigh * bHigh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+  *pLow = (mid << 32) | (ll & 0xffffffff);
+#endif
+}
+
+
+}
+
+
+#endif
@@ -1,15 +1,16 @@
-#include "hjson.h"
+#include "hjson_internal.h"
 #include <vector>
+#include <atomic>
 #include <assert.h>
 #include <cstring>
 #include <algorithm>
+#include <cstdint>
+#include <cmath>
 #if HJSON_USE_CHARCONV
 # include <charconv>
-# include <array>
 #elif HJSON_USE_STRTOD
 # include <cstdlib>
 # include <cerrno>
-# include <cstdio>
 #else
 # include <sstream>
 #endif
@@ -18,93 +19,411 @@
 namespace Hjson {
 
 
-typedef std::vector<std::string> KeyVec;
-typedef std::vector<Value> ValueVec;
+// Allocates from an Arena, or from the heap if the Arena pointer is null.
+// Memory allocated from an Arena is never given back, it is released together
+// with the Arena.
+template<typename T>
+class ArenaAllocator {
+public:
+  typedef T value_type;
+
+  Arena *arena;
+
+  ArenaAllocator(Arena *_arena = nullptr) noexcept
+    : arena(_arena)
+  {
+  }
+
+  template<typename U>
+  ArenaAllocator(const ArenaAllocator<U>& other) noexcept
+    : arena(other.arena)
+  {
+  }
+
+  T *allocate(std::size_t n) {
+    if (arena) {
+      return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, std::size_t) noexcept {
+    if (!arena) {
+      ::operator delete(p);
+    }
+  }
+
+  // A copy of a container is placed on the heap, so that it can outlive the
+  // Arena.
+  ArenaAllocator select_on_container_copy_construction() const {
+    return ArenaAllocator();
+  }
+};
+
+
+template<typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+  return a.arena == b.arena;
+}
+
+
+template<typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+  return a.arena != b.arena;
+}
+
+
+typedef std::vector<Value, ArenaAllocator<Value>> ValueVec;
 typedef std::map<std::string, Value> ValueMap;
+typedef std::vector<ValueMap::iterator, ArenaAllocator<ValueMap::iterator>> KeyVec;
 
 
+// The map owns the elements and gives the alphabetical iteration order. The
+// vector holds an iterator to each map node in insertion order, so that
+// access by index is done without any key lookup.
 class ValueVecMap {
 public:
   KeyVec v;
   ValueMap m;
+
+  explicit ValueVecMap(Arena *arena)
+    : v(KeyVec::allocator_type(arena))
+  {
+  }
+};
+
+
+// A string value that is a part of memory kept alive by owner (or by the
+// caller, if owner is null), see DecoderOptions::stringViews.
+class StringRef {
+public:
+  std::shared_ptr<const void> owner;
+  const char *pCh;
+  size_t size;
+  // A null-terminated copy of the string, created by the first call to
+  // c_str().
+  mutable std::atomic<std::string*> cstr;
+
+  StringRef(const std::shared_ptr<const void>& owner, const char *pCh, size_t size);
+  StringRef(const StringRef&);
+  ~StringRef();
+
+  // Safe to call from several threads at the same time.
+  const char *c_str() const;
 };
 
 
+// The Arena that new Values are allocated from, if any. Only set by the
+// decoder for the duration of an unmarshal call.
+static thread_local Arena *_currentArena = nullptr;
+
+
+// Sets the Arena that new Values on this thread are allocated from, returns
+// the previous one.
+Arena *swapCurrentArena(Arena *arena) {
+  Arena *prev = _currentArena;
+  _currentArena = arena;
+  return prev;
+}
+
+
+#if !HJSON_NO_STATS
+// Counts the allocations of new Values, if not null. Only set (by
+// AllocationCounter) for the duration of an unmarshal call with stats.
+static thread_local std::uint64_t *_allocationCount = nullptr;
+#endif
+
+
+AllocationCounter::AllocationCounter(std::uint64_t *pCount) {
+#if !HJSON_NO_STATS
+  prev = _allocationCount;
+  _allocationCount = pCount;
+#else
+  (void) pCount;
+  prev = nullptr;
+#endif
+}
+
+
+AllocationCounter::~AllocationCounter() {
+#if !HJSON_NO_STATS
+  _allocationCount = prev;
+#endif
+}
+
+
+static inline void _countAllocation() {
+#if !HJSON_NO_STATS
+  if (_allocationCount) {
+    ++*_allocationCount;
+  }
+#endif
+}
+
+
+template<typename T, typename... Args>
+static T *_construct(Arena *arena, Args&&... args) {
+  _countAllocation();
+  if (arena) {
+    return new(arena->allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+  }
+  return new T(std::forward<Args>(args)...);
+}
+
+
+template<typename T>
+static void _destroy(T *p, bool inArena) {
+  if (inArena) {
+    p->~T();
+  } else {
+    delete p;
+  }
+}
+
+
 class Value::ValueImpl {
 public:
   Type type;
+  // True if this object was allocated from an Arena.
+  bool inArena;
+  // True if the string or container pointed to by s, sr, v or m was
+  // allocated from an Arena.
+  bool dataInArena;
+  // True if the String is stored in sr instead of s.
+  bool isView;
+  // True if this object (and everything it contains) must not be changed
+  // anymore, see Value::freeze().
+  bool frozen;
+  // Only set if frozen: true if this object or anything it contains was
+  // allocated from an Arena.
+  bool arenaInside;
+  // Only set if frozen: the structural hash of the Value, see Value::hash().
+  // Fits in the padding before the union.
+  std::uint32_t hash;
   union {
     bool b;
     double d;
     std::int64_t i;
     std::string *s;
+    StringRef *sr;
     ValueVec *v;
     ValueVecMap *m;
   };
 
   ValueImpl();
-  ValueImpl(bool);
-  ValueImpl(double);
-  explicit ValueImpl(std::int64_t);
-  ValueImpl(const std::string&);
-  ValueImpl(Type);
+  ValueImpl(bool, Arena *arena = nullptr);
+  ValueImpl(double, Arena *arena = nullptr);
+  explicit ValueImpl(std::int64_t, Arena *arena = nullptr);
+  ValueImpl(const std::string&, Arena *arena = nullptr);
+  ValueImpl(const StringRef&, Arena *arena = nullptr);
+  ValueImpl(Type, Arena *arena = nullptr);
   ~ValueImpl();
+
+  // The following three functions are only for Type::String.
+  StringView view() const;
+  const char *c_str() const;
+  // Copies the string if it is a view or if other Values share it, returns
+  // the string for modification.
+  static std::string *ownString(ImplRef& prv);
+
+  // Stores a Null, Bool, Double or Int64 in the ImplRef itself. Other types
+  // are allocated from the current Arena, if any.
+  static ImplRef create(bool input) {
+    return _local(input);
+  }
+  static ImplRef create(double input) {
+    return _local(input);
+  }
+  static ImplRef create(std::int64_t input) {
+    return _local(input);
+  }
+  static ImplRef create(Type type) {
+    return (type == Type::Null ? _local(type) : _shared(type));
+  }
+  template<typename T>
+  static ImplRef create(const T& input) {
+    return _shared(input);
+  }
+
+  // Returns a copy of this object that is not frozen. The elements of a
+  // container are not copied, the copy refers to the same elements.
+  ImplRef thawedCopy() const;
+  // Only for Type::Vector and Type::Map. Moves the ImplRef of each element
+  // that is a Vector or Map not shared with anything else to the end of stack.
+  void takeUniqueContainers(std::vector<ImplRef>& stack);
+
+  // Called first by each function that changes a Value.
+  static void thaw(ImplRef& prv) {
+    if (prv->frozen) {
+      prv = prv->thawedCopy();
+    }
+  }
+
+  // Turns the Undefined Value into an empty Vector or Map (of the type
+  // `type`), or throws type_mismatch if it is of any other type than Undefined
+  // or `type`. The object is recreated in the same memory block, so that all
+  // Values that share the Undefined object see the change.
+  static void makeContainer(ImplRef& prv, Type type) {
+    if (prv->type == Type::Undefined) {
+      thaw(prv);
+      bool inArena = prv->inArena;
+      prv->~ValueImpl();
+      new(&(*prv)) ValueImpl(type);
+      prv->inArena = inArena;
+    } else if (prv->type != type) {
+      throw type_mismatch(type == Type::Map ?
+        "Must be of type Undefined or Map for that operation." :
+        "Must be of type Undefined or Vector for that operation.");
+    }
+  }
+
+private:
+  template<typename T>
+  static ImplRef _local(const T& input);
+  template<typename T>
+  static ImplRef _shared(const T& input);
 };
 
 
 class Value::Comments {
 public:
-  std::string m_commentBefore, m_commentKey, m_commentInside, m_commentAfter;
+  // A comment from the decoder is a span of the decoder input until it is
+  // changed, all other comments are strings of their own.
+  class Comment {
+  public:
+    const char *pSpan;
+    size_t spanSize;
+    std::string text;
+
+    Comment();
+    const char *data() const;
+    size_t size() const;
+  };
+
+  // Keeps the memory of all spans alive.
+  std::shared_ptr<const void> owner;
+  Comment c[4];
+  // True if these comments belong to an element of a frozen tree, and
+  // therefore must be copied before they are changed.
+  bool frozen = false;
+
+  std::string get(ValueAccess::CommentKind) const;
+  void set(ValueAccess::CommentKind, const std::string&);
+  void setSpan(ValueAccess::CommentKind, const std::shared_ptr<const void>& owner,
+    const char *pCh, size_t size);
+  void append(ValueAccess::CommentKind, const std::shared_ptr<const void>& owner,
+    const char *pCh, size_t size);
+
+  // Allocates the new object from the current Arena, if any. A copy is never
+  // frozen.
+  static std::shared_ptr<Comments> create();
+  static std::shared_ptr<Comments> create(const Comments&);
+
+  // Called first by each function that changes the comments of a Value.
+  static void thaw(std::shared_ptr<Comments>& cm) {
+    if (cm && cm->frozen) {
+      cm = create(*cm);
+    }
+  }
 };
 
 
 Value::ValueImpl::ValueImpl()
-  : type(Type::Undefined)
+  : type(Type::Undefined),
+  inArena(false),
+  dataInArena(false),
+  isView(false),
+  frozen(false),
+  arenaInside(false),
+  hash(0)
 {
 }
 
 
-Value::ValueImpl::ValueImpl(bool input)
+Value::ValueImpl::ValueImpl(bool input, Arena*)
   : type(Type::Bool),
+  inArena(false),
+  dataInArena(false),
+  isView(false),
+  frozen(false),
+  arenaInside(false),
+  hash(0),
   b(input)
 {
 }
 
 
-Value::ValueImpl::ValueImpl(double input)
+Value::ValueImpl::ValueImpl(double input, Arena*)
   : type(Type::Double),
+  inArena(false),
+  dataInArena(false),
+  isView(false),
+  frozen(false),
+  arenaInside(false),
+  hash(0),
   d(input)
 {
 }
 
 
-Value::ValueImpl::ValueImpl(std::int64_t input)
+Value::ValueImpl::ValueImpl(std::int64_t input, Arena*)
   : type(Type::Int64),
+  inArena(false),
+  dataInArena(false),
+  isView(false),
+  frozen(false),
+  arenaInside(false),
+  hash(0),
   i(input)
 {
 }
 
 
-Value::ValueImpl::ValueImpl(const std::string &input)
+Value::ValueImpl::ValueImpl(const std::string &input, Arena *arena)
   : type(Type::String),
-  s(new std::string(input))
+  inArena(false),
+  dataInArena(arena != nullptr),
+  isView(false),
+  frozen(false),
+  arenaInside(false),
+  hash(0),
+  s(_construct<std::string>(arena, input))
 {
 }
 
 
-Value::ValueImpl::ValueImpl(Type _type)
-  : type(_type)
+Value::ValueImpl::ValueImpl(const StringRef &input, Arena *arena)
+  : type(Type::String),
+  inArena(false),
+  dataInArena(arena != nullptr),
+  isView(true),
+  frozen(false),
+  arenaInside(false),
+  hash(0),
+  sr(_construct<StringRef>(arena, input))
+{
+}
+
+
+Value::ValueImpl::ValueImpl(Type _type, Arena *arena)
+  : type(_type),
+  inArena(false),
+  dataInArena(arena != nullptr),
+  isView(false),
+  frozen(false),
+  arenaInside(false),
+  hash(0)
 {
   switch (_type)
   {
   case Type::String:
-    s = new std::string();
+    s = _construct<std::string>(arena);
     break;
   case Type::Vector:
-    v = new ValueVec();
+    v = _construct<ValueVec>(arena, ValueVec::allocator_type(arena));
     break;
   case Type::Map:
-    m = new ValueVecMap();
+    m = _construct<ValueVecMap>(arena, arena);
     break;
   default:
     break;
@@ -116,13 +435,32 @@ Value::ValueImpl::~ValueImpl() {
   switch (type)
   {
   case Type::String:
-    delete s;
+    if (isView) {
+      _destroy(sr, dataInArena);
+    } else {
+      _destroy(s, dataInArena);
+    }
     break;
   case Type::Vector:
-    delete v;
-    break;
   case Type::Map:
-    delete m;
+    {
+      // Destroying the elements one at a time from a stack instead of letting
+      // each container destroy its own elements means that a deep tree is not
+      // destroyed by recursive calls. The containers on the stack have no
+      // unique container elements left when they are destroyed.
+      std::vector<ImplRef> stack;
+      takeUniqueContainers(stack);
+      while (!stack.empty()) {
+        ImplRef next(std::move(stack.back()));
+        stack.pop_back();
+        next->takeUniqueContainers(stack);
+      }
+    }
+    if (type == Type::Vector) {
+      _destroy(v, dataInArena);
+    } else {
+      _destroy(m, dataInArena);
+    }
     break;
   default:
     break;
@@ -130,115 +468,756 @@ Value::ValueImpl::~ValueImpl() {
 }
 
 
+StringView Value::ValueImpl::view() const {
+  if (isView) {
+    return StringView(sr->pCh, sr->size);
+  }
+
+  return StringView(s->data(), s->size());
+}
+
+
+const char *Value::ValueImpl::c_str() const {
+  return isView ? sr->c_str() : s->c_str();
+}
+
+
+std::string *Value::ValueImpl::ownString(ImplRef& prv) {
+  if (prv.sp.use_count() > 1) {
+    // Like the scalars that are stored in the ImplRef, a String is not
+    // changed through the other Values.
+    prv = _shared(std::string(prv->view()));
+  } else if (prv->isView) {
+    std::string *str = new std::string(prv->sr->pCh, prv->sr->size);
+    _destroy(prv->sr, prv->dataInArena);
+    prv->s = str;
+    prv->isView = false;
+    prv->dataInArena = false;
+  }
+
+  return prv->s;
+}
+
+
+template<typename T>
+Value::ImplRef Value::ValueImpl::_local(const T& input) {
+  static_assert(sizeof(ValueImpl) <= sizeof(ImplRef::local) &&
+    alignof(ValueImpl) <= 8, "ImplRef::local is too small for a ValueImpl");
+
+  ImplRef ret;
+  ret._release();
+  ret.p = new(ret.local) ValueImpl(input);
+
+  return ret;
+}
+
+
+template<typename T>
+Value::ImplRef Value::ValueImpl::_shared(const T& input) {
+  _countAllocation();
+  if (_currentArena) {
+    auto ret = std::allocate_shared<ValueImpl>(
+      ArenaAllocator<ValueImpl>(_currentArena), input, _currentArena);
+    ret->inArena = true;
+    return ret;
+  }
+
+  return std::make_shared<ValueImpl>(input);
+}
+
+
+Value::ImplRef::ImplRef()
+  : p(nullptr),
+  sp()
+{
+}
+
+
+Value::ImplRef::ImplRef(std::shared_ptr<ValueImpl> _sp)
+  : p(_sp.get()),
+  sp(std::move(_sp))
+{
+}
+
+
+Value::ImplRef::ImplRef(const ImplRef& other) {
+  _copyFrom(other);
+}
+
+
+Value::ImplRef::ImplRef(ImplRef&& other) {
+  _moveFrom(other);
+}
+
+
+Value::ImplRef::~ImplRef() {
+  _release();
+}
+
+
+Value::ImplRef& Value::ImplRef::operator=(const ImplRef& other) {
+  if (this != &other) {
+    // other can be an element of the tree that is released by _release(), so
+    // it must be copied first.
+    ImplRef tmp(other);
+    _release();
+    _moveFrom(tmp);
+  }
+
+  return *this;
+}
+
+
+Value::ImplRef& Value::ImplRef::operator=(ImplRef&& other) {
+  if (this != &other) {
+    ImplRef tmp(std::move(other));
+    _release();
+    _moveFrom(tmp);
+  }
+
+  return *this;
+}
+
+
+bool Value::ImplRef::operator==(const ImplRef& other) const {
+  if (p == other.p) {
+    return true;
+  }
+  if (!_isLocal() || !other._isLocal() || p->type != other.p->type ||
+    p->frozen != other.p->frozen)
+  {
+    return false;
+  }
+
+  switch (p->type) {
+  case Type::Bool:
+    return p->b == other.p->b;
+  case Type::Double:
+    return !std::memcmp(&p->d, &other.p->d, sizeof(p->d));
+  case Type::Int64:
+    return p->i == other.p->i;
+  default:
+    return true;
+  }
+}
+
+
+void Value::ImplRef::_copyFrom(const ImplRef& other) {
+  if (other._isLocal()) {
+    p = new(local) ValueImpl(*other.p);
+  } else {
+    new(&sp) std::shared_ptr<ValueImpl>(other.sp);
+    p = other.p;
+  }
+}
+
+
+void Value::ImplRef::_moveFrom(ImplRef& other) {
+  if (other._isLocal()) {
+    p = new(local) ValueImpl(*other.p);
+  } else {
+    new(&sp) std::shared_ptr<ValueImpl>(std::move(other.sp));
+    p = other.p;
+    other.p = nullptr;
+  }
+}
+
+
+void Value::ImplRef::_release() {
+  if (_isLocal()) {
+    // Only scalars are stored locally, nothing to free. p is local here, which
+    // the compiler can see is not null.
+    reinterpret_cast<ValueImpl*>(local)->~ValueImpl();
+  } else {
+    sp.~shared_ptr();
+  }
+}
+
+
+void Value::ValueImpl::takeUniqueContainers(std::vector<ImplRef>& stack) {
+  auto take = [&stack](Value& elem) {
+    if (!elem.prv._isLocal() && elem.prv.sp.use_count() == 1 &&
+      (elem.prv->type == Type::Vector || elem.prv->type == Type::Map))
+    {
+      stack.push_back(std::move(elem.prv));
+    }
+  };
+
+  if (type == Type::Vector) {
+    for (auto& elem : *v) {
+      take(elem);
+    }
+  } else {
+    for (auto& it : m->m) {
+      take(it.second);
+    }
+  }
+}
+
+
+Value::ImplRef Value::ValueImpl::thawedCopy() const {
+  switch (type)
+  {
+  case Type::Bool:
+    return create(b);
+  case Type::Double:
+    return create(d);
+  case Type::Int64:
+    return create(i);
+  case Type::String:
+    if (isView) {
+      return create(*sr);
+    }
+    return create(*s);
+  case Type::Vector:
+    {
+      auto ret = create(Type::Vector);
+      ret->v->assign(v->begin(), v->end());
+      return ret;
+    }
+  case Type::Map:
+    {
+      auto ret = create(Type::Map);
+      ret->m->v.reserve(m->v.size());
+      for (const auto& it : m->v) {
+        ret->m->v.push_back(ret->m->m.emplace(it->first, it->second).first);
+      }
+      return ret;
+    }
+  default:
+    return create(type);
+  }
+}
+
+
+std::shared_ptr<Value::Comments> Value::Comments::create() {
+  _countAllocation();
+  if (_currentArena) {
+    return std::allocate_shared<Comments>(ArenaAllocator<Comments>(_currentArena));
+  }
+
+  return std::make_shared<Comments>();
+}
+
+
+std::shared_ptr<Value::Comments> Value::Comments::create(const Comments& other) {
+  std::shared_ptr<Comments> ret;
+
+  _countAllocation();
+  if (_currentArena) {
+    ret = std::allocate_shared<Comments>(ArenaAllocator<Comments>(_currentArena),
+      other);
+  } else {
+    ret = std::make_shared<Comments>(other);
+  }
+  ret->frozen = false;
+
+  return ret;
+}
+
+
+StringRef::StringRef(const std::shared_ptr<const void>& _owner, const char *_pCh,
+  size_t _size)
+  : owner(_owner),
+  pCh(_pCh),
+  size(_size),
+  cstr(nullptr)
+{
+}
+
+
+StringRef::StringRef(const StringRef& other)
+  : owner(other.owner),
+  pCh(other.pCh),
+  size(other.size),
+  cstr(nullptr)
+{
+}
+
+
+StringRef::~StringRef() {
+  delete cstr.load();
+}
+
+
+const char *StringRef::c_str() const {
+  std::string *ret = cstr.load(std::memory_order_acquire);
+
+  if (!ret) {
+    std::string *str = new std::string(pCh, size);
+    if (cstr.compare_exchange_strong(ret, str, std::memory_order_acq_rel)) {
+      ret = str;
+    } else {
+      // Another thread was first, ret now points to its copy.
+      delete str;
+    }
+  }
+
+  return ret->c_str();
+}
+
+
+StringView::StringView()
+  : pCh(""),
+  len(0)
+{
+}
+
+
+StringView::StringView(const char *data, size_t size)
+  : pCh(data),
+  len(size)
+{
+}
+
+
+StringView::StringView(const char *str)
+  : pCh(str),
+  len(std::strlen(str))
+{
+}
+
+
+StringView::StringView(const std::string& str)
+  : pCh(str.data()),
+  len(str.size())
+{
+}
+
+
+const char *StringView::data() const {
+  return pCh;
+}
+
+
+size_t StringView::size() const {
+  return len;
+}
+
+
+bool StringView::empty() const {
+  return !len;
+}
+
+
+const char *StringView::begin() const {
+  return pCh;
+}
+
+
+const char *StringView::end() const {
+  return pCh + len;
+}
+
+
+char StringView::operator[](size_t index) const {
+  return pCh[index];
+}
+
+
+int StringView::compare(const StringView& other) const {
+  int ret = std::memcmp(pCh, other.pCh, std::min(len, other.len));
+
+  if (ret) {
+    return ret;
+  }
+
+  return (len < other.len ? -1 : (len > other.len ? 1 : 0));
+}
+
+
+StringView::operator std::string() const {
+  return std::string(pCh, len);
+}
+
+
+bool operator ==(const StringView& a, const StringView& b) {
+  return a.size() == b.size() && !std::memcmp(a.data(), b.data(), a.size());
+}
+
+
+bool operator !=(const StringView& a, const StringView& b) {
+  return !(a == b);
+}
+
+
+bool operator <(const StringView& a, const StringView& b) {
+  return a.compare(b) < 0;
+}
+
+
+// The Path::Step index for the element "-", the end of a Vector.
+static const int _pathEnd = -2;
+
+
+// Returns the Vector index that a Path element means, see Path::Step.
+static int _pathIndex(const std::string& key) {
+  if (key == "-") {
+    return _pathEnd;
+  }
+  // At most 9 digits, so that the index fits in an int.
+  if (key.empty() || key.size() > 9 || (key[0] == '0' && key.size() > 1)) {
+    return -1;
+  }
+
+  int ret = 0;
+  for (char c : key) {
+    if (c < '0' || c > '9') {
+      return -1;
+    }
+    ret = ret * 10 + (c - '0');
+  }
+
+  return ret;
+}
+
+
+// Replaces "~1" with '/' and "~0" with '~' in an element of the JSON Pointer
+// `path`.
+static std::string _unescapePointer(const std::string& elem, const std::string& path) {
+  if (elem.find('~') == std::string::npos) {
+    return elem;
+  }
+
+  std::string ret;
+  for (size_t a = 0; a < elem.size(); ++a) {
+    if (elem[a] != '~') {
+      ret += elem[a];
+    } else if (a + 1 < elem.size() && (elem[a + 1] == '0' || elem[a + 1] == '1')) {
+      ret += (elem[++a] == '0' ? '~' : '/');
+    } else {
+      throw syntax_error("Invalid escape sequence in JSON Pointer: " + path);
+    }
+  }
+
+  return ret;
+}
+
+
+// The opposite of _unescapePointer().
+static std::string _escapePointer(const std::string& key) {
+  std::string ret;
+
+  for (char c : key) {
+    if (c == '~') {
+      ret += "~0";
+    } else if (c == '/') {
+      ret += "~1";
+    } else {
+      ret += c;
+    }
+  }
+
+  return ret;
+}
+
+
+Path::Path() {
+}
+
+
+Path::Path(const std::string& path) {
+  if (path.empty()) {
+    return;
+  }
+
+  bool isPointer = (path[0] == '/');
+  char separator = (isPointer ? '/' : '.');
+  size_t pos = (isPointer ? 1 : 0);
+
+  for (;;) {
+    size_t end = path.find(separator, pos);
+    std::string key = path.substr(pos, end == std::string::npos ? end : end - pos);
+
+    push_back(isPointer ? _unescapePointer(key, path) : key);
+
+    if (end == std::string::npos) {
+      break;
+    }
+    pos = end + 1;
+  }
+}
+
+
+Path::Path(const char *path)
+  : Path(std::string(path))
+{
+}
+
+
+Path& Path::push_back(const std::string& key) {
+  Step step = {key, _pathIndex(key)};
+  steps.push_back(std::move(step));
+
+  return *this;
+}
+
+
+Path& Path::push_back(int index) {
+  if (index < 0) {
+    throw index_out_of_bounds("Index out of bounds.");
+  }
+
+  Step step = {std::to_string(index), index};
+  steps.push_back(std::move(step));
+
+  return *this;
+}
+
+
+size_t Path::size() const {
+  return steps.size();
+}
+
+
+bool Path::empty() const {
+  return steps.empty();
+}
+
+
+Value::Comments::Comment::Comment()
+  : pSpan(nullptr),
+  spanSize(0)
+{
+}
+
+
+const char *Value::Comments::Comment::data() const {
+  return pSpan ? pSpan : text.data();
+}
+
+
+size_t Value::Comments::Comment::size() const {
+  return pSpan ? spanSize : text.size();
+}
+
+
+std::string Value::Comments::get(ValueAccess::CommentKind kind) const {
+  return std::string(c[kind].data(), c[kind].size());
+}
+
+
+void Value::Comments::set(ValueAccess::CommentKind kind, const std::string& str) {
+  c[kind].text = str;
+  c[kind].pSpan = nullptr;
+}
+
+
+void Value::Comments::setSpan(ValueAccess::CommentKind kind,
+  const std::shared_ptr<const void>& _owner, const char *pCh, size_t size)
+{
+  if (owner != _owner) {
+    // Only one owner is kept, so existing spans must be copied.
+    for (auto& comment : c) {
+      if (comment.pSpan) {
+        comment.text.assign(comment.pSpan, comment.spanSize);
+        comment.pSpan = nullptr;
+      }
+    }
+    owner = _owner;
+  }
+
+  c[kind].pSpan = pCh;
+  c[kind].spanSize = size;
+  c[kind].text.clear();
+}
+
+
+void Value::Comments::append(ValueAccess::CommentKind kind,
+  const std::shared_ptr<const void>& _owner, const char *pCh, size_t size)
+{
+  Comment& comment = c[kind];
+
+  if (!comment.size()) {
+    setSpan(kind, _owner, pCh, size);
+  } else if (comment.pSpan && owner == _owner && comment.pSpan + comment.spanSize == pCh) {
+    comment.spanSize += size;
+  } else {
+    std::string str(comment.data(), comment.size());
+    str.append(pCh, size);
+    set(kind, str);
+  }
+}
+
+
+class Arena::Block {
+public:
+  Block *next;
+};
+
+
+Arena::Arena(size_t _blockSize)
+  : head(nullptr),
+  pos(nullptr),
+  end(nullptr),
+  blockSize(_blockSize),
+  cap(0)
+{
+}
+
+
+Arena::~Arena() {
+  while (head) {
+    Block *next = head->next;
+    ::operator delete(head);
+    head = next;
+  }
+}
+
+
+static char *_alignUp(char *p, size_t alignment) {
+  return reinterpret_cast<char*>((reinterpret_cast<std::uintptr_t>(p) +
+    alignment - 1) & ~static_cast<std::uintptr_t>(alignment - 1));
+}
+
+
+void *Arena::allocate(size_t size, size_t alignment) {
+  if (pos) {
+    char *p = _alignUp(pos, alignment);
+    if (p <= end && size <= static_cast<size_t>(end - p)) {
+      pos = p + size;
+      return p;
+    }
+  }
+
+  // Allocations that are big compared to the block size get a block of their
+  // own, so that the remainder of the current block is not wasted.
+  size_t needed = sizeof(Block) + size + alignment;
+  bool dedicated = size + alignment > blockSize / 4;
+  size_t total = dedicated ? needed : std::max(needed, sizeof(Block) + blockSize);
+
+  Block *block = static_cast<Block*>(::operator new(total));
+  char *p = _alignUp(reinterpret_cast<char*>(block) + sizeof(Block), alignment);
+  cap += total;
+
+  if (dedicated && head) {
+    block->next = head->next;
+    head->next = block;
+  } else {
+    block->next = head;
+    head = block;
+    pos = p + size;
+    end = reinterpret_cast<char*>(block) + total;
+  }
+
+  return p;
+}
+
+
+size_t Arena::capacity() const {
+  return cap;
+}
+
+
 // Sacrifice efficiency for predictability: It is allowed to do bracket
 // assignment on an Undefined Value, and thereby turn it into a Map Value.
 // A Map Value is passed by reference, therefore an Undefined Value should also
 // be passed by reference, to avoid surprises when doing bracket assignment
 // on a Value that has been passed around but is still of type Undefined.
 Value::Value()
-  : prv(std::make_shared<ValueImpl>(Type::Undefined))
+  : prv(ValueImpl::create(Type::Undefined))
 {
 }
 
 
 Value::Value(bool input)
-  : prv(std::make_shared<ValueImpl>(input))
+  : prv(ValueImpl::create(input))
 {
 }
 
 
 Value::Value(float input)
-  : prv(std::make_shared<ValueImpl>(static_cast<double>(input)))
+  : prv(ValueImpl::create(static_cast<double>(input)))
 {
 }
 
 
 Value::Value(double input)
-  : prv(std::make_shared<ValueImpl>(input))
+  : prv(ValueImpl::create(input))
 {
 }
 
 
 Value::Value(long double input)
-  : prv(std::make_shared<ValueImpl>(static_cast<double>(input)))
+  : prv(ValueImpl::create(static_cast<double>(input)))
 {
 }
 
 
 Value::Value(char input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : prv(ValueImpl::create(static_cast<std::int64_t>(input)))
 {
 }
 
 
 Value::Value(unsigned char input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : prv(ValueImpl::create(static_cast<std::int64_t>(input)))
 {
 }
 
 
 Value::Value(short input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : prv(ValueImpl::create(static_cast<std::int64_t>(input)))
 {
 }
 
 
 Value::Value(unsigned short input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : prv(ValueImpl::create(static_cast<std::int64_t>(input)))
 {
 }
 
 
 Value::Value(int input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : prv(ValueImpl::create(static_cast<std::int64_t>(input)))
 {
 }
 
 
 Value::Value(unsigned int input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : prv(ValueImpl::create(static_cast<std::int64_t>(input)))
 {
 }
 
 
 Value::Value(long input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : prv(ValueImpl::create(static_cast<std::int64_t>(input)))
 {
 }
 
 
 Value::Value(unsigned long input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : prv(ValueImpl::create(static_cast<std::int64_t>(input)))
 {
 }
 
 
 Value::Value(long long input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : prv(ValueImpl::create(static_cast<std::int64_t>(input)))
 {
 }
 
 
 Value::Value(unsigned long long input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : prv(ValueImpl::create(static_cast<std::int64_t>(input)))
 {
 }
 
 
 Value::Value(const char *input)
-  : prv(std::make_shared<ValueImpl>(std::string(input)))
+  : prv(ValueImpl::create(std::string(input)))
 {
 }
 
 
 Value::Value(const std::string& input)
-  : prv(std::make_shared<ValueImpl>(input))
+  : prv(ValueImpl::create(input))
 {
 }
 
 
 Value::Value(Type _type)
-  : prv(std::make_shared<ValueImpl>(_type))
+  : prv(ValueImpl::create(_type))
 {
 }
 
@@ -249,7 +1228,7 @@ Value::Value(const Value& other)
   if (other.cm) {
     // Clone the comments instead of sharing the reference. This way a change
     // in the other Value does not affect the comments in this Value.
-    cm.reset(new Comments(*other.cm));
+    cm = Comments::create(*other.cm);
   }
 }
 
@@ -269,7 +1248,7 @@ Value::Value(MapProxy&& other)
 }
 
 
-Value::Value(std::shared_ptr<ValueImpl> _prv, std::shared_ptr<Comments> _cm)
+Value::Value(const ImplRef& _prv, std::shared_ptr<Comments> _cm)
   : prv(_prv),
     cm(_cm)
 {
@@ -328,10 +1307,12 @@ Value& Value::at(const std::string& name) {
   case Type::Undefined:
     throw index_out_of_bounds("Key not found.");
   case Type::Map:
-    try {
-      return prv->m->m.at(name);
-    } catch(const std::out_of_range&) {}
-    throw index_out_of_bounds("Key not found.");
+    if (!ValueAccess::find(*this, name)) {
+      throw index_out_of_bounds("Key not found.");
+    }
+    // The element can be changed through the returned reference.
+    ValueImpl::thaw(prv);
+    return prv->m->m.at(name);
   default:
     throw type_mismatch("Must be of type Map for that operation.");
   }
@@ -348,6 +1329,119 @@ Value& Value::at(const char *name) {
 }
 
 
+const Value& Value::at(const Path& path) const {
+  if (const Value *pv = find(path)) {
+    return *pv;
+  }
+
+  throw index_out_of_bounds("Path not found.");
+}
+
+
+Value& Value::at(const Path& path) {
+  if (Value *pv = find(path)) {
+    return *pv;
+  }
+
+  throw index_out_of_bounds("Path not found.");
+}
+
+
+// Returns the child element of v that the Path element leads to, or null.
+static const Value *_findPathStep(const Value& v, const std::string& key, int index) {
+  switch (v.type()) {
+  case Type::Map:
+    return ValueAccess::find(v, key);
+
+  case Type::Vector:
+    if (index >= 0 && static_cast<size_t>(index) < v.size()) {
+      return &v[index];
+    }
+    return nullptr;
+
+  default:
+    return nullptr;
+  }
+}
+
+
+const Value *Value::find(const Path& path) const {
+  const Value *pv = this;
+
+  for (const auto& step : path.steps) {
+    if (!(pv = _findPathStep(*pv, step.key, step.index))) {
+      break;
+    }
+  }
+
+  return pv;
+}
+
+
+Value *Value::find(const Path& path) {
+  // Look the element up without changing anything first, so that a failed
+  // lookup leaves a frozen tree as it was.
+  const Value *pc = this;
+  bool frozen = false;
+
+  for (const auto& step : path.steps) {
+    frozen = frozen || pc->prv->frozen;
+    if (!(pc = _findPathStep(*pc, step.key, step.index))) {
+      return nullptr;
+    }
+  }
+
+  if (!frozen) {
+    return const_cast<Value*>(pc);
+  }
+
+  // The element can be changed through the returned pointer, so the frozen
+  // Values along the path must be copied.
+  Value *pv = this;
+
+  for (const auto& step : path.steps) {
+    ValueImpl::thaw(pv->prv);
+    pv = const_cast<Value*>(_findPathStep(*pv, step.key, step.index));
+  }
+
+  return pv;
+}
+
+
+std::vector<const Value*> Value::find(const std::vector<Path>& paths) const {
+  std::vector<const Value*> ret;
+  ret.reserve(paths.size());
+  // trail[i] is the Value found after i elements of the previous path.
+  std::vector<const Value*> trail(1, this);
+  const Path *pPrev = nullptr;
+
+  for (const auto& path : paths) {
+    size_t common = 0;
+    if (pPrev) {
+      while (common + 1 < trail.size() && common < path.steps.size() &&
+        path.steps[common].key == pPrev->steps[common].key)
+      {
+        ++common;
+      }
+    }
+    trail.resize(common + 1);
+
+    const Value *pv = trail.back();
+    for (size_t a = common; a < path.steps.size(); ++a) {
+      if (!(pv = _findPathStep(*pv, path.steps[a].key, path.steps[a].index))) {
+        break;
+      }
+      trail.push_back(pv);
+    }
+
+    ret.push_back(pv);
+    pPrev = &path;
+  }
+
+  return ret;
+}
+
+
 const Value Value::operator[](const std::string& name) const {
   if (prv->type == Type::Undefined) {
     return Value();
@@ -364,19 +1458,15 @@ const Value Value::operator[](const std::string& name) const {
 
 
 MapProxy Value::operator[](const std::string& name) {
-  if (prv->type == Type::Undefined) {
-    prv->~ValueImpl();
-    // Recreate the private object using the same memory block.
-    new(&(*prv)) ValueImpl(Type::Map);
-  } else if (prv->type != Type::Map) {
-    throw type_mismatch("Must be of type Undefined or Map for that operation.");
-  }
+  ValueImpl::makeContainer(prv, Type::Map);
 
+  // A frozen Map is not copied here, but by the MapProxy if the element is
+  // changed. That way reading an element does not copy anything.
   auto it = prv->m->m.find(name);
   if (it == prv->m->m.end()) {
-    return MapProxy(prv, name, 0);
+    return MapProxy(this, name, 0);
   }
-  return MapProxy(prv, name, &it->second);
+  return MapProxy(this, name, &it->second);
 }
 
 
@@ -416,11 +1506,7 @@ const Value& Value::operator[](int index) const {
     case Type::Vector:
       return prv->v[0][index];
     case Type::Map:
-      {
-        auto it = prv->m->m.find(prv->m->v[index]);
-        assert(it != prv->m->m.end());
-        return it->second;
-      }
+      return prv->m->v[index]->second;
     default:
       break;
     }
@@ -441,16 +1527,15 @@ Value& Value::operator[](int index) {
       throw index_out_of_bounds("Index out of bounds.");
     }
 
+    // The element can be changed through the returned reference.
+    ValueImpl::thaw(prv);
+
     switch (prv->type)
     {
     case Type::Vector:
       return prv->v[0][index];
     case Type::Map:
-      {
-        auto it = prv->m->m.find(prv->m->v[index]);
-        assert(it != prv->m->m.end());
-        return it->second;
-      }
+      return prv->m->v[index]->second;
     default:
       break;
     }
@@ -559,7 +1644,11 @@ Value operator+(const Value& a, const Value& b) {
   case Type::Int64:
     return a.prv->i + b.prv->i;
   case Type::String:
-    return *a.prv->s + *b.prv->s;
+    {
+      std::string ret(a.prv->view());
+      auto bView = b.prv->view();
+      return ret.append(bView.data(), bView.size());
+    }
   default:
     break;
   }
@@ -585,7 +1674,7 @@ bool operator<(const Value& a, const Value& b) {
   case Type::Int64:
     return a.prv->i < b.prv->i;
   case Type::String:
-    return *a.prv->s < *b.prv->s;
+    return a.prv->view().compare(b.prv->view()) < 0;
   default:
     break;
   }
@@ -611,7 +1700,7 @@ bool operator>(const Value& a, const Value& b) {
   case Type::Int64:
     return a.prv->i > b.prv->i;
   case Type::String:
-    return *a.prv->s > *b.prv->s;
+    return a.prv->view().compare(b.prv->view()) > 0;
   default:
     break;
   }
@@ -637,7 +1726,7 @@ bool operator<=(const Value& a, const Value& b) {
   case Type::Int64:
     return a.prv->i <= b.prv->i;
   case Type::String:
-    return *a.prv->s <= *b.prv->s;
+    return a.prv->view().compare(b.prv->view()) <= 0;
   default:
     break;
   }
@@ -663,7 +1752,7 @@ bool operator>=(const Value& a, const Value& b) {
   case Type::Int64:
     return a.prv->i >= b.prv->i;
   case Type::String:
-    return *a.prv->s >= *b.prv->s;
+    return a.prv->view().compare(b.prv->view()) >= 0;
   default:
     break;
   }
@@ -692,7 +1781,7 @@ bool operator==(const Value& a, const Value& b) {
   case Type::Double:
     return a.prv->d == b.prv->d;
   case Type::String:
-    return *a.prv->s == *b.prv->s;
+    return a.prv->view() == b.prv->view();
   case Type::Vector:
     return a.prv->v == b.prv->v;
   case Type::Map:
@@ -829,17 +1918,21 @@ Value& Value::operator+=(const char *b) {
 
 
 Value& Value::operator+=(const std::string& b) {
+  ValueImpl::thaw(prv);
+
   if (prv->type != Type::String) {
     throw type_mismatch("The value must be of type String for this operation.");
   }
 
-  *prv->s += b;
+  *ValueImpl::ownString(prv) += b;
 
   return *this;
 }
 
 
 Value& Value::operator+=(const Value& b) {
+  ValueImpl::thaw(prv);
+
   if (prv->type == Type::Double && b.prv->type == Type::Int64) {
     prv->d += b.prv->i;
   } else if (prv->type == Type::Int64 && b.prv->type == Type::Double) {
@@ -857,7 +1950,11 @@ Value& Value::operator+=(const Value& b) {
       prv->i += b.prv->i;
       break;
     case Type::String:
-      *prv->s += *b.prv->s;
+      {
+        std::string *str = ValueImpl::ownString(prv);
+        auto bView = b.prv->view();
+        str->append(bView.data(), bView.size());
+      }
       break;
     default:
       throw type_mismatch("The values must be of type Double, Int64 or String for this operation.");
@@ -877,6 +1974,8 @@ Value& Value::operator-=(const Value& b) {
 
 
 Value& Value::operator*=(const Value& b) {
+  ValueImpl::thaw(prv);
+
   if (prv->type == Type::Double && b.prv->type == Type::Int64) {
     prv->d *= b.prv->i;
   } else if (prv->type == Type::Int64 && b.prv->type == Type::Double) {
@@ -904,6 +2003,8 @@ Value& Value::operator*=(const Value& b) {
 
 
 Value& Value::operator/=(const Value& b) {
+  ValueImpl::thaw(prv);
+
   if (prv->type == Type::Double && b.prv->type == Type::Int64) {
     prv->d /= b.prv->i;
   } else if (prv->type == Type::Int64 && b.prv->type == Type::Double) {
@@ -931,6 +2032,8 @@ Value& Value::operator/=(const Value& b) {
 
 
 Value& Value::operator%=(const Value& b) {
+  ValueImpl::thaw(prv);
+
   if (prv->type != b.prv->type || prv->type != Type::Int64) {
     throw type_mismatch("The values must be of the Int64 type for this operation.");
   }
@@ -972,6 +2075,8 @@ Value Value::operator-() const {
 
 
 Value& Value::operator++() {
+  ValueImpl::thaw(prv);
+
   switch (prv->type) {
   case Type::Double:
     prv->d++;
@@ -989,6 +2094,8 @@ Value& Value::operator++() {
 
 
 Value& Value::operator--() {
+  ValueImpl::thaw(prv);
+
   switch (prv->type) {
   case Type::Double:
     prv->d--;
@@ -1006,6 +2113,8 @@ Value& Value::operator--() {
 
 
 Value Value::operator++(int) {
+  ValueImpl::thaw(prv);
+
   Value ret;
 
   switch (prv->type) {
@@ -1027,6 +2136,8 @@ Value Value::operator++(int) {
 
 
 Value Value::operator--(int) {
+  ValueImpl::thaw(prv);
+
   Value ret;
 
   switch (prv->type) {
@@ -1129,7 +2240,7 @@ Value::operator const char*() const {
     throw type_mismatch("Must be of type String for that operation.");
   }
 
-  return prv->s->c_str();
+  return prv->c_str();
 }
 
 
@@ -1138,7 +2249,16 @@ Value::operator std::string() const {
     throw type_mismatch("Must be of type String for that operation.");
   }
 
-  return *prv->s;
+  return std::string(prv->view());
+}
+
+
+StringView Value::as_string_view() const {
+  if (prv->type != Type::String) {
+    throw type_mismatch("Must be of type String for that operation.");
+  }
+
+  return prv->view();
 }
 
 
@@ -1150,7 +2270,7 @@ bool Value::defined() const {
 bool Value::empty() const {
   return (prv->type == Type::Undefined ||
     prv->type == Type::Null ||
-    (prv->type == Type::String && prv->s->empty()) ||
+    (prv->type == Type::String && prv->view().empty()) ||
     (prv->type == Type::Vector && prv->v->empty()) ||
     (prv->type == Type::Map && prv->m->m.empty()));
 }
@@ -1186,84 +2306,387 @@ size_t Value::size() const {
 }
 
 
-bool Value::deep_equal(const Value& other) const {
-  if (*this == other) {
-    return true;
-  }
+// Mixes x into the hash h.
+static inline std::uint64_t _hashMix(std::uint64_t h, std::uint64_t x) {
+  h ^= x + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+  return h;
+}
 
-  if (this->type() != other.type() || this->size() != other.size()) {
-    return false;
-  }
 
-  switch (prv->type)
-  {
-  case Type::Vector:
+// Computes the hash of v from the hashes of its elements, which are cached if
+// the elements are frozen.
+static std::uint32_t _structuralHash(const Value& v) {
+  std::uint64_t h = static_cast<std::uint64_t>(v.type());
+
+  switch (v.type()) {
+  case Type::Bool:
+    h = _hashMix(h, v.to_int64());
+    break;
+
+  case Type::Double:
+  case Type::Int64:
     {
-      auto itA = this->prv->v->begin();
-      auto endA = this->prv->v->end();
-      auto itB = other.prv->v->begin();
-      while (itA != endA) {
-        if (!itA->deep_equal(*itB)) {
-          return false;
-        }
-        ++itA;
-        ++itB;
+      // 1 and 1.0 are equal (see operator==), so both types are hashed as the
+      // same double, and integral doubles as integers.
+      double d = v.to_double();
+      h = static_cast<std::uint64_t>(Type::Double);
+      if (d == std::floor(d) && std::fabs(d) < 9.2e18) {
+        h = _hashMix(h, static_cast<std::uint64_t>(static_cast<std::int64_t>(d)));
+      } else {
+        std::uint64_t bits;
+        std::memcpy(&bits, &d, sizeof(bits));
+        h = _hashMix(h, bits);
       }
     }
-    return true;
+    break;
 
-  case Type::Map:
+  case Type::String:
     {
-      auto itA = this->begin(), endA = this->end(), itB = other.begin();
-      while (itA != endA) {
-        if (!itA->second.deep_equal(itB->second)) {
-          return false;
-        }
-        ++itA;
-        ++itB;
-      }
+      auto view = v.as_string_view();
+      h = _hashMix(h, hashBytes(view.data(), view.size()));
     }
-    return true;
+    break;
+
+  case Type::Vector:
+    for (int a = 0; a < int(v.size()); ++a) {
+      h = _hashMix(h, v[a].hash());
+    }
+    break;
+
+  case Type::Map:
+    for (const auto& it : v) {
+      h = _hashMix(h, hashBytes(it.first.data(), it.first.size()));
+      h = _hashMix(h, it.second.hash());
+    }
+    break;
 
   default:
     break;
   }
 
-  return false;
+  return static_cast<std::uint32_t>(h ^ (h >> 32));
+}
+
+
+std::size_t Value::hash() const {
+  if (prv->frozen) {
+    return prv->hash;
+  }
+  if (prv->type != Type::Vector && prv->type != Type::Map) {
+    return _structuralHash(*this);
+  }
+
+  // The same hash as _structuralHash() gives, but the elements that are
+  // containers and not frozen are hashed from an explicit stack instead of by
+  // recursive calls.
+  struct HashFrame {
+    const Value *pv;
+    size_t index;
+    ValueMap::const_iterator it;
+    std::uint64_t h;
+  };
+  std::vector<HashFrame> stack;
+  auto push = [&stack](const Value *pv) {
+    HashFrame frame = { pv, 0, ValueMap::const_iterator(),
+      static_cast<std::uint64_t>(pv->prv->type) };
+    if (pv->prv->type == Type::Map) {
+      frame.it = pv->prv->m->m.begin();
+    }
+    stack.push_back(frame);
+  };
+  push(this);
+
+  for (;;) {
+    HashFrame& frame = stack.back();
+    const ValueImpl *p = frame.pv->prv.operator->();
+    const Value *pElem = nullptr;
+    if (p->type == Type::Vector) {
+      if (frame.index < p->v->size()) {
+        pElem = &(*p->v)[frame.index++];
+      }
+    } else if (frame.it != p->m->m.end()) {
+      frame.h = _hashMix(frame.h, hashBytes(frame.it->first.data(),
+        frame.it->first.size()));
+      pElem = &frame.it->second;
+      ++frame.it;
+    }
+
+    if (pElem) {
+      if (!pElem->prv->frozen &&
+        (pElem->prv->type == Type::Vector || pElem->prv->type == Type::Map))
+      {
+        push(pElem);
+      } else {
+        frame.h = _hashMix(frame.h, pElem->hash());
+      }
+      continue;
+    }
+
+    std::uint32_t h = static_cast<std::uint32_t>(frame.h ^ (frame.h >> 32));
+    stack.pop_back();
+    if (stack.empty()) {
+      return h;
+    }
+    stack.back().h = _hashMix(stack.back().h, h);
+  }
+}
+
+
+// Compares a and b without comparing their elements. Returns 1 if they are
+// equal, 0 if they are not, and -1 if they are equal if all their elements are.
+static int _shallowEqual(const Value& a, const Value& b) {
+  if (a == b) {
+    return 1;
+  }
+
+  if (a.is_frozen() && b.is_frozen() && a.hash() != b.hash()) {
+    return 0;
+  }
+
+  if (a.type() != b.type() || a.size() != b.size()) {
+    return 0;
+  }
+
+  return (a.type() == Type::Vector || a.type() == Type::Map) ? -1 : 0;
+}
+
+
+bool Value::deep_equal(const Value& other) const {
+  int eq = _shallowEqual(*this, other);
+  if (eq >= 0) {
+    return eq == 1;
+  }
+
+  // The elements are compared from an explicit stack instead of by recursive
+  // calls, so that a deep tree cannot overflow the call stack.
+  struct EqualFrame {
+    const Value *pA;
+    const Value *pB;
+    size_t index;
+    ValueMap::const_iterator itA, itB;
+  };
+  std::vector<EqualFrame> stack;
+  auto push = [&stack](const Value *pA, const Value *pB) {
+    EqualFrame frame = { pA, pB, 0, ValueMap::const_iterator(),
+      ValueMap::const_iterator() };
+    if (pA->type() == Type::Map) {
+      frame.itA = pA->prv->m->m.begin();
+      frame.itB = pB->prv->m->m.begin();
+    }
+    stack.push_back(frame);
+  };
+  push(this, &other);
+
+  while (!stack.empty()) {
+    EqualFrame& frame = stack.back();
+    const Value *pElemA = nullptr, *pElemB = nullptr;
+    if (frame.pA->type() == Type::Vector) {
+      if (frame.index < frame.pA->prv->v->size()) {
+        pElemA = &(*frame.pA->prv->v)[frame.index];
+        pElemB = &(*frame.pB->prv->v)[frame.index];
+        ++frame.index;
+      }
+    } else if (frame.itA != frame.pA->prv->m->m.end()) {
+      if (frame.itA->first != frame.itB->first) {
+        return false;
+      }
+      pElemA = &frame.itA->second;
+      pElemB = &frame.itB->second;
+      ++frame.itA;
+      ++frame.itB;
+    }
+
+    if (!pElemA) {
+      stack.pop_back();
+      continue;
+    }
+
+    eq = _shallowEqual(*pElemA, *pElemB);
+    if (eq == 0) {
+      return false;
+    }
+    if (eq < 0) {
+      push(pElemA, pElemB);
+    }
+  }
+
+  return true;
 }
 
 
 Value Value::clone() const {
-  switch (prv->type) {
-  case Type::Vector:
-    {
-      Value ret;
-      for (int index = 0; index < int(size()); ++index) {
-        ret.push_back(operator[](index).clone());
+  // Returns a clone of v, except that a Vector or Map that must be cloned is
+  // returned empty (but with the comments of v), and mustFill is set to true.
+  bool mustFill;
+  auto cloneShallow = [&mustFill](const Value& v) -> Value {
+    mustFill = false;
+
+    if (v.prv->frozen && !v.prv->arenaInside) {
+      // Nothing in a frozen tree can be changed, so sharing it is as good as
+      // a clone.
+      return v;
+    }
+
+    Value ret(Type::Null);
+    switch (v.prv->type) {
+    case Type::Vector:
+    case Type::Map:
+      ret = Value(v.prv->type);
+      mustFill = true;
+      break;
+
+    default:
+      if (!v.prv->inArena) {
+        return v;
       }
-      ret.set_comments(*this);
-      return ret;
+      // Scalar values are normally shared rather than cloned, but the clone
+      // must not depend on the Arena.
+      switch (v.prv->type) {
+      case Type::Undefined:
+        ret = Value();
+        break;
+      case Type::Bool:
+        ret = Value(v.prv->b);
+        break;
+      case Type::Double:
+        ret = Value(v.prv->d);
+        break;
+      case Type::Int64:
+        ret = Value(v.prv->i);
+        break;
+      case Type::String:
+        ret = Value(std::string(v.prv->view()));
+        break;
+      default:
+        break;
+      }
+      break;
     }
 
-  case Type::Map:
-    {
-      Value ret;
-      for (int index = 0; index < size(); ++index) {
-        ret[key(index)] = operator[](index).clone();
+    ret.set_comments(v);
+    return ret;
+  };
+
+  Value ret = cloneShallow(*this);
+  if (!mustFill) {
+    return ret;
+  }
+
+  // The elements are cloned from an explicit stack instead of by recursive
+  // calls, so that a deep tree cannot overflow the call stack. Each container
+  // is filled after it has been added to its parent, which shares it.
+  struct CloneFrame {
+    const Value *pSrc;
+    Value *pDst;
+    int index;
+  };
+  std::vector<CloneFrame> stack;
+  CloneFrame root = { this, &ret, 0 };
+  stack.push_back(root);
+
+  while (!stack.empty()) {
+    CloneFrame& frame = stack.back();
+    if (frame.index >= int(frame.pSrc->size())) {
+      stack.pop_back();
+      continue;
+    }
+
+    int index = frame.index++;
+    const Value& src = (*frame.pSrc)[index];
+    Value elem = cloneShallow(src);
+    Value *pElem;
+    if (frame.pSrc->type() == Type::Vector) {
+      frame.pDst->push_back(elem);
+      pElem = &frame.pDst->prv->v->back();
+    } else {
+      const std::string& key = frame.pSrc->key(index);
+      (*frame.pDst)[key] = elem;
+      pElem = &frame.pDst->prv->m->m.find(key)->second;
+    }
+
+    if (mustFill) {
+      CloneFrame next = { &src, pElem, 0 };
+      stack.push_back(next);
+    }
+  }
+
+  return ret;
+}
+
+
+void Value::freeze() {
+  if (prv->frozen) {
+    // Only shared parts of a frozen tree are found here, and they are
+    // already frozen all the way down.
+    return;
+  }
+
+  // Each Value is frozen after its elements, from an explicit stack instead of
+  // by recursive calls, so that a deep tree cannot overflow the call stack.
+  struct FreezeFrame {
+    Value *pv;
+    size_t index;
+  };
+  std::vector<FreezeFrame> stack;
+  FreezeFrame root = { this, 0 };
+  stack.push_back(root);
+
+  while (!stack.empty()) {
+    FreezeFrame& frame = stack.back();
+    ValueImpl *p = frame.pv->prv.operator->();
+    Value *pElem = nullptr;
+    if (p->type == Type::Vector) {
+      if (frame.index < p->v->size()) {
+        pElem = &(*p->v)[frame.index++];
+      }
+    } else if (p->type == Type::Map) {
+      if (frame.index < p->m->v.size()) {
+        pElem = &p->m->v[frame.index++]->second;
       }
-      ret.set_comments(*this);
-      return ret;
     }
 
-  default:
-    break;
+    if (pElem) {
+      if (!pElem->prv->frozen) {
+        FreezeFrame next = { pElem, 0 };
+        stack.push_back(next);
+      }
+      continue;
+    }
+
+    // All elements are frozen.
+    Value& v = *frame.pv;
+    stack.pop_back();
+
+    if (v.cm) {
+      v.cm->frozen = true;
+    }
+
+    bool arenaInside = p->inArena || p->dataInArena;
+    if (p->type == Type::Vector) {
+      for (const auto& elem : *p->v) {
+        arenaInside = arenaInside || elem.prv->arenaInside;
+      }
+    } else if (p->type == Type::Map) {
+      for (const auto& it : p->m->m) {
+        arenaInside = arenaInside || it.second.prv->arenaInside;
+      }
+    }
+
+    p->arenaInside = arenaInside;
+    p->hash = _structuralHash(v);
+    p->frozen = true;
   }
+}
 
-  return *this;
+
+bool Value::is_frozen() const {
+  return prv->frozen;
 }
 
 
 void Value::clear() {
+  ValueImpl::thaw(prv);
+
   switch (prv->type) {
   case Type::Vector:
     prv->v->clear();
@@ -1281,6 +2704,8 @@ void Value::clear() {
 
 
 void Value::erase(int index) {
+  ValueImpl::thaw(prv);
+
   switch (prv->type)
   {
   case Type::Undefined:
@@ -1299,8 +2724,9 @@ void Value::erase(int index) {
       break;
     case Type::Map:
       {
-        prv->m->m.erase(prv->m->v[index]);
+        auto it = prv->m->v[index];
         prv->m->v.erase(prv->m->v.begin() + index);
+        prv->m->m.erase(it);
       }
       break;
     default:
@@ -1315,19 +2741,109 @@ void Value::erase(int index) {
 
 
 void Value::push_back(const Value& other) {
-  if (prv->type == Type::Undefined) {
-    prv->~ValueImpl();
-    // Recreate the private object using the same memory block.
-    new(&(*prv)) ValueImpl(Type::Vector);
-  } else if (prv->type != Type::Vector) {
-    throw type_mismatch("Must be of type Undefined or Vector for that operation.");
-  }
+  ValueImpl::thaw(prv);
+  ValueImpl::makeContainer(prv, Type::Vector);
 
   prv->v->push_back(other);
 }
 
 
+void Value::push_back(Value&& other) {
+  ValueImpl::thaw(prv);
+  ValueImpl::makeContainer(prv, Type::Vector);
+
+  prv->v->push_back(std::move(other));
+}
+
+
+void Value::reserve(size_t count) {
+  ValueImpl::thaw(prv);
+
+  switch (prv->type) {
+  case Type::Vector:
+    prv->v->reserve(count);
+    break;
+
+  case Type::Map:
+    prv->m->v.reserve(count);
+    break;
+
+  default:
+    break;
+  }
+}
+
+
+bool Value::insert_or_assign(std::string key, Value value) {
+  ValueImpl::thaw(prv);
+  ValueImpl::makeContainer(prv, Type::Map);
+
+  auto& m = prv->m->m;
+  auto it = m.lower_bound(key);
+  if (it != m.end() && it->first == key) {
+    it->second.assign_with_comments(std::move(value));
+    return false;
+  }
+
+  prv->m->v.push_back(m.emplace_hint(it, std::move(key), std::move(value)));
+
+  return true;
+}
+
+
+bool Value::insert_or_assign(const Path& path, Value value) {
+  if (path.steps.empty()) {
+    assign_with_comments(std::move(value));
+    return false;
+  }
+
+  Value *pv = this;
+
+  for (size_t a = 0; a < path.steps.size(); ++a) {
+    const auto& step = path.steps[a];
+    bool last = (a + 1 == path.steps.size());
+    ValueImpl::thaw(pv->prv);
+
+    if (pv->prv->type == Type::Vector) {
+      auto& v = *pv->prv->v;
+      size_t index = (step.index == _pathEnd ? v.size() : static_cast<size_t>(step.index));
+      if (step.index < 0 && step.index != _pathEnd) {
+        throw type_mismatch("Must be of type Undefined or Map for that operation.");
+      } else if (index > v.size()) {
+        throw index_out_of_bounds("Index out of bounds.");
+      } else if (index == v.size()) {
+        if (last) {
+          v.push_back(std::move(value));
+          return true;
+        }
+        v.push_back(Value());
+      } else if (last) {
+        v[index].assign_with_comments(std::move(value));
+        return false;
+      }
+      pv = &v[index];
+    } else if (last) {
+      return pv->insert_or_assign(step.key, std::move(value));
+    } else {
+      ValueImpl::makeContainer(pv->prv, Type::Map);
+      auto& m = pv->prv->m->m;
+      auto it = m.lower_bound(step.key);
+      if (it == m.end() || it->first != step.key) {
+        it = m.emplace_hint(it, step.key, Value());
+        pv->prv->m->v.push_back(it);
+      }
+      pv = &it->second;
+    }
+  }
+
+  // Not reached, the last step always returns.
+  return false;
+}
+
+
 void Value::move(int from, int to) {
+  ValueImpl::thaw(prv);
+
   switch (prv->type)
   {
   case Type::Undefined:
@@ -1385,7 +2901,7 @@ std::string Value::key(int index) const {
     if (index < 0 || index >= size()) {
       throw index_out_of_bounds("Index out of bounds.");
     }
-    return prv->m->v[index];
+    return prv->m->v[index]->first;
   default:
     throw type_mismatch("Must be of type Map for that operation.");
   }
@@ -1399,6 +2915,8 @@ ValueMap::iterator Value::begin() {
     return ValueMap::iterator();
   }
 
+  ValueImpl::thaw(prv);
+
   return prv->m->m.begin();
 }
 
@@ -1410,6 +2928,8 @@ ValueMap::iterator Value::end() {
     return ValueMap::iterator();
   }
 
+  ValueImpl::thaw(prv);
+
   return prv->m->m.end();
 }
 
@@ -1437,25 +2957,29 @@ ValueMap::const_iterator Value::end() const {
 
 
 size_t Value::erase(const std::string &key) {
+  ValueImpl::thaw(prv);
+
   if (prv->type == Type::Undefined) {
     return 0;
   } else if (prv->type != Type::Map) {
     throw type_mismatch("Must be of type Map for that operation.");
   }
 
-  size_t ret = prv->m->m.erase(key);
+  auto it = prv->m->m.find(key);
+  if (it == prv->m->m.end()) {
+    return 0;
+  }
 
-  if (ret > 0) {
-    auto v = &prv->m->v;
-    auto it = std::find(v->begin(), v->end(), key);
-    if (it == v->end()) {
-      assert(!"Value found in map but not in vector");
-    } else {
-      v->erase(it);
-    }
+  auto v = &prv->m->v;
+  auto itV = std::find(v->begin(), v->end(), it);
+  if (itV == v->end()) {
+    assert(!"Value found in map but not in vector");
+  } else {
+    v->erase(itV);
   }
+  prv->m->m.erase(it);
 
-  return ret;
+  return 1;
 }
 
 
@@ -1480,22 +3004,23 @@ double Value::to_double() const {
       double ret;
 
 #if HJSON_USE_CHARCONV
-      const char *pCh = prv->s->c_str();
-      const char *pEnd = pCh + prv->s->size();
+      auto view = prv->view();
+      const char *pCh = view.data();
+      const char *pEnd = pCh + view.size();
 
       auto res = std::from_chars(pCh, pEnd, ret);
 
       if (res.ptr != pEnd || res.ec == std::errc::result_out_of_range) {
 #elif HJSON_USE_STRTOD
-      const char *pCh = prv->s->c_str();
+      const char *pCh = prv->c_str();
       char *endptr;
       errno = 0;
 
       ret = std::strtod(pCh, &endptr);
 
-      if (errno || endptr - pCh != prv->s->size()) {
+      if (errno || endptr - pCh != prv->view().size()) {
 #else
-      std::stringstream ss(*prv->s);
+      std::stringstream ss(static_cast<std::string>(prv->view()));
 
       // Make sure we expect dot (not comma) as decimal point.
       ss.imbue(std::locale::classic());
@@ -1533,22 +3058,23 @@ std::int64_t Value::to_int64() const {
       std::int64_t ret;
 
 #if HJSON_USE_CHARCONV
-      const char *pCh = prv->s->c_str();
-      const char *pEnd = pCh + prv->s->size();
+      auto view = prv->view();
+      const char *pCh = view.data();
+      const char *pEnd = pCh + view.size();
 
       auto res = std::from_chars(pCh, pEnd, ret);
 
       if (res.ptr != pEnd || res.ec == std::errc::result_out_of_range) {
 #elif HJSON_USE_STRTOD
-      const char *pCh = prv->s->c_str();
+      const char *pCh = prv->c_str();
       char *endptr;
       errno = 0;
 
       ret = std::strtoll(pCh, &endptr, 0);
 
-      if (errno || endptr - pCh != prv->s->size()) {
+      if (errno || endptr - pCh != prv->view().size()) {
 #else
-      std::stringstream ss(*prv->s);
+      std::stringstream ss(static_cast<std::string>(prv->view()));
 
       // Avoid localization surprises.
       ss.imbue(std::locale::classic());
@@ -1565,108 +3091,32 @@ std::int64_t Value::to_int64() const {
     }
   default:
     break;
-  }
-
-  throw type_mismatch("Illegal type for this operation.");
-}
-
-
-std::string Value::to_string() const {
-  switch (prv->type) {
-  case Type::Undefined:
-    return "";
-  case Type::Null:
-    return "null";
-  case Type::Bool:
-    return (prv->b ? "true" : "false");
-  case Type::Double:
-    {
-#if HJSON_USE_CHARCONV
-      std::array<char, 32> buf;
-
-      auto res = std::to_chars(buf.data(), buf.data() + buf.size(), prv->d);
-
-      if (res.ptr - buf.data() >= buf.size() || res.ec != std::errc()) {
-        return "";
-      }
-
-      // to_chars() does not set a zero termination, which is needed by strchr().
-      *res.ptr = '\0';
-
-      // Always output a decimal point.
-      if (strchr(buf.data(), '.') == nullptr) {
-        if (res.ptr - buf.data() >= buf.size() - 1) {
-          return "";
-        }
-        *(res.ptr++) = '.';
-        *(res.ptr++) = '0';
-      }
-
-      return std::string(buf.data(), res.ptr);
-#elif HJSON_USE_STRTOD
-      char buf[32];
-      int nChars = snprintf(buf, sizeof(buf), "%.15g", prv->d);
-
-      if (nChars < 0 || nChars >= static_cast<int>(sizeof(buf))) {
-        return "";
-      }
-
-      // Always output a decimal point.
-      if (strchr(buf, '.') == nullptr) {
-        if (nChars >= static_cast<int>(sizeof(buf)) - 1) {
-          return "";
-        }
-        buf[nChars++] = '.';
-        buf[nChars++] = '0';
-      }
-
-      return std::string(buf, nChars);
-#else
-      std::ostringstream oss;
-
-      // Make sure we use dot (not comma) as decimal point.
-      oss.imbue(std::locale::classic());
-      oss.precision(15);
-
-      oss << prv->d;
-
-      // Always output a decimal point. Done like this to avoid printing more
-      // decimals than needed, which would be the result of using
-      // std::ios::showpoint.
-      if (oss.str().find_first_of('.', 0) == std::string::npos) {
-        oss << ".0";
-      }
-
-      return oss.str();
-#endif
-    }
-  case Type::Int64:
-    {
-#if HJSON_USE_CHARCONV
-      std::array<char, 32> buf;
-
-      auto res = std::to_chars(buf.data(), buf.data() + buf.size(), prv->i);
-
-      if (res.ec != std::errc()) {
-        return "";
-      }
-
-      return std::string(buf.data(), res.ptr);
-#elif HJSON_USE_STRTOD
-      return std::to_string(prv->i);
-#else
-      std::ostringstream oss;
+  }
 
-      // Avoid localization surprises.
-      oss.imbue(std::locale::classic());
+  throw type_mismatch("Illegal type for this operation.");
+}
 
-      oss << prv->i;
 
-      return oss.str();
-#endif
+std::string Value::to_string() const {
+  switch (prv->type) {
+  case Type::Undefined:
+    return "";
+  case Type::Null:
+    return "null";
+  case Type::Bool:
+    return (prv->b ? "true" : "false");
+  case Type::Double:
+    {
+      char buf[32];
+      return std::string(buf, formatDouble(prv->d, buf));
+    }
+  case Type::Int64:
+    {
+      char buf[32];
+      return std::string(buf, formatInt64(prv->i, buf));
     }
   case Type::String:
-    return *prv->s;
+    return std::string(prv->view());
   default:
     break;
   }
@@ -1680,16 +3130,17 @@ void Value::set_comment_before(const std::string& str) {
     if (str.empty()) {
       return;
     }
-    cm.reset(new Comments());
+    cm = Comments::create();
   }
+  Comments::thaw(cm);
 
-  cm->m_commentBefore = str;
+  cm->set(ValueAccess::CommentBefore, str);
 }
 
 
 std::string Value::get_comment_before() const {
   if (cm) {
-    return cm->m_commentBefore;
+    return cm->get(ValueAccess::CommentBefore);
   }
 
   return "";
@@ -1701,16 +3152,17 @@ void Value::set_comment_key(const std::string& str) {
     if (str.empty()) {
       return;
     }
-    cm.reset(new Comments());
+    cm = Comments::create();
   }
+  Comments::thaw(cm);
 
-  cm->m_commentKey = str;
+  cm->set(ValueAccess::CommentKey, str);
 }
 
 
 std::string Value::get_comment_key() const {
   if (cm) {
-    return cm->m_commentKey;
+    return cm->get(ValueAccess::CommentKey);
   }
 
   return "";
@@ -1722,16 +3174,17 @@ void Value::set_comment_inside(const std::string& str) {
     if (str.empty()) {
       return;
     }
-    cm.reset(new Comments());
+    cm = Comments::create();
   }
+  Comments::thaw(cm);
 
-  cm->m_commentInside = str;
+  cm->set(ValueAccess::CommentInside, str);
 }
 
 
 std::string Value::get_comment_inside() const {
   if (cm) {
-    return cm->m_commentInside;
+    return cm->get(ValueAccess::CommentInside);
   }
 
   return "";
@@ -1743,16 +3196,17 @@ void Value::set_comment_after(const std::string& str) {
     if (str.empty()) {
       return;
     }
-    cm.reset(new Comments());
+    cm = Comments::create();
   }
+  Comments::thaw(cm);
 
-  cm->m_commentAfter = str;
+  cm->set(ValueAccess::CommentAfter, str);
 }
 
 
 std::string Value::get_comment_after() const {
   if (cm) {
-    return cm->m_commentAfter;
+    return cm->get(ValueAccess::CommentAfter);
   }
 
   return "";
@@ -1761,11 +3215,12 @@ std::string Value::get_comment_after() const {
 
 void Value::set_comments(const Value& other) {
   if (other.cm) {
-    if (!cm) {
-      cm.reset(new Comments());
+    if (!cm || cm->frozen) {
+      cm = Comments::create(*other.cm);
+    } else {
+      *cm = *other.cm;
+      cm->frozen = false;
     }
-
-    *cm = *other.cm;
   } else {
     clear_comments();
   }
@@ -1797,11 +3252,120 @@ Value& Value::assign_with_comments(Value&& other) {
 }
 
 
-MapProxy::MapProxy(std::shared_ptr<ValueImpl> _parent, const std::string &_key,
-  Value *_pTarget)
-  : Value(_pTarget ? _pTarget->prv : std::make_shared<ValueImpl>(Type::Undefined),
+void ValueAccess::setComment(Value& val, CommentKind kind,
+  const std::shared_ptr<const void>& owner, const char *pCh, size_t size)
+{
+  if (!size) {
+    if (val.cm) {
+      val.cm->set(kind, "");
+    }
+    return;
+  }
+
+  if (!val.cm) {
+    val.cm = Value::Comments::create();
+  }
+
+  val.cm->setSpan(kind, owner, pCh, size);
+}
+
+
+void ValueAccess::appendComment(Value& val, CommentKind kind,
+  const std::shared_ptr<const void>& owner, const char *pCh, size_t size)
+{
+  if (!size) {
+    return;
+  }
+
+  if (!val.cm) {
+    val.cm = Value::Comments::create();
+  }
+
+  val.cm->append(kind, owner, pCh, size);
+}
+
+
+void ValueAccess::copyComment(Value& val, CommentKind kind, const char *pCh, size_t size,
+  bool append)
+{
+  if (!val.cm) {
+    if (!size) {
+      return;
+    }
+    val.cm = Value::Comments::create();
+  }
+
+  if (append) {
+    val.cm->set(kind, val.cm->get(kind).append(pCh, size));
+  } else {
+    val.cm->set(kind, std::string(pCh, size));
+  }
+}
+
+
+void ValueAccess::moveComment(Value& val, CommentKind from, CommentKind to) {
+  if (!val.cm || !val.cm->c[from].size()) {
+    return;
+  }
+
+  auto& comment = val.cm->c[from];
+  if (comment.pSpan) {
+    val.cm->append(to, val.cm->owner, comment.pSpan, comment.spanSize);
+  } else {
+    val.cm->set(to, val.cm->get(to) + comment.text);
+  }
+  val.cm->set(from, "");
+}
+
+
+const char *ValueAccess::getComment(const Value& val, CommentKind kind, size_t *pSize) {
+  if (!val.cm) {
+    *pSize = 0;
+    return "";
+  }
+
+  *pSize = val.cm->c[kind].size();
+  return val.cm->c[kind].data();
+}
+
+
+Value ValueAccess::stringView(const std::shared_ptr<const void>& owner,
+  const char *pCh, size_t size)
+{
+  return Value(Value::ValueImpl::create(StringRef(owner, pCh, size)), nullptr);
+}
+
+
+const std::string& ValueAccess::key(const Value& map, size_t index) {
+  return map.prv->m->v[index]->first;
+}
+
+
+const Value& ValueAccess::element(const Value& map, size_t index) {
+  return map.prv->m->v[index]->second;
+}
+
+
+const Value *ValueAccess::find(const Value& map, const std::string& key) {
+  auto it = map.prv->m->m.find(key);
+  if (it == map.prv->m->m.end()) {
+    return nullptr;
+  }
+
+  return &it->second;
+}
+
+
+void ValueAccess::append(Value& map, const std::string& key, Value&& val) {
+  map.prv->m->v.push_back(map.prv->m->m.emplace(key, std::move(val)).first);
+}
+
+
+MapProxy::MapProxy(Value *_parent, const std::string &_key, Value *_pTarget)
+  : Value(_pTarget ? _pTarget->prv : ValueImpl::create(Type::Undefined),
       _pTarget ? _pTarget->cm : 0),
-    parentPrv(_parent),
+    parentPrv(_parent->prv),
+    parent(_parent),
     key(_key),
     pTarget(_pTarget),
     wasAssigned(false)
@@ -1817,22 +3381,35 @@ MapProxy::MapProxy(Value&& other)
 
 MapProxy::~MapProxy() {
   if (wasAssigned || !empty()) {
+    if (parentPrv->frozen) {
+      if (pTarget && pTarget->prv == prv && pTarget->cm == cm) {
+        // Not changed.
+        return;
+      }
+      ValueImpl::thaw(parent->prv);
+      parentPrv = parent->prv;
+      if (pTarget) {
+        pTarget = &parentPrv->m->m.find(key)->second;
+      }
+    }
     if (pTarget) {
       // Can have changed due to assignment.
       pTarget->prv = this->prv;
       // In case cm was 0 but now has been created by a call to set_comment_x.
       pTarget->cm = this->cm;
     } else {
-      // If the key is new we must add it to the order vector also.
-      parentPrv->m->v.push_back(key);
-
       // We waited until now because we don't want to insert a Value object of
       // type Undefined into the parent map, unless such an object was explicitly
       // assigned (e.g. `val["key"] = Hjson::Value()`).
       // Without this requirement, checking for the existence of an element
       // would create an Undefined element for that key if it didn't already exist
       // (e.g. `if (val["key"] == 1) {` would create an element for "key").
-      parentPrv->m->m.emplace(key, Value(this->prv, this->cm));
+      auto res = parentPrv->m->m.emplace(key, Value(this->prv, this->cm));
+
+      // If the key is new we must add it to the order vector also.
+      if (res.second) {
+        parentPrv->m->v.push_back(res.first);
+      }
     }
   }
 }
@@ -1882,33 +3459,386 @@ MapProxy& MapProxy::assign_with_comments(Value&& other) {
 }
 
 
-Value Merge(const Value& base, const Value& ext) {
-  Value merged;
-
-  if (!ext.defined()) {
-    merged = base.clone();
-  } else if (base.type() == Type::Map && ext.type() == Type::Map) {
-    for (int index = 0; index < ext.size(); ++index) {
-      if (base[ext.key(index)].defined()) {
-        merged[ext.key(index)] = Merge(base[ext.key(index)], ext[index]);
-      } else {
-        merged[ext.key(index)] = ext[index].clone();
-      }
+// Returned for elements that do not exist, so that a ConstValue always refers
+// to a Value.
+static const Value& _undefinedValue() {
+  static const Value undefined(Type::Undefined);
+  return undefined;
+}
+
+
+ConstValue::ConstValue()
+  : pv(&_undefinedValue())
+{
+}
+
+
+ConstValue::ConstValue(const Value& v)
+  : pv(&v)
+{
+}
+
+
+Type ConstValue::type() const {
+  return pv->type();
+}
+
+
+bool ConstValue::defined() const {
+  return pv->defined();
+}
+
+
+bool ConstValue::empty() const {
+  return pv->empty();
+}
+
+
+bool ConstValue::is_container() const {
+  return pv->is_container();
+}
+
+
+bool ConstValue::is_numeric() const {
+  return pv->is_numeric();
+}
+
+
+bool ConstValue::is_frozen() const {
+  return pv->is_frozen();
+}
+
+
+size_t ConstValue::size() const {
+  return pv->size();
+}
+
+
+ConstValue ConstValue::operator[](const std::string& name) const {
+  if (pv->prv->type == Type::Undefined) {
+    return ConstValue();
+  } else if (pv->prv->type == Type::Map) {
+    auto it = pv->prv->m->m.find(name);
+    if (it == pv->prv->m->m.end()) {
+      return ConstValue();
     }
+    return ConstValue(it->second);
+  }
 
-    for (int index = 0; index < base.size(); ++index) {
-      if (!merged[base.key(index)].defined()) {
-        merged[base.key(index)] = base[index].clone();
-      }
+  throw type_mismatch("Must be of type Undefined or Map for that operation.");
+}
+
+
+ConstValue ConstValue::operator[](const char *name) const {
+  return operator[](std::string(name));
+}
+
+
+ConstValue ConstValue::operator[](int index) const {
+  return ConstValue(pv->operator[](index));
+}
+
+
+ConstValue ConstValue::at(const std::string& name) const {
+  return ConstValue(pv->at(name));
+}
+
+
+ConstValue ConstValue::at(const char *name) const {
+  return at(std::string(name));
+}
+
+
+ConstValue ConstValue::at(const Path& path) const {
+  return ConstValue(pv->at(path));
+}
+
+
+const std::string& ConstValue::key(int index) const {
+  switch (pv->prv->type)
+  {
+  case Type::Undefined:
+  case Type::Map:
+    if (index < 0 || index >= size()) {
+      throw index_out_of_bounds("Index out of bounds.");
     }
+    return pv->prv->m->v[index]->first;
+  default:
+    throw type_mismatch("Must be of type Map for that operation.");
+  }
+}
 
-    merged.set_comments(ext);
-  } else {
-    merged = ext.clone();
+
+double ConstValue::to_double() const {
+  return pv->to_double();
+}
+
+
+std::int64_t ConstValue::to_int64() const {
+  return pv->to_int64();
+}
+
+
+std::string ConstValue::to_string() const {
+  return pv->to_string();
+}
+
+
+StringView ConstValue::as_string_view() const {
+  return pv->as_string_view();
+}
+
+
+const Value& ConstValue::value() const {
+  return *pv;
+}
+
+
+// Merges the values at the same position in each layer, the last layer has
+// the highest priority. Maps are merged, all other values replace the values
+// of the layers before.
+static Value _merge(const Value *const *layers, size_t count) {
+  size_t last = count;
+  while (last > 0 && !layers[last - 1]->defined()) {
+    --last;
+  }
+  if (!last) {
+    return layers[0]->clone();
+  }
+
+  const Value& top = *layers[last - 1];
+  if (top.type() != Type::Map) {
+    return top.clone();
+  }
+
+  // The maps (and Undefined values in between) that are merged with top.
+  size_t first = last - 1, nMaps = 1;
+  while (first > 0 && (!layers[first - 1]->defined() ||
+    layers[first - 1]->type() == Type::Map))
+  {
+    --first;
+    if (layers[first]->defined()) {
+      ++nMaps;
+    }
+  }
+  if (nMaps == 1) {
+    return top.clone();
+  }
+
+  Value merged(Type::Map);
+  std::vector<const Value*> values;
+
+  // Keys from later layers come first, in the same order as in Merge(base,
+  // ext).
+  for (size_t i = last; i-- > first;) {
+    const Value& layer = *layers[i];
+    if (layer.type() != Type::Map) {
+      continue;
+    }
+    for (size_t index = 0; index < layer.size(); ++index) {
+      const std::string& key = ValueAccess::key(layer, index);
+      if (ValueAccess::find(merged, key)) {
+        continue;
+      }
+      values.clear();
+      for (size_t j = first; j < i; ++j) {
+        if (layers[j]->type() == Type::Map) {
+          if (const Value *val = ValueAccess::find(*layers[j], key)) {
+            values.push_back(val);
+          }
+        }
+      }
+      values.push_back(&ValueAccess::element(layer, index));
+      ValueAccess::append(merged, key, _merge(values.data(), values.size()));
+    }
   }
 
+  merged.set_comments(top);
+
   return merged;
 }
 
 
+Value Merge(const Value& base, const Value& ext) {
+  const Value *layers[] = {&base, &ext};
+
+  return _merge(layers, 2);
+}
+
+
+Value Merge(const std::vector<Value>& layers) {
+  if (layers.empty()) {
+    return Value();
+  }
+
+  std::vector<const Value*> pointers;
+  pointers.reserve(layers.size());
+  for (const auto& layer : layers) {
+    pointers.push_back(&layer);
+  }
+
+  return _merge(pointers.data(), pointers.size());
+}
+
+
+// Adds an operation to the patch.
+static void _patchOp(Value *pPatch, const char *name, const std::string& path,
+  const Value *pValue)
+{
+  Value op(Type::Map);
+  op.insert_or_assign("op", Value(name));
+  op.insert_or_assign("path", Value(path));
+  if (pValue) {
+    op.insert_or_assign("value", pValue->clone());
+  }
+  pPatch->push_back(std::move(op));
+}
+
+
+// Adds the operations that turn a into b to the patch. *pPath is the JSON
+// Pointer to a and b.
+static void _diff(const Value& a, const Value& b, std::string *pPath, Value *pPatch) {
+  if (a.type() != b.type() || !a.is_container()) {
+    if (!a.deep_equal(b)) {
+      _patchOp(pPatch, "replace", *pPath, &b);
+    }
+    return;
+  }
+
+  if (a == b) {
+    // The same container.
+    return;
+  }
+
+  size_t pathSize = pPath->size();
+
+  if (a.type() == Type::Vector) {
+    size_t common = std::min(a.size(), b.size());
+    for (size_t index = 0; index < common; ++index) {
+      *pPath += "/" + std::to_string(index);
+      _diff(a[static_cast<int>(index)], b[static_cast<int>(index)], pPath, pPatch);
+      pPath->resize(pathSize);
+    }
+    for (size_t index = common; index < b.size(); ++index) {
+      _patchOp(pPatch, "add", *pPath + "/" + std::to_string(index), &b[static_cast<int>(index)]);
+    }
+    // From the end, so that the indexes stay valid.
+    for (size_t index = a.size(); index > common; --index) {
+      _patchOp(pPatch, "remove", *pPath + "/" + std::to_string(index - 1), nullptr);
+    }
+    return;
+  }
+
+  // Both maps are walked in key order at the same time.
+  auto itA = a.begin(), itB = b.begin();
+  while (itA != a.end() || itB != b.end()) {
+    bool inA = (itA != a.end() && (itB == b.end() || itA->first <= itB->first));
+    bool inB = (itB != b.end() && (itA == a.end() || itB->first <= itA->first));
+    const std::string& key = (inA ? itA->first : itB->first);
+    bool definedA = (inA && itA->second.defined());
+    bool definedB = (inB && itB->second.defined());
+
+    *pPath += "/" + _escapePointer(key);
+    if (definedA && definedB) {
+      _diff(itA->second, itB->second, pPath, pPatch);
+    } else if (definedA) {
+      _patchOp(pPatch, "remove", *pPath, nullptr);
+    } else if (definedB) {
+      _patchOp(pPatch, "add", *pPath, &itB->second);
+    }
+    pPath->resize(pathSize);
+
+    if (inA) {
+      ++itA;
+    }
+    if (inB) {
+      ++itB;
+    }
+  }
+}
+
+
+Value Diff(const Value& from, const Value& to) {
+  Value patch(Type::Vector);
+  std::string path;
+
+  _diff(from, to, &path, &patch);
+
+  return patch;
+}
+
+
+void ApplyPatch(Value& target, const Value& patch) {
+  if (patch.type() != Type::Vector && patch.defined()) {
+    throw type_mismatch("The patch must be a Vector.");
+  }
+
+  for (int a = 0; a < int(patch.size()); ++a) {
+    const Value& op = patch[a];
+    if (op.type() != Type::Map) {
+      throw type_mismatch("Each patch operation must be a Map.");
+    }
+
+    std::string name = op["op"].to_string();
+    std::string pointer = op["path"].to_string();
+    bool isAdd = (name == "add"), isRemove = (name == "remove");
+    if (!isAdd && !isRemove && name != "replace") {
+      throw type_mismatch("Unknown patch operation: '" + name + "'");
+    }
+    Value value = (isRemove ? Value(Type::Null) : op["value"].clone());
+
+    if (pointer.empty()) {
+      target.assign_with_comments(isRemove ? Value() : std::move(value));
+      continue;
+    }
+
+    size_t pos = pointer.rfind('/');
+    if (pointer[0] != '/') {
+      throw syntax_error("Invalid JSON Pointer: " + pointer);
+    }
+    Value *pParent = target.find(Path(pointer.substr(0, pos)));
+    std::string key = _unescapePointer(pointer.substr(pos + 1), pointer);
+    if (!pParent) {
+      throw index_out_of_bounds("Path not found: " + pointer);
+    }
+
+    if (pParent->type() == Type::Vector) {
+      size_t size = pParent->size();
+      int index = _pathIndex(key);
+      if (index == _pathEnd) {
+        index = static_cast<int>(size);
+      }
+      if (index < 0 || static_cast<size_t>(index) > size ||
+        (!isAdd && static_cast<size_t>(index) == size))
+      {
+        throw index_out_of_bounds("Path not found: " + pointer);
+      }
+
+      if (isAdd) {
+        pParent->push_back(std::move(value));
+        if (static_cast<size_t>(index) < size) {
+          pParent->move(static_cast<int>(size), index);
+        }
+      } else if (isRemove) {
+        pParent->erase(index);
+      } else {
+        (*pParent)[index].assign_with_comments(std::move(value));
+      }
+    } else if (pParent->type() == Type::Map || (isAdd && !pParent->defined())) {
+      if (!isAdd && !ValueAccess::find(*pParent, key)) {
+        throw index_out_of_bounds("Path not found: " + pointer);
+      }
+
+      if (isRemove) {
+        pParent->erase(key);
+      } else {
+        pParent->insert_or_assign(key, std::move(value));
+      }
+    } else {
+      throw type_mismatch("Must be of type Vector or Map for that operation.");
+    }
+  }
+}
+
+
 }
@@ -37,19 +37,11 @@ static std::string _readStream(std::ifstream *pInfile) {
 }
 
 
-static std::string _readFile(std::string pathBeginning, std::string extra,
-  std::string pathEnd, bool *pUsedExtra)
-{
+static std::string _readFile(std::string path) {
   // The output from Hjson::Marshal() always uses Unix EOL, but git might have
   // converted files to Windows EOL on Windows, therefore we open the file in
   // text mode instead of binary mode.
-  std::ifstream infile(pathBeginning + extra + pathEnd, std::ifstream::ate);
-  if (!infile.is_open()) {
-    infile.open(pathBeginning + pathEnd, std::ifstream::ate);
-    *pUsedExtra = false;
-  } else {
-    *pUsedExtra = true;
-  }
+  std::ifstream infile(path, std::ifstream::ate);
   if (!infile.is_open()) {
     return "";
   }
@@ -160,21 +152,15 @@ static void _examine(std::string filename) {
     }
   }
 
-  std::string extra = "";
-#if HJSON_USE_CHARCONV
-  extra = "charconv/";
-#endif
-
   Hjson::EncoderOptions opt;
   opt.bracesSameLine = true;
 
-  bool bUsedExtra = false;
-  auto rhjson = _readFile("assets/comments2/", extra, name + "_result.hjson", &bUsedExtra);
+  auto rhjson = _readFile("assets/comments2/" + name + "_result.hjson");
   auto actualHjson = Hjson::Marshal(root, opt);
 
 #if WRITE_FACIT
   std::ofstream outputFile = std::ofstream("assets/comments2/" +
-    (bUsedExtra ? extra + '/' : "") + name + "_result.hjson", std::ofstream::binary);
+    name + "_result.hjson", std::ofstream::binary);
   outputFile << actualHjson << '\n';
   outputFile.close();
 #endif
@@ -183,11 +169,11 @@ static void _examine(std::string filename) {
 
   opt.bracesSameLine = false;
 
-  rhjson = _readFile("assets/comments/", extra, name + "_result.hjson", &bUsedExtra);
+  rhjson = _readFile("assets/comments/" + name + "_result.hjson");
   actualHjson = Hjson::Marshal(root, opt);
 
 #if WRITE_FACIT
-  outputFile = std::ofstream("assets/comments/" + (bUsedExtra ? extra + '/' : "") +
+  outputFile = std::ofstream("assets/comments/" +
     name + "_result.hjson", std::ofstream::binary);
   outputFile << actualHjson << '\n';
   outputFile.close();
@@ -197,11 +183,11 @@ static void _examine(std::string filename) {
 
   opt.comments = false;
 
-  rhjson = _readFile("assets/", extra, name + "_result.hjson", &bUsedExtra);
+  rhjson = _readFile("assets/" + name + "_result.hjson");
   actualHjson = Hjson::Marshal(root, opt);
 
 #if WRITE_FACIT
-  outputFile = std::ofstream("assets/" + (bUsedExtra ? extra + '/' : "") +
+  outputFile = std::ofstream("assets/" +
     name + "_result.hjson", std::ofstream::binary);
   outputFile << actualHjson << '\n';
   outputFile.close();
@@ -209,11 +195,11 @@ static void _examine(std::string filename) {
 
   _evaluate(rhjson, actualHjson);
 
-  auto rjson = _readFile("assets/", extra, name + "_result.json", &bUsedExtra);
+  auto rjson = _readFile("assets/" + name + "_result.json");
   auto actualJson = Hjson::MarshalJson(root);
 
 #if WRITE_FACIT
-  outputFile = std::ofstream("assets/" + (bUsedExtra ? extra + '/' : "") +
+  outputFile = std::ofstream("assets/" +
     name + "_result.json", std::ofstream::binary);
   outputFile << actualJson << '\n';
   outputFile.close();
@@ -223,11 +209,11 @@ static void _examine(std::string filename) {
 
   opt.preserveInsertionOrder = false;
 
-  rhjson = _readFile("assets/sorted/", extra, name + "_result.hjson", &bUsedExtra);
+  rhjson = _readFile("assets/sorted/" + name + "_result.hjson");
   actualHjson = Hjson::Marshal(root, opt);
 
 #if WRITE_FACIT
-  outputFile = std::ofstream("assets/sorted/" + (bUsedExtra ? extra + '/' : "") +
+  outputFile = std::ofstream("assets/sorted/" +
     name + "_result.hjson", std::ofstream::binary);
   outputFile << actualHjson << '\n';
   outputFile.close();
@@ -241,11 +227,11 @@ static void _examine(std::string filename) {
   opt.separator = true;
   opt.comments = false;
 
-  rjson = _readFile("assets/sorted/", extra, name + "_result.json", &bUsedExtra);
+  rjson = _readFile("assets/sorted/" + name + "_result.json");
   actualJson = Hjson::Marshal(root, opt);
 
 #if WRITE_FACIT
-  outputFile = std::ofstream("assets/sorted/" + (bUsedExtra ? extra + '/' : "") +
+  outputFile = std::ofstream("assets/sorted/" +
     name + "_result.json", std::ofstream::binary);
   outputFile << actualJson << '\n';
   outputFile.close();
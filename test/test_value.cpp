@@ -1,8 +1,14 @@
 #include <hjson.h>
+#include <hjson_bind.h>
 #include <cmath>
 #include <cstring>
 #include <sstream>
+#include <fstream>
 #include <cstdio>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <limits>
 #include "hjson_test.h"
 
 
@@ -11,6 +17,87 @@ static std::string _test_string_param(std::string param) {
 }
 
 
+// Records the events from Hjson::Parse() as text.
+class EventRecorder : public Hjson::EventHandler {
+public:
+  std::string events;
+
+  void start_object() override {
+    events += "{";
+  }
+
+  void end_object() override {
+    events += "}";
+  }
+
+  void start_array() override {
+    events += "[";
+  }
+
+  void end_array() override {
+    events += "]";
+  }
+
+  void key(const Hjson::StringView& name) override {
+    events += "k:" + static_cast<std::string>(name) + " ";
+  }
+
+  void string(const Hjson::StringView& str) override {
+    events += "s:" + static_cast<std::string>(str) + " ";
+  }
+
+  void scalar(const Hjson::Value& val) override {
+    events += Hjson::Marshal(val) + " ";
+  }
+
+  void comment(const Hjson::StringView& text) override {
+    events += "c:" + static_cast<std::string>(text) + " ";
+  }
+};
+
+
+
+struct BindPool {
+  std::string host;
+  int port = 80;
+  std::vector<double> weights;
+};
+HJSON_BIND(BindPool,
+  HJSON_FIELD(host)
+  HJSON_FIELD(port)
+  HJSON_FIELD_NAMED(weights, "weight-list"))
+
+
+struct BindService {
+  std::string name;
+  bool enabled = false;
+  std::uint16_t retries = 0;
+  std::vector<BindPool> pools;
+  std::map<std::string, std::int64_t> limits;
+  Hjson::Value extra;
+};
+HJSON_BIND(BindService,
+  HJSON_FIELD(name)
+  HJSON_FIELD(enabled)
+  HJSON_FIELD(retries)
+  HJSON_FIELD(pools)
+  HJSON_FIELD(limits)
+  HJSON_FIELD(extra))
+
+
+struct BindNumbers {
+  std::uint8_t u8 = 0;
+  short s = 0;
+  int i = 0;
+  std::uint64_t u64 = 0;
+};
+HJSON_BIND(BindNumbers,
+  HJSON_FIELD(u8)
+  HJSON_FIELD(s)
+  HJSON_FIELD(i)
+  HJSON_FIELD(u64))
+
+
 void test_value() {
   {
     Hjson::Value valVec(Hjson::Type::Vector);
@@ -1457,4 +1544,1312 @@ key: val2
       assert(!"Did not throw error for duplicate key");
     } catch(const Hjson::syntax_error& e) {}
   }
+
+  {
+    Hjson::Value val;
+    val["a"] = "x\xe2\x80\xa8y";
+    val["b"] = "true // no";
+    val["c"] = "line1\r\nline2\n";
+    val["d"] = " lead";
+    val["e"] = "it'''s\n";
+    val["f"] = "tab\there";
+    val["g/*"] = "\xef\xbb\xbf";
+    val["h"] = "nul\x01";
+    auto str = Hjson::Marshal(val);
+    assert(str == "{\n  a: \"x\\u2028y\"\n  b: \"true // no\"\n  c:\n    '''\n"
+      "    line1\n\n    line2\n\n    '''\n  d: \" lead\"\n  e: \"it'''s\\n\"\n"
+      "  f: '''tab\there'''\n  \"g/*\": \"\\ufeff\"\n  h: \"nul\\u0001\"\n}");
+    str = Hjson::MarshalJson(val);
+    assert(str == "{\n  \"a\": \"x\\u2028y\",\n  \"b\": \"true // no\",\n"
+      "  \"c\": \"line1\\r\\nline2\\n\",\n  \"d\": \" lead\",\n"
+      "  \"e\": \"it'''s\\n\",\n  \"f\": \"tab\\there\",\n"
+      "  \"g/*\": \"\\ufeff\",\n  \"h\": \"nul\\u0001\"\n}");
+  }
+
+  {
+    // Special characters on each side of the chunk borders used when
+    // scanning the input.
+    for (int len = 0; len < 70; ++len) {
+      std::string pad(len, 'x');
+      auto root = Hjson::Unmarshal("[\n\"" + pad + "\\t\"\n'''\n" + pad +
+        "\ny'''\n# " + pad + "\n/* " + pad + " */ " + pad + "z\n]");
+      assert(root.size() == 3);
+      assert(root[0] == pad + "\t");
+      assert(root[1] == pad + "\ny");
+      assert(root[2] == pad + "z");
+      assert(root[2].get_comment_before() == "\n# " + pad + "\n/* " + pad + " */ ");
+    }
+  }
+
+  {
+    std::string str = R"(
+# comment
+a: 1
+b: [2, "three", 4.5, true, null]
+c: {
+  d: quoteless string that is longer than the small string buffer
+}
+)";
+    auto root = Hjson::Unmarshal(str);
+    Hjson::Value clone;
+    {
+      Hjson::Arena arena(256);
+      Hjson::DecoderOptions decOpt;
+      decOpt.arena = &arena;
+      auto root2 = Hjson::Unmarshal(str, decOpt);
+      assert(arena.capacity() > 0);
+      assert(root2.deep_equal(root));
+      assert(Hjson::Marshal(root2) == Hjson::Marshal(root));
+      root2["b"].push_back(6);
+      root2["e"] = "new";
+      assert(root2["b"].size() == 6);
+      assert(root2["e"] == "new");
+      root2.erase("e");
+      root2["b"].erase(5);
+      clone = root2.clone();
+    }
+    assert(clone.deep_equal(root));
+    assert(Hjson::Marshal(clone) == Hjson::Marshal(root));
+    // Values created outside of the decoder are not allocated from the arena.
+    Hjson::Arena arena;
+    Hjson::Value val(1);
+    assert(arena.capacity() == 0);
+  }
+
+  {
+    Hjson::Value val;
+    for (int a = 0; a < 1000; ++a) {
+      val["k" + std::to_string(999 - a)] = a;
+    }
+    for (int a = 0; a < 1000; a += 3) {
+      assert(val.erase("k" + std::to_string(999 - a)) == 1);
+    }
+    assert(val.erase("k999") == 0);
+    assert(val.size() == 666);
+    val.erase(0);
+    val.move(0, 10);
+    assert(val.key(9) == "k997");
+    assert(val[9] == 2);
+    for (int a = 0; a < int(val.size()); ++a) {
+      assert(val[a] == val[val.key(a)]);
+    }
+    std::string prev;
+    for (const auto& it : val) {
+      assert(prev < it.first);
+      prev = it.first;
+    }
+    val.clear();
+    assert(val.size() == 0);
+    val["x"] = 1;
+    assert(val.key(0) == "x");
+  }
+
+  {
+    std::string txt = "# before\n5 # after";
+    Hjson::Value root = Hjson::Unmarshal(txt);
+    // The comments must not depend on the input buffer.
+    txt.assign(txt.size(), 'x');
+    assert(root.get_comment_before() == "# before\n");
+    assert(root.get_comment_after() == " # after");
+    root.set_comment_after(" # changed");
+    assert(root.get_comment_before() == "# before\n");
+    assert(Hjson::Marshal(root) == "# before\n5 # changed");
+
+    txt = "{\n  a: /* v */ 1\n  b: 2 # two\n}";
+    Hjson::Value map = Hjson::Unmarshal(txt);
+    assert(map["a"].get_comment_key() == " /* v */ ");
+    assert(map["a"].get_comment_before() == "");
+    assert(map["b"].get_comment_after() == " # two\n");
+    assert(Hjson::Marshal(map) == txt);
+    Hjson::DecoderOptions decOpt;
+    decOpt.comments = false;
+    Hjson::Value noComments = Hjson::Unmarshal(txt, decOpt);
+    assert(noComments["b"].get_comment_after() == "");
+    assert(Hjson::Marshal(noComments) == "{\n  a: 1\n  b: 2\n}");
+  }
+
+  {
+    std::string txt = "[\n  \"quoted\"\n  \"esc\\taped\"\n  quoteless value\n  'single'\n  ''\n]";
+    Hjson::DecoderOptions decOpt;
+    decOpt.stringViews = true;
+    Hjson::Value root = Hjson::Unmarshal(txt, decOpt);
+    assert(root[0].as_string_view() == "quoted");
+    assert(root[0].as_string_view().data() == txt.data() + 5);
+    assert(root[1].as_string_view() == "esc\taped");
+    assert(root[2].as_string_view() == "quoteless value");
+    assert(root[2].as_string_view().data() == txt.data() + 29);
+    assert(root[3] == "single");
+    assert(root[4].as_string_view().empty());
+    assert(root[2].to_string() == "quoteless value");
+    assert(!std::strcmp(root[2], "quoteless value"));
+    assert(root[0] < root[2]);
+    assert(Hjson::Marshal(root) == Hjson::Marshal(Hjson::Unmarshal(txt)));
+    root[0] += "!";
+    assert(root[0] == "quoted!");
+    assert(txt.substr(5, 7) == "quoted\"");
+
+    Hjson::Value owned = Hjson::Unmarshal(std::move(txt), decOpt);
+    txt = "";
+    assert(owned[2] == "quoteless value");
+    Hjson::Value val(std::string("str"));
+    Hjson::StringView view = val.as_string_view();
+    assert(view.size() == 3 && view[1] == 't');
+    assert(static_cast<std::string>(view) == "str");
+    assert(view.compare("strs") < 0 && view.compare("st") > 0);
+    try {
+      Hjson::Value(1).as_string_view();
+      assert(!"Did not throw error for as_string_view() on Int64.");
+    } catch(const Hjson::type_mismatch&) {}
+  }
+
+  {
+    const char *szTmp = "tmpTestFile.hjson";
+    {
+      std::ofstream outfile(szTmp, std::ofstream::binary);
+      outfile << "# head\n{\n  a: 1 # after a\n  b: \"quoted\"\n  c: quoteless\n}\n";
+    }
+
+    Hjson::DecoderOptions decOpt;
+    auto root1 = Hjson::UnmarshalFromFile(szTmp, decOpt);
+    decOpt.stringViews = true;
+    auto root2 = Hjson::UnmarshalFromFile(szTmp, decOpt);
+    // Neither tree may depend on the file once it has been removed.
+    std::remove(szTmp);
+    assert(root1.deep_equal(root2));
+    assert(root1["c"] == "quoteless");
+    assert(root1["a"].get_comment_after() == " # after a\n  ");
+    assert(root2["a"].get_comment_after() == " # after a\n  ");
+    assert(root2["b"].as_string_view() == "quoted");
+    assert(root1.get_comment_before() == "# head\n");
+    assert(Hjson::Marshal(root1) == Hjson::Marshal(root2));
+
+    {
+      std::ofstream outfile(szTmp, std::ofstream::binary);
+    }
+    // An empty file cannot be mapped.
+    assert(Hjson::UnmarshalFromFile(szTmp).empty());
+    std::remove(szTmp);
+  }
+
+  {
+    std::string txt = "# head\n{\n  a: \"}{\" // }\n  b: x } y\n  c: 1\n  d: [\n    /* ] */ '''\n    }'''\n  ]\n}\n[1, 2]# tail\nrootless: 3\n";
+    Hjson::IncrementalDecoder dec;
+    std::vector<Hjson::Value> docs;
+    for (char c : txt) {
+      if (dec.feed(&c, 1)) {
+        docs.push_back(dec.take());
+        assert(!dec.ready());
+      }
+    }
+    assert(docs.size() == 2);
+    assert(!dec.take().defined());
+    assert(dec.finish());
+    docs.push_back(dec.take());
+    assert(!dec.ready() && dec.buffered() == 0);
+
+    assert(docs[0]["a"] == "}{");
+    assert(docs[0]["b"] == "x } y");
+    assert(docs[0]["c"] == 1);
+    assert(docs[0]["d"][0] == "}");
+    assert(docs[0].get_comment_before() == "# head\n");
+    assert(Hjson::Marshal(docs[0]) == Hjson::Marshal(Hjson::Unmarshal(
+      txt.substr(0, txt.find("[1, 2]")))));
+    assert(docs[1].size() == 2 && docs[1][1] == 2);
+    assert(docs[2]["rootless"] == 3);
+
+    // Several documents in one chunk, and only whitespace after the last one.
+    Hjson::IncrementalDecoder dec2;
+    assert(dec2.feed("{a: 1}{b: 2}\n"));
+    assert(dec2.take()["a"] == 1);
+    assert(dec2.ready());
+    assert(dec2.take()["b"] == 2);
+    assert(!dec2.finish());
+    assert(dec2.buffered() == 0);
+
+    Hjson::IncrementalDecoder dec3;
+    assert(!dec3.feed("{a: 1\n"));
+    assert(dec3.finish());
+    try {
+      dec3.take();
+      assert(!"Did not throw error for an unterminated document.");
+    } catch(const Hjson::syntax_error&) {}
+
+    // A syntax error before the end of the input is reported without waiting
+    // for more input, and all of the buffered input is discarded.
+    Hjson::IncrementalDecoder dec4;
+    assert(!dec4.feed("{a: [1, 2"));
+    assert(dec4.feed("}, b: 3}\n{c: 4}"));
+    try {
+      dec4.take();
+      assert(!"Did not throw error for an invalid document.");
+    } catch(const Hjson::syntax_error&) {}
+    assert(!dec4.ready() && dec4.buffered() == 0);
+    assert(dec4.feed("{c: 5}") && dec4.take()["c"] == 5);
+  }
+
+  {
+    std::string txt = "# head\n{\n  a: 1\n  \"b\\tc\": [true, null, -2.5, 'x']\n  d: quoteless, {x}\n  e: {} // end\n}";
+    EventRecorder rec;
+    Hjson::Parse(txt, rec);
+    assert(rec.events == "c:# head\n {k:a 1 k:b\tc [true null -2.5 s:x ]k:d "
+      "s:quoteless, {x} k:e {}c: // end\n }");
+
+    Hjson::DecoderOptions decOpt;
+    decOpt.comments = false;
+    EventRecorder rec2;
+    Hjson::Parse("a: 1\n# c\nb: '''\n  ml\n  '''", rec2, decOpt);
+    assert(rec2.events == "{k:a 1 k:b s:ml }");
+
+    // A single value as root.
+    EventRecorder rec3;
+    Hjson::Parse("hello world", rec3);
+    assert(rec3.events == "s:hello world ");
+    EventRecorder rec4;
+    Hjson::Parse("", rec4);
+    assert(rec4.events == "{}");
+
+    try {
+      EventRecorder rec5;
+      Hjson::Parse("[1, 2", rec5);
+      assert(!"Did not throw error for an unterminated vector.");
+    } catch(const Hjson::syntax_error&) {}
+    try {
+      EventRecorder rec6;
+      Hjson::Parse("{a: 1} b", rec6);
+      assert(!"Did not throw error for trailing characters.");
+    } catch(const Hjson::syntax_error&) {}
+  }
+
+  {
+    Hjson::Value root = Hjson::Unmarshal("[9223372036854775807, -9223372036854775808, "
+      "9223372036854775808, -0, -0.0, 0.1, 1., 2.2250738585072011e-308, 5e-324, "
+      "1.00000000000000011102230246251565404236316680908203125, "
+      "1.00000000000000011102230246251565404236316680908203126\n1e309\n00\n1e\n]");
+    assert(root[0].type() == Hjson::Type::Int64);
+    assert(root[0].to_int64() == INT64_MAX);
+    assert(root[1].to_int64() == INT64_MIN);
+    assert(root[2].type() == Hjson::Type::Double);
+    assert(root[2].to_double() == 9223372036854775808.0);
+    assert(root[3].type() == Hjson::Type::Int64 && root[3] == 0);
+    assert(root[4].type() == Hjson::Type::Double && std::signbit(root[4].to_double()));
+    assert(root[5].to_double() == 0.1);
+    assert(root[6].type() == Hjson::Type::Double && root[6] == 1.0);
+    assert(root[7].to_double() == std::nextafter(2.2250738585072014e-308, 0.0));
+    assert(root[8].to_double() == std::nextafter(0.0, 1.0));
+    // Exactly halfway between 1 and the next double, rounded to even. Then
+    // just above halfway.
+    assert(root[9].to_double() == 1.0);
+    assert(root[10].to_double() == std::nextafter(1.0, 2.0));
+    // Not numbers.
+    assert(root[11] == "1e309");
+    assert(root[12] == "00");
+    assert(root[13] == "1e");
+  }
+
+  {
+    assert(Hjson::Value(0.1 + 0.2).to_string() == "0.30000000000000004");
+    assert(Hjson::Value(1701.0).to_string() == "1701.0");
+    assert(Hjson::Value(-0.0).to_string() == "-0.0");
+    assert(Hjson::Value(1e20).to_string() == "1e+20");
+    assert(Hjson::Value(1.5e-7).to_string() == "1.5e-07");
+    assert(Hjson::Value(0.0001).to_string() == "0.0001");
+    assert(Hjson::Value(5e-324).to_string() == "5e-324");
+    assert(Hjson::Value(1.7976931348623157e308).to_string() == "1.7976931348623157e+308");
+    assert(Hjson::Value(INT64_MIN).to_string() == "-9223372036854775808");
+
+    Hjson::Value arr;
+    arr.push_back(0.1 + 0.2);
+    arr.push_back(1e20);
+    arr.push_back(-0.0);
+    arr.push_back(-12);
+    Hjson::EncoderOptions opt;
+    opt.separator = true;
+    assert(Hjson::Marshal(arr, opt) == "[\n  0.30000000000000004,\n  1e+20,\n  0,\n  -12\n]");
+    // Every formatted Double is decoded back as exactly the same Double.
+    Hjson::Value back = Hjson::Unmarshal(Hjson::Marshal(arr));
+    assert(back[0].type() == Hjson::Type::Double && back[0] == 0.1 + 0.2);
+    assert(back[1].type() == Hjson::Type::Double && back[1] == 1e20);
+  }
+
+  {
+    Hjson::Value root;
+    for (int i = 0; i < 10000; ++i) {
+      root["key" + std::to_string(i)] = "value number " + std::to_string(i);
+    }
+    root["long"] = std::string(100000, 'x');
+    std::string expected = Hjson::Marshal(root);
+    std::string got;
+    int nChunks = 0;
+    Hjson::MarshalToCallback(root, [&](const char *data, size_t size) {
+      got.append(data, size);
+      ++nChunks;
+    });
+    assert(got == expected);
+    assert(nChunks > 1);
+
+    std::stringstream ss;
+    ss << Hjson::StreamEncoder(root, Hjson::EncoderOptions());
+    assert(ss.str() == expected);
+  }
+
+  {
+    Hjson::Value root = Hjson::Unmarshal("{\n  # comment\n  b: [1, 2.5, true, null]\n"
+      "  a: quoteless text\n  c: '''\n    two\n    lines\n    '''\n  d: {}\n  e: []\n"
+      "  \"k\\\"ey\": \"tab\\there, long enough to be checked 8 chars at a time\"\n}");
+    root["u"] = Hjson::Value(Hjson::Type::Undefined);
+    root["z"] = -0.0;
+    assert(Hjson::MarshalJsonCompact(root) == "{\"b\":[1,2.5,true,null],"
+      "\"a\":\"quoteless text\",\"c\":\"two\\nlines\",\"d\":{},\"e\":[],"
+      "\"k\\\"ey\":\"tab\\there, long enough to be checked 8 chars at a time\",\"z\":0}");
+
+    Hjson::EncoderOptions opt;
+    opt.bracesSameLine = true;
+    opt.quoteAlways = true;
+    opt.quoteKeys = true;
+    opt.separator = true;
+    opt.comments = false;
+    assert(Hjson::MarshalJson(root) == Hjson::Marshal(root, opt));
+    assert(Hjson::MarshalJsonCompact(Hjson::Value("x")) == "\"x\"");
+    assert(Hjson::MarshalJsonCompact(Hjson::Value(7)) == "7");
+  }
+
+  {
+    std::string arr = "// before\n[\n", obj = "{\n";
+    for (int i = 0; i < 40000; ++i) {
+      arr += "  {\n    id: " + std::to_string(i) + " # comment " + std::to_string(i) +
+        "\n    text: '''\n    multi\n    line\n    '''\n  }\n";
+      obj += "  key" + std::to_string(i % 30000) + ": value " + std::to_string(i) + "\n";
+    }
+    arr += "] // after";
+    obj += "}";
+    Hjson::DecoderOptions opt;
+    opt.threads = 4;
+    size_t nCalls = 0;
+    Hjson::DecoderOptions optExec = opt;
+    optExec.executor = [&](size_t count, const std::function<void(size_t)>& task) {
+      for (size_t i = 0; i < count; ++i) {
+        ++nCalls;
+        task(i);
+      }
+    };
+    Hjson::Value seqArr = Hjson::Unmarshal(arr), parArr = Hjson::Unmarshal(arr, opt);
+    assert(parArr.size() == 40000);
+    assert(Hjson::Marshal(parArr) == Hjson::Marshal(seqArr));
+    assert(Hjson::Marshal(Hjson::Unmarshal(arr, optExec)) == Hjson::Marshal(seqArr));
+    assert(nCalls > 1);
+    // Duplicate keys overwrite the earlier value but keep its position.
+    Hjson::Value seqObj = Hjson::Unmarshal(obj), parObj = Hjson::Unmarshal(obj, opt);
+    assert(parObj.size() == 30000);
+    assert(parObj["key5"] == "value 30005");
+    assert(Hjson::Marshal(parObj) == Hjson::Marshal(seqObj));
+
+    opt.duplicateKeyException = true;
+    try {
+      Hjson::Unmarshal(obj, opt);
+      assert(!"Did not throw error for a duplicate key.");
+    } catch (const Hjson::syntax_error& e) {
+      assert(std::string(e.what()).find("'key0'") != std::string::npos);
+    }
+    arr.insert(arr.find("  {\n    id: 20000 "), "  }\n");
+    try {
+      Hjson::Unmarshal(arr, opt);
+      assert(!"Did not throw error for a syntax error.");
+    } catch (const Hjson::syntax_error&) {}
+  }
+
+  {
+    std::string text = "# settings\nname: demo\nports: [80, 443]\n\"a\\tb\": 2.5\n"
+      "nested: {\n  deep: {flag: true, none: null}\n  text: quoteless here\n}\n"
+      "ml: '''\n  one\n  two\n  '''\nname: again\n";
+    Hjson::LazyDocument doc(text);
+    Hjson::LazyValue root = doc.root();
+    assert(root.type() == Hjson::Type::Map);
+    assert(root.size() == 6);
+    assert(root["name"].to_string() == "again");
+    assert(root["ports"].size() == 2);
+    assert(root["ports"][1].type() == Hjson::Type::Int64);
+    assert(root["ports"][1].to_int64() == 443);
+    assert(root["a\tb"].type() == Hjson::Type::Double);
+    assert(root.key(2) == "a\tb");
+    assert(root["nested"]["deep"]["flag"].type() == Hjson::Type::Bool);
+    assert(root["nested"]["deep"]["none"].type() == Hjson::Type::Null);
+    assert(root["nested"]["text"].to_string() == "quoteless here");
+    assert(root["ml"].to_string() == "one\ntwo");
+    assert(!root["missing"].defined());
+    assert(!root["missing"]["more"].defined());
+    assert(root["nested"].to_value().deep_equal(Hjson::Unmarshal(text)["nested"]));
+    assert(root.to_value()["ports"].deep_equal(Hjson::Unmarshal(text)["ports"]));
+    try {
+      root.at("missing");
+      assert(!"Did not throw error for a missing key.");
+    } catch (const Hjson::index_out_of_bounds&) {}
+    try {
+      root["ports"]["x"];
+      assert(!"Did not throw error for a key lookup in a vector.");
+    } catch (const Hjson::type_mismatch&) {}
+    try {
+      root["ports"][2];
+      assert(!"Did not throw error for an index out of bounds.");
+    } catch (const Hjson::index_out_of_bounds&) {}
+
+    assert(Hjson::LazyDocument(std::string("[1, 2]")).root()[0].to_int64() == 1);
+    assert(Hjson::LazyDocument("").root().type() == Hjson::Type::Map);
+    assert(Hjson::LazyDocument("\"str\"").root().to_string() == "str");
+    try {
+      Hjson::LazyDocument("{a: [1, 2}");
+      assert(!"Did not throw error for a syntax error.");
+    } catch (const Hjson::syntax_error&) {}
+  }
+
+  {
+    Hjson::Value root = Hjson::Unmarshal("db: {\n  host: localhost\n  port: 5432\n}\n"
+      "names: [\"one\", \"two\"]\ncount: 1\nother: {\n  text: shared\n}\n");
+    Hjson::Value snap = root;
+    snap.freeze();
+    assert(root.is_frozen() && root["db"]["port"].is_frozen());
+    Hjson::ConstValue cv = snap;
+    assert(cv["db"]["host"].as_string_view() == "localhost");
+    assert(cv["db"]["port"].to_int64() == 5432);
+    assert(cv["names"][1].to_string() == "two");
+    assert(cv.key(2) == "count");
+    assert(!cv["missing"].defined() && !cv["missing"]["more"].defined());
+    const Hjson::Value& constSnap = snap;
+    assert(&cv["other"].value() == &constSnap.at("other"));
+    // Reading through a non-const Value does not copy anything either.
+    assert(snap["db"]["host"] == "localhost" && snap.is_frozen());
+    // Lookups that fail leave the frozen tree as it was.
+    assert(!snap.find(Hjson::Path("db.missing")) && snap.is_frozen());
+    assert(!snap.find(Hjson::Path("names.5")) && snap.is_frozen());
+    try {
+      snap.at("missing");
+      assert(!"Did not throw error for a missing key.");
+    } catch (const Hjson::index_out_of_bounds&) {}
+    try {
+      snap["names"][5];
+      assert(!"Did not throw error for an index out of bounds.");
+    } catch (const Hjson::index_out_of_bounds&) {}
+    assert(snap.is_frozen() && snap["names"].is_frozen());
+    // A found element can be changed through the pointer, so the path to it
+    // is copied, but only in the Value that was used for the lookup.
+    Hjson::Value found = snap;
+    assert(found.find(Hjson::Path("db.host"))->to_string() == "localhost");
+    assert(!found.is_frozen() && !found["db"].is_frozen() && snap.is_frozen());
+
+    Hjson::Value next = snap;
+    next["db"]["host"] = "remote";
+    next["names"].push_back("three");
+    ++next["count"];
+    next["added"] = true;
+    assert(snap["db"]["host"] == "localhost");
+    assert(snap["names"].size() == 2);
+    assert(snap["count"] == 1);
+    assert(!snap["added"].defined());
+    assert(next["db"]["host"] == "remote");
+    assert(next["names"].size() == 3);
+    assert(next["count"] == 2);
+    // Only the changed path was copied.
+    assert(!next.is_frozen() && !next["db"].is_frozen());
+    assert(next["db"]["port"].is_frozen() && next["other"].is_frozen());
+    assert(next["other"]["text"].as_string_view().data() ==
+      snap["other"]["text"].as_string_view().data());
+    next.freeze();
+    assert(next.is_frozen() && next["db"].is_frozen());
+    next.erase("other");
+    assert(next.size() == 4 && snap.size() == 4 && snap["other"].defined());
+    assert(Hjson::Marshal(snap) == Hjson::Marshal(root));
+
+    // Scalars are stored inline, so an equal frozen scalar counts as the same
+    // value, and assigning it does not thaw the tree.
+    Hjson::Value scalars = Hjson::Unmarshal("{a: 1, b: 1, c: 2}");
+    scalars.freeze();
+    const Hjson::Value& constScalars = scalars;
+    Hjson::Value same = scalars;
+    same["a"] = constScalars["b"];
+    assert(same.is_frozen());
+    same["a"] = 1;
+    assert(!same.is_frozen() && scalars.is_frozen());
+    Hjson::Value other = scalars;
+    other["a"] = constScalars["c"];
+    assert(!other.is_frozen() && other["a"] == 2 && scalars["a"] == 1);
+  }
+
+  {
+    Hjson::Value defaults = Hjson::Unmarshal("server: {\n  host: localhost\n  port: 80\n}\n"
+      "limits: {\n  users: 10\n}\nempty: {}\nname: default");
+    Hjson::Value region = Hjson::Unmarshal("server: {\n  port: 8080\n}\nregion: eu");
+    Hjson::Value host = Hjson::Unmarshal("server: {\n  host: example.com\n}\nname: host");
+    Hjson::Value merged = Hjson::Merge({defaults, region, host});
+    assert(Hjson::Marshal(merged) == Hjson::Marshal(Hjson::Merge(Hjson::Merge(defaults,
+      region), host)));
+    assert(merged.key(0) == "server" && merged.key(1) == "name");
+    assert(merged["server"]["host"] == "example.com" && merged["server"]["port"] == 8080);
+    assert(merged["empty"].type() == Hjson::Type::Map);
+    assert(!Hjson::Merge(std::vector<Hjson::Value>()).defined());
+    assert(Hjson::Merge(Hjson::Value(Hjson::Type::Map), Hjson::Value(Hjson::Type::Map)).type() ==
+      Hjson::Type::Map);
+
+    // Frozen subtrees that only one layer has are shared instead of cloned.
+    defaults.freeze();
+    region.freeze();
+    host.freeze();
+    Hjson::Value shared = Hjson::Merge({defaults, region, host});
+    assert(Hjson::Marshal(shared) == Hjson::Marshal(merged));
+    assert(!shared.is_frozen() && !shared["server"].is_frozen());
+    assert(shared["limits"].is_frozen());
+    shared["limits"]["users"] = 20;
+    assert(defaults["limits"]["users"] == 10);
+  }
+
+  {
+    std::string text = "# settings\nname: \"a\\u0001b\"\nsize: 12\nratio: 0.5\n"
+      "list: [\n  1\n  [\n    plain\n  ]\n]\n";
+    Hjson::DecoderStats decStats;
+    Hjson::DecoderOptions decOpt;
+    decOpt.stats = &decStats;
+    Hjson::Value root = Hjson::Unmarshal(text, decOpt);
+    assert(root["size"] == 12);
+    // All members stay zero if the library was built without stats.
+    if (decStats.bytes) {
+      assert(decStats.bytes == text.size());
+      assert(decStats.nodes[static_cast<int>(Hjson::Type::Map)] == 1);
+      assert(decStats.nodes[static_cast<int>(Hjson::Type::Vector)] == 2);
+      assert(decStats.nodes[static_cast<int>(Hjson::Type::Int64)] == 2);
+      assert(decStats.nodes[static_cast<int>(Hjson::Type::Double)] == 1);
+      assert(decStats.nodes[static_cast<int>(Hjson::Type::String)] == 2);
+      assert(decStats.maxDepth == 3);
+      assert(decStats.numbers == 3);
+      assert(decStats.stringBytesUnescaped == 3);
+      assert(decStats.stringBytesCopied == 5);
+      assert(decStats.commentBytes >= 10);
+      assert(decStats.allocations > 0);
+
+      // The counters are added to.
+      Hjson::Unmarshal(text, decOpt);
+      assert(decStats.bytes == 2 * text.size() && decStats.numbers == 6);
+
+      Hjson::EncoderStats encStats;
+      Hjson::EncoderOptions encOpt;
+      encOpt.stats = &encStats;
+      std::string out = Hjson::Marshal(root, encOpt);
+      assert(encStats.bytes == out.size());
+      assert(encStats.nodes[static_cast<int>(Hjson::Type::String)] == 2);
+      assert(encStats.maxDepth == 3 && encStats.numbers == 3);
+      assert(encStats.stringBytesEscaped == 3 && encStats.stringBytesCopied == 5);
+      assert(encStats.commentBytes >= 10);
+
+      Hjson::EncoderStats cbStats;
+      encOpt.stats = &cbStats;
+      size_t written = 0;
+      Hjson::MarshalToCallback(root, [&](const char*, size_t size) {
+        written += size;
+      }, encOpt);
+      assert(cbStats.bytes == written && written == out.size());
+    }
+  }
+
+  {
+    auto nested = [](int depth) {
+      return std::string(depth, '[') + "1" + std::string(depth, ']');
+    };
+    Hjson::Value deep = Hjson::Unmarshal(nested(1000));
+    assert(Hjson::MarshalJsonCompact(deep) == nested(1000));
+    assert(Hjson::Unmarshal(Hjson::Marshal(deep)).deep_equal(deep));
+
+    bool threw = false;
+    try {
+      Hjson::Unmarshal(nested(1001));
+    } catch (const Hjson::syntax_error&) {
+      threw = true;
+    }
+    assert(threw);
+    // Not read as a quoteless string instead.
+    threw = false;
+    try {
+      Hjson::Unmarshal("a: " + nested(1001));
+    } catch (const Hjson::syntax_error&) {
+      threw = true;
+    }
+    assert(threw);
+    threw = false;
+    try {
+      Hjson::EventHandler handler;
+      Hjson::Parse(nested(1001), handler);
+    } catch (const Hjson::syntax_error&) {
+      threw = true;
+    }
+    assert(threw);
+
+    Hjson::DecoderOptions decOpt;
+    decOpt.maxDepth = 3;
+    assert(Hjson::Unmarshal("a: {\n  b: [1]\n}", decOpt)["a"]["b"][0] == 1);
+    threw = false;
+    try {
+      Hjson::Unmarshal("a: {\n  b: [[1]]\n}", decOpt);
+    } catch (const Hjson::syntax_error&) {
+      threw = true;
+    }
+    assert(threw);
+
+    // No limit, and no recursion in the decoder or the encoder.
+    decOpt.maxDepth = 0;
+    Hjson::Value deeper = Hjson::Unmarshal(nested(5000), decOpt);
+    assert(Hjson::MarshalJsonCompact(deeper) == nested(5000));
+
+    // Nor in clone(), deep_equal(), hash(), freeze() or the destructor.
+    {
+      Hjson::Value deepest = Hjson::Unmarshal(nested(200000), decOpt);
+      Hjson::Value copy = deepest.clone();
+      assert(copy.deep_equal(deepest) && copy.hash() == deepest.hash());
+      Hjson::Value inner = copy;
+      while (inner[0].size()) {
+        inner = inner[0];
+      }
+      inner.push_back(1);
+      assert(!copy.deep_equal(deepest) && !deepest.deep_equal(copy));
+      deepest.freeze();
+      assert(deepest.is_frozen() && deepest.clone().deep_equal(deepest));
+      copy.freeze();
+      assert(copy.is_frozen() && !copy.deep_equal(deepest));
+    }
+  }
+
+  {
+    Hjson::Value root = Hjson::UnmarshalFromFile("assets/comments_test.hjson");
+    root["extra"] = Hjson::Value(Hjson::Type::Vector);
+    root["extra"].push_back(-12345678901234LL);
+    root["extra"].push_back(0.1);
+    root["extra"].push_back(Hjson::Value());
+    root["extra"].push_back(false);
+    root["extra"].push_back(std::string("nul\0char", 8));
+    root["extra"].push_back(Hjson::Value(Hjson::Type::Map));
+
+    std::string bin = Hjson::MarshalBinary(root);
+    Hjson::Value back = Hjson::UnmarshalBinary(bin);
+    assert(back.deep_equal(root));
+    assert(Hjson::Marshal(back) == Hjson::Marshal(root));
+    assert(back["extra"][0].type() == Hjson::Type::Int64);
+    assert(back["extra"][2].type() == Hjson::Type::Undefined);
+    assert(back["extra"][4].to_string().size() == 8);
+
+    Hjson::EncoderOptions encOpt;
+    encOpt.comments = false;
+    std::string binNoComments = Hjson::MarshalBinary(root, encOpt);
+    assert(binNoComments.size() < bin.size());
+    Hjson::DecoderOptions decOpt;
+    decOpt.comments = false;
+    assert(Hjson::Marshal(Hjson::UnmarshalBinary(binNoComments)) ==
+      Hjson::Marshal(Hjson::UnmarshalBinary(bin, decOpt)));
+
+    // Strings refer to the data, which the Value tree keeps alive.
+    decOpt.stringViews = true;
+    std::string copy = bin;
+    Hjson::Value views = Hjson::UnmarshalBinary(std::move(copy), decOpt);
+    assert(views.deep_equal(root));
+    auto sv = views["extra"][4].as_string_view();
+    assert(sv.size() == 8 && !std::memcmp(sv.data(), "nul\0char", 8));
+
+    const char *szTmp = "tmpTestFile.hjb";
+    Hjson::MarshalBinaryToFile(root, szTmp);
+    assert(Hjson::UnmarshalBinaryFromFile(szTmp).deep_equal(root));
+    assert(Hjson::UnmarshalBinaryFromFile(szTmp, decOpt).deep_equal(root));
+    std::remove(szTmp);
+
+    // Every truncation and a few corruptions are detected.
+    for (size_t a = 0; a < bin.size(); ++a) {
+      bool threw = false;
+      try {
+        Hjson::UnmarshalBinary(bin.data(), a);
+      } catch (const Hjson::syntax_error&) {
+        threw = true;
+      }
+      assert(threw);
+    }
+    for (const char *sz : {"{}", "HJB\x02\x01", "HJB\x01\x01\x01", "HJB\x01\x20",
+      "HJB\x01\x16", "HJB\x01\x06\xff\xff\xff\xff\x0f"})
+    {
+      bool threw = false;
+      try {
+        Hjson::UnmarshalBinary(std::string(sz));
+      } catch (const Hjson::syntax_error&) {
+        threw = true;
+      }
+      assert(threw);
+    }
+
+    // A varint must not be longer than MarshalBinary() writes it, nor overflow
+    // 64 bits.
+    Hjson::Value extremes(Hjson::Type::Vector);
+    extremes.push_back(std::numeric_limits<std::int64_t>::min());
+    extremes.push_back(std::numeric_limits<std::int64_t>::max());
+    Hjson::Value extremesBack = Hjson::UnmarshalBinary(Hjson::MarshalBinary(extremes));
+    assert(extremesBack[0] == std::numeric_limits<std::int64_t>::min());
+    assert(extremesBack[1] == std::numeric_limits<std::int64_t>::max());
+    for (const std::string& bad : {std::string("HJB\x01\x04\x80\x00", 7),
+      std::string("HJB\x01\x04") + std::string(9, '\xff') + '\x02'})
+    {
+      bool threw = false;
+      try {
+        Hjson::UnmarshalBinary(bad);
+      } catch (const Hjson::syntax_error&) {
+        threw = true;
+      }
+      assert(threw);
+    }
+
+    // Nested vectors that each claim about as many elements as there are bytes
+    // left fail without reserving room for all of them.
+    std::string claims = "HJB\x01";
+    for (int a = 0; a < 999; ++a) {
+      claims += "\x06\xff\xff\x7f";
+    }
+    claims.append(1 << 21, '\xff');
+    bool threwClaims = false;
+    try {
+      Hjson::UnmarshalBinary(claims);
+    } catch (const Hjson::syntax_error&) {
+      threwClaims = true;
+    }
+    assert(threwClaims);
+
+    Hjson::Value deep = Hjson::Unmarshal("[[[1]]]");
+    decOpt.maxDepth = 2;
+    bool threw = false;
+    try {
+      Hjson::UnmarshalBinary(Hjson::MarshalBinary(deep), decOpt);
+    } catch (const Hjson::syntax_error&) {
+      threw = true;
+    }
+    assert(threw);
+    decOpt.maxDepth = 3;
+    assert(Hjson::UnmarshalBinary(Hjson::MarshalBinary(deep), decOpt).deep_equal(deep));
+  }
+
+  {
+    // Scalars are values, only vectors and maps (and Undefined) are shared.
+    Hjson::Value num = 1, numCopy = num;
+    numCopy += 1;
+    assert(num == 1 && numCopy == 2);
+    Hjson::Value str = "text", strCopy = str;
+    strCopy += "s";
+    assert(str == "text" && strCopy == "texts");
+
+    Hjson::Value map;
+    map["n"] = 1.5;
+    map["b"] = true;
+    Hjson::Value elem = map["n"];
+    elem += 1;
+    assert(map["n"] == 1.5 && elem == 2.5);
+    map["n"] += 1;
+    map["b"] = false;
+    assert(map["n"] == 2.5 && map["b"] == false);
+    map["n"].set_comment_after(" # changed");
+    assert(map["n"].get_comment_after() == " # changed" && map["n"] == 2.5);
+
+    Hjson::Value vec(Hjson::Type::Vector), vecCopy = vec;
+    vecCopy.push_back(1);
+    assert(vec.size() == 1);
+    Hjson::Value undef, undefCopy = undef;
+    undefCopy["key"] = 1;
+    assert(undef["key"] == 1);
+
+    // The number of allocations does not depend on the number of scalars.
+    auto allocations = [](const std::string& text) {
+      Hjson::DecoderStats stats;
+      Hjson::DecoderOptions decOpt;
+      decOpt.stats = &stats;
+      Hjson::Unmarshal(text, decOpt);
+      return stats.allocations;
+    };
+    assert(allocations("[1, 2.5, true, null]") ==
+      allocations("[1, 2.5, true, null, 3, 4.5, false, null, -5, 6e7]"));
+  }
+
+  {
+    Hjson::Value vec;
+    vec.reserve(10);
+    assert(vec.type() == Hjson::Type::Undefined);
+    vec.push_back(1);
+    vec.reserve(10);
+    Hjson::Value elem = "moved";
+    elem.set_comment_before("# before");
+    vec.push_back(std::move(elem));
+    assert(vec.size() == 2 && vec[1] == "moved");
+    assert(vec[1].get_comment_before() == "# before");
+    Hjson::Value& added = vec.emplace_back("text");
+    added.set_comment_after(" # after");
+    assert(vec.size() == 3 && vec[2] == "text");
+    assert(vec[2].get_comment_after() == " # after");
+    assert(vec.emplace_back(Hjson::Type::Map).type() == Hjson::Type::Map);
+    assert(vec.emplace_back(3.5) == 3.5 && vec.size() == 5);
+
+    Hjson::Value map;
+    Hjson::Value val = 1;
+    val.set_comment_key("# key");
+    assert(map.insert_or_assign("first", val));
+    map["second"] = 2;
+    map.reserve(3);
+    assert(map.insert_or_assign("third", 3));
+    assert(!map.insert_or_assign("first", Hjson::Value("one")));
+    assert(map.size() == 3 && map.key(0) == "first" && map.key(2) == "third");
+    assert(map["first"] == "one" && map["first"].get_comment_key() == "");
+    assert(!map.insert_or_assign("third", val));
+    assert(map["third"] == 1 && map["third"].get_comment_key() == "# key");
+
+    // The frozen original is not changed.
+    Hjson::Value frozen = map.clone();
+    frozen.freeze();
+    Hjson::Value thawed = frozen;
+    assert(thawed.insert_or_assign("fourth", 4));
+    assert(frozen.size() == 3 && thawed.size() == 4);
+
+    bool threw = false;
+    try {
+      vec.insert_or_assign("key", 1);
+    } catch (const Hjson::type_mismatch&) {
+      threw = true;
+    }
+    assert(threw);
+  }
+
+  {
+    // Elements of different shapes after each other (the decoder reserves
+    // room for each vector or map based on the previous one).
+    Hjson::Value root = Hjson::Unmarshal("[\n{a: 1, b: 2, c: 3}\n{a: 4}\n"
+      "[1, 2, 3, 4]\n{}\n[]\n{a: 5, b: [6, 7], c: {d: 8}, e: 9}\n]");
+    assert(root.size() == 6);
+    assert(root[0].size() == 3 && root[0]["c"] == 3);
+    assert(root[1].size() == 1 && root[1]["a"] == 4);
+    assert(root[2].size() == 4 && root[2][3] == 4);
+    assert(root[3].type() == Hjson::Type::Map && root[3].empty());
+    assert(root[4].type() == Hjson::Type::Vector && root[4].empty());
+    assert(root[5].size() == 4 && root[5]["b"][1] == 7 && root[5]["c"]["d"] == 8);
+    assert(root[5].key(3) == "e");
+  }
+
+  {
+    Hjson::Value cfg = Hjson::Unmarshal("{service: {pools: [1, 2, 3, {timeout: 30}], "
+      "\"a/b\": {\"c~d\": 4, \"e.f\": 5}}}");
+    Hjson::Path dotted("service.pools.3.timeout");
+    Hjson::Path pointer("/service/pools/3/timeout");
+    assert(dotted.size() == 4 && pointer.size() == 4);
+    assert(cfg.at(dotted) == 30 && cfg.at(pointer) == 30);
+    assert(cfg.find(Hjson::Path("/service/a~1b/c~0d"))->to_int64() == 4);
+    assert(cfg.at(Hjson::Path().push_back("service").push_back("a/b").push_back("e.f")) == 5);
+    assert(cfg.find(Hjson::Path("service.pools.1")) == &cfg["service"]["pools"][1]);
+    assert(cfg.find(Hjson::Path("")) == &cfg && Hjson::Path("").empty());
+    assert(!cfg.find(Hjson::Path("service.pools.4")));
+    assert(!cfg.find(Hjson::Path("service.pools.01")));
+    assert(!cfg.find(Hjson::Path("service.pools.0.x")));
+    assert(!cfg.find(Hjson::Path("service.missing.x")));
+    const Hjson::Value& cCfg = cfg;
+    assert(cCfg.find(pointer) == cfg.find(pointer));
+    assert(Hjson::ConstValue(cfg).at(pointer).to_int64() == 30);
+
+    bool threw = false;
+    try {
+      cfg.at(Hjson::Path("service.pools.7"));
+    } catch (const Hjson::index_out_of_bounds&) {
+      threw = true;
+    }
+    assert(threw);
+    threw = false;
+    try {
+      Hjson::Path("/a/~2");
+    } catch (const Hjson::syntax_error&) {
+      threw = true;
+    }
+    assert(threw);
+
+    std::vector<Hjson::Path> paths = {
+      Hjson::Path("service.pools.0"),
+      Hjson::Path("service.pools.3.timeout"),
+      Hjson::Path("service.pools.9"),
+      Hjson::Path("service.a/b.c~d"),
+      Hjson::Path("/service/a~1b/c~0d"),
+    };
+    auto found = cCfg.find(paths);
+    assert(found.size() == 5);
+    assert(*found[0] == 1 && *found[1] == 30 && !found[2] && *found[3] == 4 && found[4] == found[3]);
+
+    // Setting values by path.
+    Hjson::Value root;
+    Hjson::Value val = "new";
+    val.set_comment_after(" # new");
+    assert(root.insert_or_assign(Hjson::Path("a.b.c"), val));
+    assert(root["a"]["b"]["c"] == "new" && root["a"]["b"]["c"].get_comment_after() == " # new");
+    assert(!root.insert_or_assign(Hjson::Path("a.b.c"), 1));
+    assert(root["a"]["b"]["c"] == 1 && root["a"]["b"]["c"].get_comment_after() == "");
+    root["list"] = Hjson::Value(Hjson::Type::Vector);
+    assert(root.insert_or_assign(Hjson::Path("/list/-"), 1));
+    assert(root.insert_or_assign(Hjson::Path("list.1.x"), 2));
+    assert(!root.insert_or_assign(Hjson::Path("list.0"), 3));
+    assert(root["list"].size() == 2 && root["list"][0] == 3 && root["list"][1]["x"] == 2);
+    threw = false;
+    try {
+      root.insert_or_assign(Hjson::Path("list.5"), 1);
+    } catch (const Hjson::index_out_of_bounds&) {
+      threw = true;
+    }
+    assert(threw);
+    threw = false;
+    try {
+      root.insert_or_assign(Hjson::Path("a.b.c.d"), 1);
+    } catch (const Hjson::type_mismatch&) {
+      threw = true;
+    }
+    assert(threw);
+
+    // A frozen tree is thawed along the path.
+    Hjson::Value frozen = cfg.clone();
+    frozen.freeze();
+    Hjson::Value thawed = frozen;
+    thawed.insert_or_assign(dotted, 60);
+    *thawed.find(Hjson::Path("service.pools.0")) = 10;
+    assert(frozen.at(dotted) == 30 && frozen.at(Hjson::Path("service.pools.0")) == 1);
+    assert(thawed.at(dotted) == 60 && thawed.at(Hjson::Path("service.pools.0")) == 10);
+  }
+
+  {
+    std::string text = "# service\nname: api\nenabled: true\nretries: 3\nunknown: {a: [1, {b: 2}]}\n"
+      "pools: [\n  {host: \"a.example\", port: 8080, weight-list: [0.5, 1]}\n  {host: \"b\"}\n]\n"
+      "limits: {rps: 100, burst: 20}\nextra: {x: [1, \"two\"]}\n";
+    BindService svc = Hjson::Unmarshal<BindService>(text);
+    assert(svc.name == "api" && svc.enabled && svc.retries == 3);
+    assert(svc.pools.size() == 2);
+    assert(svc.pools[0].host == "a.example" && svc.pools[0].port == 8080);
+    assert(svc.pools[0].weights.size() == 2 && svc.pools[0].weights[0] == 0.5);
+    assert(svc.pools[1].host == "b" && svc.pools[1].port == 80 && svc.pools[1].weights.empty());
+    assert(svc.limits.size() == 2 && svc.limits["rps"] == 100 && svc.limits["burst"] == 20);
+    assert(svc.extra["x"][1] == "two");
+
+    // The text matches what Marshal() writes for the same tree, with the
+    // fields in the listed order.
+    Hjson::EncoderOptions encOpt;
+    encOpt.comments = false;
+    encOpt.preserveInsertionOrder = true;
+    std::string out = Hjson::Marshal(svc, encOpt);
+    Hjson::Value tree = Hjson::Unmarshal(out);
+    assert(tree.key(0) == "name" && tree.key(5) == "extra");
+    assert(out == Hjson::Marshal(tree, encOpt));
+    assert(tree["pools"][0]["weight-list"][1] == 1.0);
+    BindService again = Hjson::Unmarshal<BindService>(out);
+    assert(Hjson::Marshal(again) == Hjson::Marshal(svc));
+
+    // Undefined Value fields are left out.
+    svc.extra = Hjson::Value();
+    assert(!Hjson::Unmarshal(Hjson::Marshal(svc))["extra"].defined());
+
+    auto vec = Hjson::Unmarshal<std::vector<int>>("[1, 2, 3]");
+    assert(vec.size() == 3 && vec[2] == 3);
+
+    bool threw = false;
+    try {
+      Hjson::Unmarshal<BindService>("{pools: {host: \"a\"}}");
+    } catch (const Hjson::type_mismatch& e) {
+      threw = (std::string(e.what()).find("'pools'") != std::string::npos);
+    }
+    assert(threw);
+    threw = false;
+    try {
+      Hjson::Unmarshal<BindService>("{retries: \"3\"}");
+    } catch (const Hjson::type_mismatch&) {
+      threw = true;
+    }
+    assert(threw);
+
+    // Numbers that do not fit in the field are not truncated.
+    const char *badNumbers[] = {"{u8: 300}", "{u8: -1}", "{s: 70000}", "{i: 3.9}",
+      "{i: 1e10}", "{u64: -1}", "{u64: 18446744073709551615}"};
+    for (const char *bad : badNumbers) {
+      threw = false;
+      try {
+        Hjson::Unmarshal<BindNumbers>(bad);
+      } catch (const Hjson::type_mismatch&) {
+        threw = true;
+      }
+      assert(threw);
+    }
+    BindNumbers nums = Hjson::Unmarshal<BindNumbers>(
+      "{u8: 255, s: -32768, i: 3.0, u64: 9223372036854775808}");
+    assert(nums.u8 == 255 && nums.s == -32768 && nums.i == 3);
+    assert(nums.u64 == 9223372036854775808ULL);
+    nums.u64 = 18446744073709549568ULL;
+    BindNumbers numsBack = Hjson::Unmarshal<BindNumbers>(Hjson::Marshal(nums));
+    assert(numsBack.u64 == nums.u64 && numsBack.s == -32768);
+
+    // EventEncoder writes the same text as Marshal() without comments.
+    Hjson::Value root = Hjson::Unmarshal("{a: {}, b: [1, [], {c: \"x\\ny\"}], d: \"text\"}");
+    Hjson::EventEncoder enc(encOpt);
+    Hjson::Parse("{a: {}, b: [1, [], {c: \"x\\ny\"}], d: \"text\"}", enc);
+    assert(enc.take() == Hjson::Marshal(root, encOpt));
+    enc.value(root);
+    assert(enc.take() == Hjson::Marshal(root, encOpt));
+  }
+
+  {
+    std::string text = "{a: [1, 2.5, {b: true}], c: \"text\", d: {e: null}}";
+    Hjson::Value a = Hjson::Unmarshal(text), b = Hjson::Unmarshal(text);
+    assert(a.hash() == b.hash() && Hjson::Value(1).hash() == Hjson::Value(1.0).hash());
+    size_t hashBefore = a.hash();
+    a.freeze();
+    assert(a.hash() == hashBefore && a.deep_equal(b));
+    Hjson::Value changed = a;
+    changed["a"][2]["b"] = false;
+    assert(changed.hash() != a.hash() && !changed.deep_equal(a));
+    changed.freeze();
+    assert(!changed.deep_equal(a) && a["a"][2]["b"] == true);
+
+    // Maps with the same values under other keys differ, frozen or not.
+    Hjson::Value keyA = Hjson::Unmarshal("{a: 1}"), keyB = Hjson::Unmarshal("{b: 1}");
+    assert(!keyA.deep_equal(keyB));
+    keyA.freeze();
+    keyB.freeze();
+    assert(!keyA.deep_equal(keyB) && keyA.deep_equal(Hjson::Unmarshal("{a: 1}")));
+
+    // Diff() and ApplyPatch().
+    Hjson::Value from = Hjson::Unmarshal("{keep: {x: 1}, drop: 2, change: [1, 2, 3], "
+      "\"a/b~c\": 1, shrink: [1, 2, 3], retype: {y: 1}}");
+    Hjson::Value to = Hjson::Unmarshal("{keep: {x: 1}, add: {z: [1]}, change: [1, 5, 3, 4, 6], "
+      "\"a/b~c\": 2, shrink: [1], retype: [1]}");
+    Hjson::Value patch = Hjson::Diff(from, to);
+    Hjson::Value target = from.clone();
+    Hjson::ApplyPatch(target, patch);
+    assert(target.deep_equal(to));
+    assert(Hjson::Diff(target, to).empty() && Hjson::Diff(to, to).empty());
+    bool foundEscaped = false;
+    for (int i = 0; i < int(patch.size()); ++i) {
+      foundEscaped = foundEscaped || patch[i]["path"] == "/a~1b~0c";
+    }
+    assert(foundEscaped);
+    // The patch survives being sent as text.
+    target = from.clone();
+    Hjson::ApplyPatch(target, Hjson::Unmarshal(Hjson::Marshal(patch)));
+    assert(target.deep_equal(to));
+
+    // Only the changed parts of a frozen tree are copied.
+    from.freeze();
+    Hjson::Value next = from;
+    Hjson::ApplyPatch(next, patch);
+    assert(next.deep_equal(to) && !from.deep_equal(to));
+    assert(next["keep"] == from["keep"]);
+    assert(Hjson::Diff(from, next).size() == patch.size());
+
+    Hjson::Value root = 1;
+    Hjson::ApplyPatch(root, Hjson::Diff(root, Hjson::Value("text")));
+    assert(root == "text");
+
+    Hjson::Value list = Hjson::Unmarshal("[1, 3]");
+    Hjson::ApplyPatch(list, Hjson::Unmarshal("[{op: \"add\", path: \"/1\", value: 2}, "
+      "{op: \"add\", path: \"/-\", value: 4}]"));
+    assert(list.size() == 4 && list[1] == 2 && list[3] == 4);
+
+    bool threw = false;
+    try {
+      Hjson::ApplyPatch(list, Hjson::Unmarshal("[{op: \"remove\", path: \"/9\"}]"));
+    } catch (const Hjson::index_out_of_bounds&) {
+      threw = true;
+    }
+    assert(threw);
+  }
+
+  {
+    Hjson::Decoder decoder;
+    std::string lines = "{\"a\": 1}\n{\"a\": 2} // two\n\n# three\n[3]\n4\n\"x\"\nb: 5, c: 6\n"
+      "{\"a\": 7}{\"a\": 8}[9]\n";
+    decoder.reset(lines);
+    std::vector<Hjson::Value> docs;
+    for (const Hjson::Value& doc : decoder) {
+      docs.push_back(doc);
+    }
+    assert(docs.size() == 9);
+    assert(docs[0]["a"] == 1 && docs[1]["a"] == 2 && docs[2][0] == 3);
+    assert(docs[1].get_comment_after() == " // two\n");
+    assert(docs[2].get_comment_before().find("# three") != std::string::npos);
+    assert(docs[3] == 4 && docs[4] == "x" && docs[5]["b"] == 5 && docs[5]["c"] == 6);
+    assert(docs[6]["a"] == 7 && docs[7]["a"] == 8 && docs[8][0] == 9);
+    Hjson::Value doc;
+    assert(!decoder.next(doc) && !doc.defined());
+
+    // A bad line is skipped after the error.
+    decoder.reset("1\n\"unterminated\n2\n");
+    assert(decoder.next(doc) && doc == 1);
+    bool threw = false;
+    try {
+      decoder.next(doc);
+    } catch (const Hjson::syntax_error&) {
+      threw = true;
+    }
+    assert(threw && decoder.next(doc) && doc == 2 && !decoder.next(doc));
+
+    // A bad document over several lines is skipped as a whole, braces in its
+    // strings and comments included.
+    std::string badDocs = "{\n  a: \"}\"\n  b: ::\n  # ]\n  c: [1, {d: 'it\\'s'}]\n  e: it's\n}\n"
+      "{f: 2}\n[\n  1\n  2,,\n]\n3\n";
+    for (int pass = 0; pass < 2; ++pass) {
+      std::istringstream badIn(badDocs);
+      if (pass) {
+        decoder.reset(badIn);
+      } else {
+        decoder.reset(badDocs);
+      }
+      int docCount = 0, errors = 0;
+      for (;;) {
+        try {
+          if (!decoder.next(doc)) {
+            break;
+          }
+          assert(docCount ? doc == 3 : doc["f"] == 2);
+          ++docCount;
+        } catch (const Hjson::syntax_error&) {
+          ++errors;
+        }
+      }
+      assert(docCount == 2 && errors == 2);
+    }
+
+    assert(decoder.decode("{a: [1, 2]}").deep_equal(Hjson::Unmarshal("{a: [1, 2]}")));
+
+    // From a stream, with documents that cross the chunks read from it.
+    std::string text, big = "[0";
+    for (int i = 0; i < 20000; ++i) {
+      text += "{\"id\": " + std::to_string(i) + ", \"name\": \"n\\t" + std::to_string(i) + "\"}\n";
+      big += ", " + std::to_string(i + 1);
+    }
+    big += "\n]";
+    std::istringstream in(text + big + " # end");
+    decoder.reset(in);
+    int count = 0;
+    while (decoder.next(doc)) {
+      if (count < 20000) {
+        assert(doc["id"] == count && doc["name"] == "n\t" + std::to_string(count));
+      } else {
+        assert(doc.size() == 20001 && doc[20000] == 20000);
+        assert(doc.get_comment_after() == " # end");
+      }
+      ++count;
+    }
+    assert(count == 20001);
+  }
+
+  {
+    // Marshal with several threads gives the same text as with one.
+    std::string text = "# root\n[\n  // inside\n";
+    for (int i = 0; i < 5000; ++i) {
+      text += (i % 7 ? "" : "  # before\n") + std::string("  {id: ") + std::to_string(i) +
+        ", name: \"n " + std::to_string(i) + "\"}" + (i % 5 ? "" : " // after") + "\n";
+    }
+    Hjson::Value root = Hjson::Unmarshal(text + "]");
+    Hjson::Value map(Hjson::Type::Map);
+    for (int i = 0; i < 3000; ++i) {
+      map["k" + std::to_string(i * 7 % 3000)] = root[i];
+    }
+    for (int i = 0; i < 3000; i += 4) {
+      root[i] = Hjson::Value();
+      map["k" + std::to_string(i)] = Hjson::Value();
+    }
+    root.push_back(map);
+    for (int options = 0; options < 8; ++options) {
+      Hjson::EncoderOptions opt;
+      opt.preserveInsertionOrder = !(options & 1);
+      opt.separator = !!(options & 2);
+      opt.bracesSameLine = !(options & 4);
+      std::string expected = Hjson::Marshal(root, opt);
+      opt.threads = 4;
+      assert(Hjson::Marshal(root, opt) == expected);
+      size_t tasks = 0;
+      opt.executor = [&tasks](size_t count, const std::function<void(size_t)>& task) {
+        for (size_t i = 0; i < count; ++i) {
+          task(i);
+        }
+        tasks += count;
+      };
+      assert(Hjson::Marshal(root, opt) == expected && tasks > 0);
+    }
+  }
+
+  {
+    const char *szTmp = "tmpTestFile.hjson";
+    auto writeFile = [szTmp](const std::string& text) {
+      std::ofstream outfile(szTmp, std::ofstream::binary);
+      outfile << text;
+    };
+
+    writeFile("# config\n{a: 1, b: [1, 2]}\n");
+    Hjson::FileCache cache;
+    Hjson::Value first = cache.get(szTmp);
+    assert(first.is_frozen() && first["a"] == 1 && first.get_comment_before() == "# config\n");
+    // Same tree, not parsed again.
+    assert(cache.get(szTmp)["b"] == first["b"] && cache.refresh() == 0);
+    Hjson::Value changed = cache.get(szTmp);
+    changed["a"] = 2;
+    assert(cache.get(szTmp)["a"] == 1);
+
+    writeFile("{a: 3, b: [1, 2, 3]}\n");
+    assert(cache.refresh() == 1 && cache.cached(szTmp)["a"] == 3);
+    assert(cache.get(szTmp)["b"].size() == 3 && first["b"].size() == 2);
+
+    // A file that cannot be parsed keeps its previous tree.
+    writeFile("{a: 4, b: [1, 2, 3}");
+    bool threw = false;
+    try {
+      cache.get(szTmp);
+    } catch (const Hjson::syntax_error&) {
+      threw = true;
+    }
+    assert(threw && cache.cached(szTmp)["a"] == 3 && cache.refresh() == 0);
+
+    // With compareContent, rewriting the same text keeps the tree.
+    writeFile("{a: 5}");
+    Hjson::FileCache contentCache(Hjson::DecoderOptions(), true);
+    Hjson::Value five = contentCache.get(szTmp);
+    writeFile("{a: 5}");
+    assert(contentCache.get(szTmp) == five && contentCache.get(szTmp)["a"] == 5);
+
+    // The watch thread swaps in new trees.
+    std::atomic<int> changes(0);
+    cache.watch(std::chrono::milliseconds(1), [&changes](const std::string&,
+      const Hjson::Value& root)
+    {
+      if (root["a"] == 6) {
+        ++changes;
+      }
+    });
+    writeFile("{a: 6, b: []}");
+    for (int i = 0; i < 2000 && !changes; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    cache.stop();
+    assert(changes > 0 && cache.cached(szTmp)["a"] == 6);
+
+    // onChange can stop the thread, but not start another one.
+    std::atomic<int> calls(0);
+    std::atomic<bool> watchThrew(false);
+    cache.watch(std::chrono::milliseconds(1), [&](const std::string&,
+      const Hjson::Value&)
+    {
+      try {
+        cache.watch(std::chrono::milliseconds(1));
+      } catch (const std::logic_error&) {
+        watchThrew = true;
+      }
+      cache.stop();
+      ++calls;
+    });
+    writeFile("{a: 7}");
+    for (int i = 0; i < 2000 && !calls; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    cache.stop();
+    assert(calls == 1 && watchThrew);
+
+    std::remove(szTmp);
+    threw = false;
+    try {
+      contentCache.erase(szTmp);
+      contentCache.get(szTmp);
+    } catch (const Hjson::file_error&) {
+      threw = true;
+    }
+    assert(threw && !contentCache.cached(szTmp).defined());
+  }
 }